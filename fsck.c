@@ -0,0 +1,1179 @@
+// offline consistency checker for nufs images
+//
+// usage: fsck.nufs [-n | -y] [-j threads] <image>
+//
+// Checks an image that is not mounted: every inode and its extent tree,
+// the directory tree and link counts, then the block bitmap and reference
+// counts against the blocks the inodes and snapshots actually own, the
+// fingerprints and the metadata checksums. The journal is replayed first,
+// the way mounting would.
+//
+//   -n  only report, change nothing (not even replay the journal)
+//   -y  repair everything that is wrong
+//   -j  threads scanning the inode table, one per CPU by default
+//
+// Files and directories that are in no directory are put back into the
+// root directory as "#<inum>". Exits with 0 if the image is clean, 1 if
+// everything wrong was repaired, 4 if errors are left and 8 if the image
+// could not be checked.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "storage/bitmap.h"
+#include "storage/csum.h"
+#include "storage/directory.h"
+#include "storage/inode.h"
+#include "storage/journal.h"
+#include "storage/snapshot.h"
+
+#define EXIT_CLEAN 0
+#define EXIT_FIXED 1
+#define EXIT_ERRORS 4
+#define EXIT_FAILED 8
+
+#define CHUNK 1024     // inodes a thread takes from the table at a time
+#define MAX_DEPTH 8    // extent trees deeper than this are damaged
+#define MAX_LISTED 10  // block problems of one kind listed one by one
+
+// what owns a block
+#define KIND_DATA 0x1  // file data
+#define KIND_META 0x2  // an extent node, directory block or exception table
+#define KIND_TABLE 0x4 // an exception table block, seen once already
+
+// what the scan made of an inode
+#define STATE_FREE 0
+#define STATE_OK 1  // allocated, its blocks are counted
+#define STATE_BAD 2 // allocated but unusable, nothing of it is counted
+
+typedef struct edge {
+  uint32_t dir;   // directory holding the entry
+  uint32_t bnum;  // its directory block
+  uint32_t off;   // the record in there
+  uint32_t child; // inode it names
+} edge_t;
+
+typedef struct scan {
+  pthread_t thread;
+  edge_t *edges;
+  int count, cap;
+} scan_t;
+
+static int repair = 0;   // -y
+static int readonly = 0; // -n
+static const char *path;
+
+static char *image;
+static superblock_t *sb;
+static int bs;
+
+static int errors = 0;  // problems found
+static int unfixed = 0; // and left alone
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t *owners; // per block: extent trees and snapshots owning it
+static uint8_t *kinds;   // per block: KIND_* of those owners
+static uint8_t *dirty;   // per block: changed by a repair
+static uint8_t *states;  // per inode: STATE_*
+static int next_chunk = 0;
+
+static edge_t *edges = NULL; // of every directory, by directory
+static int *first_edge;      // per inode: its first edge, and past its last
+static int edge_count = 0;
+static int *links;          // per inode: entries naming it
+static uint64_t *parent_entry; // per directory: where its ".." is in the
+                               // image, + 1, 0 for none
+static uint8_t *reached;    // per inode: found from the root
+static int *queue;
+static int queue_len = 0;
+
+static void usage() {
+  fprintf(stderr, "usage: fsck.nufs [-n | -y] [-j threads] <image>\n");
+  exit(EXIT_FAILED);
+}
+
+static void fail(const char *what) {
+  fprintf(stderr, "fsck.nufs: %s: %s\n", path, what);
+  exit(EXIT_FAILED);
+}
+
+static void *block(uint32_t bnum) { return image + (size_t)bnum * bs; }
+
+static void *bbm() { return block(sb->block_bitmap_start); }
+static void *ibm() { return block(sb->inode_bitmap_start); }
+
+static inode_t *inode(int inum) {
+  return (inode_t *)((char *)block(sb->inode_table_start) +
+                     (size_t)inum * sizeof(inode_t));
+}
+
+// is the block one of the tables with an entry per block?
+static int is_table(uint64_t bnum) {
+  return bnum >= sb->refcount_start && bnum < blocks_tables_end(sb);
+}
+
+static int is_data(uint64_t bnum, uint64_t count) {
+  return bnum >= sb->data_start && bnum + count <= sb->block_count &&
+         (bnum + count <= sb->refcount_start || bnum >= blocks_tables_end(sb));
+}
+
+// Report a problem. Returns 1 if it is to be repaired.
+static int problem(int fixable, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  pthread_mutex_lock(&report_lock);
+  vprintf(fmt, ap);
+  int fix = repair && fixable;
+  printf("%s\n", fix ? ", fixed" : "");
+  errors++;
+  unfixed += !fix;
+  pthread_mutex_unlock(&report_lock);
+  va_end(ap);
+  return fix;
+}
+
+// the bytes [p, p + len) are about to be repaired
+static void touch(void *p, size_t len) {
+  size_t start = ((char *)p - image) / bs;
+  size_t end = ((char *)p + len - 1 - image) / bs;
+  for (size_t b = start; b <= end; b++) {
+    __atomic_store_n(&dirty[b], 1, __ATOMIC_RELAXED);
+  }
+}
+
+// the checksums have no checksums, nor does the journal
+static int has_sum(uint32_t bnum) {
+  if (bnum >= sb->csum_start && bnum < sb->csum_start + sb->csum_blocks) {
+    return 0;
+  }
+  return bnum < sb->journal_start ||
+         bnum >= sb->journal_start + sb->journal_blocks;
+}
+
+// check a metadata block against its checksum, if it has one
+static void verify(uint32_t bnum) {
+  if (sb->csum_blocks == 0 || !has_sum(bnum)) {
+    return;
+  }
+  uint32_t sum = ((uint32_t *)block(sb->csum_start))[bnum];
+  if (sum != 0 && crc32c(0, block(bnum), bs) != sum &&
+      problem(1, "checksum mismatch in block %u", bnum)) {
+    touch(block(bnum), bs); // taken again once everything is repaired
+  }
+}
+
+// Extent trees
+
+static int node_max(int root) {
+  return root ? EXTENT_ROOT_ENTRIES
+              : (bs - sizeof(extent_header_t)) / sizeof(extent_t);
+}
+
+// Check the node and everything under it, which may map the logical blocks
+// [lo, hi). Adds the blocks its extents map to blocks. Returns NULL or what
+// is wrong.
+static const char *check_node(extent_header_t *eh, int root, int depth,
+                              uint64_t lo, uint64_t hi, uint64_t *blocks) {
+  if (eh->magic != EXTENT_MAGIC) {
+    return "bad magic";
+  }
+  if (eh->max != node_max(root) || eh->entries > eh->max) {
+    return "bad node size";
+  }
+  if (root ? eh->depth > MAX_DEPTH : eh->depth != depth) {
+    return "bad depth";
+  }
+
+  if (eh->depth == 0) {
+    extent_t *ex = (extent_t *)(eh + 1);
+    uint64_t next = lo;
+    for (int i = 0; i < eh->entries; i++) {
+      if (ex[i].len == 0 || ex[i].lblock < next ||
+          (uint64_t)ex[i].lblock + ex[i].len > hi) {
+        return "extents overlap or are out of order";
+      }
+      if (ex[i].flags & ~(EXTENT_UNWRITTEN | EXTENT_COMPRESSED)) {
+        return "bad extent flags";
+      }
+      if (!is_data(ex[i].pblock, ex[i].len)) {
+        return "extent outside the data region";
+      }
+      next = (uint64_t)ex[i].lblock + ex[i].len;
+      *blocks += ex[i].len;
+    }
+    return NULL;
+  }
+
+  extent_index_t *idx = (extent_index_t *)(eh + 1);
+  for (int i = 0; i < eh->entries; i++) {
+    uint64_t start = i == 0 ? lo : idx[i].lblock;
+    uint64_t end = i + 1 < eh->entries ? idx[i + 1].lblock : hi;
+    if (idx[i].lblock < lo || start >= end || end > hi) {
+      return "index entries out of order";
+    }
+    if (!is_data(idx[i].child, 1)) {
+      return "node outside the data region";
+    }
+    verify(idx[i].child);
+    const char *why =
+        check_node(block(idx[i].child), 0, eh->depth - 1, start, end, blocks);
+    if (why) {
+      return why;
+    }
+  }
+  return NULL;
+}
+
+// count the blocks of a checked tree as owned (delta 1) or not (-1)
+static void count_node(extent_header_t *eh, int delta, int kind) {
+  if (eh->depth == 0) {
+    extent_t *ex = (extent_t *)(eh + 1);
+    for (int i = 0; i < eh->entries; i++) {
+      for (uint32_t b = ex[i].pblock; b < ex[i].pblock + ex[i].len; b++) {
+        __atomic_add_fetch(&owners[b], delta, __ATOMIC_RELAXED);
+        __atomic_or_fetch(&kinds[b], kind, __ATOMIC_RELAXED);
+      }
+    }
+    return;
+  }
+  extent_index_t *idx = (extent_index_t *)(eh + 1);
+  for (int i = 0; i < eh->entries; i++) {
+    __atomic_add_fetch(&owners[idx[i].child], delta, __ATOMIC_RELAXED);
+    __atomic_or_fetch(&kinds[idx[i].child], KIND_META, __ATOMIC_RELAXED);
+    count_node(block(idx[i].child), delta, kind);
+  }
+}
+
+// the block mapping logical block lblock in a checked tree, or 0
+static uint32_t lookup(extent_header_t *eh, uint32_t lblock) {
+  while (eh->depth > 0) {
+    extent_index_t *idx = (extent_index_t *)(eh + 1);
+    int i = eh->entries - 1;
+    while (i > 0 && idx[i].lblock > lblock) {
+      i--;
+    }
+    if (i < 0) {
+      return 0;
+    }
+    eh = block(idx[i].child);
+  }
+  extent_t *ex = (extent_t *)(eh + 1);
+  for (int i = 0; i < eh->entries; i++) {
+    if (lblock >= ex[i].lblock && lblock < ex[i].lblock + ex[i].len) {
+      return ex[i].pblock + (lblock - ex[i].lblock);
+    }
+  }
+  return 0;
+}
+
+static void reset_tree(inode_t *node) {
+  memset(&node->eh, 0, sizeof(node->eh) + sizeof(node->extents));
+  node->eh.magic = EXTENT_MAGIC;
+  node->eh.max = EXTENT_ROOT_ENTRIES;
+  node->size = 0;
+  node->blocks = 0;
+}
+
+// The inode table, by several threads
+
+static void add_edge(scan_t *t, int dir, uint32_t bnum, int off, int child) {
+  if (t->count == t->cap) {
+    t->cap = t->cap ? 2 * t->cap : 256;
+    t->edges = realloc(t->edges, t->cap * sizeof(edge_t));
+    if (!t->edges) {
+      fail("out of memory");
+    }
+  }
+  t->edges[t->count++] = (edge_t){dir, bnum, off, child};
+}
+
+// the record stays, free, in the chain of its block
+static void clear_entry(dirent_t *de) {
+  touch(&de->inum, sizeof(de->inum));
+  de->inum = 0;
+}
+
+// the leaf of the checked directory serving the hash, and the hashes
+// [*lo, *hi] it serves
+static uint32_t dir_leaf(inode_t *node, uint32_t hash, uint64_t *lo,
+                         uint64_t *hi) {
+  uint32_t bnum = lookup(&node->eh, 0);
+  *lo = 0;
+  *hi = UINT32_MAX;
+  if (!(node->flags & INODE_INDEX)) {
+    return bnum;
+  }
+  dx_header_t *hdr = block(bnum);
+  int levels = hdr->levels;
+  for (int level = 0; level <= levels; level++) {
+    dx_entry_t *e = (dx_entry_t *)(hdr + 1);
+    int i = hdr->count - 1;
+    while (i > 0 && e[i].hash > hash) {
+      i--;
+    }
+    *lo = e[i].hash;
+    if (i + 1 < hdr->count) {
+      *hi = e[i + 1].hash - 1;
+    }
+    bnum = lookup(&node->eh, e[i].block);
+    hdr = block(bnum);
+  }
+  return bnum;
+}
+
+// add an entry for the name to the root directory, -ENOSPC if its block
+// is full
+static int root_add(const char *name, int inum) {
+  uint64_t lo, hi;
+  uint32_t hash = directory_hash(name);
+  void *leaf = block(dir_leaf(inode(ROOT_INODE), hash, &lo, &hi));
+  touch(leaf, bs);
+  return dirent_add(leaf, bs, name, strlen(name), hash, inum,
+                    (inode(inum)->mode & S_IFMT) >> 12);
+}
+
+// Check the index block of a directory and the ones under it, whose
+// entries serve the hashes [lo, hi]. Returns NULL or what is wrong.
+static const char *check_index(inode_t *node, dx_header_t *hdr, int level,
+                               int levels, uint32_t blocks, uint64_t lo,
+                               uint64_t hi) {
+  if (hdr->magic != DX_MAGIC) {
+    return "bad magic";
+  }
+  if (hdr->limit != (bs - sizeof(dx_header_t)) / sizeof(dx_entry_t) ||
+      hdr->count == 0 || hdr->count > hdr->limit) {
+    return "bad node size";
+  }
+
+  dx_entry_t *e = (dx_entry_t *)(hdr + 1);
+  for (int i = 0; i < hdr->count; i++) {
+    if ((i == 0 ? e[i].hash != lo : e[i].hash <= e[i - 1].hash) ||
+        e[i].hash > hi) {
+      return "entries out of order";
+    }
+    uint32_t bnum = e[i].block == 0 || e[i].block >= blocks
+                        ? 0
+                        : lookup(&node->eh, e[i].block);
+    if (bnum == 0) {
+      return "entry names no block";
+    }
+    if (level < levels) {
+      verify(bnum);
+      uint64_t end = i + 1 < hdr->count ? e[i + 1].hash - 1 : hi;
+      const char *why = check_index(node, block(bnum), level + 1, levels,
+                                    blocks, e[i].hash, end);
+      if (why) {
+        return why;
+      }
+    }
+  }
+  return NULL;
+}
+
+// check the entries of the directory block, which serves the hashes
+// [lo, hi], collecting the ones that look right and noting "." and ".." in
+// seen
+static void scan_dir(scan_t *t, int inum, uint32_t bnum, uint64_t lo,
+                     uint64_t hi, int *seen) {
+  verify(bnum);
+  char *blk = block(bnum);
+  for (int off = 0, prev = -1, rec; off < bs; prev = off, off += rec) {
+    dirent_t *de = (dirent_t *)(blk + off);
+    rec = off + (int)sizeof(dirent_t) <= bs ? dirent_len(de, off, bs) : 0;
+    if (rec < (int)sizeof(dirent_t) || rec % 4 || off + rec > bs ||
+        (de->inum && DIRENT_SIZE(de->name_len) > rec)) {
+      // the records from here on are lost
+      if (problem(1, "directory %d: block %u is damaged at %d", inum, bnum,
+                  off)) {
+        dirent_t *last = (dirent_t *)(blk + (prev < 0 ? 0 : prev));
+        touch(last, sizeof(dirent_t));
+        last->rec_len = 0;
+        if (prev < 0) {
+          last->inum = 0;
+        }
+      }
+      break;
+    }
+    if (de->inum == 0) {
+      continue;
+    }
+
+    char name[DIR_NAME_LENGTH];
+    memcpy(name, de->name, de->name_len);
+    name[de->name_len] = 0;
+    if (de->name_len == 0 || strlen(name) != de->name_len ||
+        strchr(name, '/')) {
+      if (problem(1, "directory %d: entry at %u:%d is damaged", inum, bnum,
+                  off)) {
+        clear_entry(de);
+      }
+      continue;
+    }
+
+    uint32_t hash = directory_hash(name);
+    if ((hash < lo || hash > hi) &&
+        problem(1, "directory %d: \"%s\" is in the wrong block", inum,
+                name)) {
+      clear_entry(de);
+      continue;
+    }
+    if (de->hash != hash &&
+        problem(1, "directory %d: \"%s\" has a bad hash", inum, name)) {
+      touch(&de->hash, sizeof(de->hash));
+      de->hash = hash;
+    }
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      // every directory may have these, the root must
+      int bit = name[1] ? 2 : 1;
+      if (*seen & bit) {
+        if (problem(1, "directory %d: second \"%s\"", inum, name)) {
+          clear_entry(de);
+        }
+        continue;
+      }
+      *seen |= bit;
+      if (name[1]) {
+        // checked once the parent is known
+        parent_entry[inum] = (uint64_t)bnum * bs + off + 1;
+      } else if (de->inum != (uint32_t)inum &&
+                 problem(1, "directory %d: \".\" names inode %u", inum,
+                         de->inum)) {
+        touch(&de->inum, sizeof(de->inum));
+        de->inum = inum;
+      }
+      continue;
+    }
+    if (de->inum >= sb->inode_count) {
+      if (problem(1, "directory %d: \"%s\" names bad inode %u", inum, name,
+                  de->inum)) {
+        clear_entry(de);
+      }
+      continue;
+    }
+
+    // names that are the same hash the same, so end up in the same block
+    int dup = 0;
+    for (int o = 0; o < off && !dup;) {
+      dirent_t *other = (dirent_t *)(blk + o);
+      dup = other->inum && other->name_len == de->name_len &&
+            memcmp(other->name, name, de->name_len) == 0;
+      o += dirent_len(other, o, bs);
+    }
+    if (dup) {
+      if (problem(1, "directory %d: \"%s\" is there twice", inum, name)) {
+        clear_entry(de);
+      }
+      continue;
+    }
+    add_edge(t, inum, bnum, off, de->inum);
+  }
+}
+
+// scan the leaves under the checked index block, which serves the hashes up
+// to hi
+static void scan_leaves(scan_t *t, int inum, dx_header_t *hdr, int level,
+                        int levels, uint64_t hi, int *seen) {
+  inode_t *node = inode(inum);
+  dx_entry_t *e = (dx_entry_t *)(hdr + 1);
+  for (int i = 0; i < hdr->count; i++) {
+    uint32_t bnum = lookup(&node->eh, e[i].block);
+    uint64_t end = i + 1 < hdr->count ? e[i + 1].hash - 1 : hi;
+    if (level < levels) {
+      scan_leaves(t, inum, block(bnum), level + 1, levels, end, seen);
+    } else {
+      scan_dir(t, inum, bnum, e[i].hash, end, seen);
+    }
+  }
+}
+
+// the root directory gets back the "." and ".." it lost
+static void add_dots(int seen) {
+  for (int k = 0; k < 2; k++) {
+    const char *name = k ? ".." : ".";
+    if ((seen & (k + 1)) ||
+        !problem(1, "directory %d: \"%s\" is missing", ROOT_INODE, name)) {
+      continue;
+    }
+    root_add(name, ROOT_INODE);
+  }
+}
+
+static void scan_inode(scan_t *t, int inum) {
+  inode_t *node = inode(inum);
+  if (inum == 0) {
+    problem(1, "inode 0 is in use");
+    states[inum] = STATE_BAD;
+    return;
+  }
+
+  int type = node->mode & S_IFMT;
+  if (type != S_IFREG && type != S_IFDIR && type != S_IFLNK &&
+      type != S_IFIFO && type != S_IFSOCK && type != S_IFCHR &&
+      type != S_IFBLK) {
+    problem(1, "inode %d has a bad mode %o", inum, node->mode);
+    states[inum] = STATE_BAD;
+    return;
+  }
+  int known = INODE_INLINE | INODE_COMPRESSED |
+              (type == S_IFDIR ? INODE_INDEX : 0);
+  if ((node->flags & ~known) &&
+      problem(1, "inode %d has bad flags %x", inum, node->flags)) {
+    touch(node, sizeof(*node));
+    node->flags &= known;
+  }
+
+  if (node->flags & INODE_INLINE) {
+    if (type != S_IFREG) {
+      problem(1, "inode %d is not a file but has inline data", inum);
+      states[inum] = STATE_BAD;
+      return;
+    }
+    if ((node->size < 0 || node->size > INODE_INLINE_SIZE) &&
+        problem(1, "inode %d has inline data of bad size %ld", inum,
+                (long)node->size)) {
+      touch(node, sizeof(*node));
+      node->size = node->size < 0 ? 0 : INODE_INLINE_SIZE;
+    }
+    if (node->blocks != 0 &&
+        problem(1, "inode %d has inline data but %u blocks", inum,
+                node->blocks)) {
+      touch(node, sizeof(*node));
+      node->blocks = 0;
+    }
+    states[inum] = STATE_OK;
+    return;
+  }
+
+  uint64_t blocks = 0;
+  const char *why = check_node(&node->eh, 1, 0, 0, UINT32_MAX, &blocks);
+  if (why) {
+    if (type == S_IFDIR) {
+      problem(1, "directory %d has a damaged extent tree (%s)", inum, why);
+      states[inum] = STATE_BAD;
+      return;
+    }
+    // the file loses its contents
+    if (problem(1, "inode %d has a damaged extent tree (%s)", inum, why)) {
+      touch(node, sizeof(*node));
+      reset_tree(node);
+    }
+    states[inum] = STATE_OK;
+    return;
+  }
+
+  uint32_t dir_block = 0;
+  if (type == S_IFDIR) {
+    dir_block = lookup(&node->eh, 0);
+    if (dir_block == 0) {
+      problem(1, "directory %d has no block", inum);
+      states[inum] = STATE_BAD;
+      return;
+    }
+  }
+  if (dir_block && (node->flags & INODE_INDEX)) {
+    verify(dir_block);
+    dx_header_t *hdr = block(dir_block);
+    const char *why = hdr->levels > 1 ? "bad depth"
+                      : hdr->blocks > blocks ? "bad block count"
+                      : check_index(node, hdr, 0, hdr->levels, hdr->blocks,
+                                    0, UINT32_MAX);
+    if (why) {
+      problem(1, "directory %d has a damaged index (%s)", inum, why);
+      states[inum] = STATE_BAD;
+      return;
+    }
+  }
+
+  count_node(&node->eh, 1, type == S_IFDIR ? KIND_META : KIND_DATA);
+  if (node->blocks != blocks &&
+      problem(1, "inode %d has %u blocks, counted %lu", inum,
+              node->blocks, (unsigned long)blocks)) {
+    touch(node, sizeof(*node));
+    node->blocks = blocks;
+  }
+  if (node->size < 0 && problem(1, "inode %d has a negative size", inum)) {
+    touch(node, sizeof(*node));
+    node->size = 0;
+  }
+  states[inum] = STATE_OK;
+
+  if (dir_block) {
+    int seen = 0;
+    if (node->flags & INODE_INDEX) {
+      dx_header_t *hdr = block(dir_block);
+      scan_leaves(t, inum, hdr, 0, hdr->levels, UINT32_MAX, &seen);
+    } else {
+      scan_dir(t, inum, dir_block, 0, UINT32_MAX, &seen);
+    }
+    if (inum == ROOT_INODE) {
+      add_dots(seen);
+    }
+  }
+}
+
+static void *scan_thread(void *arg) {
+  scan_t *t = arg;
+  for (;;) {
+    int start = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED) * CHUNK;
+    if (start >= (int)sb->inode_count) {
+      return NULL;
+    }
+    int end = start + CHUNK;
+    if (end > (int)sb->inode_count) {
+      end = sb->inode_count;
+    }
+    for (int inum = bitmap_find_one(ibm(), start, end); inum < end;
+         inum = bitmap_find_one(ibm(), inum + 1, end)) {
+      scan_inode(t, inum);
+    }
+  }
+}
+
+// scan the inode table and gather the entries of every directory, by
+// directory
+static void scan_inodes(int threads) {
+  scan_t *scans = calloc(threads, sizeof(scan_t));
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&scans[i].thread, NULL, scan_thread, &scans[i]) != 0) {
+      fail("cannot start threads");
+    }
+  }
+
+  first_edge = calloc(sb->inode_count + 1, sizeof(int));
+  for (int i = 0; i < threads; i++) {
+    pthread_join(scans[i].thread, NULL);
+    edge_count += scans[i].count;
+    for (int e = 0; e < scans[i].count; e++) {
+      first_edge[scans[i].edges[e].dir + 1]++;
+    }
+  }
+  for (uint32_t d = 0; d < sb->inode_count; d++) {
+    first_edge[d + 1] += first_edge[d];
+  }
+
+  int *fill = malloc(sb->inode_count * sizeof(int));
+  memcpy(fill, first_edge, sb->inode_count * sizeof(int));
+  edges = malloc((edge_count + 1) * sizeof(edge_t));
+  for (int i = 0; i < threads; i++) {
+    for (int e = 0; e < scans[i].count; e++) {
+      edges[fill[scans[i].edges[e].dir]++] = scans[i].edges[e];
+    }
+    free(scans[i].edges);
+  }
+  free(fill);
+  free(scans);
+}
+
+// Snapshots
+
+static void cut_table(snapshot_slot_t *slot, uint32_t *link) {
+  touch(link, sizeof(*link));
+  *link = 0;
+  touch(slot, sizeof(*slot));
+  slot->flags |= SNAPSHOT_BROKEN;
+}
+
+// count the exception tables and the copies in them as owned
+static void scan_snapshots() {
+  if (sb->snapshot_start == 0) {
+    return;
+  }
+  snapshot_slot_t *slots = block(sb->snapshot_start);
+  int per_table = (bs - sizeof(snapshot_table_t)) / sizeof(snapshot_entry_t);
+  for (int s = 0; s < SNAPSHOT_MAX; s++) {
+    snapshot_slot_t *slot = &slots[s];
+    if (slot->name[0] == 0) {
+      continue;
+    }
+    if (!memchr(slot->name, 0, NUFS_SNAPSHOT_NAME_MAX) &&
+        problem(1, "snapshot %d has a bad name", s)) {
+      touch(slot, sizeof(*slot));
+      slot->name[NUFS_SNAPSHOT_NAME_MAX - 1] = 0;
+    }
+
+    uint32_t *link = &slot->table;
+    while (*link) {
+      uint32_t tb = *link;
+      snapshot_table_t *table = block(tb);
+      if (!is_data(tb, 1) || (kinds[tb] & KIND_TABLE) ||
+          table->count > (uint32_t)per_table) {
+        if (problem(1, "snapshot %.*s: bad exception table block %u",
+                    NUFS_SNAPSHOT_NAME_MAX, slot->name, tb)) {
+          cut_table(slot, link);
+        }
+        break;
+      }
+      verify(tb);
+      owners[tb]++;
+      kinds[tb] |= KIND_META | KIND_TABLE;
+
+      for (uint32_t i = 0; i < table->count; i++) {
+        snapshot_entry_t *e = &table->entries[i];
+        if (e->copy == 0) {
+          continue;
+        }
+        if (!is_data(e->copy, 1)) {
+          if (problem(1, "snapshot %.*s: bad copy %u of block %u",
+                      NUFS_SNAPSHOT_NAME_MAX, slot->name, e->copy, e->bnum)) {
+            touch(e, sizeof(*e));
+            e->copy = 0;
+            touch(slot, sizeof(*slot));
+            slot->flags |= SNAPSHOT_BROKEN;
+          }
+          continue;
+        }
+        owners[e->copy]++;
+      }
+      link = &table->next;
+    }
+  }
+}
+
+// The directory tree
+
+static void free_inode_fsck(int inum) {
+  inode_t *node = inode(inum);
+  if (states[inum] == STATE_OK && !(node->flags & INODE_INLINE)) {
+    count_node(&node->eh, -1, 0);
+  }
+  touch((char *)ibm() + inum / 8, 1);
+  bitmap_put(ibm(), inum, 0);
+  touch(node, sizeof(*node));
+  memset(node, 0, sizeof(*node));
+  states[inum] = STATE_FREE;
+}
+
+static dirent_t *edge_entry(edge_t *e) {
+  return (dirent_t *)((char *)block(e->bnum) + e->off);
+}
+
+static void remove_edge(edge_t *e) {
+  clear_entry(edge_entry(e));
+  e->child = 0;
+}
+
+// the ".." of the directory, if it has one, should name its parent
+static void check_parent(int inum, int parent) {
+  if (parent_entry[inum] == 0) {
+    return;
+  }
+  uint64_t at = parent_entry[inum] - 1;
+  dirent_t *de = (dirent_t *)((char *)block(at / bs) + at % bs);
+  if (de->inum != (uint32_t)parent &&
+      problem(1, "directory %d: \"..\" names inode %u, not %d", inum,
+              de->inum, parent)) {
+    touch(&de->inum, sizeof(de->inum));
+    de->inum = parent;
+  }
+}
+
+// take in everything under the directories in the queue
+static void walk_tree() {
+  while (queue_len > 0) {
+    int dir = queue[--queue_len];
+    for (int i = first_edge[dir]; i < first_edge[dir + 1]; i++) {
+      edge_t *e = &edges[i];
+      if (e->child == 0) {
+        continue;
+      }
+      dirent_t *de = edge_entry(e);
+      int len = de->name_len;
+      const char *name = de->name;
+      int child = e->child;
+      if (states[child] != STATE_OK) {
+        if (problem(1, "directory %d: \"%.*s\" names %s inode %d", dir, len,
+                    name, states[child] == STATE_FREE ? "free" : "damaged",
+                    child)) {
+          remove_edge(e);
+        }
+        continue;
+      }
+      int is_dir = S_ISDIR(inode(child)->mode);
+      if (is_dir && reached[child]) {
+        if (problem(1, "directory %d: \"%.*s\" is directory %d, which is "
+                       "already in another directory",
+                    dir, len, name, child)) {
+          remove_edge(e);
+        }
+        continue;
+      }
+      int type = (inode(child)->mode & S_IFMT) >> 12;
+      if (de->type != type &&
+          problem(1, "directory %d: \"%.*s\" has type %d, not %d", dir, len,
+                  name, de->type, type)) {
+        touch(&de->type, sizeof(de->type));
+        de->type = type;
+      }
+      links[child]++;
+      if (!reached[child]) {
+        reached[child] = 1;
+        if (is_dir) {
+          check_parent(child, dir);
+          queue[queue_len++] = child;
+        }
+      }
+    }
+  }
+}
+
+// put the lost inode back into the root directory
+static void reconnect(int inum) {
+  int is_dir = S_ISDIR(inode(inum)->mode);
+  if (!problem(1, "%s %d is in no directory", is_dir ? "directory" : "inode",
+               inum)) {
+    // don't report what is under it as well
+    reached[inum] = 1;
+    links[inum] = inode(inum)->refs;
+    if (is_dir) {
+      queue[queue_len++] = inum;
+    }
+    walk_tree();
+    return;
+  }
+
+  char name[DIR_NAME_LENGTH];
+  snprintf(name, sizeof(name), "#%d", inum);
+  if (root_add(name, inum) < 0) {
+    printf("the root directory is full, freed inode %d\n", inum);
+    free_inode_fsck(inum);
+    return;
+  }
+  reached[inum] = 1;
+  links[inum] = 1;
+  if (is_dir) {
+    check_parent(inum, ROOT_INODE);
+    queue[queue_len++] = inum;
+  }
+  walk_tree();
+}
+
+static void check_tree() {
+  links = calloc(sb->inode_count, sizeof(int));
+  reached = calloc(sb->inode_count, 1);
+  queue = malloc(sb->inode_count * sizeof(int));
+
+  reached[ROOT_INODE] = 1;
+  check_parent(ROOT_INODE, ROOT_INODE);
+  queue[queue_len++] = ROOT_INODE;
+  walk_tree();
+
+  // the tops of lost subtrees first, then what is left (directories that
+  // are in each other)
+  uint8_t *named = calloc(sb->inode_count, 1);
+  for (int e = 0; e < edge_count; e++) {
+    if (!reached[edges[e].dir] && states[edges[e].dir] == STATE_OK) {
+      named[edges[e].child] = 1;
+    }
+  }
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint32_t inum = ROOT_INODE + 1; inum < sb->inode_count; inum++) {
+      if (states[inum] == STATE_OK && !reached[inum] &&
+          (pass == 1 || !named[inum])) {
+        reconnect(inum);
+      }
+    }
+  }
+  free(named);
+
+  for (uint32_t inum = 0; inum < sb->inode_count; inum++) {
+    if (states[inum] == STATE_BAD && repair) {
+      free_inode_fsck(inum);
+      continue;
+    }
+    if (states[inum] != STATE_OK) {
+      continue;
+    }
+    inode_t *node = inode(inum);
+    int want = inum == ROOT_INODE ? 1 : links[inum];
+    if (node->refs != want &&
+        problem(1, "inode %u has link count %d, counted %d", inum, node->refs,
+                want)) {
+      touch(node, sizeof(*node));
+      node->refs = want;
+    }
+  }
+}
+
+// Blocks
+
+// report a problem with a block, the first few one by one
+static int block_problem(int *count, int fixable, const char *what,
+                         uint32_t bnum) {
+  if ((*count)++ < MAX_LISTED) {
+    return problem(fixable, "block %u %s", bnum, what);
+  }
+  errors++;
+  unfixed += !(repair && fixable);
+  return repair && fixable;
+}
+
+static void listed(int count, const char *what) {
+  if (count > MAX_LISTED) {
+    printf("... and %d more blocks %s\n", count - MAX_LISTED, what);
+  }
+}
+
+static void check_blocks() {
+  void *bm = bbm();
+  refcount_t *refs = sb->refcount_blocks ? block(sb->refcount_start) : NULL;
+  uint32_t *fps = sb->dedup_blocks ? block(sb->dedup_start) : NULL;
+  int unmarked = 0, marked = 0, wrong_refs = 0, shared = 0, stale = 0;
+
+  for (uint32_t b = 0; b < sb->block_count; b++) {
+    int want = b < sb->data_start || is_table(b) || owners[b] > 0;
+    if (bitmap_get(bm, b) != want &&
+        block_problem(want ? &unmarked : &marked, 1,
+                      want ? "is in use but marked free"
+                           : "is free but marked in use",
+                      b)) {
+      touch((char *)bm + b / 8, 1);
+      bitmap_put(bm, b, want);
+    }
+
+    uint32_t extra = b >= sb->data_start && owners[b] ? owners[b] - 1 : 0;
+    if ((kinds[b] & KIND_META) && owners[b] > 1) {
+      block_problem(&shared, 0, "is metadata with more than one owner", b);
+    } else if (!refs && extra > 0) {
+      block_problem(&shared, 0, "has more than one owner", b);
+    } else if (refs && extra > NUFS_MAX_SHARES) {
+      block_problem(&shared, 0, "has too many owners", b);
+    } else if (refs && refs[b] != extra &&
+               block_problem(&wrong_refs, 1, "has a wrong reference count",
+                             b)) {
+      touch(&refs[b], sizeof(refcount_t));
+      refs[b] = extra;
+    }
+
+    if (fps && fps[b] != 0 && b >= sb->data_start &&
+        (!want || (kinds[b] & KIND_META)) &&
+        block_problem(&stale, 1, "has a stale fingerprint", b)) {
+      touch(&fps[b], sizeof(uint32_t));
+      fps[b] = 0;
+    }
+  }
+
+  // nothing past the end of the image is in use
+  int end = sb->max_block_count;
+  for (int b = bitmap_find_one(bm, sb->block_count, end); b < end;
+       b = bitmap_find_one(bm, b + 1, end)) {
+    if (block_problem(&marked, 1, "is free but marked in use", b)) {
+      touch((char *)bm + b / 8, 1);
+      bitmap_put(bm, b, 0);
+    }
+  }
+
+  listed(unmarked, "in use but marked free");
+  listed(marked, "free but marked in use");
+  listed(wrong_refs, "with wrong reference counts");
+  listed(shared, "with too many owners");
+  listed(stale, "with stale fingerprints");
+}
+
+// take the checksums of the repaired metadata blocks again
+static void update_sums() {
+  if (sb->csum_blocks == 0) {
+    return;
+  }
+  uint32_t *table = block(sb->csum_start);
+  for (uint32_t b = 0; b < sb->block_count; b++) {
+    if (dirty[b] && has_sum(b) && table[b] != 0 &&
+        (b < sb->data_start || is_table(b) || (kinds[b] & KIND_META))) {
+      table[b] = crc32c(0, block(b), bs);
+    }
+  }
+}
+
+// The image
+
+// check the superblock, so that every region can be trusted to be where it
+// says
+static int check_superblock(superblock_t *s, off_t size) {
+  if (s->magic != NUFS_MAGIC || s->version != NUFS_VERSION) {
+    return -1;
+  }
+  if (s->block_size < 512 || s->block_size > (1 << 20) ||
+      (s->block_size & (s->block_size - 1)) ||
+      s->inode_size != sizeof(inode_t)) {
+    return -1;
+  }
+  if (s->block_count > s->max_block_count ||
+      s->inode_count > s->max_inode_count || s->inode_count <= ROOT_INODE ||
+      s->data_start > s->block_count ||
+      (off_t)s->block_count * s->block_size > size) {
+    return -1;
+  }
+
+  uint64_t bits = (uint64_t)s->block_size * 8;
+  uint32_t regions[][2] = {
+      {s->block_bitmap_start, s->block_bitmap_blocks},
+      {s->inode_bitmap_start, s->inode_bitmap_blocks},
+      {s->inode_table_start, s->inode_table_blocks},
+      {s->snapshot_start, s->snapshot_start ? 1 : 0},
+      {s->journal_start, s->journal_blocks},
+  };
+  for (int i = 0; i < (int)(sizeof(regions) / sizeof(regions[0])); i++) {
+    if (regions[i][1] > 0 && (regions[i][0] == 0 ||
+                              (uint64_t)regions[i][0] + regions[i][1] >
+                                  s->data_start)) {
+      return -1;
+    }
+  }
+  if (s->block_bitmap_blocks * bits < s->max_block_count ||
+      s->inode_bitmap_blocks * bits < s->max_inode_count ||
+      (uint64_t)s->inode_table_blocks * s->block_size <
+          (uint64_t)s->max_inode_count * sizeof(inode_t)) {
+    return -1;
+  }
+
+  // the tables with an entry per block are sized for the image, in a run
+  // of their own among the data blocks
+  superblock_t tables = *s;
+  blocks_place_tables(&tables, s->refcount_start, s->block_count);
+  if (memcmp(&tables, s, sizeof(*s)) != 0 ||
+      s->refcount_start < s->data_start ||
+      blocks_tables_end(s) > s->block_count) {
+    return -1;
+  }
+  return 0;
+}
+
+// replay the journal, or with -n just say whether it needs it
+static void check_journal(int fd, superblock_t *s) {
+  if (s->journal_blocks == 0) {
+    return;
+  }
+  int found = readonly ? journal_pending(fd, s) : journal_replay(fd, s);
+  if (found < 0) {
+    if (problem(1, "the journal header is damaged")) {
+      // start over with an empty log that no stale block can pass for
+      char *buf = calloc(1, s->block_size);
+      for (uint32_t b = 1; b < s->journal_blocks; b++) {
+        pwrite(fd, buf, s->block_size, (off_t)(s->journal_start + b) *
+                                           s->block_size);
+      }
+      journal_format(buf, 1);
+      if (pwrite(fd, buf, s->block_size, (off_t)s->journal_start *
+                                             s->block_size) != s->block_size) {
+        fail("cannot write the journal");
+      }
+      free(buf);
+    }
+  } else if (found > 0) {
+    printf(readonly ? "%d journal transactions not replayed, the results may "
+                      "be off\n"
+                    : "replayed %d journal transactions\n",
+           found);
+  }
+}
+
+int main(int argc, char **argv) {
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  while ((opt = getopt(argc, argv, "nyj:")) != -1) {
+    switch (opt) {
+    case 'n':
+      readonly = 1;
+      break;
+    case 'y':
+      repair = 1;
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind + 1 != argc || (readonly && repair) || threads < 1) {
+    usage();
+  }
+  path = argv[optind];
+
+  int fd = open(path, readonly ? O_RDONLY : O_RDWR);
+  if (fd < 0) {
+    fail(strerror(errno));
+  }
+  struct stat st;
+  superblock_t s;
+  if (fstat(fd, &st) < 0 || pread(fd, &s, sizeof(s), 0) != sizeof(s) ||
+      check_superblock(&s, st.st_size) < 0) {
+    fail("not a nufs image, or its superblock is damaged");
+  }
+  check_journal(fd, &s);
+
+  bs = s.block_size;
+  image = mmap(NULL, (size_t)s.block_count * bs,
+               readonly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+               0);
+  if (image == MAP_FAILED) {
+    fail(strerror(errno));
+  }
+  sb = (superblock_t *)image;
+
+  owners = calloc(sb->block_count, sizeof(uint32_t));
+  kinds = calloc(sb->block_count, 1);
+  dirty = calloc(sb->block_count, 1);
+  states = calloc(sb->inode_count, 1);
+  parent_entry = calloc(sb->inode_count, sizeof(uint64_t));
+  if (!owners || !kinds || !dirty || !states || !parent_entry) {
+    fail("out of memory");
+  }
+
+  for (uint32_t b = 0; b < sb->data_start; b++) {
+    verify(b);
+  }
+  for (uint32_t b = sb->refcount_start; b < blocks_tables_end(sb); b++) {
+    verify(b);
+  }
+  scan_inodes(threads);
+  int files = 0;
+  for (uint32_t inum = 0; inum < sb->inode_count; inum++) {
+    files += states[inum] != STATE_FREE;
+  }
+  // an image that was never mounted has no root directory yet, mounting
+  // makes it
+  if (files > 0 && (states[ROOT_INODE] != STATE_OK ||
+                    !S_ISDIR(inode(ROOT_INODE)->mode))) {
+    fprintf(stderr, "fsck.nufs: %s: the root directory is damaged\n", path);
+    exit(EXIT_ERRORS);
+  }
+  scan_snapshots();
+  if (files > 0) {
+    check_tree();
+  }
+  check_blocks();
+
+  if (repair) {
+    update_sums();
+    if (msync(image, (size_t)sb->block_count * bs, MS_SYNC) < 0) {
+      fail(strerror(errno));
+    }
+  }
+
+  int used = 0;
+  files = 0;
+  for (uint32_t inum = 0; inum < sb->inode_count; inum++) {
+    files += bitmap_get(ibm(), inum);
+  }
+  for (uint32_t b = 0; b < sb->block_count; b++) {
+    used += bitmap_get(bbm(), b);
+  }
+  printf("%s: %d/%u inodes, %d/%u blocks, %s\n", path, files, sb->inode_count,
+         used, sb->block_count,
+         errors == 0 ? "clean" : unfixed ? "errors left" : "repaired");
+
+  munmap(image, (size_t)sb->block_count * bs);
+  close(fd);
+  return errors == 0 ? EXIT_CLEAN : unfixed ? EXIT_ERRORS : EXIT_FIXED;
+}
@@ -26,5 +26,17 @@ int main(int argc, char **argv) {
   bitmap_put(bm, 255, 1);
   bitmap_print(bm, SIZE);
 
+  printf("\nSetting bits 3-130: \n");
+  bitmap_put_range(bm, 3, 128, 1);
+  bitmap_print(bm, SIZE);
+
+  printf("\nBits set: %d\n", bitmap_count(bm, SIZE));
+  printf("First clear bit: %d\n", bitmap_find_zero(bm, 0, SIZE));
+  printf("First clear bit from 3: %d\n", bitmap_find_zero(bm, 3, SIZE));
+  printf("First run of 100 clear bits: %d\n",
+         bitmap_find_zero_run(bm, 0, SIZE, 100));
+  printf("First run of 200 clear bits: %d\n",
+         bitmap_find_zero_run(bm, 0, SIZE, 200));
+
   return 0;
 }
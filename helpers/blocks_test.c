@@ -6,7 +6,7 @@
 #define TEST_NAME "block_test.img"
 
 int main(int argc, char **argv) {
-  blocks_init(TEST_NAME);
+  blocks_init(TEST_NAME, NULL);
 
   printf("Block bitmap at the beginning:\n");
   bitmap_print(get_blocks_bitmap(), BLOCK_COUNT);
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compress.h"
+
+#define CLUSTER (4 * 4096)
+#define CLUSTERS 4096 // 64MB
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// fill len bytes with something like a log file
+static void fill_text(char *buf, size_t len) {
+  static const char *words[] = {"GET",   "POST",  "/index.html", "/api/v1",
+                                "200",   "404",   "ok",          "error",
+                                "user=", "time=", "\n"};
+  size_t n = 0;
+  while (n < len) {
+    const char *w = words[rand() % 11];
+    size_t wl = strlen(w);
+    for (size_t i = 0; i <= wl && n < len; i++) {
+      buf[n++] = i < wl ? w[i] : ' ';
+    }
+  }
+}
+
+// compress and decompress every cluster of data, checking the round trip
+static void run(const char *name, const char *data) {
+  char *packed = malloc(CLUSTER);
+  char *back = malloc(CLUSTER);
+  size_t in = 0, out = 0;
+  int stored = 0, bad = 0;
+
+  double start = seconds();
+  for (int c = 0; c < CLUSTERS; c++) {
+    int n = lz4_compress(data + (size_t)c * CLUSTER, CLUSTER, packed, CLUSTER);
+    in += CLUSTER;
+    out += n ? n : CLUSTER;
+    stored += n == 0;
+  }
+  double compressed = seconds() - start;
+
+  start = seconds();
+  for (int c = 0; c < CLUSTERS; c++) {
+    const char *orig = data + (size_t)c * CLUSTER;
+    int n = lz4_compress(orig, CLUSTER, packed, CLUSTER);
+    if (n == 0) {
+      continue;
+    }
+    if (lz4_decompress(packed, n, back, CLUSTER) != CLUSTER ||
+        memcmp(orig, back, CLUSTER) != 0) {
+      bad++;
+    }
+  }
+  double round_trip = seconds() - start;
+
+  double mb = (double)in / (1 << 20);
+  printf("%-8s ratio %.2f, %d clusters left plain, %d bad round trips\n", name,
+         (double)in / out, stored, bad);
+  printf("%-8s compress: %.0f MB/s, compress+decompress: %.0f MB/s\n", "",
+         mb / compressed, mb / round_trip);
+  free(packed);
+  free(back);
+}
+
+int main(int argc, char **argv) {
+  char *data = malloc((size_t)CLUSTERS * CLUSTER);
+
+  fill_text(data, (size_t)CLUSTERS * CLUSTER);
+  run("text", data);
+
+  memset(data, 0, (size_t)CLUSTERS * CLUSTER);
+  run("zeros", data);
+
+  for (size_t i = 0; i < (size_t)CLUSTERS * CLUSTER; i++) {
+    data[i] = rand();
+  }
+  run("random", data);
+
+  free(data);
+  return 0;
+}
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "csum.h"
+
+#define BLOCK 4096
+#define BLOCKS 16384 // 64MB
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  printf("CRC32C of \"123456789\": %08x (expect e3069283)\n",
+         crc32c(0, "123456789", 9));
+
+  char *zeros = calloc(1, BLOCK);
+  printf("CRC32C of a zero block: %08x\n", crc32c(0, zeros, BLOCK));
+
+  // checksumming a block in pieces gives the same answer
+  char *data = malloc((size_t)BLOCKS * BLOCK);
+  char *copy = malloc((size_t)BLOCKS * BLOCK);
+  for (size_t i = 0; i < (size_t)BLOCKS * BLOCK; i++) {
+    data[i] = rand();
+  }
+  uint32_t whole = crc32c(0, data, BLOCK);
+  uint32_t pieces = crc32c(crc32c(0, data, 1000), data + 1000, BLOCK - 1000);
+  printf("Whole block %08x, in two pieces %08x\n", whole, pieces);
+
+  // how it compares to just copying the blocks
+  memset(copy, 0, (size_t)BLOCKS * BLOCK);
+  double start = seconds();
+  memcpy(copy, data, (size_t)BLOCKS * BLOCK);
+  double copied = seconds() - start;
+  uint32_t copy_sum = crc32c(0, copy, (size_t)BLOCKS * BLOCK);
+
+  start = seconds();
+  uint32_t sum = 0;
+  for (int b = 0; b < BLOCKS; b++) {
+    sum ^= crc32c(0, data + (size_t)b * BLOCK, BLOCK);
+  }
+  double summed = seconds() - start;
+
+  double mb = (double)BLOCKS * BLOCK / (1 << 20);
+  printf("memcpy: %.0f MB/s (%08x), crc32c: %.0f MB/s (%08x)\n", mb / copied,
+         copy_sum, mb / summed, sum);
+
+  free(zeros);
+  free(data);
+  free(copy);
+  return 0;
+}
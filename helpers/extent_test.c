@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <limits.h>
+
+#include "blocks.h"
+#include "extent.h"
+#include "inode.h"
+
+#define TEST_NAME "extent_test.img"
+
+int main(int argc, char **argv) {
+  blocks_init(TEST_NAME, NULL);
+
+  inode_t node;
+  extent_init(&node);
+
+  printf("Mapping 8 contiguous blocks at 0:\n");
+  int start = alloc_block();
+  extent_insert(&node, 0, start, 1, 0);
+  for (int i = 1; i < 8; i++) {
+    extent_insert(&node, i, alloc_block(), 1, 0);
+  }
+  extent_print(&node);
+
+  printf("\nMapping every other block from 100 on:\n");
+  for (int i = 0; i < 20; i++) {
+    alloc_block(); // leave a gap on disk so nothing merges
+    extent_insert(&node, 100 + 2 * i, alloc_block(), 1, 0);
+  }
+  extent_print(&node);
+
+  int count;
+  int bnum = extent_lookup(&node, 3, &count, NULL);
+  printf("\nBlock 3 -> %d (%d contiguous)\n", bnum, count);
+  bnum = extent_lookup(&node, 50, &count, NULL);
+  printf("Block 50 -> %d (hole of %d)\n", bnum, count);
+
+  printf("\nPunching [2, 4) and truncating at 110:\n");
+  extent_remove(&node, 2, 2);
+  extent_remove(&node, 110, INT_MAX - 110);
+  extent_print(&node);
+
+  printf("\nPreallocating [200, 204) and writing block 201:\n");
+  int pre = alloc_block();
+  for (int i = 1; i < 4; i++) {
+    alloc_block();
+  }
+  extent_insert(&node, 200, pre, 4, EXTENT_UNWRITTEN);
+  extent_set_flags(&node, 201, 1, 0);
+  extent_print(&node);
+
+  extent_remove(&node, 0, INT_MAX);
+  blocks_free();
+
+  return 0;
+}
@@ -26,6 +26,15 @@ int main(int argc, char **argv) {
 
   print_list(list2);
 
+  // Paths are walked in place
+  const char *path = "/usr//local/bin/";
+  printf("\nNames in \"%s\":\n", path);
+  path_iter_t it;
+  path_begin(&it, path);
+  while (path_next(&it)) {
+    printf("%.*s%s\n", it.len, it.name, path_last(&it) ? " (last)" : "");
+  }
+
   s_free(list1);
   s_free(list2);
   return 0;
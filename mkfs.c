@@ -0,0 +1,174 @@
+// format a nufs image
+//
+// usage: mkfs.nufs [-F] [-v] [-b block_size] [-N inodes] [-J journal_blocks]
+//                  [-M max_size] <image> [size[K|M|G|T]]
+//
+// Makes the image a sparse file of the given size (by default the size of
+// an existing file, or 1M for a new one) and writes the metadata and the
+// root directory into it. The data region is never touched, so formatting
+// takes the same few milliseconds whatever the size.
+//
+//   -b  block size in bytes, a power of two from 1K to 64K (4K)
+//   -N  number of inodes (one for every 16K of the image)
+//   -J  journal size in blocks, 0 for no journal (one block in 64, within
+//       16 and 8192)
+//   -M  the largest size the image can be grown to (64 times its size); the
+//       bitmaps and tables are sized for it
+//   -F  format over an existing nufs image
+//   -v  show what the storage code does
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "storage/blocks.h"
+#include "storage/storage.h"
+
+static void usage() {
+  fprintf(stderr, "usage: mkfs.nufs [-F] [-v] [-b block_size] [-N inodes] "
+                  "[-J journal_blocks]\n"
+                  "                 [-M max_size] <image> [size[K|M|G|T]]\n");
+  exit(2);
+}
+
+// parse a size like 4096, 64K, 16M, 2G or 1T, returns -1 if it isn't one
+static int64_t parse_size(const char *text) {
+  char *end;
+  int64_t size = strtoll(text, &end, 10);
+  if (end == text || size < 0) {
+    return -1;
+  }
+
+  switch (*end) {
+  case 'T': case 't':
+    size *= 1024;
+    // fall through
+  case 'G': case 'g':
+    size *= 1024;
+    // fall through
+  case 'M': case 'm':
+    size *= 1024;
+    // fall through
+  case 'K': case 'k':
+    size *= 1024;
+    end++;
+    break;
+  }
+  return *end == '\0' ? size : -1;
+}
+
+static int64_t parse_arg(const char *text, const char *what) {
+  int64_t value = parse_size(text);
+  if (value < 0) {
+    fprintf(stderr, "mkfs.nufs: bad %s '%s'\n", what, text);
+    exit(2);
+  }
+  return value;
+}
+
+int main(int argc, char **argv) {
+  format_config_t conf = {0};
+  int force = 0, verbose = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "Fvb:N:J:M:")) != -1) {
+    switch (opt) {
+    case 'F':
+      force = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'b':
+      conf.block_size = parse_arg(optarg, "block size");
+      break;
+    case 'N':
+      conf.inode_count = parse_arg(optarg, "inode count");
+      break;
+    case 'J':
+      conf.journal_blocks = parse_arg(optarg, "journal size");
+      if (conf.journal_blocks == 0) {
+        conf.journal_blocks = -1;
+      }
+      break;
+    case 'M':
+      conf.max_size = parse_arg(optarg, "maximum size");
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind + 1 != argc && optind + 2 != argc) {
+    usage();
+  }
+  const char *path = argv[optind];
+
+  int fd = open(path, O_CREAT | O_RDWR, 0644);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "mkfs.nufs: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  int64_t size = optind + 2 == argc ? parse_arg(argv[optind + 1], "size")
+                                    : st.st_size;
+  if (size == 0) {
+    size = NUFS_DEFAULT_SIZE;
+  }
+
+  superblock_t old;
+  if (!force && pread(fd, &old, sizeof(old), 0) == sizeof(old) &&
+      old.magic == NUFS_MAGIC) {
+    fprintf(stderr, "mkfs.nufs: %s already holds a nufs image, use -F to "
+                    "format it anyway\n",
+            path);
+    return 1;
+  }
+
+  // the old contents go, and the new image is one big hole
+  if (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0) {
+    fprintf(stderr, "mkfs.nufs: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  // the storage code reports everything it does on stdout
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  if (!verbose) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+  }
+  int rv = blocks_format(fd, size, &conf);
+  close(fd);
+  if (rv == 0) {
+    // mounting makes the root directory
+    storage_init(path, NULL);
+    storage_free();
+  }
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  if (rv < 0) {
+    fprintf(stderr, "mkfs.nufs: cannot format %s\n", path);
+    return 1;
+  }
+
+  fd = open(path, O_RDONLY);
+  superblock_t sb;
+  if (fd < 0 || pread(fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+    fprintf(stderr, "mkfs.nufs: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  close(fd);
+  printf("%s: %u blocks of %u bytes, %u inodes, %u journal blocks, data "
+         "from block %u, room to grow to %u blocks and %u inodes\n",
+         path, sb.block_count, sb.block_size, sb.inode_count,
+         sb.journal_blocks, sb.data_start, sb.max_block_count,
+         sb.max_inode_count);
+  return 0;
+}
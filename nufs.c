@@ -12,23 +12,78 @@
 
 #include "storage/directory.h"
 #include "storage/inode.h"
+#include "storage/journal.h"
+#include "storage/nufs_ioctl.h"
+#include "storage/snapshot.h"
 #include "storage/storage.h"
 
 #define FUSE_USE_VERSION 30
 #include <fuse.h>
 
+// Snapshots of the volume show up read-only under /.snapshots/NAME, so they
+// can be read while the volume is being written.
+#define SNAPSHOTS_DIR "/.snapshots"
+
+// Is the path /.snapshots or something under it?
+static int in_snapshots(const char *path) {
+  size_t len = strlen(SNAPSHOTS_DIR);
+  return strncmp(path, SNAPSHOTS_DIR, len) == 0 &&
+         (path[len] == '\0' || path[len] == '/');
+}
+
+// If the path is under /.snapshots/NAME, enter the snapshot NAME and point
+// inner at the rest of the path ("/" for NAME itself). Returns 1 if a
+// snapshot was entered (leave it with snapshot_leave), 0 if the path is
+// not in one, or a negative errno.
+static int enter_snapshot(const char *path, const char **inner) {
+  *inner = path;
+  if (!in_snapshots(path) || strcmp(path, SNAPSHOTS_DIR) == 0) {
+    return 0;
+  }
+
+  const char *name = path + strlen(SNAPSHOTS_DIR) + 1;
+  const char *rest = strchr(name, '/');
+  size_t len = rest ? (size_t)(rest - name) : strlen(name);
+  if (len >= NUFS_SNAPSHOT_NAME_MAX) {
+    return -ENOENT;
+  }
+  char buf[NUFS_SNAPSHOT_NAME_MAX];
+  memcpy(buf, name, len);
+  buf[len] = '\0';
+
+  int rv = snapshot_enter(buf);
+  if (rv < 0) {
+    return rv;
+  }
+  *inner = rest ? rest : "/";
+  return 1;
+}
+
 // implementation for: man 2 access
 // Checks if a file exists.
 int nufs_access(const char *path, int mask) {
   printf("----------------start access----------------\n");
-  int inum = tree_lookup(path);
+  if (in_snapshots(path) && (mask & W_OK)) {
+    return -EROFS;
+  }
+  if (strcmp(path, SNAPSHOTS_DIR) == 0 && snapshot_supported()) {
+    return 0;
+  }
+  const char *inner;
+  int entered = enter_snapshot(path, &inner);
+  if (entered < 0) {
+    return entered;
+  }
+  int inum = tree_lookup(inner);
+  inode_t *node = inum < 0 ? NULL : get_inode(inum);
+  if (entered) {
+    snapshot_leave();
+  }
 
   if (inum == -1) {
     return -1;
   }
 
-  inode_t *node = get_inode(inum);
-
   printf("access(%s, %04o) -> \n", path, mask);
   if (node) {
     return 0;
@@ -42,7 +97,24 @@ int nufs_access(const char *path, int mask) {
 // This is a crucial function.
 int nufs_getattr(const char *path, struct stat *st) {
   printf("----------------start getattr----------------\n");
-  int rv = storage_stat(path, -1, st);
+  if (strcmp(path, SNAPSHOTS_DIR) == 0 && snapshot_supported()) {
+    memset(st, 0, sizeof(*st));
+    st->st_uid = getuid();
+    st->st_mode = 040555;
+    st->st_nlink = 2;
+    return 0;
+  }
+  const char *inner;
+  int rv = enter_snapshot(path, &inner);
+  if (rv < 0) {
+    return rv;
+  }
+  int entered = rv;
+  rv = storage_stat(inner, -1, st);
+  if (entered) {
+    st->st_mode &= ~0222;
+    snapshot_leave();
+  }
 
   if (rv < 0) {
     return -ENOENT;
@@ -57,7 +129,29 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi) {
   printf("----------------start readdir----------------\n");
   int rv = 0;
-  dirent_node_t *items = storage_list(path, -1);
+  if (strcmp(path, SNAPSHOTS_DIR) == 0 && snapshot_supported()) {
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    // the list only changes inside journal operations
+    journal_begin();
+    for (int i = 0; i < SNAPSHOT_MAX; i++) {
+      if (snapshot_name(i)) {
+        filler(buf, snapshot_name(i), NULL, 0);
+      }
+    }
+    journal_end();
+    printf("readdir(%s) -> %d\n", path, rv);
+    return 0;
+  }
+  const char *inner;
+  int entered = enter_snapshot(path, &inner);
+  if (entered < 0) {
+    return entered;
+  }
+  if (strcmp(path, "/") == 0 && snapshot_supported()) {
+    filler(buf, SNAPSHOTS_DIR + 1, NULL, 0);
+  }
+  dirent_node_t *items = storage_list(inner, -1);
   int flag = 0;
 
   for (dirent_node_t *xs = items; xs != 0;) {
@@ -77,6 +171,9 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
       break;
     }
   }
+  if (entered) {
+    snapshot_leave();
+  }
 
   // filler(buf, "hello.txt", &st, 0);
 
@@ -90,6 +187,9 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 // function.
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
   printf("----------------start mknod----------------\n");
+  if (in_snapshots(path)) {
+    return -EROFS;
+  }
 
   char *directory = malloc(strlen(path) + 1);
   char *name = malloc(strlen(path) + 1);
@@ -108,6 +208,8 @@ int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
 int nufs_mkdir(const char *path, mode_t mode) {
   printf("----------------start mkdir----------------\n");
 
+  // the new directory and its entries land in the same transaction
+  journal_begin();
   int rv = nufs_mknod(path, mode | 040000, 0);
   int inum = tree_lookup(path);
   inode_t *node = get_inode(inum);
@@ -121,6 +223,7 @@ int nufs_mkdir(const char *path, mode_t mode) {
     directory_put(node, ".", inum);
     directory_put(node, "..", parent_inum);
   }
+  journal_end();
 
   printf("mkdir(%s) -> %d\n", path, rv);
   return rv;
@@ -129,6 +232,9 @@ int nufs_mkdir(const char *path, mode_t mode) {
 // unlinks file from this path
 int nufs_unlink(const char *path) {
   printf("----------------start unlink----------------\n");
+  if (in_snapshots(path)) {
+    return -EROFS;
+  }
 
   char *directory = malloc(strlen(path) + 1);
   char *child = malloc(strlen(path) + 1);
@@ -147,6 +253,9 @@ int nufs_unlink(const char *path) {
 // links the files from the to paths
 int nufs_link(const char *from, const char *to) {
   printf("----------------start link----------------\n");
+  if (in_snapshots(from) || in_snapshots(to)) {
+    return -EROFS;
+  }
 
   char *to_parent = malloc(strlen(to) + 1);
   char *to_child = malloc(strlen(to) + 1);
@@ -166,6 +275,9 @@ int nufs_link(const char *from, const char *to) {
 // removes the directory from that path
 int nufs_rmdir(const char *path) {
   printf("----------------start rmdir----------------\n");
+  if (in_snapshots(path)) {
+    return -EROFS;
+  }
 
   int inum = tree_lookup(path);
   inode_t *node = get_inode(inum);
@@ -184,6 +296,9 @@ int nufs_rmdir(const char *path) {
 // called to move a file within the same filesystem
 int nufs_rename(const char *from, const char *to) {
   printf("----------------start rename----------------\n");
+  if (in_snapshots(from) || in_snapshots(to)) {
+    return -EROFS;
+  }
 
   char *from_parent = malloc(strlen(from) + 1);
   char *from_child = malloc(strlen(from) + 1);
@@ -208,6 +323,9 @@ int nufs_rename(const char *from, const char *to) {
 // changes permissions
 int nufs_chmod(const char *path, mode_t mode) {
   printf("----------------start chmod----------------\n");
+  if (in_snapshots(path)) {
+    return -EROFS;
+  }
 
   int rv = -1;
   int inum = tree_lookup(path);
@@ -216,7 +334,10 @@ int nufs_chmod(const char *path, mode_t mode) {
   if (node->mode == mode) {
     return 0;
   } else {
+    journal_begin();
+    inode_dirty(node);
     node->mode = mode;
+    journal_end();
     rv = 0;
   }
   printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
@@ -226,6 +347,9 @@ int nufs_chmod(const char *path, mode_t mode) {
 // truncates file/dir by the passed in size
 int nufs_truncate(const char *path, off_t size) {
   printf("----------------start truncate----------------\n");
+  if (in_snapshots(path)) {
+    return -EROFS;
+  }
   int rv = storage_truncate(path, size);
   printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
   return rv;
@@ -237,7 +361,7 @@ int nufs_truncate(const char *path, off_t size) {
 // You can just check whether the file is accessible.
 int nufs_open(const char *path, struct fuse_file_info *fi) {
   printf("----------------start open----------------\n");
-  int rv = nufs_access(path, 0);
+  int rv = nufs_access(path, (fi->flags & O_ACCMODE) == O_RDONLY ? 0 : W_OK);
   printf("open(%s) -> %d\n", path, rv);
   return rv;
 }
@@ -246,7 +370,16 @@ int nufs_open(const char *path, struct fuse_file_info *fi) {
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
   printf("----------------start read----------------\n");
-  int rv = storage_read(path, -1, buf, size, offset);
+  const char *inner;
+  int rv = enter_snapshot(path, &inner);
+  if (rv < 0) {
+    return rv;
+  }
+  int entered = rv;
+  rv = storage_read(inner, -1, buf, size, offset);
+  if (entered) {
+    snapshot_leave();
+  }
   printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
   return rv;
 }
@@ -255,31 +388,130 @@ int nufs_read(const char *path, char *buf, size_t size, off_t offset,
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
   printf("----------------start write----------------\n");
+  if (in_snapshots(path)) {
+    return -EROFS;
+  }
   int rv = storage_write(path, -1, buf, size, offset);
   printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
   return rv;
 }
 
+// Preallocate or punch out space in a file
+int nufs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                   struct fuse_file_info *fi) {
+  printf("----------------start fallocate----------------\n");
+  if (in_snapshots(path)) {
+    return -EROFS;
+  }
+  int rv = storage_fallocate(path, -1, mode, offset, length);
+  printf("fallocate(%s, %d, @+%ld, %ld bytes) -> %d\n", path, mode, offset,
+         length, rv);
+  return rv;
+}
+
+// Get a file onto the disk. Snapshots never change, so there is nothing
+// to do for them.
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  printf("----------------start fsync----------------\n");
+  int rv = in_snapshots(path) ? 0 : storage_fsync(path, -1);
+  printf("fsync(%s, %d) -> %d\n", path, datasync, rv);
+  return rv;
+}
+
+// Get a directory onto the disk.
+int nufs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+  printf("----------------start fsyncdir----------------\n");
+  int rv = in_snapshots(path) ? 0 : storage_fsync(path, -1);
+  printf("fsyncdir(%s, %d) -> %d\n", path, datasync, rv);
+  return rv;
+}
+
+// Called on every close of the file. Nothing is buffered per open file, but
+// starting the write-back here leaves less for the next fsync or commit.
+int nufs_flush(const char *path, struct fuse_file_info *fi) {
+  printf("----------------start flush----------------\n");
+  int rv = in_snapshots(path) ? 0 : storage_flush(path, -1);
+  printf("flush(%s) -> %d\n", path, rv);
+  return rv;
+}
+
 // Update the timestamps on a file or directory.
 int nufs_utimens(const char *path, const struct timespec ts[2]) {
   printf("----------------start utimens----------------\n");
+  if (in_snapshots(path)) {
+    return -EROFS;
+  }
   int inum = tree_lookup(path);
   inode_t *node = get_inode(inum);
-  time_t time = ts->tv_sec;
-  node->mtime = time;
   if (node == NULL) {
     return -1;
   }
+  time_t time = ts->tv_sec;
+  journal_begin();
+  inode_dirty(node);
+  node->mtime = time;
+  journal_end();
   printf("utimens(%s, [%ld, %ld; %ld, %ld]) -> %d\n", path, ts[0].tv_sec,
          ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, 1);
   return 0;
 }
 
+// Write everything back when the filesystem is unmounted
+void nufs_destroy(void *private_data) {
+  printf("----------------start destroy----------------\n");
+  storage_free();
+}
+
 // Extended operations
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data) {
   printf("----------------start ioctl----------------\n");
-  int rv = 0;
+  int rv = -ENOTTY;
+  if (cmd == NUFS_IOC_RESIZE && strcmp(path, "/") == 0) {
+    rv = storage_resize(*(uint64_t *)data);
+  } else if (cmd == NUFS_IOC_SNAPSHOT_CREATE && strcmp(path, "/") == 0) {
+    struct nufs_snapshot *snap = data;
+    snap->name[NUFS_SNAPSHOT_NAME_MAX - 1] = '\0';
+    rv = storage_snapshot(snap->name);
+  } else if (cmd == NUFS_IOC_SNAPSHOT_DELETE && strcmp(path, "/") == 0) {
+    struct nufs_snapshot *snap = data;
+    snap->name[NUFS_SNAPSHOT_NAME_MAX - 1] = '\0';
+    rv = storage_delete_snapshot(snap->name);
+  } else if ((unsigned int)cmd == NUFS_IOC_TRIM && strcmp(path, "/") == 0) {
+    struct nufs_trim_range *range = data;
+    int64_t trimmed = storage_trim(range->start, range->len, range->minlen);
+    if (trimmed >= 0) {
+      range->len = trimmed;
+    }
+    rv = trimmed < 0 ? trimmed : 0;
+  } else if (cmd == NUFS_IOC_CLONE_RANGE) {
+    if (in_snapshots(path)) {
+      return -EROFS;
+    }
+    struct nufs_clone_range *range = data;
+    range->src_path[NUFS_CLONE_PATH_MAX - 1] = '\0';
+    rv = storage_clone(range->src_path, -1, range->src_offset,
+                       range->src_length, path, -1, range->dest_offset);
+  } else if ((unsigned int)cmd == NUFS_IOC_GETFLAGS) {
+    const char *inner;
+    int entered = enter_snapshot(path, &inner);
+    if (entered < 0) {
+      return entered;
+    }
+    rv = strcmp(path, SNAPSHOTS_DIR) == 0 ? 0 : storage_get_flags(inner, -1);
+    if (entered) {
+      snapshot_leave();
+    }
+    if (rv >= 0) {
+      *(unsigned int *)data = rv;
+      rv = 0;
+    }
+  } else if ((unsigned int)cmd == NUFS_IOC_SETFLAGS) {
+    if (in_snapshots(path)) {
+      return -EROFS;
+    }
+    rv = storage_set_flags(path, -1, *(unsigned int *)data);
+  }
   printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
   return rv;
 }
@@ -300,14 +532,51 @@ static const struct fuse_operations nufs_ops = {
   .open = nufs_open,
   .read = nufs_read,
   .write = nufs_write,
+  .fallocate = nufs_fallocate,
+  .fsync = nufs_fsync,
+  .fsyncdir = nufs_fsyncdir,
+  .flush = nufs_flush,
   .utimens = nufs_utimens,
   .ioctl = nufs_ioctl,
+  .destroy = nufs_destroy,
+};
+
+// options on top of the fuse ones, e.g. -o backend=pread,cache_blocks=8192
+static const struct fuse_opt nufs_opts[] = {
+  {"backend=mmap", offsetof(blocks_config_t, backend), BLOCKS_MMAP},
+  {"backend=pread", offsetof(blocks_config_t, backend), BLOCKS_PREAD},
+  {"cache_blocks=%d", offsetof(blocks_config_t, cache_blocks), 0},
+  {"odirect", offsetof(blocks_config_t, direct), 1},
+  {"commit=%d", offsetof(blocks_config_t, commit_interval), 0},
+  {"snapshot=%s", offsetof(blocks_config_t, snapshot), 0},
+  {"checksum=metadata", offsetof(blocks_config_t, checksum), CSUM_METADATA},
+  {"checksum=off", offsetof(blocks_config_t, checksum), CSUM_OFF},
+  {"checksum=full", offsetof(blocks_config_t, checksum), CSUM_FULL},
+  {"dedup", offsetof(blocks_config_t, dedup), 1},
+  {"discard", offsetof(blocks_config_t, discard), DISCARD_SYNC},
+  {"discard=sync", offsetof(blocks_config_t, discard), DISCARD_SYNC},
+  {"discard=async", offsetof(blocks_config_t, discard), DISCARD_ASYNC},
+  FUSE_OPT_END
 };
 
 int main(int argc, char *argv[]) {
-  assert(argc > 2 && argc < 6);
+  assert(argc > 2);
+
+  // pick our options out of the command line
+  const char *image = argv[--argc];
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  blocks_config_t conf = {.backend = BLOCKS_MMAP};
+  if (fuse_opt_parse(&args, &conf, nufs_opts, NULL) == -1) {
+    return 1;
+  }
+  // snapshots are read-only
+  if (conf.snapshot) {
+    fuse_opt_add_arg(&args, "-oro");
+  }
 
   // initalize blocks
-  storage_init(argv[--argc]);
-  return fuse_main(argc, argv, &nufs_ops, NULL);
+  storage_init(image, &conf);
+  int rv = fuse_main(args.argc, args.argv, &nufs_ops, NULL);
+  fuse_opt_free_args(&args);
+  return rv;
 }
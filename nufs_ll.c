@@ -12,6 +12,8 @@
 
 #include "storage/directory.h"
 #include "storage/inode.h"
+#include "storage/journal.h"
+#include "storage/nufs_ioctl.h"
 #include "storage/storage.h"
 
 #define FUSE_USE_VERSION 34
@@ -91,54 +93,47 @@ void nufs_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 
   fuse_reply_attr(req, &st, 1.0);}
 
+// the reply being filled by nufs_readdir
+typedef struct readdir_reply {
+  fuse_req_t req;
+  char *buf;
+  size_t size;
+  size_t used;
+} readdir_reply_t;
+
+static int readdir_fill(void *arg, const char *name, int inum, int type,
+                        off_t next) {
+  readdir_reply_t *r = arg;
+  struct stat st = {.st_ino = inum, .st_mode = type << 12};
+  size_t len = fuse_add_direntry(r->req, r->buf + r->used, r->size - r->used,
+                                 name, &st, next);
+  if (len > r->size - r->used) {
+    // it comes first in the next call
+    return 1;
+  }
+  r->used += len;
+  return 0;
+}
+
 // implementation for: man 2 readdir
-// lists the contents of a directory
+// lists the contents of a directory, from the cookie of the entry the last
+// call stopped at
 void nufs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 			 struct fuse_file_info *fi) {
   printf("----------------start readdir: ino=%ld, size=%ld, off=%ld\n", ino, size, off);
-  int rv = 0;
-  dirent_node_t *items = storage_list(NULL, ino);
-  int flag = 0;
-
-  char *buf;
-  char *pbuf;
-	size_t rem = size+off;
-  off_t next_off = 0;
-	buf = calloc(1, rem);
-  if (!buf) {
+  readdir_reply_t r = {req, malloc(size), size, 0};
+  if (!r.buf) {
     fuse_reply_err(req, ENOMEM);
     return;
   }
-  pbuf = buf;
-
-  for (dirent_node_t *xs = items; xs != 0;) {
-    size_t entsize;
-    struct stat st;
-    printf("current item: %s\n", xs->entry.name);
-
-    rv = storage_stat(NULL, xs->entry.inum, &st);
-    assert(rv == 0);
-    next_off += fuse_add_direntry(req, NULL, 0,  xs->entry.name, NULL, 0);
-    entsize = fuse_add_direntry(req, pbuf, rem, xs->entry.name, &st, next_off);
-
-    dirent_node_t *to_del = xs;
-    xs = to_struct((list_next(&xs->dirent_list)), dirent_node_t, dirent_list);
-    list_del(&to_del->dirent_list);
-    free(to_del);
 
-
-    pbuf += entsize;
-    rem -= entsize;
-    if (to_del == xs) {
-      break;
-    }
-  }
-  if (next_off == off) {
-    fuse_reply_buf(req, NULL, 0);
+  int rv = storage_readdir(NULL, ino, off, readdir_fill, &r);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
   } else {
-    fuse_reply_buf(req, buf+off, next_off-off);
+    fuse_reply_buf(req, r.buf, r.used);
   }
-  free(buf);
+  free(r.buf);
 
   printf("+ readdir(%ld) -> %d\n", ino, rv);
 }
@@ -164,9 +159,13 @@ void nufs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
 void nufs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 		       mode_t mode) {
   printf("----------------start mkdir: parent=%ld, name=%s, mode=%04o\n", parent, name, mode);
+  // the new directory and its entries land in the same transaction
+  journal_begin();
   int rv = storage_mknod(NULL, name, parent, mode | 040000);
   if (rv < 0) {
+    journal_end();
     fuse_reply_err(req, -rv);
+    return;
   }
 
   inode_t *pnode = get_inode(parent);
@@ -175,6 +174,7 @@ void nufs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 
   directory_put(node, ".", inum);
   directory_put(node, "..", parent);
+  journal_end();
 
   struct fuse_entry_param e;
 
@@ -299,13 +299,173 @@ void nufs_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
   printf("write(%ld, %ld bytes, @+%ld) -> %d\n", ino, size, off, rv);
 }
 
+// Preallocate or punch out space in a file
+void nufs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t off,
+		       off_t length, struct fuse_file_info *fi) {
+  printf("----------------start fallocate: ino=%ld, mode=%d, off=%ld, length=%ld\n", ino, mode, off, length);
+  int rv = storage_fallocate(NULL, ino, mode, off, length);
+  fuse_reply_err(req, -rv);
+  printf("fallocate(%ld, %d, @+%ld, %ld bytes) -> %d\n", ino, mode, off, length, rv);
+}
+
+// Find the next data or hole in a file (SEEK_DATA / SEEK_HOLE)
+void nufs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+		       struct fuse_file_info *fi) {
+  printf("----------------start lseek: ino=%ld, off=%ld, whence=%d\n", ino, off, whence);
+  off_t rv = storage_lseek(NULL, ino, off, whence);
+
+  if (rv >= 0) {
+    fuse_reply_lseek(req, rv);
+  } else {
+    fuse_reply_err(req, -rv);
+  }
+
+  printf("lseek(%ld, @+%ld, %d) -> %ld\n", ino, off, whence, rv);
+}
+
+// Get a file onto the disk
+void nufs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		       struct fuse_file_info *fi) {
+  printf("----------------start fsync: ino=%ld, datasync=%d\n", ino, datasync);
+  int rv = storage_fsync(NULL, ino);
+  fuse_reply_err(req, -rv);
+  printf("fsync(%ld, %d) -> %d\n", ino, datasync, rv);
+}
+
+// Get a directory onto the disk
+void nufs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+		       struct fuse_file_info *fi) {
+  printf("----------------start fsyncdir: ino=%ld, datasync=%d\n", ino, datasync);
+  int rv = storage_fsync(NULL, ino);
+  fuse_reply_err(req, -rv);
+  printf("fsyncdir(%ld, %d) -> %d\n", ino, datasync, rv);
+}
+
+// Called on every close; starts writing back what the file left dirty
+void nufs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  printf("----------------start flush: ino=%ld\n", ino);
+  int rv = storage_flush(NULL, ino);
+  fuse_reply_err(req, -rv);
+  printf("flush(%ld) -> %d\n", ino, rv);
+}
+
+// Write everything back when the filesystem is unmounted
+void nufs_destroy(void *userdata) {
+  printf("----------------start destroy\n");
+  storage_free();
+}
+
+// implementation for: man 2 copy_file_range
+// Whole blocks are shared with the destination instead of being copied.
+void nufs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+                          struct fuse_file_info *fi_in, fuse_ino_t ino_out,
+                          off_t off_out, struct fuse_file_info *fi_out,
+                          size_t len, int flags) {
+  printf("----------------start copy_file_range: %ld@+%ld -> %ld@+%ld, %ld\n",
+         ino_in, off_in, ino_out, off_out, len);
+  inode_t *src = get_inode(ino_in);
+  if (src == NULL || get_inode(ino_out) == NULL) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  if (off_in >= src->size) {
+    fuse_reply_write(req, 0);
+    return;
+  }
+  if (len > src->size - off_in) {
+    len = src->size - off_in;
+  }
+
+  // a short copy is fine, the caller comes back for the rest
+  size_t n = len;
+  if (off_in + n < src->size) {
+    n -= n % BLOCK_SIZE;
+  }
+  int rv = -EINVAL;
+  if (n > 0) {
+    rv = storage_clone(NULL, ino_in, off_in, n, NULL, ino_out, off_out);
+  }
+
+  // unaligned ranges are copied the ordinary way
+  if (rv < 0) {
+    n = len < 65536 ? len : 65536;
+    char *buf = malloc(n);
+    if (buf == NULL) {
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
+    rv = storage_read(NULL, ino_in, buf, n, off_in);
+    if (rv > 0) {
+      rv = storage_write(NULL, ino_out, buf, rv, off_out);
+    }
+    free(buf);
+    n = rv;
+  }
+
+  if (rv >= 0) {
+    fuse_reply_write(req, n);
+  } else {
+    fuse_reply_err(req, -rv);
+  }
+  printf("copy_file_range(%ld -> %ld, %ld bytes) -> %d\n", ino_in, ino_out,
+         len, rv);
+}
+
 // Extended operations
 void nufs_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd,
 		       void *arg, struct fuse_file_info *fi, unsigned flags,
 		       const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
   printf("----------------start ioctl: ino=%ld, cmd=%d\n", ino, cmd);
-  int rv = 0;
-  fuse_reply_err(req, EBADR);
+  int rv = -ENOTTY;
+  unsigned int out = 0;
+  struct nufs_trim_range trim;
+  const void *out_buf = &out;
+  size_t out_size = 0;
+  if (cmd == NUFS_IOC_RESIZE && ino == ROOT_INODE &&
+      in_bufsz == sizeof(uint64_t)) {
+    rv = storage_resize(*(const uint64_t *)in_buf);
+  } else if ((cmd == NUFS_IOC_SNAPSHOT_CREATE ||
+              cmd == NUFS_IOC_SNAPSHOT_DELETE) &&
+             ino == ROOT_INODE && in_bufsz == sizeof(struct nufs_snapshot)) {
+    struct nufs_snapshot snap;
+    memcpy(&snap, in_buf, sizeof(snap));
+    snap.name[NUFS_SNAPSHOT_NAME_MAX - 1] = '\0';
+    rv = cmd == NUFS_IOC_SNAPSHOT_CREATE ? storage_snapshot(snap.name)
+                                         : storage_delete_snapshot(snap.name);
+  } else if (cmd == NUFS_IOC_CLONE_RANGE &&
+             in_bufsz == sizeof(struct nufs_clone_range)) {
+    struct nufs_clone_range range;
+    memcpy(&range, in_buf, sizeof(range));
+    range.src_path[NUFS_CLONE_PATH_MAX - 1] = '\0';
+    rv = storage_clone(range.src_path, -1, range.src_offset, range.src_length,
+                       NULL, ino, range.dest_offset);
+  } else if ((unsigned int)cmd == NUFS_IOC_TRIM && ino == ROOT_INODE &&
+             in_bufsz == sizeof(trim)) {
+    memcpy(&trim, in_buf, sizeof(trim));
+    int64_t trimmed = storage_trim(trim.start, trim.len, trim.minlen);
+    if (trimmed >= 0) {
+      trim.len = trimmed;
+      out_buf = &trim;
+      out_size = sizeof(trim);
+    }
+    rv = trimmed < 0 ? trimmed : 0;
+  } else if ((unsigned int)cmd == NUFS_IOC_GETFLAGS) {
+    rv = storage_get_flags(NULL, ino);
+    if (rv >= 0) {
+      out = rv;
+      out_size = sizeof(out);
+      rv = 0;
+    }
+  } else if ((unsigned int)cmd == NUFS_IOC_SETFLAGS &&
+             in_bufsz >= sizeof(unsigned int)) {
+    rv = storage_set_flags(NULL, ino, *(const unsigned int *)in_buf);
+  }
+
+  if (rv == 0) {
+    fuse_reply_ioctl(req, 0, out_size ? out_buf : NULL, out_size);
+  } else {
+    fuse_reply_err(req, -rv);
+  }
   printf("ioctl(%ld, %d, ...) -> %d\n", ino, cmd, rv);
 }
 
@@ -325,16 +485,51 @@ static const struct fuse_lowlevel_ops nufs_ops = {
   .open = nufs_open,
   .read = nufs_read,
   .write = nufs_write,
+  .lseek = nufs_lseek,
+  .fallocate = nufs_fallocate,
+  .fsync = nufs_fsync,
+  .fsyncdir = nufs_fsyncdir,
+  .flush = nufs_flush,
+  .copy_file_range = nufs_copy_file_range,
   .ioctl = nufs_ioctl,
+  .destroy = nufs_destroy,
+};
+
+// options on top of the fuse ones, e.g. -o backend=pread,cache_blocks=8192
+static const struct fuse_opt nufs_opts[] = {
+  {"backend=mmap", offsetof(blocks_config_t, backend), BLOCKS_MMAP},
+  {"backend=pread", offsetof(blocks_config_t, backend), BLOCKS_PREAD},
+  {"cache_blocks=%d", offsetof(blocks_config_t, cache_blocks), 0},
+  {"odirect", offsetof(blocks_config_t, direct), 1},
+  {"commit=%d", offsetof(blocks_config_t, commit_interval), 0},
+  {"snapshot=%s", offsetof(blocks_config_t, snapshot), 0},
+  {"checksum=metadata", offsetof(blocks_config_t, checksum), CSUM_METADATA},
+  {"checksum=off", offsetof(blocks_config_t, checksum), CSUM_OFF},
+  {"checksum=full", offsetof(blocks_config_t, checksum), CSUM_FULL},
+  {"dedup", offsetof(blocks_config_t, dedup), 1},
+  {"discard", offsetof(blocks_config_t, discard), DISCARD_SYNC},
+  {"discard=sync", offsetof(blocks_config_t, discard), DISCARD_SYNC},
+  {"discard=async", offsetof(blocks_config_t, discard), DISCARD_ASYNC},
+  FUSE_OPT_END
 };
 
 int main(int argc, char *argv[]) {
-  assert(argc > 2 && argc < 6);
+  assert(argc > 2);
+
+  // pick our options out of the command line
+  const char *image = argv[--argc];
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	blocks_config_t conf = {.backend = BLOCKS_MMAP};
+	if (fuse_opt_parse(&args, &conf, nufs_opts, NULL) == -1)
+		return 1;
+  // snapshots are read-only
+  if (conf.snapshot) {
+    fuse_opt_add_arg(&args, "-oro");
+  }
 
   // initalize blocks
-  storage_init(argv[--argc]);
+  storage_init(image, &conf);
 
-	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	struct fuse_session *se;
 	struct fuse_cmdline_opts opts;
 	struct fuse_loop_config config;
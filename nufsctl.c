@@ -0,0 +1,227 @@
+// control tool for a mounted nufs
+//
+// usage: nufsctl resize <mountpoint> <size>[K|M|G]
+//        nufsctl clone <source> <dest>
+//        nufsctl snapshot <mountpoint> <name>
+//        nufsctl delete-snapshot <mountpoint> <name>
+//        nufsctl compress|uncompress <path>
+//        nufsctl trim <mountpoint>
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "storage/nufs_ioctl.h"
+
+static void usage() {
+  fprintf(stderr, "usage: nufsctl resize <mountpoint> <size>[K|M|G]\n"
+                  "       nufsctl clone <source> <dest>\n"
+                  "       nufsctl snapshot <mountpoint> <name>\n"
+                  "       nufsctl delete-snapshot <mountpoint> <name>\n"
+                  "       nufsctl compress|uncompress <path>\n"
+                  "       nufsctl trim <mountpoint>\n");
+  exit(2);
+}
+
+// parse a size like 4096, 64K, 16M or 2G, returns -1 if it isn't one
+static int64_t parse_size(const char *text) {
+  char *end;
+  int64_t size = strtoll(text, &end, 10);
+  if (end == text || size < 0) {
+    return -1;
+  }
+
+  switch (*end) {
+  case 'G': case 'g':
+    size *= 1024;
+    // fall through
+  case 'M': case 'm':
+    size *= 1024;
+    // fall through
+  case 'K': case 'k':
+    size *= 1024;
+    end++;
+    break;
+  }
+  return *end == '\0' ? size : -1;
+}
+
+// grow the filesystem mounted at mnt to size bytes
+static int resize(const char *mnt, const char *size_text) {
+  int64_t size = parse_size(size_text);
+  if (size < 0) {
+    fprintf(stderr, "nufsctl: bad size '%s'\n", size_text);
+    return 1;
+  }
+
+  int fd = open(mnt, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    fprintf(stderr, "nufsctl: %s: %s\n", mnt, strerror(errno));
+    return 1;
+  }
+
+  uint64_t arg = size;
+  int rv = ioctl(fd, NUFS_IOC_RESIZE, &arg);
+  if (rv < 0) {
+    fprintf(stderr, "nufsctl: resize %s to %ld bytes: %s\n", mnt, (long)size,
+            strerror(errno));
+  }
+  close(fd);
+  return rv < 0 ? 1 : 0;
+}
+
+// store the path of file from the root of the filesystem holding it in out
+static int mount_path(const char *file, char *out, size_t size) {
+  char *full = realpath(file, NULL);
+  struct stat st;
+  if (full == NULL || stat(full, &st) < 0) {
+    free(full);
+    return -1;
+  }
+
+  // walk up while the parent directory is on the same filesystem
+  size_t root = strlen(full);
+  while (root > 0) {
+    char *slash = memrchr(full, '/', root);
+    size_t parent = slash - full;
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", parent > 0 ? (int)parent : 1, full);
+    struct stat up;
+    if (stat(dir, &up) < 0 || up.st_dev != st.st_dev) {
+      break;
+    }
+    root = parent;
+  }
+
+  snprintf(out, size, "%s", full[root] != '\0' ? full + root : "/");
+  free(full);
+  return 0;
+}
+
+// make dest a copy of source that shares its blocks
+static int clone(const char *source, const char *dest) {
+  struct nufs_clone_range range;
+  memset(&range, 0, sizeof(range));
+  if (mount_path(source, range.src_path, sizeof(range.src_path)) < 0) {
+    fprintf(stderr, "nufsctl: %s: %s\n", source, strerror(errno));
+    return 1;
+  }
+
+  int fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "nufsctl: %s: %s\n", dest, strerror(errno));
+    return 1;
+  }
+
+  int rv = ioctl(fd, NUFS_IOC_CLONE_RANGE, &range);
+  if (rv < 0) {
+    fprintf(stderr, "nufsctl: clone %s to %s: %s\n", source, dest,
+            strerror(errno));
+  }
+  close(fd);
+  return rv < 0 ? 1 : 0;
+}
+
+// take (cmd NUFS_IOC_SNAPSHOT_CREATE) or delete the named snapshot of the
+// filesystem mounted at mnt
+static int snapshot(const char *mnt, const char *name, unsigned long cmd) {
+  struct nufs_snapshot snap;
+  memset(&snap, 0, sizeof(snap));
+  if (name[0] == '\0' || strlen(name) >= sizeof(snap.name) ||
+      strchr(name, '/')) {
+    fprintf(stderr, "nufsctl: bad snapshot name '%s'\n", name);
+    return 1;
+  }
+  strcpy(snap.name, name);
+
+  int fd = open(mnt, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    fprintf(stderr, "nufsctl: %s: %s\n", mnt, strerror(errno));
+    return 1;
+  }
+
+  int rv = ioctl(fd, cmd, &snap);
+  if (rv < 0) {
+    fprintf(stderr, "nufsctl: %s snapshot %s of %s: %s\n",
+            cmd == NUFS_IOC_SNAPSHOT_CREATE ? "take" : "delete", name, mnt,
+            strerror(errno));
+  }
+  close(fd);
+  return rv < 0 ? 1 : 0;
+}
+
+// turn compression of the data written to a file, or of the files created
+// in a directory, on or off (like chattr +c / -c)
+static int compress(const char *path, int on) {
+  int fd = open(path, O_RDONLY | O_NONBLOCK);
+  if (fd < 0) {
+    fprintf(stderr, "nufsctl: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  unsigned int flags;
+  int rv = ioctl(fd, NUFS_IOC_GETFLAGS, &flags);
+  if (rv == 0) {
+    flags = on ? flags | NUFS_COMPR_FL : flags & ~NUFS_COMPR_FL;
+    rv = ioctl(fd, NUFS_IOC_SETFLAGS, &flags);
+  }
+  if (rv < 0) {
+    fprintf(stderr, "nufsctl: %s compression of %s: %s\n",
+            on ? "turn on" : "turn off", path, strerror(errno));
+  }
+  close(fd);
+  return rv < 0 ? 1 : 0;
+}
+
+// give the free space of the filesystem mounted at mnt back to the host
+static int trim(const char *mnt) {
+  int fd = open(mnt, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    fprintf(stderr, "nufsctl: %s: %s\n", mnt, strerror(errno));
+    return 1;
+  }
+
+  struct nufs_trim_range range = {.start = 0, .len = UINT64_MAX, .minlen = 0};
+  int rv = ioctl(fd, NUFS_IOC_TRIM, &range);
+  if (rv < 0) {
+    fprintf(stderr, "nufsctl: trim %s: %s\n", mnt, strerror(errno));
+  } else {
+    printf("%s: %lu bytes trimmed\n", mnt, (unsigned long)range.len);
+  }
+  close(fd);
+  return rv < 0 ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc == 4 && strcmp(argv[1], "resize") == 0) {
+    return resize(argv[2], argv[3]);
+  }
+  if (argc == 4 && strcmp(argv[1], "clone") == 0) {
+    return clone(argv[2], argv[3]);
+  }
+  if (argc == 4 && strcmp(argv[1], "snapshot") == 0) {
+    return snapshot(argv[2], argv[3], NUFS_IOC_SNAPSHOT_CREATE);
+  }
+  if (argc == 4 && strcmp(argv[1], "delete-snapshot") == 0) {
+    return snapshot(argv[2], argv[3], NUFS_IOC_SNAPSHOT_DELETE);
+  }
+  if (argc == 3 && strcmp(argv[1], "compress") == 0) {
+    return compress(argv[2], 1);
+  }
+  if (argc == 3 && strcmp(argv[1], "uncompress") == 0) {
+    return compress(argv[2], 0);
+  }
+  if (argc == 3 && strcmp(argv[1], "trim") == 0) {
+    return trim(argv[2]);
+  }
+  usage();
+  return 2;
+}
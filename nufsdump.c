@@ -0,0 +1,206 @@
+// copy a nufs volume to and from a compact archive
+//
+// usage: nufsdump [-v] <image> <archive>
+//        nufsdump -r [-F] [-v] [-s size] <archive> <image>
+//
+// Dumps the files, directories and data of an image that is not mounted
+// into an archive, which only takes the space they use however big the
+// image is (see storage/archive.h), or restores an archive into a freshly
+// formatted image with the block size, inode count and size of the dumped
+// volume. "-" dumps to standard output or restores from standard input, so
+// a volume can be moved without an intermediate file:
+//
+//   nufsdump data.nufs - | ssh host nufsdump -r - data.nufs
+//
+//   -r  restore instead of dump
+//   -s  make the restored image at least this big (K, M, G or T)
+//   -F  restore over an existing nufs image
+//   -v  show what the storage code does
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "storage/archive.h"
+#include "storage/blocks.h"
+#include "storage/storage.h"
+
+static void usage() {
+  fprintf(stderr, "usage: nufsdump [-v] <image> <archive>\n"
+                  "       nufsdump -r [-F] [-v] [-s size] <archive> "
+                  "<image>\n");
+  exit(2);
+}
+
+// parse a size like 4096, 64K, 16M, 2G or 1T, returns -1 if it isn't one
+static int64_t parse_size(const char *text) {
+  char *end;
+  int64_t size = strtoll(text, &end, 10);
+  if (end == text || size < 0) {
+    return -1;
+  }
+
+  switch (*end) {
+  case 'T': case 't':
+    size *= 1024;
+    // fall through
+  case 'G': case 'g':
+    size *= 1024;
+    // fall through
+  case 'M': case 'm':
+    size *= 1024;
+    // fall through
+  case 'K': case 'k':
+    size *= 1024;
+    end++;
+    break;
+  }
+  return *end == '\0' ? size : -1;
+}
+
+// the storage code reports everything it does on stdout, which may be
+// carrying the archive: send it to stderr with -v, nowhere otherwise
+static void quiet(int verbose) {
+  fflush(stdout);
+  int to = verbose ? dup(STDERR_FILENO) : open("/dev/null", O_WRONLY);
+  dup2(to, STDOUT_FILENO);
+  close(to);
+}
+
+static int dump(const char *image, const char *path, int verbose) {
+  int fd = strcmp(path, "-") == 0
+               ? dup(STDOUT_FILENO)
+               : open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "nufsdump: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  // mounting would format anything else
+  int ifd = open(image, O_RDWR);
+  superblock_t sb;
+  if (ifd < 0) {
+    fprintf(stderr, "nufsdump: %s: %s\n", image, strerror(errno));
+    return 1;
+  }
+  if (pread(ifd, &sb, sizeof(sb), 0) != sizeof(sb) ||
+      sb.magic != NUFS_MAGIC) {
+    fprintf(stderr, "nufsdump: %s is not a nufs image\n", image);
+    return 1;
+  }
+  close(ifd);
+
+  quiet(verbose);
+  storage_init(image, NULL);
+  int64_t rv = archive_export(fd);
+  int64_t size = NUFS_SIZE;
+  storage_free();
+  struct stat st;
+  if (rv >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && fsync(fd) < 0) {
+    rv = -errno;
+  }
+  close(fd);
+  if (rv < 0) {
+    fprintf(stderr, "nufsdump: cannot dump %s: %s\n", image, strerror(-rv));
+    return 1;
+  }
+  fprintf(stderr, "%s: %ld of %ld bytes dumped\n", image, (long)rv,
+          (long)size);
+  return 0;
+}
+
+static int restore(const char *path, const char *image, int64_t size,
+                   int force, int verbose) {
+  int fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO) : open(path, O_RDONLY);
+  archive_header_t hdr;
+  if (fd < 0) {
+    fprintf(stderr, "nufsdump: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  if (archive_header(fd, &hdr) < 0) {
+    fprintf(stderr, "nufsdump: %s is not a nufs archive\n", path);
+    return 1;
+  }
+
+  int ifd = open(image, O_CREAT | O_RDWR, 0644);
+  superblock_t old;
+  if (ifd < 0) {
+    fprintf(stderr, "nufsdump: %s: %s\n", image, strerror(errno));
+    return 1;
+  }
+  if (!force && pread(ifd, &old, sizeof(old), 0) == sizeof(old) &&
+      old.magic == NUFS_MAGIC) {
+    fprintf(stderr, "nufsdump: %s already holds a nufs image, use -F to "
+                    "restore over it anyway\n",
+            image);
+    return 1;
+  }
+  if (size < (int64_t)hdr.size) {
+    size = hdr.size;
+  }
+  if (ftruncate(ifd, 0) < 0 || ftruncate(ifd, size) < 0) {
+    fprintf(stderr, "nufsdump: %s: %s\n", image, strerror(errno));
+    return 1;
+  }
+
+  quiet(verbose);
+  format_config_t conf = {.block_size = hdr.block_size,
+                          .inode_count = hdr.inode_count};
+  if (blocks_format(ifd, size, &conf) < 0) {
+    fprintf(stderr, "nufsdump: cannot format %s\n", image);
+    return 1;
+  }
+  close(ifd);
+  storage_init(image, NULL);
+  int64_t rv = archive_import(fd, &hdr);
+  storage_free();
+  close(fd);
+  if (rv < 0) {
+    fprintf(stderr, "nufsdump: cannot restore %s: %s\n", path, strerror(-rv));
+    return 1;
+  }
+  fprintf(stderr, "%s: %ld inodes and %ld blocks restored\n", image,
+          (long)hdr.inodes, (long)rv);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int restoring = 0, force = 0, verbose = 0;
+  int64_t size = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "rFvs:")) != -1) {
+    switch (opt) {
+    case 'r':
+      restoring = 1;
+      break;
+    case 'F':
+      force = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 's':
+      size = parse_size(optarg);
+      if (size < 0) {
+        fprintf(stderr, "nufsdump: bad size '%s'\n", optarg);
+        return 2;
+      }
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind + 2 != argc || (!restoring && (force || size))) {
+    usage();
+  }
+
+  if (restoring) {
+    return restore(argv[optind], argv[optind + 1], size, force, verbose);
+  }
+  return dump(argv[optind], argv[optind + 1], verbose);
+}
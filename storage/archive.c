@@ -0,0 +1,513 @@
+// Streaming a volume to and from a compact archive.
+
+#include "archive.h"
+#include "bitmap.h"
+#include "directory.h"
+#include "journal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ARCHIVE_IO (1 << 20) // bytes of archive buffered at a time
+
+typedef struct archive_inode {
+  uint32_t inum;
+  uint32_t _reserved;
+  inode_t node;
+} archive_inode_t;
+
+// a run of data that was at from in the archived volume and is at to now
+typedef struct moved {
+  uint32_t from;
+  uint32_t to;
+  uint32_t count;
+} moved_t;
+
+typedef struct runs {
+  block_run_t *items;
+  int count;
+  int cap;
+} runs_t;
+
+static void runs_push(runs_t *r, int bnum, int count) {
+  if (r->count == r->cap) {
+    r->cap = r->cap ? 2 * r->cap : 64;
+    r->items = realloc(r->items, r->cap * sizeof(block_run_t));
+    assert(r->items);
+  }
+  r->items[r->count].bnum = bnum;
+  r->items[r->count].count = count;
+  r->count++;
+}
+
+static int by_bnum(const void *a, const void *b) {
+  return ((const block_run_t *)a)->bnum - ((const block_run_t *)b)->bnum;
+}
+
+// sort the runs and join the ones that overlap or meet, so every block is
+// in one run
+static void runs_merge(runs_t *r) {
+  if (r->count == 0) {
+    return;
+  }
+  qsort(r->items, r->count, sizeof(block_run_t), by_bnum);
+  int n = 1;
+  for (int i = 1; i < r->count; i++) {
+    block_run_t *last = &r->items[n - 1];
+    block_run_t *run = &r->items[i];
+    if (run->bnum <= last->bnum + last->count) {
+      int end = run->bnum + run->count;
+      if (end > last->bnum + last->count) {
+        last->count = end - last->bnum;
+      }
+    } else {
+      r->items[n++] = *run;
+    }
+  }
+  r->count = n;
+}
+
+// the archived data of a regular file, not its preallocated blocks
+static int has_data(inode_t *node) {
+  return S_ISREG(node->mode) && !(node->flags & INODE_INLINE);
+}
+
+// an archive being written, which may be a pipe
+typedef struct output {
+  FILE *file;
+  int64_t bytes;
+} output_t;
+
+static int put(output_t *out, const void *data, size_t len) {
+  if (len && fwrite(data, len, 1, out->file) != 1) {
+    return -EIO;
+  }
+  out->bytes += len;
+  return 0;
+}
+
+static int put_record(output_t *out, int type, const void *a, size_t alen,
+                      const void *b, size_t blen) {
+  archive_record_t rec = {type, alen + blen};
+  if (put(out, &rec, sizeof(rec)) || put(out, a, alen) || put(out, b, blen)) {
+    return -EIO;
+  }
+  return 0;
+}
+
+// write the extents of the file, or add the blocks holding its data to
+// runs if out is NULL
+static int export_extents(output_t *out, int inum, inode_t *node, runs_t *runs) {
+  int64_t lblock = 0;
+  while (lblock < INT_MAX) {
+    int n, flags;
+    int pblock = extent_lookup(node, lblock, &n, &flags);
+    if (pblock != 0) {
+      archive_extent_t ex = {inum, lblock, pblock, n, flags};
+      if (out && put_record(out, ARCHIVE_EXTENT, &ex, sizeof(ex), NULL, 0)) {
+        return -EIO;
+      }
+      if (!out && !(flags & EXTENT_UNWRITTEN)) {
+        runs_push(runs, pblock, n);
+      }
+    }
+    lblock += n;
+  }
+  return 0;
+}
+
+static int export_dirents(output_t *out, int inum) {
+  dirent_node_t *items = directory_list(NULL, inum);
+  int rv = 0;
+  for (dirent_node_t *xs = items; xs != 0;) {
+    dir_entry_t *entry = &xs->entry;
+    int root_link = inum == ROOT_INODE && (strcmp(entry->name, ".") == 0 ||
+                                           strcmp(entry->name, "..") == 0);
+    archive_dirent_t de = {inum, entry->inum};
+    if (rv == 0 && !root_link &&
+        put_record(out, ARCHIVE_DIRENT, &de, sizeof(de), entry->name,
+                   strlen(entry->name))) {
+      rv = -EIO;
+    }
+
+    dirent_node_t *to_del = xs;
+    xs = to_struct((list_next(&xs->dirent_list)), dirent_node_t, dirent_list);
+    list_del(&to_del->dirent_list);
+    free(to_del);
+
+    if (to_del == xs) {
+      break;
+    }
+  }
+  return rv;
+}
+
+// copy the runs of blocks into the archive, a few hundred blocks at a time
+static int export_data(output_t *out, runs_t *runs) {
+  char *buf = malloc((size_t)ARCHIVE_RUN * BLOCK_SIZE);
+  assert(buf);
+  int rv = 0;
+  for (int i = 0; i < runs->count && rv == 0; i++) {
+    int bnum = runs->items[i].bnum;
+    int end = bnum + runs->items[i].count;
+    while (bnum < end && rv == 0) {
+      int n = end - bnum < ARCHIVE_RUN ? end - bnum : ARCHIVE_RUN;
+      archive_data_t data = {bnum, n};
+      rv = blocks_read_checked(bnum, 0, buf, (size_t)n * BLOCK_SIZE);
+      if (rv == 0) {
+        rv = put_record(out, ARCHIVE_DATA, &data, sizeof(data), buf,
+                        (size_t)n * BLOCK_SIZE);
+      }
+      bnum += n;
+    }
+  }
+  free(buf);
+  return rv;
+}
+
+// Write the mounted volume to fd as an archive.
+int64_t archive_export(int fd) {
+  output_t archive = {fdopen(dup(fd), "w")};
+  output_t *out = &archive;
+  if (!out->file) {
+    return -errno;
+  }
+  setvbuf(out->file, NULL, _IOFBF, ARCHIVE_IO);
+
+  // nothing changes underneath the export
+  journal_begin();
+  void *ibm = get_inode_bitmap();
+  archive_header_t hdr = {ARCHIVE_MAGIC, ARCHIVE_VERSION, BLOCK_SIZE,
+                          INODE_COUNT, NUFS_SIZE};
+
+  // the blocks holding file data, each once
+  runs_t runs = {0};
+  for (int i = ROOT_INODE; i < INODE_COUNT; i++) {
+    i = bitmap_find_one(ibm, i, INODE_COUNT);
+    if (i == INODE_COUNT) {
+      break;
+    }
+    inode_t *node = get_inode(i);
+    hdr.inodes++;
+    if (has_data(node)) {
+      export_extents(NULL, i, node, &runs);
+    }
+  }
+  runs_merge(&runs);
+  for (int i = 0; i < runs.count; i++) {
+    hdr.blocks += runs.items[i].count;
+  }
+  printf("+ archive_export: %ld inodes, %ld blocks in %d runs\n",
+         (long)hdr.inodes, (long)hdr.blocks, runs.count);
+
+  int rv = put(out, &hdr, sizeof(hdr));
+  for (int pass = ARCHIVE_INODE; pass <= ARCHIVE_EXTENT && rv == 0; pass++) {
+    if (pass == ARCHIVE_DATA) {
+      rv = export_data(out, &runs);
+      continue;
+    }
+    for (int i = ROOT_INODE; i < INODE_COUNT && rv == 0; i++) {
+      i = bitmap_find_one(ibm, i, INODE_COUNT);
+      if (i == INODE_COUNT) {
+        break;
+      }
+      inode_t *node = get_inode(i);
+      if (pass == ARCHIVE_INODE) {
+        archive_inode_t in = {i, 0, *node};
+        rv = put_record(out, ARCHIVE_INODE, &in, sizeof(in), NULL, 0);
+      } else if (pass == ARCHIVE_DIRENT && S_ISDIR(node->mode)) {
+        rv = export_dirents(out, i);
+      } else if (pass == ARCHIVE_EXTENT && has_data(node)) {
+        rv = export_extents(out, i, node, NULL);
+      }
+    }
+  }
+  journal_end();
+  free(runs.items);
+
+  if (rv == 0) {
+    rv = put_record(out, ARCHIVE_END, NULL, 0, NULL, 0);
+  }
+  if (fclose(out->file) != 0 && rv == 0) {
+    rv = -EIO;
+  }
+  printf("+ archive_export: %ld bytes, rv %d\n", (long)out->bytes, rv);
+  return rv < 0 ? rv : out->bytes;
+}
+
+// state of an import
+typedef struct import {
+  archive_header_t hdr;
+  int *inums;        // new inode number of every archived one, 0 for none
+  moved_t *moved;    // where the archived data went, by from
+  int moved_count;
+  int moved_cap;
+  uint8_t *claimed;  // blocks of data an extent maps already
+  int64_t blocks;    // blocks of data restored
+} import_t;
+
+// the inode an archived inode became, or NULL
+static inode_t *imported(import_t *im, uint32_t inum) {
+  if (inum >= im->hdr.inode_count || im->inums[inum] == 0) {
+    return NULL;
+  }
+  return get_inode(im->inums[inum]);
+}
+
+static int import_inode(import_t *im, const archive_inode_t *in) {
+  const inode_t *src = &in->node;
+  if (in->inum < ROOT_INODE || in->inum >= im->hdr.inode_count ||
+      im->inums[in->inum] != 0 ||
+      (in->inum == ROOT_INODE && !S_ISDIR(src->mode))) {
+    return -EINVAL;
+  }
+
+  // the root directory is there already
+  int inum = in->inum == ROOT_INODE ? ROOT_INODE : alloc_inode(src->mode);
+  if (inum < 0) {
+    return -ENOSPC;
+  }
+  inode_t *node = get_inode(inum);
+  inode_dirty(node);
+  node->refs = src->refs;
+  node->mode = src->mode;
+  node->size = src->size;
+  node->atime = src->atime;
+  node->mtime = src->mtime;
+  if (src->flags & INODE_INLINE) {
+    if (!(node->flags & INODE_INLINE) || src->size > INODE_INLINE_SIZE) {
+      return -EINVAL;
+    }
+    memcpy(node->inline_data, src->inline_data, INODE_INLINE_SIZE);
+  } else if (node->flags & INODE_INLINE) {
+    // the extents follow
+    extent_init(node);
+  }
+  // directories are rebuilt, and index themselves again as they fill up
+  node->flags = src->flags & ~INODE_INDEX;
+  im->inums[in->inum] = inum;
+  return 0;
+}
+
+static int import_dirent(import_t *im, const archive_dirent_t *de,
+                         const char *name, int len) {
+  inode_t *dir = imported(im, de->dir);
+  if (!dir || !S_ISDIR(dir->mode) || !imported(im, de->inum) || len == 0 ||
+      len >= DIR_NAME_LENGTH) {
+    return -EINVAL;
+  }
+  char entry[DIR_NAME_LENGTH];
+  memcpy(entry, name, len);
+  entry[len] = '\0';
+  return directory_put(dir, entry, im->inums[de->inum]) < 0 ? -ENOSPC : 0;
+}
+
+static int import_data(import_t *im, const archive_data_t *data,
+                       const char *buf) {
+  moved_t *last = im->moved_count ? &im->moved[im->moved_count - 1] : NULL;
+  if (data->count == 0 || data->count > ARCHIVE_RUN ||
+      (last && data->bnum < last->from + last->count)) {
+    return -EINVAL;
+  }
+
+  int goal = last ? last->to + last->count : 0;
+  for (uint32_t done = 0; done < data->count;) {
+    int got;
+    int bnum = alloc_blocks(goal, data->count - done, &got);
+    if (bnum < 0) {
+      return -ENOSPC;
+    }
+    if (blocks_write(bnum, 0, buf + (size_t)done * BLOCK_SIZE,
+                     (size_t)got * BLOCK_SIZE) < 0) {
+      return -EIO;
+    }
+    if (im->moved_count == im->moved_cap) {
+      im->moved_cap = im->moved_cap ? 2 * im->moved_cap : 64;
+      im->moved = realloc(im->moved, im->moved_cap * sizeof(moved_t));
+      assert(im->moved);
+    }
+    im->moved[im->moved_count++] = (moved_t){data->bnum + done, bnum, got};
+    done += got;
+    goal = bnum + got;
+  }
+  im->blocks += data->count;
+  return 0;
+}
+
+// find the run of moved data holding the archived block, or NULL
+static moved_t *find_moved(import_t *im, uint32_t bnum) {
+  int lo = 0, hi = im->moved_count - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    moved_t *m = &im->moved[mid];
+    if (bnum < m->from) {
+      hi = mid - 1;
+    } else if (bnum >= m->from + m->count) {
+      lo = mid + 1;
+    } else {
+      return m;
+    }
+  }
+  return NULL;
+}
+
+// the first extent mapping a block of data owns it, the others share it
+static int claim_blocks(import_t *im, int bnum, int count) {
+  int end = bnum + count;
+  while (bnum < end) {
+    int next;
+    if (bitmap_get(im->claimed, bnum)) {
+      next = bitmap_find_zero(im->claimed, bnum, end);
+      next = next < 0 ? end : next;
+      if (blocks_share(bnum, next - bnum) < 0) {
+        return -EMLINK;
+      }
+    } else {
+      next = bitmap_find_one(im->claimed, bnum, end);
+      bitmap_put_range(im->claimed, bnum, next - bnum, 1);
+    }
+    bnum = next;
+  }
+  return 0;
+}
+
+static int import_extent(import_t *im, const archive_extent_t *ex) {
+  inode_t *node = imported(im, ex->inum);
+  if (!node || !has_data(node) || ex->len == 0) {
+    return -EINVAL;
+  }
+
+  uint32_t lblock = ex->lblock;
+  uint32_t end = ex->lblock + ex->len;
+  while (lblock < end) {
+    int bnum, n;
+    if (ex->flags & EXTENT_UNWRITTEN) {
+      // preallocated blocks only need reserving again
+      bnum = alloc_blocks(0, end - lblock, &n);
+      if (bnum < 0) {
+        return -ENOSPC;
+      }
+    } else {
+      uint32_t pblock = ex->pblock + (lblock - ex->lblock);
+      moved_t *m = find_moved(im, pblock);
+      if (!m) {
+        return -EINVAL;
+      }
+      bnum = m->to + (pblock - m->from);
+      n = m->from + m->count - pblock;
+      if (n > end - lblock) {
+        n = end - lblock;
+      }
+      int rv = claim_blocks(im, bnum, n);
+      if (rv < 0) {
+        return rv;
+      }
+    }
+    if (extent_insert(node, lblock, bnum, n, ex->flags) < 0) {
+      return -ENOSPC;
+    }
+    lblock += n;
+  }
+  return 0;
+}
+
+// Read the header of the archive from fd.
+int archive_header(int fd, archive_header_t *hdr) {
+  // the archive may come through a pipe
+  size_t got = 0;
+  while (got < sizeof(*hdr)) {
+    ssize_t n = read(fd, (char *)hdr + got, sizeof(*hdr) - got);
+    if (n <= 0) {
+      return -EINVAL;
+    }
+    got += n;
+  }
+  if (hdr->magic != ARCHIVE_MAGIC || hdr->version != ARCHIVE_VERSION ||
+      hdr->inode_count <= ROOT_INODE) {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+// Recreate the volume in the archive read from fd in the mounted image.
+int64_t archive_import(int fd, const archive_header_t *hdr) {
+  if (hdr->block_size != BLOCK_SIZE) {
+    return -EINVAL;
+  }
+  FILE *in = fdopen(dup(fd), "r");
+  if (!in) {
+    return -errno;
+  }
+  setvbuf(in, NULL, _IOFBF, ARCHIVE_IO);
+
+  import_t im = {*hdr};
+  printf("+ archive_import: %ld inodes, %ld blocks\n", (long)im.hdr.inodes,
+         (long)im.hdr.blocks);
+
+  im.inums = calloc(im.hdr.inode_count, sizeof(int));
+  im.claimed = calloc(BLOCK_COUNT / 8 + 1, 1);
+  size_t cap = sizeof(archive_data_t) + (size_t)ARCHIVE_RUN * BLOCK_SIZE;
+  char *buf = malloc(cap);
+  assert(im.inums && im.claimed && buf);
+
+  int rv = 0;
+  archive_record_t rec;
+  while (rv == 0) {
+    if (fread(&rec, sizeof(rec), 1, in) != 1 || rec.length > cap ||
+        (rec.length && fread(buf, rec.length, 1, in) != 1)) {
+      rv = -EINVAL;
+      break;
+    }
+    if (rec.type == ARCHIVE_END) {
+      break;
+    }
+
+    journal_begin();
+    switch (rec.type) {
+    case ARCHIVE_INODE:
+      rv = rec.length == sizeof(archive_inode_t)
+               ? import_inode(&im, (archive_inode_t *)buf)
+               : -EINVAL;
+      break;
+    case ARCHIVE_DIRENT:
+      rv = rec.length >= sizeof(archive_dirent_t)
+               ? import_dirent(&im, (archive_dirent_t *)buf,
+                               buf + sizeof(archive_dirent_t),
+                               rec.length - sizeof(archive_dirent_t))
+               : -EINVAL;
+      break;
+    case ARCHIVE_DATA:
+      rv = rec.length >= sizeof(archive_data_t) &&
+                   rec.length == sizeof(archive_data_t) +
+                                     (size_t)((archive_data_t *)buf)->count *
+                                         BLOCK_SIZE
+               ? import_data(&im, (archive_data_t *)buf,
+                             buf + sizeof(archive_data_t))
+               : -EINVAL;
+      break;
+    case ARCHIVE_EXTENT:
+      rv = rec.length == sizeof(archive_extent_t)
+               ? import_extent(&im, (archive_extent_t *)buf)
+               : -EINVAL;
+      break;
+    default:
+      rv = -EINVAL;
+    }
+    journal_end();
+  }
+
+  fclose(in);
+  free(buf);
+  free(im.inums);
+  free(im.moved);
+  free(im.claimed);
+  printf("+ archive_import: %ld blocks restored, rv %d\n", (long)im.blocks,
+         rv);
+  return rv < 0 ? rv : im.blocks;
+}
@@ -0,0 +1,95 @@
+// Streaming a volume to and from a compact archive.
+//
+// An archive holds what the volume uses and nothing else, as a sequence of
+// records after an archive_header_t:
+//
+//   ARCHIVE_INODE   every allocated inode, in inode order
+//   ARCHIVE_DIRENT  every directory entry (but the "." and ".." of the root)
+//   ARCHIVE_DATA    the contents of every block of file data once, however
+//                   many files share it, in the order of the blocks on disk
+//   ARCHIVE_EXTENT  the extents of the regular files, pointing at the data
+//                   by the block numbers it had in the volume
+//   ARCHIVE_END
+//
+// so exporting reads the data in long sequential runs, and importing
+// writes each block once, in one pass over the archive, keeping only the
+// new location of every run of data in memory. Directories and the extent
+// trees are rebuilt rather than copied, so the archive does not depend on
+// their layout. Blocks shared between files are shared again, compressed
+// clusters are copied as they are, and preallocated blocks are reserved
+// again without data. Snapshots are not archived.
+//
+// Records are in host byte order.
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+#define ARCHIVE_MAGIC 0x5241464e // "NFAR"
+#define ARCHIVE_VERSION 1
+
+// record types
+#define ARCHIVE_INODE 1
+#define ARCHIVE_DIRENT 2
+#define ARCHIVE_DATA 3
+#define ARCHIVE_EXTENT 4
+#define ARCHIVE_END 5
+
+// blocks of data in one ARCHIVE_DATA record at most
+#define ARCHIVE_RUN 256
+
+typedef struct archive_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_size;
+  uint32_t inode_count; // of the volume, inode numbers are below it
+  uint64_t size;        // bytes of the volume
+  uint64_t inodes;      // inodes archived
+  uint64_t blocks;      // blocks of data archived
+} archive_header_t;
+
+// Every record starts with this, followed by length bytes.
+typedef struct archive_record {
+  uint32_t type;
+  uint32_t length;
+} archive_record_t;
+
+// followed by the name, without its terminating 0
+typedef struct archive_dirent {
+  uint32_t dir;
+  uint32_t inum;
+} archive_dirent_t;
+
+// followed by count blocks of data
+typedef struct archive_data {
+  uint32_t bnum;
+  uint32_t count;
+} archive_data_t;
+
+typedef struct archive_extent {
+  uint32_t inum;
+  uint32_t lblock;
+  uint32_t pblock; // where the data was in the archived volume
+  uint16_t len;
+  uint16_t flags;  // EXTENT_* flags
+} archive_extent_t;
+
+// Write the mounted volume to fd as an archive. Returns the number of bytes
+// written or a negative errno.
+int64_t archive_export(int fd);
+
+// Read the header of the archive from fd, to format an image that can hold
+// it. Returns 0 or -EINVAL.
+int archive_header(int fd, archive_header_t *hdr);
+
+// Recreate the volume in the archive read from fd, whose header has been
+// read already, in the mounted image, which must be freshly formatted with
+// the block size of the archive. Returns the number of blocks of data
+// restored or a negative errno (-EINVAL for a damaged archive, -ENOSPC if
+// the image is too small).
+int64_t archive_import(int fd, const archive_header_t *hdr);
+
+#endif
@@ -0,0 +1,374 @@
+// Buffer cache for the pread/pwrite block backend.
+
+#define _GNU_SOURCE
+#include "bcache.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BCACHE_MIN_BLOCKS 64
+#define BCACHE_DEFAULT_BLOCKS 4096 // 16MB of 4K blocks
+
+typedef struct buf {
+  int bnum;       // block held, 0 if the buffer is free
+  int pins;       // users between get and put
+  int dirty;      // modified since it was read or written back
+  int referenced; // used since the clock hand last passed
+  int next;       // next buffer in the hash chain, -1 at the end
+} buf_t;
+
+static int cache_fd = -1;
+static int cache_direct = 0; // cache_fd was opened with O_DIRECT
+static int owns_fd = 0;
+
+static buf_t *bufs = 0;
+static char *pool = 0; // nbufs blocks, one per buffer
+static int nbufs = 0;
+static int *buckets = 0;
+static int bucket_mask = 0;
+static int hand = 0; // clock hand
+static void *zeros = 0;
+
+static long hits = 0, misses = 0, writebacks = 0;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *buf_data(int i) { return pool + (size_t)i * BLOCK_SIZE; }
+
+static int hash(int bnum) { return (bnum * 2654435761u) & bucket_mask; }
+
+// index of the buffer holding bnum, or -1
+static int lookup(int bnum) {
+  for (int i = buckets[hash(bnum)]; i >= 0; i = bufs[i].next) {
+    if (bufs[i].bnum == bnum) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void hash_remove(int i) {
+  int *link = &buckets[hash(bufs[i].bnum)];
+  while (*link != i) {
+    link = &bufs[*link].next;
+  }
+  *link = bufs[i].next;
+  bufs[i].bnum = 0;
+}
+
+static int write_back(int i) {
+  off_t off = (off_t)bufs[i].bnum * BLOCK_SIZE;
+  if (pwrite(cache_fd, buf_data(i), BLOCK_SIZE, off) != BLOCK_SIZE) {
+    perror("nufs: block write-back");
+    return -EIO;
+  }
+  bufs[i].dirty = 0;
+  writebacks++;
+  return 0;
+}
+
+// pick a buffer to reuse, writing it back if needed
+static int evict() {
+  for (int scanned = 0; scanned < 2 * nbufs; scanned++) {
+    int i = hand;
+    hand = (hand + 1) % nbufs;
+    if (bufs[i].pins > 0) {
+      continue;
+    }
+    if (bufs[i].bnum == 0) {
+      return i;
+    }
+    if (bufs[i].referenced) {
+      bufs[i].referenced = 0;
+      continue;
+    }
+    if (bufs[i].dirty && write_back(i) < 0) {
+      continue;
+    }
+    hash_remove(i);
+    return i;
+  }
+
+  fprintf(stderr, "nufs: all %d cache buffers are pinned\n", nbufs);
+  abort();
+}
+
+// find or load the buffer for bnum and pin it; call with the lock held
+static int load(int bnum, int fill) {
+  int i = lookup(bnum);
+  if (i >= 0) {
+    hits++;
+  } else {
+    misses++;
+    i = evict();
+    if (fill) {
+      off_t off = (off_t)bnum * BLOCK_SIZE;
+      if (pread(cache_fd, buf_data(i), BLOCK_SIZE, off) != BLOCK_SIZE) {
+        // past the end of a sparse image reads short; that is all zeros
+        memset(buf_data(i), 0, BLOCK_SIZE);
+      }
+    }
+    bufs[i].bnum = bnum;
+    bufs[i].dirty = 0;
+    int b = hash(bnum);
+    bufs[i].next = buckets[b];
+    buckets[b] = i;
+  }
+  bufs[i].pins++;
+  bufs[i].referenced = 1;
+  return i;
+}
+
+static int bcache_init(const char *path, int fd, const blocks_config_t *conf) {
+  cache_fd = fd;
+  owns_fd = 0;
+  cache_direct = 0;
+  if (conf->direct) {
+    int dfd = open(path, O_RDWR | O_DIRECT);
+    if (dfd < 0) {
+      perror("nufs: O_DIRECT");
+    } else {
+      cache_fd = dfd;
+      owns_fd = 1;
+      cache_direct = 1;
+    }
+  }
+
+  nbufs = conf->cache_blocks > 0 ? conf->cache_blocks : BCACHE_DEFAULT_BLOCKS;
+  if (nbufs < BCACHE_MIN_BLOCKS) {
+    nbufs = BCACHE_MIN_BLOCKS;
+  }
+  int nbuckets = 1;
+  while (nbuckets < nbufs) {
+    nbuckets *= 2;
+  }
+  bucket_mask = nbuckets - 1;
+
+  bufs = calloc(nbufs, sizeof(buf_t));
+  buckets = malloc(nbuckets * sizeof(int));
+  zeros = calloc(1, BLOCK_SIZE);
+  if (!bufs || !buckets || !zeros ||
+      posix_memalign((void **)&pool, 4096, (size_t)nbufs * BLOCK_SIZE) != 0) {
+    return -ENOMEM;
+  }
+  memset(buckets, -1, nbuckets * sizeof(int));
+  hand = 0;
+  hits = misses = writebacks = 0;
+
+  printf("+ bcache_init: %d buffers%s\n", nbufs,
+         cache_direct ? ", O_DIRECT" : "");
+  return 0;
+}
+
+static int bcache_flush() {
+  pthread_mutex_lock(&cache_lock);
+  int rv = 0;
+  for (int i = 0; i < nbufs; i++) {
+    if (bufs[i].bnum != 0 && bufs[i].dirty && write_back(i) < 0) {
+      rv = -EIO;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return rv;
+}
+
+// write back the dirty buffers among the runs, then flush the image once
+static int bcache_sync(const block_run_t *runs, int count, int wait) {
+  pthread_mutex_lock(&cache_lock);
+  int rv = 0;
+  for (int r = 0; r < count; r++) {
+    int bnum = runs[r].bnum, n = runs[r].count;
+    if (n < nbufs) {
+      for (int b = bnum; b < bnum + n; b++) {
+        int i = lookup(b);
+        if (i >= 0 && bufs[i].dirty && write_back(i) < 0) {
+          rv = -EIO;
+        }
+      }
+    } else {
+      for (int i = 0; i < nbufs; i++) {
+        if (bufs[i].bnum >= bnum && bufs[i].bnum < bnum + n &&
+            bufs[i].dirty && write_back(i) < 0) {
+          rv = -EIO;
+        }
+      }
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  // whole blocks that were not cached went to the image directly, so the
+  // runs may have dirty pages there even if nothing was cached
+  if (wait && fdatasync(cache_fd) < 0) {
+    rv = -EIO;
+  }
+  return rv;
+}
+
+static void bcache_free() {
+  bcache_flush();
+  printf("+ bcache_free: %ld hits, %ld misses, %ld write-backs\n", hits,
+         misses, writebacks);
+  if (owns_fd) {
+    close(cache_fd);
+  }
+  free(bufs);
+  free(pool);
+  free(buckets);
+  free(zeros);
+  bufs = 0;
+  pool = 0;
+  buckets = 0;
+  zeros = 0;
+  nbufs = 0;
+  cache_fd = -1;
+}
+
+static void *bcache_get(int bnum) {
+  pthread_mutex_lock(&cache_lock);
+  int i = load(bnum, 1);
+  pthread_mutex_unlock(&cache_lock);
+  return buf_data(i);
+}
+
+static void bcache_put(int bnum) {
+  pthread_mutex_lock(&cache_lock);
+  int i = lookup(bnum);
+  assert(i >= 0 && bufs[i].pins > 0);
+  bufs[i].pins--;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static void bcache_dirty(int bnum) {
+  pthread_mutex_lock(&cache_lock);
+  int i = lookup(bnum);
+  assert(i >= 0 && bufs[i].pins > 0);
+  bufs[i].dirty = 1;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+// number of blocks from bnum on, up to count, that are not cached
+static int uncached_run(int bnum, int count) {
+  int n = 0;
+  while (n < count && lookup(bnum + n) < 0) {
+    n++;
+  }
+  return n;
+}
+
+// Copy between the caller and len bytes at byte offset off of the run of
+// blocks starting at bnum. Writing with data == NULL writes zeros.
+static int transfer(int bnum, int64_t off, void *data, size_t len,
+                    int writing) {
+  bnum += off / BLOCK_SIZE;
+  int block_off = off % BLOCK_SIZE;
+
+  pthread_mutex_lock(&cache_lock);
+  while (len > 0) {
+    size_t n = BLOCK_SIZE - block_off;
+    if (n > len) {
+      n = len;
+    }
+
+    // whole blocks nobody has cached go straight to the image
+    int whole = block_off == 0 ? len / BLOCK_SIZE : 0;
+    int run = whole > 0 && !cache_direct && data ? uncached_run(bnum, whole)
+                                                  : 0;
+    if (run > 0) {
+      size_t bytes = (size_t)run * BLOCK_SIZE;
+      off_t pos = (off_t)bnum * BLOCK_SIZE;
+      ssize_t rv = writing ? pwrite(cache_fd, data, bytes, pos)
+                           : pread(cache_fd, data, bytes, pos);
+      if (rv < 0 || (writing && (size_t)rv != bytes)) {
+        pthread_mutex_unlock(&cache_lock);
+        return -EIO;
+      }
+      if ((size_t)rv < bytes) {
+        // short read at the end of a sparse image
+        memset((char *)data + rv, 0, bytes - rv);
+      }
+      bnum += run;
+      data = (char *)data + bytes;
+      len -= bytes;
+      continue;
+    }
+
+    // a whole block about to be overwritten does not need reading first
+    int i = load(bnum, !(writing && n == BLOCK_SIZE));
+    char *block = (char *)buf_data(i) + block_off;
+    if (!writing) {
+      memcpy(data, block, n);
+    } else {
+      if (data) {
+        memcpy(block, data, n);
+      } else {
+        memset(block, 0, n);
+      }
+      bufs[i].dirty = 1;
+    }
+    bufs[i].pins--;
+
+    bnum++;
+    block_off = 0;
+    if (data) {
+      data = (char *)data + n;
+    }
+    len -= n;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return 0;
+}
+
+static int bcache_read(int bnum, int64_t off, void *buf, size_t len) {
+  return transfer(bnum, off, buf, len, 0);
+}
+
+static int bcache_write(int bnum, int64_t off, const void *buf, size_t len) {
+  return transfer(bnum, off, (void *)buf, len, 1);
+}
+
+static void drop(int i) {
+  if (bufs[i].pins == 0) {
+    hash_remove(i);
+    bufs[i].dirty = 0;
+  }
+}
+
+static void bcache_forget(int bnum, int count) {
+  pthread_mutex_lock(&cache_lock);
+  if (count < nbufs) {
+    for (int b = bnum; b < bnum + count; b++) {
+      int i = lookup(b);
+      if (i >= 0) {
+        drop(i);
+      }
+    }
+  } else {
+    for (int i = 0; i < nbufs; i++) {
+      if (bufs[i].bnum >= bnum && bufs[i].bnum < bnum + count) {
+        drop(i);
+      }
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+const block_backend_t bcache_backend = {
+    .name = "pread",
+    .init = bcache_init,
+    .free = bcache_free,
+    .get = bcache_get,
+    .put = bcache_put,
+    .dirty = bcache_dirty,
+    .read = bcache_read,
+    .write = bcache_write,
+    .forget = bcache_forget,
+    .flush = bcache_flush,
+    .sync = bcache_sync,
+};
@@ -0,0 +1,16 @@
+// Buffer cache for the pread/pwrite block backend.
+//
+// Data blocks are read into a fixed pool of buffers and written back when
+// they are evicted (CLOCK) or flushed. Whole blocks that are not cached are
+// copied straight between the image and the caller, so file data is not
+// kept twice (unless the image is opened with O_DIRECT, where every
+// transfer goes through the aligned buffers).
+
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "blocks.h"
+
+extern const block_backend_t bcache_backend;
+
+#endif
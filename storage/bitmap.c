@@ -1,12 +1,32 @@
 #include "bitmap.h"
 
+#include <endian.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #define nth_bit_mask(n) (1 << (n))
 #define byte_index(n) ((n) / 8)
 #define bit_index(n) ((n) % 8)
 
+// The bulk helpers below work on 64 bits at a time. Bit i lives in bit
+// i % 64 of little-endian word i / 64, which matches the byte layout above.
+#define word_index(n) ((n) / 64)
+#define word_bit(n) ((n) % 64)
+
+// Load word w, never touching bytes past the one holding bit end - 1.
+static uint64_t load_word(void *bm, int w, int end) {
+  int64_t avail = byte_index((int64_t)end + 7) - (int64_t)w * 8;
+  uint64_t word = 0;
+  memcpy(&word, (uint8_t *)bm + w * 8, avail < 8 ? avail : 8);
+  return le64toh(word);
+}
+
+static void store_word(void *bm, int w, uint64_t word) {
+  word = htole64(word);
+  memcpy((uint8_t *)bm + w * 8, &word, 8);
+}
+
 // Get the given bit from the bitmap.
 int bitmap_get(void *bm, int i) {
   uint8_t *base = (uint8_t *)bm;
@@ -28,6 +48,108 @@ void bitmap_put(void *bm, int i, int v) {
   }
 }
 
+// Set count bits starting at the given bit to the given value.
+void bitmap_put_range(void *bm, int start, int count, int v) {
+  int end = start + count;
+
+  // single bits up to a word boundary, whole words, then the tail
+  while (start < end && word_bit(start) != 0) {
+    bitmap_put(bm, start++, v);
+  }
+  while (end - start >= 64) {
+    store_word(bm, word_index(start), v ? ~0ULL : 0);
+    start += 64;
+  }
+  while (start < end) {
+    bitmap_put(bm, start++, v);
+  }
+}
+
+// Scan [start, end) for the first bit equal to v, or return end.
+static int find_bit(void *bm, int start, int end, int v) {
+  int64_t i = start; // the next word may start past INT_MAX
+  while (i < end) {
+    int w = word_index(i);
+    uint64_t word = load_word(bm, w, end);
+    if (!v) {
+      word = ~word;
+    }
+    // ignore the bits before i
+    word &= ~0ULL << word_bit(i);
+
+    if (word) {
+      int64_t bit = (int64_t)w * 64 + __builtin_ctzll(word);
+      return bit < end ? bit : end;
+    }
+    i = ((int64_t)w + 1) * 64;
+  }
+  return end;
+}
+
+// Find the first clear bit in [start, end), or -1 if all are set.
+int bitmap_find_zero(void *bm, int start, int end) {
+  int bit = find_bit(bm, start, end, 0);
+  return bit < end ? bit : -1;
+}
+
+// Find the first set bit in [start, end), or end if all are clear.
+int bitmap_find_one(void *bm, int start, int end) {
+  return find_bit(bm, start, end, 1);
+}
+
+// Find the first run of at least len clear bits in [start, end).
+int bitmap_find_zero_run(void *bm, int start, int end, int len) {
+  int i = start;
+  while (i < end) {
+    int zero = find_bit(bm, i, end, 0);
+    if (end - zero < len) {
+      return -1;
+    }
+    // the run only has to be long enough, so stop looking at len bits
+    int one = find_bit(bm, zero, zero + len, 1);
+    if (one - zero >= len) {
+      return zero;
+    }
+    i = one;
+  }
+  return -1;
+}
+
+// Find the longest run of clear bits in [start, end).
+int bitmap_largest_zero_run(void *bm, int start, int end, int *len) {
+  int best = -1;
+  *len = 0;
+
+  int i = start;
+  while (i < end) {
+    int zero = find_bit(bm, i, end, 0);
+    if (end - zero <= *len) {
+      // nothing left that could beat the best run
+      break;
+    }
+    int one = find_bit(bm, zero, end, 1);
+    if (one - zero > *len) {
+      best = zero;
+      *len = one - zero;
+    }
+    i = one;
+  }
+  return best;
+}
+
+// Count the set bits among the first size bits.
+int bitmap_count(void *bm, int size) {
+  int count = 0;
+  for (int w = 0; w * 64 < size; ++w) {
+    uint64_t word = load_word(bm, w, size);
+    if (size - w * 64 < 64) {
+      word &= (1ULL << (size - w * 64)) - 1;
+    }
+    count += __builtin_popcountll(word);
+  }
+  return count;
+}
+
 // Pretty-print the bitmap (with the given no. of bits).
 void bitmap_print(void *bm, int size) {
   for (int i = 0; i < size; i++) {
@@ -10,6 +10,26 @@ int bitmap_get(void *bm, int i);
 // Value should be 0 or 1.
 void bitmap_put(void *bm, int i, int v);
 
+// Set count bits starting at the given bit to the given value.
+void bitmap_put_range(void *bm, int start, int count, int v);
+
+// Find the first clear bit in [start, end), or -1 if all are set.
+int bitmap_find_zero(void *bm, int start, int end);
+
+// Find the first set bit in [start, end), or end if all are clear.
+int bitmap_find_one(void *bm, int start, int end);
+
+// Find the first run of at least len clear bits in [start, end).
+// Returns the index of its first bit, or -1 if there is no such run.
+int bitmap_find_zero_run(void *bm, int start, int end, int len);
+
+// Find the longest run of clear bits in [start, end). Returns the index of
+// its first bit and stores its length in len, or returns -1 if all are set.
+int bitmap_largest_zero_run(void *bm, int start, int end, int *len);
+
+// Count the set bits among the first size bits.
+int bitmap_count(void *bm, int size);
+
 // Pretty-print the bitmap (with the given no. of bits).
 void bitmap_print(void *bm, int size);
 
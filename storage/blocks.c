@@ -1,105 +1,1048 @@
 // based on cs3650 starter code
 
 #define _GNU_SOURCE
+#include "bcache.h"
 #include "bitmap.h"
 #include "blocks.h"
+#include "csum.h"
+#include "dedup.h"
+#include "discard.h"
 #include "inode.h"
+#include "journal.h"
+#include "snapshot.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/falloc.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-const int BLOCK_COUNT = 256; // we split the "disk" into 256 blocks
-const int BLOCK_SIZE = 4096; // = 4K
+int BLOCK_COUNT;
+int BLOCK_SIZE;
+int64_t NUFS_SIZE;
 
-const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // = 1MB
-
-const int INODE_COUNT = 256; // = 256
+int INODE_COUNT;
 const int INODE_SIZE = sizeof(inode_t);
 
-const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
-// Note: assumes block count is divisible by 8
-const int INODE_BITMAP_SIZE = INODE_COUNT / 8;
+int BLOCK_BITMAP_SIZE;
+int INODE_BITMAP_SIZE;
 
 static int blocks_fd = -1;
 static void *blocks_base = 0;
+static superblock_t *sb = 0;
+
+// address space set aside for the image, so growing it never moves
+// blocks_base and pointers into the image stay valid
+static int64_t blocks_reserved = 0;
+
+static void *mmap_get(int bnum) {
+  return blocks_base + (size_t)BLOCK_SIZE * bnum;
+}
+
+static void mmap_put(int bnum) {}
+
+static void mmap_dirty(int bnum) {}
+
+static int mmap_read(int bnum, int64_t off, void *buf, size_t len) {
+  memcpy(buf, mmap_get(bnum) + off, len);
+  return 0;
+}
+
+static int mmap_write(int bnum, int64_t off, const void *buf, size_t len) {
+  if (buf) {
+    memcpy(mmap_get(bnum) + off, buf, len);
+  } else {
+    memset(mmap_get(bnum) + off, 0, len);
+  }
+  return 0;
+}
+
+static void mmap_forget(int bnum, int count) {}
+
+// the mapping is the page cache of the image, there is nothing to copy
+static int mmap_flush() { return 0; }
+
+// start writing the dirty pages of each run, then wait for them all and
+// flush once: a ranged msync gets the host's metadata and its disk cache
+// flushed, which every write that completed before it is covered by
+static int mmap_sync(const block_run_t *runs, int count, int wait) {
+  int64_t page = sysconf(_SC_PAGESIZE);
+  int rv = 0;
+  for (int pass = 0; pass < (wait ? 2 : 1); pass++) {
+    unsigned flags = pass == 0 ? SYNC_FILE_RANGE_WRITE
+                               : SYNC_FILE_RANGE_WAIT_BEFORE |
+                                     SYNC_FILE_RANGE_WRITE |
+                                     SYNC_FILE_RANGE_WAIT_AFTER;
+    for (int i = 0; i < count; i++) {
+      int64_t start = (int64_t)runs[i].bnum * BLOCK_SIZE;
+      int64_t len = (int64_t)runs[i].count * BLOCK_SIZE;
+      rv |= sync_file_range(blocks_fd, start, len, flags);
+    }
+  }
+  if (wait) {
+    int64_t start = (int64_t)runs[0].bnum * BLOCK_SIZE / page * page;
+    int64_t end = ((int64_t)runs[0].bnum + runs[0].count) * BLOCK_SIZE;
+    rv |= msync(blocks_base + start, end - start, MS_SYNC);
+  }
+  return rv ? -EIO : 0;
+}
+
+// the whole image is mapped and blocks are used in place
+static const block_backend_t mmap_backend = {
+    .name = "mmap",
+    .get = mmap_get,
+    .put = mmap_put,
+    .dirty = mmap_dirty,
+    .read = mmap_read,
+    .write = mmap_write,
+    .forget = mmap_forget,
+    .flush = mmap_flush,
+    .sync = mmap_sync,
+};
+
+// the backend for data blocks; metadata blocks are always mapped
+static const block_backend_t *backend = &mmap_backend;
+
+// is bnum a data block, handled by the backend?
+static int is_data(int bnum) { return !blocks_is_meta(bnum); }
+
+// next-fit cursor: allocation resumes where the previous one stopped
+static int next_block_hint = 0;
 
 // Get the number of blocks needed to store the given number of bytes.
-int bytes_to_blocks(int bytes) {
+int bytes_to_blocks(int64_t bytes) {
   int quo = bytes / BLOCK_SIZE;
   return bytes % BLOCK_SIZE == 0 ? quo : quo + 1;
 }
 
+// number of blocks needed to hold the given number of bytes
+static uint32_t div_up(int64_t bytes, int64_t unit) {
+  return (bytes + unit - 1) / unit;
+}
+
+// Lay out the tables with an entry per block.
+void blocks_place_tables(superblock_t *s, uint32_t start, int64_t count) {
+  s->refcount_start = start;
+  s->refcount_blocks = div_up(count * sizeof(refcount_t), s->block_size);
+  s->csum_start = s->refcount_start + s->refcount_blocks;
+  s->csum_blocks = div_up(count * sizeof(uint32_t), s->block_size);
+  s->dedup_start = s->csum_start + s->csum_blocks;
+  s->dedup_blocks = div_up(count * sizeof(uint32_t), s->block_size);
+}
+
+// Return the block after the run of tables.
+uint32_t blocks_tables_end(const superblock_t *s) {
+  return s->dedup_start + s->dedup_blocks;
+}
+
+// Is the block part of the metadata?
+int blocks_is_meta(int bnum) {
+  return bnum < (int)sb->data_start ||
+         (bnum >= (int)sb->refcount_start && bnum < (int)blocks_tables_end(sb));
+}
+
+// mark the blocks [from, to) in the bitmap block covering the blocks from
+// first on, returns whether it covers any of them
+static int mark_used(void *bits, int64_t first, int64_t per_block,
+                     int64_t from, int64_t to) {
+  from = from > first ? from : first;
+  to = to < first + per_block ? to : first + per_block;
+  if (from >= to) {
+    return 0;
+  }
+  bitmap_put_range(bits, from - first, to - from, 1);
+  return 1;
+}
+
+// zero len bytes of the file from offset on, leaving holes where it can
+static int clear_range(int fd, int64_t offset, int64_t len) {
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) ==
+      0) {
+    return 0;
+  }
+  size_t chunk = 1 << 20;
+  char *zeros = calloc(1, chunk);
+  assert(zeros);
+  int rv = 0;
+  for (int64_t done = 0; done < len && rv == 0; done += chunk) {
+    size_t n = len - done < (int64_t)chunk ? len - done : chunk;
+    rv = pwrite(fd, zeros, n, offset + done) == (ssize_t)n ? 0 : -1;
+  }
+  free(zeros);
+  return rv;
+}
+
+// Write a fresh superblock, bitmaps and inode table for an image of the
+// given size to the open file.
+int blocks_format(int fd, int64_t size, const format_config_t *conf) {
+  format_config_t defaults = {0};
+  if (conf == NULL) {
+    conf = &defaults;
+  }
+  int block_size =
+      conf->block_size > 0 ? conf->block_size : NUFS_DEFAULT_BLOCK_SIZE;
+  if (block_size < 1024 || block_size > 65536 ||
+      (block_size & (block_size - 1))) {
+    fprintf(stderr, "nufs: bad block size %d\n", block_size);
+    return -1;
+  }
+
+  superblock_t fresh;
+  memset(&fresh, 0, sizeof(fresh));
+  fresh.magic = NUFS_MAGIC;
+  fresh.version = NUFS_VERSION;
+  fresh.block_size = block_size;
+  if (size / block_size > INT_MAX) {
+    fprintf(stderr, "nufs: image of %ld bytes is too large\n", (long)size);
+    return -1;
+  }
+  fresh.block_count = size / block_size;
+  int64_t inodes = conf->inode_count > 0 ? conf->inode_count
+                                         : size / NUFS_BYTES_PER_INODE;
+  if (inodes < NUFS_MIN_INODES) {
+    inodes = NUFS_MIN_INODES;
+  }
+  if (inodes > INT_MAX / NUFS_INODE_HEADROOM) {
+    inodes = INT_MAX / NUFS_INODE_HEADROOM;
+  }
+  fresh.inode_count = inodes;
+  fresh.inode_size = sizeof(inode_t);
+
+  // size the bitmaps and the inode table for the largest the image may
+  // grow to, using up whatever is left of their last block
+  int64_t max_blocks = conf->max_size > 0
+                           ? conf->max_size / block_size
+                           : (int64_t)fresh.block_count * NUFS_GROW_LIMIT;
+  if (max_blocks < fresh.block_count) {
+    fprintf(stderr, "nufs: maximum size below the size of the image\n");
+    return -1;
+  }
+  int64_t max_inodes = (int64_t)fresh.inode_count * NUFS_INODE_HEADROOM;
+
+  // block 0 holds the superblock, the rest of the metadata follows it
+  fresh.block_bitmap_start = 1;
+  fresh.block_bitmap_blocks = div_up(div_up(max_blocks, 8), block_size);
+  max_blocks = (int64_t)fresh.block_bitmap_blocks * block_size * 8;
+  fresh.max_block_count = max_blocks < INT_MAX ? max_blocks : INT_MAX;
+
+  fresh.inode_table_blocks =
+      div_up(max_inodes * fresh.inode_size, block_size);
+  max_inodes = (int64_t)fresh.inode_table_blocks * block_size /
+               fresh.inode_size;
+  fresh.max_inode_count = max_inodes;
+
+  fresh.inode_bitmap_start = fresh.block_bitmap_start + fresh.block_bitmap_blocks;
+  fresh.inode_bitmap_blocks = div_up(div_up(max_inodes, 8), block_size);
+  fresh.inode_table_start = fresh.inode_bitmap_start + fresh.inode_bitmap_blocks;
+
+  // then the snapshot list, and the journal
+  fresh.snapshot_start = fresh.inode_table_start + fresh.inode_table_blocks;
+  fresh.journal_start = fresh.snapshot_start + 1;
+  if (conf->journal_blocks != 0) {
+    fresh.journal_blocks = conf->journal_blocks > 0 ? conf->journal_blocks : 0;
+  } else {
+    fresh.journal_blocks = fresh.block_count / 64;
+    if (fresh.journal_blocks < JOURNAL_MIN_BLOCKS) {
+      fresh.journal_blocks = JOURNAL_MIN_BLOCKS;
+    }
+    if (fresh.journal_blocks > JOURNAL_MAX_BLOCKS) {
+      fresh.journal_blocks = JOURNAL_MAX_BLOCKS;
+    }
+  }
+  if (fresh.journal_blocks > 0 && (fresh.journal_blocks < JOURNAL_MIN_BLOCKS ||
+                                   fresh.journal_blocks >= fresh.block_count)) {
+    fprintf(stderr, "nufs: bad journal size %u\n", fresh.journal_blocks);
+    return -1;
+  }
+  fresh.data_start = fresh.journal_start + fresh.journal_blocks;
+
+  // the tables with an entry for every block of the image go at its end
+  blocks_place_tables(&fresh, 0, fresh.block_count);
+  uint32_t tables = blocks_tables_end(&fresh);
+  if ((int64_t)fresh.data_start + tables >= fresh.block_count) {
+    fprintf(stderr, "nufs: image of %ld bytes is too small\n", (long)size);
+    return -1;
+  }
+  blocks_place_tables(&fresh, fresh.block_count - tables, fresh.block_count);
+
+  printf("+ blocks_format(%ld bytes): %u blocks, %u inodes, data at %u\n",
+         (long)size, fresh.block_count, fresh.inode_count, fresh.data_start);
+
+  // the metadata region and the tables are mostly zeros: clear them, then
+  // write the blocks that are not, so formatting costs the same whatever
+  // the size
+  if (clear_range(fd, 0, (int64_t)fresh.data_start * block_size) < 0 ||
+      clear_range(fd, (int64_t)fresh.refcount_start * block_size,
+                  (int64_t)tables * block_size) < 0) {
+    return -1;
+  }
+  char *buf = calloc(1, block_size);
+  assert(buf);
+  memcpy(buf, &fresh, sizeof(fresh));
+  int rv = pwrite(fd, buf, block_size, 0) == block_size ? 0 : -1;
+
+  // so are the bits of the blocks they take up
+  int64_t bits = (int64_t)block_size * 8;
+  for (int64_t b = 0; b < fresh.block_count && rv == 0; b += bits) {
+    memset(buf, 0, block_size);
+    int used = mark_used(buf, b, bits, 0, fresh.data_start);
+    used |= mark_used(buf, b, bits, fresh.refcount_start,
+                      blocks_tables_end(&fresh));
+    if (used) {
+      off_t off = ((off_t)fresh.block_bitmap_start + b / bits) * block_size;
+      rv = pwrite(fd, buf, block_size, off) == block_size ? 0 : -1;
+    }
+  }
+
+  if (fresh.journal_blocks > 0 && rv == 0) {
+    memset(buf, 0, block_size);
+    journal_format(buf, 1);
+    off_t off = (off_t)fresh.journal_start * block_size;
+    rv = pwrite(fd, buf, block_size, off) == block_size ? 0 : -1;
+  }
+  free(buf);
+  return rv;
+}
+
+// map count blocks of the image from bnum at their place in the address
+// space set aside for it: privately while journaling, so that changes stay
+// in memory until the journal writes them home. Returns 0 or -errno.
+static int map_blocks(int64_t bnum, int64_t count, int private) {
+  int64_t page = sysconf(_SC_PAGESIZE);
+  int64_t start = bnum * BLOCK_SIZE / page * page;
+  int64_t end = (bnum + count) * BLOCK_SIZE;
+  if (count == 0) {
+    return 0;
+  }
+  int flags = MAP_FIXED | (private ? MAP_PRIVATE | MAP_NORESERVE : MAP_SHARED);
+  void *at = mmap(blocks_base + start, end - start, PROT_READ | PROT_WRITE,
+                  flags, blocks_fd, start);
+  if (at == MAP_FAILED) {
+    return -errno;
+  }
+  assert(at == blocks_base + start);
+  return 0;
+}
+
 // Load and initialize the given disk image.
-void blocks_init(const char *image_path) {
+void blocks_init(const char *image_path, const blocks_config_t *conf) {
+  blocks_config_t defaults = {.backend = BLOCKS_MMAP};
+  if (conf == NULL) {
+    conf = &defaults;
+  }
+
   blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
   assert(blocks_fd != -1);
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
+  struct stat st;
+  int rv = fstat(blocks_fd, &st);
   assert(rv == 0);
 
-  // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
+  superblock_t disk_sb;
+  memset(&disk_sb, 0, sizeof(disk_sb));
+  if (pread(blocks_fd, &disk_sb, sizeof(disk_sb), 0) != sizeof(disk_sb) ||
+      disk_sb.magic != NUFS_MAGIC) {
+    // no superblock yet: format whatever space the image already has
+    int64_t size = st.st_size < NUFS_DEFAULT_SIZE ? NUFS_DEFAULT_SIZE : st.st_size;
+    rv = ftruncate(blocks_fd, size);
+    assert(rv == 0);
+    rv = blocks_format(blocks_fd, size, NULL);
+    assert(rv == 0);
+    rv = pread(blocks_fd, &disk_sb, sizeof(disk_sb), 0);
+    assert(rv == sizeof(disk_sb));
+  }
+  assert(disk_sb.version == NUFS_VERSION);
+  assert(disk_sb.inode_size == sizeof(inode_t));
+
+  // bring the metadata up to the last committed transaction
+  if (disk_sb.journal_blocks > 0) {
+    rv = journal_replay(blocks_fd, &disk_sb);
+    if (rv < 0) {
+      fprintf(stderr, "nufs: cannot replay the journal\n");
+    } else if (rv > 0) {
+      printf("+ blocks_init: replayed %d transactions\n", rv);
+      rv = pread(blocks_fd, &disk_sb, sizeof(disk_sb), 0);
+      assert(rv == sizeof(disk_sb));
+    }
+  }
+
+  BLOCK_SIZE = disk_sb.block_size;
+  BLOCK_COUNT = disk_sb.block_count;
+  NUFS_SIZE = (int64_t)BLOCK_SIZE * BLOCK_COUNT;
+  INODE_COUNT = disk_sb.inode_count;
+  BLOCK_BITMAP_SIZE = div_up(BLOCK_COUNT, 8);
+  INODE_BITMAP_SIZE = div_up(INODE_COUNT, 8);
+
+  // the image must be at least as large as the geometry it describes
+  rv = fstat(blocks_fd, &st);
+  assert(rv == 0 && st.st_size >= NUFS_SIZE);
+
+  // reserve address space for the largest the image can grow to, then map
+  // the image into it. The pread backend only needs the metadata mapped.
+  backend = conf->backend == BLOCKS_PREAD ? &bcache_backend : &mmap_backend;
+  blocks_reserved = (int64_t)BLOCK_SIZE * disk_sb.max_block_count;
+  if (blocks_reserved < NUFS_SIZE) {
+    blocks_reserved = NUFS_SIZE;
+  }
+  blocks_base = mmap(0, blocks_reserved, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (blocks_base == MAP_FAILED) {
+    // no room for growing, just make room for what is there
+    blocks_reserved = NUFS_SIZE;
+    blocks_base = mmap(0, blocks_reserved, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  }
   assert(blocks_base != MAP_FAILED);
 
-  // block 0 stores the block bitmap
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, 0, 1);
-  // block 1 stores the inode bitmap
-  bitmap_put(bbm, 1, 1);
+  // while journaling, changes to the metadata stay in a private copy of it
+  // until the journal writes them home. That only works if the metadata
+  // ends on a page boundary. Only the pages written get a private copy, so
+  // none is reserved up front: the inode table of a large image is mostly
+  // never touched.
+  int journaled =
+      disk_sb.journal_blocks > 0 && BLOCK_SIZE % sysconf(_SC_PAGESIZE) == 0;
+  if (disk_sb.journal_blocks > 0 && !journaled) {
+    fprintf(stderr, "nufs: blocks smaller than a page, journal disabled\n");
+  }
+  rv = 0;
+  if (backend == &mmap_backend) {
+    rv |= map_blocks(0, BLOCK_COUNT, 0);
+  }
+  rv |= map_blocks(0, disk_sb.data_start, journaled);
+  uint32_t tables = disk_sb.refcount_start;
+  rv |= map_blocks(tables, blocks_tables_end(&disk_sb) - tables, journaled);
+  assert(rv == 0);
+  sb = blocks_base;
+  // images formatted before growing was possible have no room for it
+  if (sb->max_block_count == 0) {
+    sb->max_block_count = sb->block_count;
+    sb->max_inode_count = sb->inode_count;
+  }
+  next_block_hint = sb->data_start;
 
-  // block 2-n stores the inode table
-  for (int i = 2; (i-2) * BLOCK_SIZE < INODE_COUNT * INODE_SIZE; ++i) {
-    bitmap_put(bbm, i, 1);
+  if (backend->init) {
+    rv = backend->init(image_path, blocks_fd, conf);
+    assert(rv == 0);
+  }
+  if (journaled) {
+    rv = journal_init(blocks_fd, sb, conf);
+    assert(rv == 0);
+  }
+  csum_init(conf);
+  snapshot_init();
+  dedup_init(conf);
+  discard_init(conf);
+  if (conf->snapshot && (rv = snapshot_mount(conf->snapshot)) < 0) {
+    fprintf(stderr, "nufs: snapshot %s: %s\n", conf->snapshot, strerror(-rv));
+    exit(1);
   }
+
+  printf("+ blocks_init(%s): %d blocks of %d bytes (%d in use), %d inodes, "
+         "%s backend\n",
+         image_path, BLOCK_COUNT, BLOCK_SIZE,
+         bitmap_count(get_blocks_bitmap(), BLOCK_COUNT), INODE_COUNT,
+         backend->name);
 }
 
 // Close the disk image.
 void blocks_free() {
-  int rv = munmap(blocks_base, NUFS_SIZE);
+  dedup_free();
+  snapshot_free();
+  discard_free();
+  journal_free();
+  if (backend->free) {
+    backend->free();
+  }
+  int rv = munmap(blocks_base, blocks_reserved);
   assert(rv == 0);
+  close(blocks_fd);
+  blocks_fd = -1;
+  blocks_base = 0;
+  blocks_reserved = 0;
+  backend = &mmap_backend;
+  sb = 0;
+}
+
+// Write every modified block back to the image file.
+int blocks_flush() { return backend->flush(); }
+
+// Write the modified data blocks among the runs back to the image file.
+int blocks_sync(const block_run_t *runs, int count, int wait) {
+  return count > 0 ? backend->sync(runs, count, wait) : 0;
+}
+
+// Get everything written so far onto the disk.
+int blocks_sync_all() {
+  int rv = backend->flush();
+  if (fdatasync(blocks_fd) < 0) {
+    rv = -EIO;
+  }
+  return rv;
+}
+
+// write the len bytes of the table at table to the blocks of the image
+// from bnum on, skipping those that are all zeros. Returns 0 or -1.
+static int write_table(const void *table, int64_t len, uint32_t bnum) {
+  char *buf = malloc(BLOCK_SIZE);
+  assert(buf);
+  int rv = 0;
+  for (int64_t off = 0; off < len && rv == 0; off += BLOCK_SIZE) {
+    int64_t n = len - off < BLOCK_SIZE ? len - off : BLOCK_SIZE;
+    memset(buf, 0, BLOCK_SIZE);
+    memcpy(buf, (const char *)table + off, n);
+    if (bitmap_find_one(buf, 0, n * 8) < n * 8) {
+      off_t at = (off_t)bnum * BLOCK_SIZE + off;
+      rv = pwrite(blocks_fd, buf, BLOCK_SIZE, at) == BLOCK_SIZE ? 0 : -1;
+    }
+  }
+  free(buf);
+  return rv;
+}
+
+// Move the tables to a run sized for count blocks, at the end of the image
+// if it grew by enough for them and in the first run free enough otherwise.
+// The new run is on the disk before the superblock points at it, and the
+// old one is freed once that has committed, so a crash leaves either.
+static int move_tables(int64_t count) {
+  superblock_t moved = *sb;
+  blocks_place_tables(&moved, 0, count);
+  uint32_t len = blocks_tables_end(&moved);
+  int64_t start = count - len;
+  if (start < BLOCK_COUNT) {
+    start = bitmap_find_zero_run(get_blocks_bitmap(), sb->data_start,
+                                 BLOCK_COUNT, len);
+    if (start < 0) {
+      return -ENOSPC;
+    }
+  }
+  blocks_place_tables(&moved, start, count);
+  printf("+ blocks_grow: moving the tables from %u to %ld\n",
+         sb->refcount_start, (long)start);
+
+  // the entries of the blocks so far, and none for the rest
+  backend->forget(start, len);
+  int rv = clear_range(blocks_fd, start * BLOCK_SIZE, (int64_t)len * BLOCK_SIZE);
+  if (rv == 0) {
+    rv = write_table(mmap_get(sb->refcount_start),
+                     (int64_t)BLOCK_COUNT * sizeof(refcount_t),
+                     moved.refcount_start);
+  }
+  if (rv == 0) {
+    rv = write_table(mmap_get(sb->csum_start),
+                     (int64_t)BLOCK_COUNT * sizeof(uint32_t), moved.csum_start);
+  }
+  if (rv == 0) {
+    rv = write_table(mmap_get(sb->dedup_start),
+                     (int64_t)BLOCK_COUNT * sizeof(uint32_t), moved.dedup_start);
+  }
+  if (rv < 0 || fdatasync(blocks_fd) < 0) {
+    return -EIO;
+  }
+  rv = map_blocks(start, len, journal_active());
+  if (rv < 0) {
+    return rv;
+  }
+
+  void *bbm = get_blocks_bitmap();
+  blocks_dirty_ptr(bbm + start / 8, (start + len - 1) / 8 - start / 8 + 1);
+  bitmap_put_range(bbm, start, len, 1);
+
+  // the old run is freed like any metadata block, once nothing can replay
+  // over it, and keeps nothing in memory. The superblock joins the
+  // transaction first, as that brings in its checksum's block of the old
+  // table.
+  uint32_t old = sb->refcount_start;
+  uint32_t old_len = blocks_tables_end(sb) - old;
+  blocks_dirty(0);
+  for (uint32_t b = old; b < old + old_len && journal_active(); b++) {
+    journal_retire(b);
+  }
+  blocks_place_tables(sb, start, count);
+  csum_forget(start, len);
+  dedup_forget(start, len);
+  if (journal_active()) {
+    rv = map_blocks(old, old_len, 0);
+  } else {
+    blocks_release(old, old_len);
+  }
+  return rv;
+}
+
+// Grow the mounted image to the given size.
+int blocks_grow(int64_t size) {
+  int64_t count = size / BLOCK_SIZE;
+  printf("+ blocks_grow(%ld bytes): %d -> %ld blocks\n", (long)size,
+         BLOCK_COUNT, (long)count);
+
+  if (count < BLOCK_COUNT) {
+    return -EINVAL;
+  }
+  if (count == BLOCK_COUNT) {
+    return 0;
+  }
+  if (count > sb->max_block_count || count * BLOCK_SIZE > blocks_reserved) {
+    return -EFBIG;
+  }
+  int64_t new_size = count * BLOCK_SIZE;
+
+  // the image file may already have been extended by hand
+  struct stat st;
+  if (fstat(blocks_fd, &st) < 0) {
+    return -errno;
+  }
+  if (st.st_size < new_size && ftruncate(blocks_fd, new_size) < 0) {
+    return -errno;
+  }
+
+  // the new blocks are mapped over the addresses set aside for them
+  if (backend == &mmap_backend) {
+    int rv = map_blocks(BLOCK_COUNT, count - BLOCK_COUNT, 0);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+
+  // the tables need room for the new blocks' entries
+  superblock_t grown = *sb;
+  blocks_place_tables(&grown, sb->refcount_start, count);
+  if (blocks_tables_end(&grown) != blocks_tables_end(sb)) {
+    int rv = move_tables(count);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+
+  // the bitmaps and the inode table were sized for this at format time, and
+  // their new bits and entries are still clear, so only the counts change
+  int64_t inodes = new_size / NUFS_BYTES_PER_INODE;
+  if (inodes > sb->max_inode_count) {
+    inodes = sb->max_inode_count;
+  }
+  blocks_dirty(0);
+  if (inodes > INODE_COUNT) {
+    sb->inode_count = inodes;
+    INODE_COUNT = inodes;
+    INODE_BITMAP_SIZE = div_up(INODE_COUNT, 8);
+  }
+
+  sb->block_count = count;
+  BLOCK_COUNT = count;
+  BLOCK_BITMAP_SIZE = div_up(BLOCK_COUNT, 8);
+  NUFS_SIZE = new_size;
+
+  printf("+ blocks_grow: %d blocks, %d inodes\n", BLOCK_COUNT, INODE_COUNT);
+  return 0;
+}
+
+// Return the superblock of the mounted image.
+superblock_t *get_superblock() { return sb; }
+
+// Get the given block, returning a pointer to its start. While journaling,
+// data blocks holding metadata live in journal buffers instead.
+void *blocks_get_block(int bnum) {
+  void *copy;
+  if (snapshot_viewing() && (bnum = snapshot_view_map(bnum, &copy)) < 0) {
+    return copy;
+  }
+  if (!is_data(bnum)) {
+    return mmap_get(bnum);
+  }
+  return journal_active() ? journal_get_block(bnum) : backend->get(bnum);
+}
+
+// Release a block returned by blocks_get_block.
+void blocks_put_block(int bnum) {
+  void *copy;
+  if (snapshot_viewing() && (bnum = snapshot_view_map(bnum, &copy)) < 0) {
+    return;
+  }
+  if (is_data(bnum) && journal_active()) {
+    journal_put_block(bnum);
+  } else if (is_data(bnum)) {
+    backend->put(bnum);
+  }
+}
+
+// Mark a block returned by blocks_get_block as modified.
+void blocks_dirty(int bnum) {
+  snapshot_preserve(bnum);
+  if (journal_active()) {
+    journal_dirty(bnum);
+  } else if (is_data(bnum)) {
+    // without the journal nothing takes the checksum of the new contents
+    csum_forget(bnum, 1);
+    backend->dirty(bnum);
+  }
+}
+
+// Mark the len bytes of mapped metadata at ptr as modified.
+void blocks_dirty_ptr(const void *ptr, size_t len) {
+  if (!journal_active() || len == 0) {
+    return;
+  }
+  // copies kept elsewhere in memory are not part of the image
+  int64_t off = (const char *)ptr - (const char *)blocks_base;
+  if (off < 0 || off + len > blocks_reserved ||
+      !blocks_is_meta(off / BLOCK_SIZE)) {
+    return;
+  }
+  for (int b = off / BLOCK_SIZE; b <= (off + len - 1) / BLOCK_SIZE; b++) {
+    snapshot_preserve(b);
+    journal_dirty(b);
+  }
 }
 
-// Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+// read from a snapshot, one block at a time since their versions of the
+// blocks need not be next to each other
+static int view_read(int bnum, int64_t off, void *buf, size_t len) {
+  bnum += off / BLOCK_SIZE;
+  off %= BLOCK_SIZE;
+  while (len > 0) {
+    size_t n = len < BLOCK_SIZE - off ? len : BLOCK_SIZE - off;
+    void *copy;
+    int b = snapshot_view_map(bnum, &copy);
+    if (b < 0) {
+      memcpy(buf, copy + off, n);
+    } else {
+      int rv = is_data(b) ? backend->read(b, off, buf, n)
+                          : mmap_read(b, off, buf, n);
+      if (rv < 0) {
+        return rv;
+      }
+    }
+    bnum++;
+    off = 0;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Copy from a run of contiguous blocks.
+int blocks_read(int bnum, int64_t off, void *buf, size_t len) {
+  if (snapshot_viewing()) {
+    return view_read(bnum, off, buf, len);
+  }
+  return is_data(bnum) ? backend->read(bnum, off, buf, len)
+                       : mmap_read(bnum, off, buf, len);
+}
+
+// Copy from a run of contiguous blocks, checking them against their
+// checksums.
+int blocks_read_checked(int bnum, int64_t off, void *buf, size_t len) {
+  if (csum_mode() != CSUM_FULL || snapshot_viewing() || !is_data(bnum)) {
+    return blocks_read(bnum, off, buf, len);
+  }
+
+  bnum += off / BLOCK_SIZE;
+  off %= BLOCK_SIZE;
+  while (len > 0) {
+    int count = 1;
+    size_t n;
+    int rv;
+    if (off == 0 && len >= (size_t)BLOCK_SIZE) {
+      // whole blocks are checked where they land
+      count = len / BLOCK_SIZE;
+      n = (size_t)count * BLOCK_SIZE;
+      rv = backend->read(bnum, 0, buf, n);
+      if (rv == 0) {
+        rv = csum_verify(bnum, count, buf);
+      }
+    } else {
+      n = len < BLOCK_SIZE - off ? len : BLOCK_SIZE - off;
+      void *block = backend->get(bnum);
+      rv = csum_verify(bnum, 1, block);
+      memcpy(buf, block + off, n);
+      backend->put(bnum);
+    }
+    if (rv < 0) {
+      return rv;
+    }
+    bnum += count;
+    off = 0;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// take the checksums of the data blocks_write just wrote
+static void written(int bnum, int64_t off, const void *buf, size_t len) {
+  bnum += off / BLOCK_SIZE;
+  off %= BLOCK_SIZE;
+  if (csum_mode() != CSUM_FULL) {
+    csum_forget(bnum, (off + len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    return;
+  }
+
+  while (len > 0) {
+    int count = 1;
+    size_t n;
+    if (off == 0 && len >= (size_t)BLOCK_SIZE) {
+      count = len / BLOCK_SIZE;
+      n = (size_t)count * BLOCK_SIZE;
+      csum_data(bnum, count, buf);
+    } else {
+      // the rest of the block is in the image
+      n = len < BLOCK_SIZE - off ? len : BLOCK_SIZE - off;
+      csum_data(bnum, 1, backend->get(bnum));
+      backend->put(bnum);
+    }
+    bnum += count;
+    off = 0;
+    if (buf) {
+      buf += n;
+    }
+    len -= n;
+  }
+}
+
+// Copy into a run of contiguous blocks.
+int blocks_write(int bnum, int64_t off, const void *buf, size_t len) {
+  if (!is_data(bnum)) {
+    return mmap_write(bnum, off, buf, len);
+  }
+  dedup_forget(bnum + off / BLOCK_SIZE,
+               (off % BLOCK_SIZE + len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+  int rv = backend->write(bnum, off, buf, len);
+  if (rv == 0) {
+    written(bnum, off, buf, len);
+  }
+  return rv;
+}
+
+// Write a block home for the journal.
+int blocks_write_home(int bnum, const void *data) {
+  return is_data(bnum) ? backend->write(bnum, 0, data, BLOCK_SIZE)
+                       : mmap_write(bnum, 0, data, BLOCK_SIZE);
+}
 
 // Return a pointer to the beginning of the block bitmap.
 // The size is BLOCK_BITMAP_SIZE bytes.
-void *get_blocks_bitmap() { return blocks_get_block(0); }
+void *get_blocks_bitmap() { return blocks_get_block(sb->block_bitmap_start); }
 
 // Return a pointer to the beginning of the inode table bitmap.
-void *get_inode_bitmap() {
-  // The inode bitmap is stored immediately after the block bitmap
-  return blocks_get_block(0) + BLOCK_BITMAP_SIZE;
-}
+// The size is INODE_BITMAP_SIZE bytes.
+void *get_inode_bitmap() { return blocks_get_block(sb->inode_bitmap_start); }
+
+// Return a pointer to the beginning of the inode table.
+void *get_inode_table() { return blocks_get_block(sb->inode_table_start); }
 
 // Allocate a new block and return its index.
 int alloc_block() {
+  int got;
+  return alloc_blocks(0, 1, &got);
+}
+
+// Allocate up to count contiguous blocks and return the first one.
+int alloc_blocks(int goal, int count, int *got) {
   void *bbm = get_blocks_bitmap();
+  int start = -1;
+  assert(count > 0);
 
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      bitmap_put(bbm, ii, 1);
-      printf("+ alloc_block() -> %d\n", ii);
-      return ii;
+  // right where the caller wants it
+  if (goal >= (int)sb->data_start && goal < BLOCK_COUNT &&
+      !bitmap_get(bbm, goal)) {
+    int end = goal + count < BLOCK_COUNT ? goal + count : BLOCK_COUNT;
+    if (bitmap_find_one(bbm, goal, end) - goal == count) {
+      start = goal;
     }
   }
 
-  return -1;
+  // the first run that is long enough, from the cursor and then wrapping
+  // around (including runs that straddle the cursor)
+  if (start < 0) {
+    start = bitmap_find_zero_run(bbm, next_block_hint, BLOCK_COUNT, count);
+  }
+  if (start < 0) {
+    int end = next_block_hint + count - 1;
+    start = bitmap_find_zero_run(bbm, sb->data_start,
+                                 end < BLOCK_COUNT ? end : BLOCK_COUNT, count);
+  }
+
+  // settle for the largest run there is
+  if (start < 0) {
+    int len;
+    start = bitmap_largest_zero_run(bbm, sb->data_start, BLOCK_COUNT, &len);
+    if (start < 0) {
+      return -1;
+    }
+    count = len;
+  }
+
+  blocks_dirty_ptr(bbm + start / 8, (start + count - 1) / 8 - start / 8 + 1);
+  bitmap_put_range(bbm, start, count, 1);
+  // whatever the blocks held before is gone
+  csum_forget(start, count);
+  dedup_forget(start, count);
+  next_block_hint =
+      start + count < BLOCK_COUNT ? start + count : sb->data_start;
+  *got = count;
+
+  if (count == 1) {
+    printf("+ alloc_block() -> %d\n", start);
+  } else {
+    printf("+ alloc_blocks(%d) -> %d\n", count, start);
+  }
+  return start;
+}
+
+// Can the image share blocks between files?
+int blocks_can_share() { return sb->refcount_blocks > 0; }
+
+static refcount_t *get_refcounts() {
+  return blocks_get_block(sb->refcount_start);
+}
+
+// Add an owner to each of the count blocks starting at bnum.
+int blocks_share(int bnum, int count) {
+  assert(blocks_can_share());
+  assert(bnum >= (int)sb->data_start && bnum + count <= BLOCK_COUNT);
+  refcount_t *refs = get_refcounts();
+  for (int b = bnum; b < bnum + count; b++) {
+    if (refs[b] == NUFS_MAX_SHARES) {
+      return -EMLINK;
+    }
+  }
+  for (int b = bnum; b < bnum + count; b++) {
+    refs[b]++;
+  }
+  blocks_dirty_ptr(refs + bnum, count * sizeof(refcount_t));
+  printf("+ blocks_share(%d, %d)\n", bnum, count);
+  return 0;
+}
+
+// Return how many of the count blocks starting at bnum are shared like bnum.
+int blocks_shared_run(int bnum, int count, int *shared) {
+  if (!blocks_can_share()) {
+    *shared = 0;
+    return count;
+  }
+  refcount_t *refs = get_refcounts();
+  *shared = refs[bnum] > 0 || snapshot_holds(bnum);
+  int n = 1;
+  while (n < count &&
+         (refs[bnum + n] > 0 || snapshot_holds(bnum + n)) == *shared) {
+    n++;
+  }
+  return n;
+}
+
+// Return the number of extra owners of the block.
+int blocks_refcount(int bnum) {
+  return blocks_can_share() ? get_refcounts()[bnum] : 0;
+}
+
+// drop one of the extra owners of a shared block, returns 0 if it had none
+static int unshare_block(int bnum) {
+  if (!blocks_can_share()) {
+    return 0;
+  }
+  refcount_t *refs = get_refcounts();
+  if (refs[bnum] == 0) {
+    return 0;
+  }
+  refs[bnum]--;
+  blocks_dirty_ptr(refs + bnum, sizeof(refcount_t));
+  return 1;
 }
 
 // Deallocate the block with the given index.
 void free_block(int bnum) {
-  printf("+ free_block(%d)\n", bnum);
+  free_blocks(bnum, 1);
+}
+
+// Deallocate count blocks starting at the given index.
+void free_blocks(int bnum, int count) {
+  if (count == 1) {
+    printf("+ free_block(%d)\n", bnum);
+  } else {
+    printf("+ free_blocks(%d, %d)\n", bnum, count);
+  }
+  assert(bnum >= (int)sb->data_start && bnum + count <= BLOCK_COUNT);
+
+  // shared blocks just lose an owner, snapshots keep the blocks they still
+  // need, and blocks the journal has logged stay allocated until the
+  // transaction freeing them has committed
+  int run = bnum;
+  for (int b = bnum; b < bnum + count; b++) {
+    if (unshare_block(b) || snapshot_adopt(b) ||
+        (journal_active() && journal_revoke(b))) {
+      if (b > run) {
+        blocks_release(run, b - run);
+      }
+      run = b + 1;
+    }
+  }
+  if (run < bnum + count) {
+    blocks_release(run, bnum + count - run);
+  }
+}
+
+// Clear the bitmap bits of blocks whose free the journal deferred.
+void blocks_release(int bnum, int count) {
+  if (!discard_queue(bnum, count)) {
+    blocks_release_now(bnum, count);
+  }
+}
+
+// Clear the bitmap bits of blocks right away.
+void blocks_release_now(int bnum, int count) {
+  backend->forget(bnum, count);
+  dedup_forget(bnum, count);
   void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, bnum, 0);
+  blocks_dirty_ptr(bbm + bnum / 8, (bnum + count - 1) / 8 - bnum / 8 + 1);
+  bitmap_put_range(bbm, bnum, count, 0);
+}
+
+// let the host reclaim the space behind count blocks starting at bnum
+void blocks_discard(int bnum, int count) {
+  printf("+ blocks_discard(%d, %d)\n", bnum, count);
+  assert(bnum >= (int)sb->data_start && bnum + count <= BLOCK_COUNT);
+
+  while (count > 0) {
+    int shared;
+    int n = blocks_shared_run(bnum, count, &shared);
+    if (!shared) {
+      // failing is harmless, the space just stays allocated in the image
+      // file
+      blocks_punch(bnum, n);
+    }
+    bnum += n;
+    count -= n;
+  }
+}
+
+// punch count free blocks starting at bnum out of the image file
+int blocks_punch(int bnum, int count) {
+  assert(bnum >= (int)sb->data_start && bnum + count <= BLOCK_COUNT);
+  backend->forget(bnum, count);
+  // the blocks read back as zeros
+  if (fallocate(blocks_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                (off_t)bnum * BLOCK_SIZE, (off_t)count * BLOCK_SIZE) < 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+// make sure the host has space behind count blocks starting at bnum
+int blocks_reserve(int bnum, int count) {
+  printf("+ blocks_reserve(%d, %d)\n", bnum, count);
+  assert(bnum >= (int)sb->data_start && bnum + count <= BLOCK_COUNT);
+  int rv = fallocate(blocks_fd, 0, (off_t)bnum * BLOCK_SIZE,
+                     (off_t)count * BLOCK_SIZE);
+  // not every host filesystem can preallocate, which only loses the
+  // guarantee
+  if (rv < 0 && errno != EOPNOTSUPP) {
+    return -errno;
+  }
+  return 0;
 }
@@ -3,40 +3,280 @@
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stdint.h>
 #include <stdio.h>
 
-extern const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
-extern const int BLOCK_SIZE;  // default = 4K
-extern const int NUFS_SIZE;   // default = 1MB
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 3
 
-extern const int INODE_COUNT; // default = 256
-extern const int INODE_SIZE;  // sizeof(inode_t) = 64
+#define NUFS_DEFAULT_BLOCK_SIZE 4096
+#define NUFS_DEFAULT_SIZE (1 << 20)  // size of a freshly created image
+#define NUFS_BYTES_PER_INODE 16384   // one inode for every 16K of disk
+#define NUFS_MIN_INODES 64
 
-extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
-extern const int INODE_BITMAP_SIZE; // default = 256 / 8 = 32
+// Room left at format time for growing the image while it is mounted: the
+// block bitmap covers 64 times the initial size (at least a whole bitmap
+// block), and the inode table twice the initial inode count. The tables
+// with an entry per block are only sized for the blocks the image has, and
+// move when it grows (see blocks_grow).
+#define NUFS_GROW_LIMIT 64
+#define NUFS_INODE_HEADROOM 2
+
+// On-disk superblock, stored at the start of block 0. It records the
+// geometry of the image so that every other region can be located.
+typedef struct superblock {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_size;
+  uint32_t block_count;
+  uint32_t inode_count;
+  uint32_t inode_size;
+  uint32_t block_bitmap_start;  // first block of the block bitmap
+  uint32_t block_bitmap_blocks;
+  uint32_t inode_bitmap_start;  // first block of the inode bitmap
+  uint32_t inode_bitmap_blocks;
+  uint32_t inode_table_start;   // first block of the inode table
+  uint32_t inode_table_blocks;
+  uint32_t data_start;          // first block handed out by alloc_block
+  uint32_t max_block_count;     // blocks the block bitmap has room for
+  uint32_t max_inode_count;     // inodes the inode table has room for
+  uint32_t journal_start;       // first block of the journal, see journal.h
+  uint32_t journal_blocks;      // 0 for images without a journal
+  uint32_t refcount_start;      // first block of the reference counts
+  uint32_t refcount_blocks;     // 0 for images that cannot share blocks
+  uint32_t snapshot_start;      // the snapshot list, 0 for images without
+  uint32_t csum_start;          // first block of the checksums, see csum.h
+  uint32_t csum_blocks;         // 0 for images without checksums
+  uint32_t dedup_start;         // first block of the fingerprints, see dedup.h
+  uint32_t dedup_blocks;        // 0 for images that cannot deduplicate
+} superblock_t;
+
+// Data blocks can be shared between files (see clone_inode). Every block of
+// the image has a count of its extra owners in a table at the end of it; a
+// freed block that still has owners only loses one.
+typedef uint16_t refcount_t;
+#define NUFS_MAX_SHARES UINT16_MAX
+
+// how blocks_init reaches the data blocks of the image
+#define BLOCKS_MMAP 0  // map the whole image (the default)
+#define BLOCKS_PREAD 1 // pread/pwrite through a buffer cache
+
+// which blocks have their checksums checked, see csum.h
+#define CSUM_METADATA 0 // the metadata (the default)
+#define CSUM_OFF 1
+#define CSUM_FULL 2     // file data as well
+
+// when freed blocks are punched out of the image file, see discard.h
+#define DISCARD_OFF 0   // never (the default)
+#define DISCARD_SYNC 1  // as the transaction freeing them commits
+#define DISCARD_ASYNC 2 // in batches, by a background thread
+
+typedef struct blocks_config {
+  int backend;      // BLOCKS_MMAP or BLOCKS_PREAD
+  int cache_blocks; // buffers in the cache of the pread backend, 0 = default
+  int direct;       // open the image with O_DIRECT (pread backend)
+  int commit_interval; // seconds between journal commits, 0 = default
+  char *snapshot;   // read this snapshot instead of the volume, or NULL
+  int checksum;     // CSUM_METADATA, CSUM_OFF or CSUM_FULL
+  int dedup;        // share blocks with the same contents, see dedup.h
+  int discard;      // DISCARD_OFF, DISCARD_SYNC or DISCARD_ASYNC
+} blocks_config_t;
+
+// Geometry of a new image, see blocks_format. Fields left 0 get the
+// defaults.
+typedef struct format_config {
+  int block_size;         // NUFS_DEFAULT_BLOCK_SIZE
+  int64_t inode_count;    // one inode for every NUFS_BYTES_PER_INODE bytes
+  int64_t journal_blocks; // one block in 64 within bounds, -1 for none
+  int64_t max_size;       // bytes the image may grow to, NUFS_GROW_LIMIT
+                          // times its size
+} format_config_t;
+
+// A run of count physically contiguous blocks starting at bnum.
+typedef struct block_run {
+  int bnum;
+  int count;
+} block_run_t;
+
+// A block backend moves the data blocks (from data_start on, apart from the
+// tables) between the image and memory. The metadata is always mapped
+// directly (privately while the journal is active).
+typedef struct block_backend {
+  const char *name;
+  // set up for the image open as fd at path, returns 0 or a negative errno
+  int (*init)(const char *path, int fd, const blocks_config_t *conf);
+  // write back everything and release the backend
+  void (*free)();
+  // pin the block in memory and return it; it stays valid until put
+  void *(*get)(int bnum);
+  void (*put)(int bnum);
+  // mark a pinned block as modified
+  void (*dirty)(int bnum);
+  // copy len bytes at byte offset off of the run of blocks starting at bnum
+  int (*read)(int bnum, int64_t off, void *buf, size_t len);
+  int (*write)(int bnum, int64_t off, const void *buf, size_t len);
+  // drop any copies of freed blocks without writing them back
+  void (*forget)(int bnum, int count);
+  // get every modified block to the image file
+  int (*flush)();
+  // get the modified blocks among the runs to the image file, and onto the
+  // disk if wait is set
+  int (*sync)(const block_run_t *runs, int count, int wait);
+} block_backend_t;
+
+// The geometry below is loaded from the superblock by blocks_init.
+extern int BLOCK_COUNT; // we split the "disk" into blocks
+extern int BLOCK_SIZE;  // default = 4K
+extern int64_t NUFS_SIZE; // = BLOCK_COUNT * BLOCK_SIZE
+
+extern int INODE_COUNT;
+extern const int INODE_SIZE;  // sizeof(inode_t)
+
+extern int BLOCK_BITMAP_SIZE; // = BLOCK_COUNT / 8
+extern int INODE_BITMAP_SIZE; // = INODE_COUNT / 8
 
 // Get the number of blocks needed to store the given number of bytes.
-int bytes_to_blocks(int bytes);
+int bytes_to_blocks(int64_t bytes);
+
+// Write a fresh superblock, bitmaps and inode table for an image of the
+// given size to the open file, with the given geometry (NULL for the
+// defaults). Only the metadata region is touched, and only its nonzero
+// blocks are written. Returns 0 on success, -1 on failure.
+int blocks_format(int fd, int64_t size, const format_config_t *conf);
 
-// Load and initialize the given disk image.
-void blocks_init(const char *image_path);
+// Load and initialize the given disk image. Images that do not carry a
+// superblock yet are formatted to fill their current size (or
+// NUFS_DEFAULT_SIZE for new files). conf may be NULL for the defaults.
+void blocks_init(const char *image_path, const blocks_config_t *conf);
 
-// Close the disk image.
+// Write back and close the disk image.
 void blocks_free();
 
+// Write every modified block back to the image file. Returns 0 or -EIO.
+int blocks_flush();
+
+// Write the modified data blocks among the given runs back to the image
+// file, leaving the rest of the image alone. With wait, return once they
+// are on the disk; otherwise only start writing them. Returns 0 or -EIO.
+int blocks_sync(const block_run_t *runs, int count, int wait);
+
+// Get everything written so far onto the disk, metadata included, when
+// the journal is not active (it commits the metadata itself, see
+// journal_sync). Returns 0 or -EIO.
+int blocks_sync_all();
+
+// Grow the mounted image to the given size, extending the backing file if
+// needed. Blocks stay at the same addresses, except for the tables with an
+// entry per block, which move to a run sized for the new size (the end of
+// it if it grew by enough). Returns 0 or a negative errno (-EINVAL when
+// shrinking, -EFBIG past the room left at format time, -ENOSPC if there is
+// no run free for the tables).
+int blocks_grow(int64_t size);
+
+// Lay out the tables with an entry per block in the superblock, sized for
+// count blocks and in a run starting at block start.
+void blocks_place_tables(superblock_t *s, uint32_t start, int64_t count);
+
+// Return the block after the run of tables with an entry per block.
+uint32_t blocks_tables_end(const superblock_t *s);
+
+// Is the block part of the metadata, mapped directly rather than handled
+// by the backend? That is everything before data_start, and the tables.
+int blocks_is_meta(int bnum);
+
+// Return the superblock of the mounted image.
+superblock_t *get_superblock();
+
 // Get the block with the given index, returning a pointer to its start.
+// Data blocks must be released with blocks_put_block when done, and marked
+// with blocks_dirty before they are modified.
 void *blocks_get_block(int bnum);
 
+// Release a block returned by blocks_get_block.
+void blocks_put_block(int bnum);
+
+// Mark a block returned by blocks_get_block as modified. Metadata blocks
+// must be marked too, so the journal picks them up, and before they change,
+// so snapshots can keep what they held.
+void blocks_dirty(int bnum);
+
+// Mark the len bytes of mapped metadata at ptr as modified (before they
+// change, like blocks_dirty).
+void blocks_dirty_ptr(const void *ptr, size_t len);
+
+// Copy len bytes starting at byte offset off of the run of physically
+// contiguous blocks starting at bnum into buf, or from buf (NULL for zeros)
+// into the blocks. Return 0 or -EIO.
+int blocks_read(int bnum, int64_t off, void *buf, size_t len);
+int blocks_write(int bnum, int64_t off, const void *buf, size_t len);
+
+// Like blocks_read, but checks the blocks read against their checksums
+// (with CSUM_FULL). Returns 0 or -EIO.
+int blocks_read_checked(int bnum, int64_t off, void *buf, size_t len);
+
+// Like blocks_write for a whole block, but leaves its checksum alone. For
+// the journal writing blocks home, whose checksums it took at commit.
+int blocks_write_home(int bnum, const void *data);
+
 // Return a pointer to the beginning of the block bitmap.
 void *get_blocks_bitmap();
 
 // Return a pointer to the beginning of the inode table bitmap.
 void *get_inode_bitmap();
 
+// Return a pointer to the beginning of the inode table.
+void *get_inode_table();
+
 // Allocate a new block and return its index.
 int alloc_block();
 
+// Allocate up to count contiguous blocks and return the first one, storing
+// the number actually allocated in got. A run starting at goal is preferred
+// (pass 0 for no preference); otherwise the first run of count free blocks
+// is used, falling back to the largest run left. Returns -1 if the disk is
+// full.
+int alloc_blocks(int goal, int count, int *got);
+
 // Deallocate the block with the given index.
 void free_block(int bnum);
 
+// Deallocate count blocks starting at the given index.
+void free_blocks(int bnum, int count);
+
+// Clear the bitmap bits of blocks whose free the journal deferred. With
+// discard on they are punched out of the image first, see discard.h.
+void blocks_release(int bnum, int count);
+
+// Clear the bitmap bits of blocks right away, for discard.c once it has
+// punched them out.
+void blocks_release_now(int bnum, int count);
+
+// Punch count free blocks starting at bnum out of the image file, so the
+// host gets their space back. Returns 0 or a negative errno.
+int blocks_punch(int bnum, int count);
+
+// Can the image share blocks between files?
+int blocks_can_share();
+
+// Add an owner to each of the count blocks starting at bnum. Returns 0, or
+// -EMLINK (changing nothing) if one of them has too many already.
+int blocks_share(int bnum, int count);
+
+// Return how many of the count blocks starting at bnum are shared like bnum
+// is, storing whether it is in shared. Blocks a snapshot needs count as
+// shared.
+int blocks_shared_run(int bnum, int count, int *shared);
+
+// Return the number of extra owners of the block.
+int blocks_refcount(int bnum);
+
+// Tell the host the count blocks starting at bnum are no longer in use, so
+// the image file can give their space back. They read as zeros afterwards.
+// Blocks other files still share are left alone.
+void blocks_discard(int bnum, int count);
+
+// Make sure the host has allocated space behind the count blocks starting
+// at bnum. Returns 0 or a negative errno.
+int blocks_reserve(int bnum, int count);
+
 #endif
@@ -0,0 +1,326 @@
+// Transparent compression of file data.
+
+#include "compress.h"
+#include "blocks.h"
+#include "extent.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The LZ4 block format: a series of sequences, each a token byte (literal
+// count in the high nibble, match length - 4 in the low one, 15 meaning
+// more length bytes follow), the literals, and a 2 byte little endian
+// offset back to the match. The last sequence is literals only.
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 // the last bytes are always literals
+#define MF_LIMIT 12     // and no match starts closer to the end than this
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static uint32_t hash4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// bytes taken by the rest of a length that does not fit in its nibble
+static size_t length_bytes(size_t n) { return n < 15 ? 0 : (n - 15) / 255 + 1; }
+
+static uint8_t *put_length(uint8_t *op, size_t n) {
+  for (n -= 15; n >= 255; n -= 255) {
+    *op++ = 255;
+  }
+  *op++ = n;
+  return op;
+}
+
+// Append lit literals followed by a match of mlen bytes offset back (mlen 0
+// for the last sequence). Returns NULL if it does not fit before oend.
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lits,
+                             size_t lit, size_t offset, size_t mlen) {
+  size_t need = 1 + length_bytes(lit) + lit;
+  if (mlen > 0) {
+    need += 2 + length_bytes(mlen - MIN_MATCH);
+  }
+  if (need > (size_t)(oend - op)) {
+    return NULL;
+  }
+
+  uint8_t *token = op++;
+  *token = (lit < 15 ? lit : 15) << 4;
+  if (lit >= 15) {
+    op = put_length(op, lit);
+  }
+  memcpy(op, lits, lit);
+  op += lit;
+  if (mlen == 0) {
+    return op;
+  }
+
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  mlen -= MIN_MATCH;
+  *token |= mlen < 15 ? mlen : 15;
+  if (mlen >= 15) {
+    op = put_length(op, mlen);
+  }
+  return op;
+}
+
+// Compress len bytes at src into the LZ4 block format at dst.
+int lz4_compress(const void *src, int len, void *dst, int cap) {
+  const uint8_t *in = src, *ip = in, *anchor = in, *end = in + len;
+  uint8_t *op = dst, *oend = op + cap;
+
+  // greedy: take the first match the hash table knows of
+  if (len > MF_LIMIT) {
+    const uint8_t *mflimit = end - MF_LIMIT;
+    const uint8_t *matchlimit = end - LAST_LITERALS;
+    uint32_t *table = calloc(1 << HASH_BITS, sizeof(uint32_t));
+    assert(table);
+    unsigned misses = 0;
+
+    while (ip <= mflimit) {
+      uint32_t h = hash4(ip);
+      const uint8_t *ref = in + table[h];
+      table[h] = ip - in;
+      if (ref >= ip || ip - ref > MAX_OFFSET || memcmp(ref, ip, 4) != 0) {
+        // step faster through data that does not compress
+        ip += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+
+      while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const uint8_t *m = ip + MIN_MATCH, *r = ref + MIN_MATCH;
+      while (m < matchlimit && *m == *r) {
+        m++;
+        r++;
+      }
+
+      op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, m - ip);
+      if (op == NULL) {
+        free(table);
+        return 0;
+      }
+      ip = anchor = m;
+    }
+    free(table);
+  }
+
+  op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+  return op ? op - (uint8_t *)dst : 0;
+}
+
+// read the rest of a length whose nibble was 15
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *n) {
+  uint8_t b;
+  do {
+    if (*ip >= iend) {
+      return -1;
+    }
+    b = *(*ip)++;
+    *n += b;
+  } while (b == 255);
+  return 0;
+}
+
+// Decompress the len bytes of LZ4 data at src into dst.
+int lz4_decompress(const void *src, int len, void *dst, int cap) {
+  const uint8_t *ip = src, *iend = ip + len;
+  uint8_t *out = dst, *op = out, *oend = out + cap;
+
+  while (ip < iend) {
+    uint8_t token = *ip++;
+    size_t lit = token >> 4;
+    if (lit == 15 && get_length(&ip, iend, &lit) < 0) {
+      return -1;
+    }
+    if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+      return -1;
+    }
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip == iend) {
+      break; // the last sequence has no match
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t mlen = token & 15;
+    if (mlen == 15 && get_length(&ip, iend, &mlen) < 0) {
+      return -1;
+    }
+    mlen += MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - out) ||
+        mlen > (size_t)(oend - op)) {
+      return -1;
+    }
+
+    // a match closer than its length repeats itself: copy what is there,
+    // which doubles what can be copied next
+    const uint8_t *from = op - offset;
+    size_t period = offset;
+    while (mlen > 0) {
+      size_t n = period < mlen ? period : mlen;
+      memcpy(op, from, n);
+      op += n;
+      mlen -= n;
+      period += n;
+    }
+  }
+  return op - out;
+}
+
+// Return the number of bytes in a cluster.
+int64_t cluster_bytes() { return (int64_t)CLUSTER_BLOCKS * BLOCK_SIZE; }
+
+// Return the first block of the cluster if it is compressed.
+int cluster_lookup(inode_t *node, int cluster, int *count) {
+  int run, flags;
+  int pblock = extent_lookup(node, cluster * CLUSTER_BLOCKS, &run, &flags);
+  if (pblock == 0 || !(flags & EXTENT_COMPRESSED)) {
+    return 0;
+  }
+  if (count) {
+    *count = run;
+  }
+  return pblock;
+}
+
+// Return the first compressed cluster in [cluster, last).
+int cluster_next(inode_t *node, int cluster, int last) {
+  // compressed extents start clusters, so walking the runs from the start
+  // of one lands on them
+  int64_t lblock = (int64_t)cluster * CLUSTER_BLOCKS;
+  int64_t end = (int64_t)last * CLUSTER_BLOCKS;
+  while (lblock < end) {
+    int count, flags;
+    int pblock = extent_lookup(node, lblock, &count, &flags);
+    if (pblock != 0 && (flags & EXTENT_COMPRESSED)) {
+      return lblock / CLUSTER_BLOCKS;
+    }
+    lblock += count;
+  }
+  return last;
+}
+
+// Read the whole cluster into buf.
+int cluster_read(inode_t *node, int cluster, char *buf) {
+  int count;
+  int pblock = cluster_lookup(node, cluster, &count);
+
+  if (pblock == 0) {
+    // plain, one run of blocks at a time
+    int lblock = cluster * CLUSTER_BLOCKS;
+    int done = 0;
+    while (done < CLUSTER_BLOCKS) {
+      int run, flags;
+      int bnum = extent_lookup(node, lblock + done, &run, &flags);
+      if (run > CLUSTER_BLOCKS - done) {
+        run = CLUSTER_BLOCKS - done;
+      }
+      char *to = buf + (int64_t)done * BLOCK_SIZE;
+      if (bnum == 0 || (flags & EXTENT_UNWRITTEN)) {
+        memset(to, 0, (size_t)run * BLOCK_SIZE);
+      } else if (blocks_read_checked(bnum, 0, to, (size_t)run * BLOCK_SIZE) <
+                 0) {
+        return -EIO;
+      }
+      done += run;
+    }
+    return 0;
+  }
+
+  char *data = malloc((size_t)count * BLOCK_SIZE);
+  assert(data);
+  if (blocks_read_checked(pblock, 0, data, (size_t)count * BLOCK_SIZE) < 0) {
+    free(data);
+    return -EIO;
+  }
+  cluster_header_t hdr = *(cluster_header_t *)data;
+  int n = -1;
+  if (hdr.csize <= (size_t)count * BLOCK_SIZE - sizeof(hdr) &&
+      hdr.size <= cluster_bytes()) {
+    n = lz4_decompress(data + sizeof(hdr), hdr.csize, buf, hdr.size);
+  }
+  free(data);
+
+  if (n < 0 || n != (int)hdr.size) {
+    fprintf(stderr, "nufs: damaged compressed cluster at block %d\n", pblock);
+    return -EIO;
+  }
+  memset(buf + n, 0, cluster_bytes() - n);
+  return 0;
+}
+
+// Store the cluster compressed if that saves a block.
+int cluster_pack(inode_t *node, int cluster, const char *buf) {
+  int64_t start = (int64_t)cluster * cluster_bytes();
+  int64_t size = node->size - start;
+  if (size > cluster_bytes()) {
+    size = cluster_bytes();
+  }
+  int plain = bytes_to_blocks(size);
+  if (plain < 2) {
+    return 0;
+  }
+
+  // it has to come out at least a block smaller than the plain blocks
+  size_t room = (size_t)(plain - 1) * BLOCK_SIZE;
+  char *data = calloc(1, room);
+  assert(data);
+  cluster_header_t *hdr = (cluster_header_t *)data;
+  int csize = lz4_compress(buf, size, hdr + 1, room - sizeof(*hdr));
+  if (csize == 0) {
+    free(data);
+    return 0;
+  }
+  hdr->csize = csize;
+  hdr->size = size;
+  int count = bytes_to_blocks(sizeof(*hdr) + csize);
+
+  // in one run, right after the blocks of the cluster before it
+  int lblock = cluster * CLUSTER_BLOCKS;
+  int prev_count;
+  int goal = cluster > 0 ? cluster_lookup(node, cluster - 1, &prev_count) : 0;
+  if (goal != 0) {
+    goal += prev_count;
+  } else if (lblock > 0) {
+    goal = extent_lookup(node, lblock - 1, NULL, NULL);
+    goal = goal ? goal + 1 : 0;
+  }
+  int got;
+  int bnum = alloc_blocks(goal, count, &got);
+  if (bnum < 0) {
+    free(data);
+    return -ENOSPC;
+  }
+  if (got < count) {
+    // no run long enough is left, plain blocks will do
+    free_blocks(bnum, got);
+    free(data);
+    return 0;
+  }
+  blocks_write(bnum, 0, data, (size_t)count * BLOCK_SIZE);
+  free(data);
+
+  extent_remove(node, lblock, CLUSTER_BLOCKS);
+  if (extent_insert(node, lblock, bnum, count, EXTENT_COMPRESSED) < 0) {
+    free_blocks(bnum, count);
+    return -ENOSPC;
+  }
+  printf("+ cluster %d: %ld bytes packed into %d blocks at %d\n", cluster,
+         (long)size, count, bnum);
+  return 1;
+}
@@ -0,0 +1,62 @@
+// Transparent compression of file data.
+//
+// Files with INODE_COMPRESSED set (see storage_set_flags; files and
+// directories created in a directory that has it inherit it) store their
+// data in clusters of CLUSTER_BLOCKS logical blocks. A cluster that LZ4
+// compresses into at least one block less than it takes plain is kept as a
+// single extent flagged EXTENT_COMPRESSED at the start of the cluster: a
+// cluster_header_t followed by the compressed bytes. The rest of the
+// cluster is left unmapped, so the extent tree still maps every logical
+// block to one physical block and sharing, snapshots and freeing work on
+// compressed extents like on any other.
+//
+// Compressed clusters are never changed in place. Writing into one reads it
+// whole and stores it again, compressed if it still pays, plain otherwise.
+// Clusters that do not compress are stored plain, so a file can mix both,
+// and clearing the flag leaves the clusters already compressed readable.
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+#define CLUSTER_BLOCKS 4
+
+// at the start of the first block of a compressed cluster
+typedef struct cluster_header {
+  uint32_t csize; // bytes of LZ4 data following the header
+  uint32_t size;  // bytes they decompress to, the rest of the cluster is 0
+} cluster_header_t;
+
+// Compress len bytes at src into the LZ4 block format at dst. Returns the
+// compressed size, or 0 if it does not fit in cap bytes.
+int lz4_compress(const void *src, int len, void *dst, int cap);
+
+// Decompress the len bytes of LZ4 data at src into dst. Returns the number
+// of bytes produced, or -1 if the data is damaged or needs more than cap.
+int lz4_decompress(const void *src, int len, void *dst, int cap);
+
+// Return the number of bytes in a cluster.
+int64_t cluster_bytes();
+
+// Return the first physical block of the given cluster of the inode if it
+// is compressed, storing the number of blocks it takes in count (if not
+// NULL), or 0 if it is stored plain.
+int cluster_lookup(inode_t *node, int cluster, int *count);
+
+// Return the first compressed cluster of the inode in [cluster, last), or
+// last if there is none.
+int cluster_next(inode_t *node, int cluster, int last);
+
+// Read the whole cluster into buf (cluster_bytes() long), decompressing it
+// if it is compressed. Holes read as zeros. Returns 0 or -EIO.
+int cluster_read(inode_t *node, int cluster, char *buf);
+
+// Store the part of the cluster at buf that is inside the file compressed
+// in new blocks, replacing whatever backed it before, if that saves at
+// least a block. Returns 1 if it did, 0 if nothing changed, or -ENOSPC.
+int cluster_pack(inode_t *node, int cluster, const char *buf);
+
+#endif
@@ -0,0 +1,295 @@
+// Checksums of the blocks of the image.
+
+#include "csum.h"
+#include "journal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78 // Castagnoli, bit-reversed
+
+// CRC32C of len bytes without the pre- and post-inversion
+typedef uint32_t (*crc_fn)(uint32_t crc, const uint8_t *p, size_t len);
+
+static crc_fn crc_impl;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+// portable version: slicing-by-8, eight table lookups per 8 bytes
+static uint32_t crc_table[8][256];
+
+static uint32_t crc_sw(uint32_t crc, const uint8_t *p, size_t len) {
+  while (len > 0 && ((uintptr_t)p & 7) != 0) {
+    crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    word ^= crc;
+    crc = crc_table[7][word & 0xff] ^ crc_table[6][(word >> 8) & 0xff] ^
+          crc_table[5][(word >> 16) & 0xff] ^ crc_table[4][(word >> 24) & 0xff] ^
+          crc_table[3][(word >> 32) & 0xff] ^ crc_table[2][(word >> 40) & 0xff] ^
+          crc_table[1][(word >> 48) & 0xff] ^ crc_table[0][word >> 56];
+    p += 8;
+    len -= 8;
+  }
+#endif
+  while (len-- > 0) {
+    crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+// a * b modulo the polynomial, both bit-reversed
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+  uint32_t p = 0;
+  for (uint32_t m = 1u << 31; m != 0; m >>= 1) {
+    if (a & m) {
+      p ^= b;
+    }
+    b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+// x^n modulo the polynomial, bit-reversed
+static uint32_t xpow(int n) {
+  uint32_t p = 1u << 31; // x^0
+  while (n-- > 0) {
+    p = p & 1 ? (p >> 1) ^ CRC32C_POLY : p >> 1;
+  }
+  return p;
+}
+
+#if defined(__x86_64__)
+// Each crc32 instruction depends on the one before, so a single stream runs
+// at a third of what the CPU can do. Long buffers are cut into three
+// streams of STRIDE bytes that are worked through side by side, then
+// combined by shifting the earlier ones past the later (a multiplication by
+// x^(8 * STRIDE), with PCLMULQDQ where there is one). Three strides cover a
+// 4K block.
+#define STRIDE 1360
+
+static uint32_t shift_k;  // x^(8 * STRIDE) for multmodp
+static uint32_t shift_k33; // x^(8 * STRIDE - 33) for the carry-less version
+static int has_pclmul = 0;
+
+// the product of two bit-reversed 32 bit values is the 64 bit value of the
+// product times x; crc32 of that multiplies by x^32 and reduces it
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t shift_clmul(uint32_t crc) {
+  __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+                                      _mm_cvtsi32_si128(shift_k33), 0);
+  return _mm_crc32_u64(0, _mm_cvtsi128_si64(prod));
+}
+
+static uint32_t shift(uint32_t crc) {
+  return has_pclmul ? shift_clmul(crc) : multmodp(crc, shift_k);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const uint8_t *p, size_t len) {
+  while (len > 0 && ((uintptr_t)p & 7) != 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+    len--;
+  }
+
+  while (len >= 3 * STRIDE) {
+    uint64_t c0 = crc, c1 = 0, c2 = 0;
+    for (const uint8_t *end = p + STRIDE; p < end; p += 8) {
+      c0 = _mm_crc32_u64(c0, *(const uint64_t *)p);
+      c1 = _mm_crc32_u64(c1, *(const uint64_t *)(p + STRIDE));
+      c2 = _mm_crc32_u64(c2, *(const uint64_t *)(p + 2 * STRIDE));
+    }
+    crc = shift(shift(c0) ^ c1) ^ c2;
+    p += 2 * STRIDE;
+    len -= 3 * STRIDE;
+  }
+
+  uint64_t c = crc;
+  while (len >= 8) {
+    c = _mm_crc32_u64(c, *(const uint64_t *)p);
+    p += 8;
+    len -= 8;
+  }
+  crc = c;
+  while (len-- > 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+static void crc_setup() {
+  for (int n = 0; n < 256; n++) {
+    uint32_t crc = n;
+    for (int k = 0; k < 8; k++) {
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    crc_table[0][n] = crc;
+  }
+  for (int n = 0; n < 256; n++) {
+    uint32_t crc = crc_table[0][n];
+    for (int k = 1; k < 8; k++) {
+      crc = crc_table[0][crc & 0xff] ^ (crc >> 8);
+      crc_table[k][n] = crc;
+    }
+  }
+  crc_impl = crc_sw;
+
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    shift_k = xpow(8 * STRIDE);
+    shift_k33 = xpow(8 * STRIDE - 33);
+    has_pclmul = __builtin_cpu_supports("pclmul");
+    crc_impl = crc_hw;
+  }
+#endif
+}
+
+// Return the CRC32C of len bytes at data, continuing from crc.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+  pthread_once(&crc_once, crc_setup);
+  return ~crc_impl(~crc, data, len);
+}
+
+static int mode = CSUM_OFF;
+static uint32_t zero_sum; // of a block of zeros
+
+static const char *mode_names[] = {"metadata", "off", "full"};
+
+static uint32_t *get_table() {
+  superblock_t *sb = get_superblock();
+  return (uint32_t *)((char *)sb + (size_t)sb->csum_start * BLOCK_SIZE);
+}
+
+// the table and the journal have no checksums of their own
+static int has_sum(int bnum) {
+  superblock_t *sb = get_superblock();
+  if (bnum >= (int)sb->csum_start &&
+      bnum < (int)(sb->csum_start + sb->csum_blocks)) {
+    return 0;
+  }
+  return bnum < (int)sb->journal_start ||
+         bnum >= (int)(sb->journal_start + sb->journal_blocks);
+}
+
+static void set_sum(int bnum, uint32_t sum) {
+  uint32_t *table = get_table();
+  if (table[bnum] != sum) {
+    blocks_dirty_ptr(table + bnum, sizeof(uint32_t));
+    table[bnum] = sum;
+  }
+}
+
+// Pick the mode and check the metadata region.
+void csum_init(const blocks_config_t *conf) {
+  superblock_t *sb = get_superblock();
+  mode = sb->csum_blocks > 0 ? conf->checksum : CSUM_OFF;
+  if (sb->csum_blocks == 0) {
+    return;
+  }
+
+  void *zeros = calloc(1, BLOCK_SIZE);
+  assert(zeros);
+  zero_sum = crc32c(0, zeros, BLOCK_SIZE);
+  free(zeros);
+
+  int checked = 0, bad = 0;
+  if (mode != CSUM_OFF && journal_active()) {
+    // the metadata region, and the tables at the other end of the image
+    uint32_t *table = get_table();
+    uint32_t ranges[][2] = {{0, sb->data_start},
+                            {sb->refcount_start, blocks_tables_end(sb)}};
+    for (int r = 0; r < 2; r++) {
+      for (int b = ranges[r][0]; b < (int)ranges[r][1]; b++) {
+        if (has_sum(b) && table[b] != 0) {
+          bad += csum_verify(b, 1, blocks_get_block(b)) < 0;
+          checked++;
+        }
+      }
+    }
+  }
+  if (bad > 0) {
+    fprintf(stderr, "nufs: %d damaged metadata blocks\n", bad);
+  }
+  printf("+ csum_init: %s checksums, %d metadata blocks checked\n",
+         mode_names[mode], checked);
+}
+
+// Return the mode of the mounted image.
+int csum_mode() { return mode; }
+
+// The count whole blocks starting at bnum were written with the file data.
+void csum_data(int bnum, int count, const void *data) {
+  if (mode != CSUM_FULL) {
+    csum_forget(bnum, count);
+    return;
+  }
+  for (int i = 0; i < count; i++) {
+    set_sum(bnum + i, data ? crc32c(0, (const char *)data + (size_t)i * BLOCK_SIZE,
+                                    BLOCK_SIZE)
+                           : zero_sum);
+  }
+}
+
+// The metadata block is being committed.
+void csum_meta(int bnum, const void *data) {
+  if (get_superblock()->csum_blocks == 0 || !has_sum(bnum)) {
+    return;
+  }
+  set_sum(bnum, mode == CSUM_OFF ? 0 : crc32c(0, data, BLOCK_SIZE));
+}
+
+// The table block committing the metadata block will change.
+int csum_table_block(int bnum) {
+  superblock_t *sb = get_superblock();
+  if (sb->csum_blocks == 0 || !has_sum(bnum) ||
+      (mode == CSUM_OFF && get_table()[bnum] == 0)) {
+    return -1;
+  }
+  return sb->csum_start + bnum / (BLOCK_SIZE / sizeof(uint32_t));
+}
+
+// Forget the checksums of count blocks starting at bnum.
+void csum_forget(int bnum, int count) {
+  if (get_superblock()->csum_blocks == 0) {
+    return;
+  }
+  uint32_t *table = get_table();
+  for (int b = bnum; b < bnum + count; b++) {
+    if (table[b] != 0) {
+      blocks_dirty_ptr(table + b, sizeof(uint32_t));
+      table[b] = 0;
+    }
+  }
+}
+
+// Check the count whole blocks starting at bnum against their checksums.
+int csum_verify(int bnum, int count, const void *data) {
+  if (get_superblock()->csum_blocks == 0) {
+    return 0;
+  }
+  uint32_t *table = get_table();
+  int rv = 0;
+  for (int i = 0; i < count; i++) {
+    uint32_t sum = table[bnum + i];
+    if (sum != 0 &&
+        crc32c(0, (const char *)data + (size_t)i * BLOCK_SIZE, BLOCK_SIZE) != sum) {
+      fprintf(stderr, "nufs: checksum mismatch in block %d\n", bnum + i);
+      rv = -EIO;
+    }
+  }
+  return rv;
+}
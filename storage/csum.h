@@ -0,0 +1,64 @@
+// Checksums of the blocks of the image.
+//
+// Images formatted with a checksum table keep a CRC32C of every block of
+// the image in it, 0 for blocks that have none. The table sits at the end
+// of the image with the reference counts and fingerprints, and moves when
+// it grows. How much of the image is checked is picked when it is mounted
+// (blocks_config_t.checksum):
+//
+//  - CSUM_METADATA, the default: the blocks the journal logs, that is the
+//    superblock, bitmaps, inode and reference count tables and snapshot
+//    list, and the directory and extent blocks. Their checksums are taken
+//    when the transaction changing them commits, so they land in that same
+//    transaction. The metadata region and the tables at the end of the
+//    image are checked when it is mounted, and the other metadata blocks
+//    when they are read in.
+//  - CSUM_FULL: file data too. Its checksums are taken as it is written and
+//    checked whenever storage_read reads it.
+//  - CSUM_OFF: nothing. Blocks that change only lose their checksums, so
+//    that they are not checked against stale ones later.
+//
+// Metadata checksums need the journal; images without one only check file
+// data.
+
+#ifndef CSUM_H
+#define CSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blocks.h"
+
+// Return the CRC32C of len bytes at data, continuing from crc (0 to start).
+// Uses the SSE4.2 instructions where the CPU has them.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+// Pick the mode and check the metadata region. Called by blocks_init once
+// the journal is running.
+void csum_init(const blocks_config_t *conf);
+
+// Return the CSUM_* mode of the mounted image, CSUM_OFF if it has no table.
+int csum_mode();
+
+// The count whole blocks starting at bnum were written with the file data
+// at data (NULL for zeros): take their checksums, or forget them unless the
+// mode is CSUM_FULL.
+void csum_data(int bnum, int count, const void *data);
+
+// The metadata block is being committed with the contents at data: take its
+// checksum, or forget it with CSUM_OFF. Called by the journal.
+void csum_meta(int bnum, const void *data);
+
+// Return the block of the checksum table that committing the metadata
+// block will change, or -1 if there is none. For the journal, which counts
+// it against the room in the transaction as soon as the block joins it.
+int csum_table_block(int bnum);
+
+// Forget the checksums of count blocks starting at bnum.
+void csum_forget(int bnum, int count);
+
+// Check the count whole blocks starting at bnum, read into data, against
+// their checksums. Returns 0 or -EIO.
+int csum_verify(int bnum, int count, const void *data);
+
+#endif
@@ -0,0 +1,278 @@
+// Cache of name lookups in directories.
+
+#include "dcache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "csum.h"
+
+typedef struct dentry {
+  int dir;        // directory holding the name, 0 if the entry is free
+  int inum;       // what the name names, -ENOENT for nothing
+  unsigned gen;   // changes whenever inum does or the entry is reused
+  int referenced; // used since the clock hand last passed
+  int next;       // next entry in the hash chain, -1 at the end
+  char name[DCACHE_NAME_MAX];
+} dentry_t;
+
+typedef struct pentry {
+  int dentry;     // entry of the last name, -1 if the entry is free
+  unsigned gen;   // of that entry when the path was resolved
+  unsigned epoch; // of the cache then
+  int referenced;
+  int next;
+  char path[DCACHE_PATH_MAX];
+} pentry_t;
+
+// a pool of entries of either kind, with its hash table and clock hand
+typedef struct pool {
+  int *buckets;
+  int mask;
+  int hand;
+} pool_t;
+
+static dentry_t *dentries = 0;
+static pentry_t *pentries = 0;
+static pool_t names, paths;
+
+static unsigned next_gen = 0;
+static unsigned epoch = 0;   // bumped when a directory is unlinked or moved
+static unsigned changes = 0; // bumped whenever a directory changes
+
+static long hits = 0, misses = 0;
+
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int pool_init(pool_t *pool, int count) {
+  pool->buckets = malloc(2 * count * sizeof(int));
+  if (!pool->buckets) {
+    return -ENOMEM;
+  }
+  memset(pool->buckets, -1, 2 * count * sizeof(int));
+  pool->mask = 2 * count - 1;
+  pool->hand = 0;
+  return 0;
+}
+
+static int name_hash(int dir, const char *name) {
+  return crc32c(dir, name, strlen(name)) & names.mask;
+}
+
+static int path_hash(const char *path) {
+  return crc32c(0, path, strlen(path)) & paths.mask;
+}
+
+// index of the entry for the name in dir, or -1
+static int find_name(int dir, const char *name) {
+  for (int i = names.buckets[name_hash(dir, name)]; i >= 0;
+       i = dentries[i].next) {
+    if (dentries[i].dir == dir && strcmp(dentries[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int find_path(const char *path) {
+  for (int i = paths.buckets[path_hash(path)]; i >= 0; i = pentries[i].next) {
+    if (strcmp(pentries[i].path, path) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void remove_name(int i) {
+  int *link = &names.buckets[name_hash(dentries[i].dir, dentries[i].name)];
+  while (*link != i) {
+    link = &dentries[*link].next;
+  }
+  *link = dentries[i].next;
+  dentries[i].dir = 0;
+  // the paths ending here are gone with it
+  dentries[i].gen = ++next_gen;
+}
+
+static void remove_path(int i) {
+  int *link = &paths.buckets[path_hash(pentries[i].path)];
+  while (*link != i) {
+    link = &pentries[*link].next;
+  }
+  *link = pentries[i].next;
+  pentries[i].dentry = -1;
+}
+
+// pick an entry of the name pool to reuse
+static int evict_name() {
+  for (;;) {
+    int i = names.hand;
+    names.hand = (names.hand + 1) % DCACHE_ENTRIES;
+    if (dentries[i].dir == 0) {
+      return i;
+    }
+    if (dentries[i].referenced) {
+      dentries[i].referenced = 0;
+      continue;
+    }
+    remove_name(i);
+    return i;
+  }
+}
+
+static int evict_path() {
+  for (;;) {
+    int i = paths.hand;
+    paths.hand = (paths.hand + 1) % DCACHE_PATHS;
+    if (pentries[i].dentry < 0) {
+      return i;
+    }
+    if (pentries[i].referenced) {
+      pentries[i].referenced = 0;
+      continue;
+    }
+    remove_path(i);
+    return i;
+  }
+}
+
+// set what the name in dir names, adding an entry for it if there is none
+static void set_name(int dir, const char *name, int inum) {
+  int i = find_name(dir, name);
+  if (i < 0) {
+    i = evict_name();
+    dentries[i].dir = dir;
+    strcpy(dentries[i].name, name);
+    int b = name_hash(dir, name);
+    dentries[i].next = names.buckets[b];
+    names.buckets[b] = i;
+  }
+  dentries[i].inum = inum;
+  dentries[i].gen = ++next_gen;
+  dentries[i].referenced = 1;
+}
+
+void dcache_init() {
+  dcache_free();
+  dentries = malloc(DCACHE_ENTRIES * sizeof(dentry_t));
+  pentries = malloc(DCACHE_PATHS * sizeof(pentry_t));
+  if (!dentries || !pentries || pool_init(&names, DCACHE_ENTRIES) < 0 ||
+      pool_init(&paths, DCACHE_PATHS) < 0) {
+    perror("nufs: dcache_init");
+    abort();
+  }
+  for (int i = 0; i < DCACHE_ENTRIES; i++) {
+    dentries[i] = (dentry_t){.dir = 0, .next = -1};
+  }
+  for (int i = 0; i < DCACHE_PATHS; i++) {
+    pentries[i] = (pentry_t){.dentry = -1, .next = -1};
+  }
+  hits = misses = 0;
+  printf("+ dcache_init: %d names, %d paths\n", DCACHE_ENTRIES, DCACHE_PATHS);
+}
+
+void dcache_free() {
+  if (!dentries) {
+    return;
+  }
+  printf("+ dcache_free: %ld hits, %ld misses\n", hits, misses);
+  free(dentries);
+  free(pentries);
+  free(names.buckets);
+  free(paths.buckets);
+  dentries = 0;
+  pentries = 0;
+}
+
+int dcache_lookup(int dir, const char *name, int *inum, unsigned *ticket) {
+  pthread_mutex_lock(&dcache_lock);
+  int i = strlen(name) < DCACHE_NAME_MAX ? find_name(dir, name) : -1;
+  if (i >= 0) {
+    hits++;
+    dentries[i].referenced = 1;
+    *inum = dentries[i].inum;
+  } else {
+    misses++;
+    *ticket = changes;
+  }
+  pthread_mutex_unlock(&dcache_lock);
+  return i >= 0;
+}
+
+void dcache_insert(int dir, const char *name, int inum, unsigned ticket) {
+  pthread_mutex_lock(&dcache_lock);
+  // a lookup racing with a change to a directory may have seen it half
+  // done
+  if (ticket == changes && strlen(name) < DCACHE_NAME_MAX) {
+    set_name(dir, name, inum);
+  }
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_update(int dir, const char *name, int inum, int moved) {
+  pthread_mutex_lock(&dcache_lock);
+  changes++;
+  epoch += moved;
+  if (strlen(name) < DCACHE_NAME_MAX) {
+    set_name(dir, name, inum);
+  }
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_forget(int dir) {
+  pthread_mutex_lock(&dcache_lock);
+  changes++;
+  for (int i = 0; i < DCACHE_ENTRIES; i++) {
+    if (dentries[i].dir == dir) {
+      remove_name(i);
+    }
+  }
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+int dcache_path_lookup(const char *path, int *inum, unsigned *ticket) {
+  pthread_mutex_lock(&dcache_lock);
+  int i = strlen(path) < DCACHE_PATH_MAX ? find_path(path) : -1;
+  int found = 0;
+  if (i >= 0 && pentries[i].epoch == epoch &&
+      dentries[pentries[i].dentry].gen == pentries[i].gen) {
+    found = 1;
+    hits++;
+    pentries[i].referenced = 1;
+    dentries[pentries[i].dentry].referenced = 1;
+    *inum = dentries[pentries[i].dentry].inum;
+  } else {
+    misses++;
+    *ticket = changes;
+  }
+  pthread_mutex_unlock(&dcache_lock);
+  return found;
+}
+
+void dcache_path_insert(const char *path, int dir, const char *name,
+                        unsigned ticket) {
+  pthread_mutex_lock(&dcache_lock);
+  int d = -1;
+  if (ticket == changes && strlen(path) < DCACHE_PATH_MAX &&
+      strlen(name) < DCACHE_NAME_MAX) {
+    d = find_name(dir, name);
+  }
+  if (d >= 0) {
+    int i = find_path(path);
+    if (i < 0) {
+      i = evict_path();
+      strcpy(pentries[i].path, path);
+      int b = path_hash(path);
+      pentries[i].next = paths.buckets[b];
+      paths.buckets[b] = i;
+    }
+    pentries[i].dentry = d;
+    pentries[i].gen = dentries[d].gen;
+    pentries[i].epoch = epoch;
+    pentries[i].referenced = 1;
+  }
+  pthread_mutex_unlock(&dcache_lock);
+}
@@ -0,0 +1,55 @@
+// Cache of name lookups in directories.
+//
+// directory_lookup remembers what it finds, and what it does not find, as
+// (directory, name) -> inum entries in a fixed pool reused in CLOCK order,
+// so looking a name up again is a hash probe instead of a walk through the
+// blocks of the directory. directory_put and directory_delete update the
+// entry of the name they change, and a directory that is freed forgets its
+// entries, so nothing cached is ever out of date.
+//
+// tree_lookup caches whole paths too, each pointing at the entry of its
+// last name. A path stays valid while that entry does not change and no
+// directory is unlinked or renamed, which may change what every path going
+// through it resolves to.
+//
+// Snapshots are read without the cache.
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#define DCACHE_ENTRIES 8192 // names cached
+#define DCACHE_PATHS 4096   // paths cached
+#define DCACHE_NAME_MAX 64  // longer names are not cached
+#define DCACHE_PATH_MAX 256 // longer paths are not cached
+
+// Start with an empty cache, for the image being mounted.
+void dcache_init();
+
+// Drop the cache.
+void dcache_free();
+
+// Look the name up in the directory. Returns 1 and sets *inum (to -ENOENT
+// for a name that is known not to be there) if the answer is cached, or 0
+// and a ticket for dcache_insert.
+int dcache_lookup(int dir, const char *name, int *inum, unsigned *ticket);
+
+// Remember what looking the name up found, unless a directory changed
+// since dcache_lookup gave out the ticket.
+void dcache_insert(int dir, const char *name, int inum, unsigned ticket);
+
+// The name in the directory now names inum, or nothing (-ENOENT). moved is
+// set when it named a directory that went away, see above.
+void dcache_update(int dir, const char *name, int inum, int moved);
+
+// Forget the names in the directory, which is being freed.
+void dcache_forget(int dir);
+
+// Look a whole path up, like dcache_lookup.
+int dcache_path_lookup(const char *path, int *inum, unsigned *ticket);
+
+// Remember the path, which ends with the name in the directory and was
+// resolved with what is cached for it now.
+void dcache_path_insert(const char *path, int dir, const char *name,
+                        unsigned ticket);
+
+#endif
@@ -0,0 +1,285 @@
+// Deduplication of file data.
+
+#include "dedup.h"
+#include "bitmap.h"
+#include "csum.h"
+#include "extent.h"
+#include "journal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define PASS_BATCH 64 // blocks the pass looks at per journal operation
+
+// the index: open addressing on the fingerprint, bnum 0 for empty slots;
+// blocks with the same fingerprint get a slot each
+typedef struct index_entry {
+  uint32_t fp;
+  int bnum;
+} index_entry_t;
+
+static index_entry_t *entries = NULL;
+static int index_size = 0; // a power of two
+static int index_count = 0;
+
+static int enabled = 0;
+static pthread_t pass;
+static int passing = 0;
+static int stopping = 0; // read and written inside journal operations
+
+static uint32_t *get_table() {
+  superblock_t *sb = get_superblock();
+  return (uint32_t *)((char *)sb + (size_t)sb->dedup_start * BLOCK_SIZE);
+}
+
+static uint32_t fingerprint(const void *data) {
+  uint32_t fp = crc32c(0, data, BLOCK_SIZE);
+  return fp != 0 ? fp : 1;
+}
+
+static void index_put(uint32_t fp, int bnum) {
+  int mask = index_size - 1;
+  int i = (fp * 2654435761u) & mask;
+  while (entries[i].bnum != 0) {
+    i = (i + 1) & mask;
+  }
+  entries[i].fp = fp;
+  entries[i].bnum = bnum;
+}
+
+static void index_grow() {
+  index_entry_t *old = entries;
+  int old_size = index_size;
+  index_size = index_size ? 2 * index_size : 1024;
+  entries = calloc(index_size, sizeof(index_entry_t));
+  assert(entries);
+  for (int i = 0; i < old_size; i++) {
+    if (old[i].bnum != 0) {
+      index_put(old[i].fp, old[i].bnum);
+    }
+  }
+  free(old);
+}
+
+static void index_add(uint32_t fp, int bnum) {
+  if (2 * (index_count + 1) > index_size) {
+    index_grow();
+  }
+  index_put(fp, bnum);
+  index_count++;
+}
+
+static void index_remove(uint32_t fp, int bnum) {
+  int mask = index_size - 1;
+  int i = (fp * 2654435761u) & mask;
+  while (entries[i].bnum != bnum) {
+    if (entries[i].bnum == 0) {
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+
+  // move later entries of the probe sequence up into the gap, so lookups
+  // never stop short of them
+  int gap = i;
+  for (i = (gap + 1) & mask; entries[i].bnum != 0; i = (i + 1) & mask) {
+    int home = (entries[i].fp * 2654435761u) & mask;
+    if (((i - home) & mask) >= ((i - gap) & mask)) {
+      entries[gap] = entries[i];
+      gap = i;
+    }
+  }
+  entries[gap].bnum = 0;
+  index_count--;
+}
+
+// a block in the index holding the same bytes as data, or 0
+static int index_find(uint32_t fp, const void *data) {
+  if (index_count == 0) {
+    return 0;
+  }
+  char *block = malloc(BLOCK_SIZE);
+  assert(block);
+  int mask = index_size - 1;
+  int found = 0;
+  for (int i = (fp * 2654435761u) & mask; entries[i].bnum != 0;
+       i = (i + 1) & mask) {
+    // the fingerprint only narrows it down, the bytes decide
+    if (entries[i].fp == fp &&
+        blocks_read_checked(entries[i].bnum, 0, block, BLOCK_SIZE) == 0 &&
+        memcmp(block, data, BLOCK_SIZE) == 0) {
+      found = entries[i].bnum;
+      break;
+    }
+  }
+  free(block);
+  return found;
+}
+
+// look at up to PASS_BATCH blocks of the file from lblock on, returns 1
+// when it is done with the file
+static int pass_step(int inum, int *lblock, char *data, int *shared,
+                     int *indexed) {
+  if (!bitmap_get(get_inode_bitmap(), inum)) {
+    return 1;
+  }
+  inode_t *node = get_inode(inum);
+  if (!S_ISREG(node->mode) || (node->flags & INODE_INLINE)) {
+    return 1;
+  }
+
+  uint32_t *table = get_table();
+  int last = bytes_to_blocks(node->size);
+  int seen = 0;
+  while (*lblock < last && seen < PASS_BATCH) {
+    int count, flags;
+    int pblock = extent_lookup(node, *lblock, &count, &flags);
+    if (pblock == 0 || (flags & (EXTENT_UNWRITTEN | EXTENT_COMPRESSED))) {
+      *lblock += count;
+      continue;
+    }
+    seen++;
+    if (table[pblock] == 0 &&
+        blocks_read_checked(pblock, 0, data, BLOCK_SIZE) == 0) {
+      uint32_t fp;
+      int rv = dedup_block(node, *lblock, data, &fp);
+      if (rv > 0) {
+        (*shared)++;
+      } else if (rv == 0) {
+        dedup_add(pblock, fp);
+        (*indexed)++;
+      }
+    }
+    (*lblock)++;
+  }
+  return *lblock >= last;
+}
+
+// go through every file once, a batch of blocks per operation so the file
+// system keeps going meanwhile
+static void *pass_thread(void *arg) {
+  char *data = malloc(BLOCK_SIZE);
+  assert(data);
+  int shared = 0, indexed = 0;
+  int done = 0;
+  for (int inum = 0; !done; inum++) {
+    int lblock = 0;
+    for (int file_done = 0; !file_done && !done;) {
+      journal_begin();
+      done = stopping || inum >= INODE_COUNT;
+      if (!done) {
+        file_done = pass_step(inum, &lblock, data, &shared, &indexed);
+      }
+      journal_end();
+    }
+  }
+  free(data);
+  printf("+ dedup: pass %s, %d blocks shared, %d indexed\n",
+         stopping ? "stopped" : "done", shared, indexed);
+  return NULL;
+}
+
+// Load the index and start the pass.
+void dedup_init(const blocks_config_t *conf) {
+  superblock_t *sb = get_superblock();
+  if (!conf->dedup || conf->snapshot) {
+    return;
+  }
+  if (sb->dedup_blocks == 0 || !journal_active()) {
+    fprintf(stderr, "nufs: dedup needs an image with a dedup table and a "
+                    "journal\n");
+    return;
+  }
+
+  uint32_t *table = get_table();
+  void *bbm = get_blocks_bitmap();
+  for (int b = sb->data_start; b < BLOCK_COUNT; b++) {
+    if (table[b] != 0 && bitmap_get(bbm, b)) {
+      index_add(table[b], b);
+    }
+  }
+  enabled = 1;
+
+  stopping = 0;
+  passing = pthread_create(&pass, NULL, pass_thread, NULL) == 0;
+  printf("+ dedup_init: %d blocks indexed\n", index_count);
+}
+
+// Stop the pass and drop the index.
+void dedup_free() {
+  if (passing) {
+    journal_begin();
+    stopping = 1;
+    journal_end();
+    pthread_join(pass, NULL);
+    passing = 0;
+  }
+  free(entries);
+  entries = NULL;
+  index_size = index_count = 0;
+  enabled = 0;
+}
+
+// Is dedup on for the mounted image?
+int dedup_enabled() { return enabled; }
+
+// Map the block of the file to a block holding the same data if there is
+// one.
+int dedup_block(inode_t *node, int lblock, const void *data, uint32_t *fp) {
+  *fp = fingerprint(data);
+  int bnum = index_find(*fp, data);
+  if (bnum == 0) {
+    return 0;
+  }
+  if (extent_lookup(node, lblock, NULL, NULL) == bnum) {
+    return 1; // that is where it is already
+  }
+  if (blocks_share(bnum, 1) < 0) {
+    return 0; // too many owners, a copy will do
+  }
+
+  // the block it had is freed, unless someone else still has it
+  if (extent_remove(node, lblock, 1) < 0 ||
+      extent_insert(node, lblock, bnum, 1, 0) < 0) {
+    free_block(bnum); // just takes back the new owner
+    return -ENOSPC;
+  }
+  printf("+ dedup: block %d shares block %d\n", lblock, bnum);
+  return 1;
+}
+
+// The data block was written with contents of the given fingerprint.
+void dedup_add(int bnum, uint32_t fp) {
+  if (!enabled) {
+    return;
+  }
+  uint32_t *table = get_table();
+  if (table[bnum] != 0) {
+    index_remove(table[bnum], bnum);
+  }
+  blocks_dirty_ptr(table + bnum, sizeof(uint32_t));
+  table[bnum] = fp;
+  index_add(fp, bnum);
+}
+
+// Forget the fingerprints of count blocks starting at bnum.
+void dedup_forget(int bnum, int count) {
+  if (get_superblock()->dedup_blocks == 0) {
+    return;
+  }
+  uint32_t *table = get_table();
+  for (int b = bnum; b < bnum + count; b++) {
+    if (table[b] != 0) {
+      if (enabled) {
+        index_remove(table[b], b);
+      }
+      blocks_dirty_ptr(table + b, sizeof(uint32_t));
+      table[b] = 0;
+    }
+  }
+}
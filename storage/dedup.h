@@ -0,0 +1,52 @@
+// Deduplication of file data.
+//
+// Images formatted with a dedup table keep a fingerprint of the contents of
+// data blocks in it (their CRC32C, made nonzero), 0 for blocks that have
+// none. Like the checksums, it sits at the end of the image and moves when
+// the image grows. Only blocks of file data that the dedup code saw written
+// get one, and a block forgets it as soon as it is allocated, written or
+// released, so a fingerprint always describes what its block holds.
+//
+// Mounted with -o dedup (blocks_config_t.dedup), the fingerprints are
+// loaded into an index in memory. A whole block written to a file that
+// compares equal to a block in the index then shares that block (see
+// blocks_share) instead of getting one of its own, and writing the shared
+// block later copies it like any other. A background pass goes through the
+// files once per mount and does the same for the blocks written without
+// dedup.
+//
+// The index is only used inside journal operations, which the pass runs in
+// too, so dedup needs the journal.
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+#include "blocks.h"
+#include "inode.h"
+
+// Load the index and start the pass if the image was mounted with dedup.
+// Called by blocks_init once the journal is running.
+void dedup_init(const blocks_config_t *conf);
+
+// Stop the pass and drop the index. Called by blocks_free before the
+// journal stops.
+void dedup_free();
+
+// Is dedup on for the mounted image?
+int dedup_enabled();
+
+// Map the logical block lblock of the file to a block holding the same
+// BLOCK_SIZE bytes as data if the index knows one. Returns 1 if it did, 0
+// if the data has to be written, storing its fingerprint in fp for
+// dedup_add, or -ENOSPC.
+int dedup_block(inode_t *node, int lblock, const void *data, uint32_t *fp);
+
+// The data block bnum was written with contents of the given fingerprint.
+void dedup_add(int bnum, uint32_t fp);
+
+// Forget the fingerprints of count blocks starting at bnum.
+void dedup_forget(int bnum, int count);
+
+#endif
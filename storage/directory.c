@@ -1,5 +1,35 @@
 #include "directory.h"
-#define TOTAL_DIRENTS BLOCK_SIZE / sizeof(dirent_t)
+#include "csum.h"
+#include "dcache.h"
+#include "snapshot.h"
+
+#include <sys/stat.h>
+#define DX_LIMIT (int)((BLOCK_SIZE - sizeof(dx_header_t)) / sizeof(dx_entry_t))
+
+// the index blocks followed to a leaf, the root first
+typedef struct dx_path {
+  int depth;
+  int lblock[2];
+  int pos[2]; // entry followed in each
+} dx_path_t;
+
+// get the number of the block holding the given logical block of the
+// directory
+static int directory_bnum(inode_t *dd, int lblock) {
+  return extent_lookup(dd, lblock, NULL, NULL);
+}
+
+// the number of the directory for the dcache, or -1 if it is not cached
+static int dcache_dir(inode_t *dd) {
+  if (snapshot_viewing() || !S_ISDIR(dd->mode)) {
+    return -1;
+  }
+  return dd - (inode_t *)get_inode_table();
+}
+
+static dx_entry_t *dx_entries(dx_header_t *hdr) {
+  return (dx_entry_t *)(hdr + 1);
+}
 
 // Initializes the root node directory
 void directory_init() {
@@ -9,18 +39,22 @@ void directory_init() {
     printf("root inode already exists\n");
     return;
   }
+  blocks_dirty_ptr(ibm + i / 8, 1);
   bitmap_put(ibm, i, 1);
 
   inode_t* new_dir_inode = get_inode(i);
 
   printf("intializing dir\n");
-  
+
+  inode_dirty(new_dir_inode);
   memset(new_dir_inode, 0, sizeof(inode_t));
   new_dir_inode->mode = 040755;
   new_dir_inode->refs = 1;
   new_dir_inode->size = 0;
-  new_dir_inode->block = alloc_block();
-  new_dir_inode->next_inode = -1;
+  extent_init(new_dir_inode);
+  int bnum = alloc_block();
+  blocks_write(bnum, 0, NULL, BLOCK_SIZE);
+  extent_insert(new_dir_inode, 0, bnum, 1, 0);
   new_dir_inode->atime = time(NULL);
   new_dir_inode->mtime = time(NULL);
 
@@ -28,39 +62,431 @@ void directory_init() {
   directory_put(new_dir_inode, "..", i);
 }
 
+// Hash of a name in the directory index
+uint32_t directory_hash(const char *name) {
+  return crc32c(0, name, strlen(name));
+}
+
+// the last entry of the index block whose range starts at or below hash
+static int dx_search(dx_header_t *hdr, uint32_t hash) {
+  dx_entry_t *entries = dx_entries(hdr);
+  int lo = 0, hi = hdr->count - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (entries[mid].hash <= hash) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+// find the leaf of the indexed directory serving the hash, recording the
+// way there in path
+static int dx_find(inode_t *dd, uint32_t hash, dx_path_t *path) {
+  int lblock = 0;
+  int levels = 0;
+  for (int level = 0; level <= levels; level++) {
+    int bnum = directory_bnum(dd, lblock);
+    dx_header_t *hdr = blocks_get_block(bnum);
+    assert(hdr->magic == DX_MAGIC);
+    if (level == 0) {
+      levels = hdr->levels;
+      assert(levels <= 1);
+    }
+    int pos = dx_search(hdr, hash);
+    path->lblock[level] = lblock;
+    path->pos[level] = pos;
+    path->depth = level + 1;
+    lblock = dx_entries(hdr)[pos].block;
+    blocks_put_block(bnum);
+  }
+  return lblock;
+}
+
+// find the leaf serving the hash of a name
+static int leaf_of(inode_t *dd, uint32_t hash, dx_path_t *path) {
+  if (!(dd->flags & INODE_INDEX)) {
+    return 0;
+  }
+  return dx_find(dd, hash, path);
+}
+
+static dirent_t *dirent_at(void *block, int off) {
+  return (dirent_t *)((char *)block + off);
+}
+
+int dirent_len(const dirent_t *de, int off, int size) {
+  return de->rec_len ? de->rec_len : size - off;
+}
+
+// set the length of the record at off, which is the last one if it runs
+// to the end of the block
+static void set_rec_len(dirent_t *de, int off, int len, int size) {
+  de->rec_len = off + len == size ? 0 : len;
+}
+
+int dirent_add(void *block, int size, const char *name, int len,
+               uint32_t hash, int inum, int type) {
+  int need = DIRENT_SIZE(len);
+  for (int off = 0; off < size;) {
+    dirent_t *de = dirent_at(block, off);
+    int rec = dirent_len(de, off, size);
+    int used = de->inum ? DIRENT_SIZE(de->name_len) : 0;
+    if (rec - used >= need) {
+      // the new record takes the free space after this one
+      if (used) {
+        set_rec_len(de, off, used, size);
+        off += used;
+        de = dirent_at(block, off);
+        set_rec_len(de, off, rec - used, size);
+      }
+      de->inum = inum;
+      de->hash = hash;
+      de->name_len = len;
+      de->type = type;
+      memcpy(de->name, name, len);
+      return off;
+    }
+    off += rec;
+  }
+  return -ENOSPC;
+}
+
+// the offset of the record of the leaf holding name, or -1. *prev gets the
+// offset of the record before it, -1 for the first one.
+static int leaf_find(void *block, const char *name, int len, uint32_t hash,
+                     int *prev) {
+  int last = -1;
+  for (int off = 0; off < BLOCK_SIZE;) {
+    dirent_t *de = dirent_at(block, off);
+    if (de->inum && de->hash == hash && de->name_len == len &&
+        memcmp(de->name, name, len) == 0) {
+      if (prev) {
+        *prev = last;
+      }
+      return off;
+    }
+    last = off;
+    off += dirent_len(de, off, BLOCK_SIZE);
+  }
+  return -1;
+}
+
+// free the record at off, merging it into the one before it
+static void leaf_remove(void *block, int off, int prev) {
+  dirent_t *de = dirent_at(block, off);
+  if (prev < 0) {
+    de->inum = 0;
+    return;
+  }
+  set_rec_len(dirent_at(block, prev), prev,
+              off - prev + dirent_len(de, off, BLOCK_SIZE), BLOCK_SIZE);
+}
+
+// add a zeroed block to the directory at lblock, returns its number or
+// -ENOSPC
+static int directory_grow(inode_t *dd, int lblock) {
+  int bnum = alloc_block();
+  if (bnum < 0) {
+    return -ENOSPC;
+  }
+  blocks_write(bnum, 0, NULL, BLOCK_SIZE);
+  inode_dirty(dd);
+  if (extent_insert(dd, lblock, bnum, 1, 0) < 0) {
+    free_block(bnum);
+    return -ENOSPC;
+  }
+  return bnum;
+}
+
+// add a block to the indexed directory, returning its logical block
+static int dx_grow(inode_t *dd, int *bnum) {
+  int rbnum = directory_bnum(dd, 0);
+  dx_header_t *root = blocks_get_block(rbnum);
+  int lblock = root->blocks;
+  *bnum = directory_grow(dd, lblock);
+  if (*bnum >= 0) {
+    blocks_dirty(rbnum);
+    root->blocks++;
+  }
+  blocks_put_block(rbnum);
+  return *bnum < 0 ? *bnum : lblock;
+}
+
+// insert an entry into the index block at pos
+static void dx_insert(dx_header_t *hdr, int pos, uint32_t hash, int lblock) {
+  assert(hdr->count < hdr->limit);
+  dx_entry_t *entries = dx_entries(hdr);
+  memmove(&entries[pos + 1], &entries[pos],
+          (hdr->count - pos) * sizeof(dx_entry_t));
+  entries[pos] = (dx_entry_t){hash, lblock};
+  hdr->count++;
+}
+
+// the full single block of the directory moves into a leaf of its own and
+// the first block becomes the root of the index
+static int dx_create(inode_t *dd) {
+  printf("indexing directory\n");
+  int bnum = directory_grow(dd, 1);
+  if (bnum < 0) {
+    return bnum;
+  }
+  int rbnum = directory_bnum(dd, 0);
+  void *root = blocks_get_block(rbnum);
+  void *leaf = blocks_get_block(bnum);
+  blocks_dirty(bnum);
+  memcpy(leaf, root, BLOCK_SIZE);
+  blocks_put_block(bnum);
+
+  blocks_dirty(rbnum);
+  memset(root, 0, BLOCK_SIZE);
+  dx_header_t *hdr = root;
+  hdr->magic = DX_MAGIC;
+  hdr->limit = DX_LIMIT;
+  hdr->levels = 0;
+  hdr->blocks = 2;
+  dx_insert(hdr, 0, 0, 1);
+  blocks_put_block(rbnum);
+
+  inode_dirty(dd);
+  dd->flags |= INODE_INDEX;
+  return 0;
+}
+
+// make room for another entry in the index block right above the leaf at
+// the end of path, following it to the block that gets the room
+static int dx_make_room(inode_t *dd, dx_path_t *path) {
+  int pbnum = directory_bnum(dd, path->lblock[path->depth - 1]);
+  dx_header_t *parent = blocks_get_block(pbnum);
+  int full = parent->count == parent->limit;
+  blocks_put_block(pbnum);
+  if (!full) {
+    return 0;
+  }
+
+  int rbnum = directory_bnum(dd, 0);
+  dx_header_t *root = blocks_get_block(rbnum);
+  int levels = root->levels;
+  int room = root->count < root->limit;
+  blocks_put_block(rbnum);
+
+  int bnum, lblock;
+  if (levels == 0) {
+    // the entries of the root move down into an index block, which is then
+    // split like any other
+    lblock = dx_grow(dd, &bnum);
+    if (lblock < 0) {
+      return lblock;
+    }
+    printf("directory index grows a level\n");
+    root = blocks_get_block(rbnum);
+    dx_header_t *node = blocks_get_block(bnum);
+    blocks_dirty(rbnum);
+    blocks_dirty(bnum);
+    memcpy(node, root, BLOCK_SIZE);
+    node->blocks = 0;
+    root->count = 0;
+    root->levels = 1;
+    dx_insert(root, 0, 0, lblock);
+    blocks_put_block(bnum);
+    blocks_put_block(rbnum);
+
+    path->depth = 2;
+    path->lblock[1] = lblock;
+    path->pos[1] = path->pos[0];
+    path->pos[0] = 0;
+    room = 1;
+  }
+  if (!room) {
+    printf("directory index is full\n");
+    return -ENOSPC;
+  }
+
+  // split the index block in half
+  lblock = dx_grow(dd, &bnum);
+  if (lblock < 0) {
+    return lblock;
+  }
+  pbnum = directory_bnum(dd, path->lblock[1]);
+  parent = blocks_get_block(pbnum);
+  dx_header_t *node = blocks_get_block(bnum);
+  blocks_dirty(pbnum);
+  blocks_dirty(bnum);
+  int half = parent->count / 2;
+  node->magic = DX_MAGIC;
+  node->limit = parent->limit;
+  node->count = parent->count - half;
+  memcpy(dx_entries(node), &dx_entries(parent)[half],
+         node->count * sizeof(dx_entry_t));
+  parent->count = half;
+  uint32_t hash = dx_entries(node)[0].hash;
+  blocks_put_block(bnum);
+  blocks_put_block(pbnum);
+
+  root = blocks_get_block(rbnum);
+  blocks_dirty(rbnum);
+  dx_insert(root, path->pos[0] + 1, hash, lblock);
+  blocks_put_block(rbnum);
+  if (path->pos[1] >= half) {
+    path->pos[0]++;
+    path->lblock[1] = lblock;
+    path->pos[1] -= half;
+  }
+  return 0;
+}
+
+// orders records by hash, and names with the same hash by name, which
+// readdir cookies rely on
+static int by_hash(const void *a, const void *b) {
+  const dirent_t *x = *(dirent_t *const *)a;
+  const dirent_t *y = *(dirent_t *const *)b;
+  if (x->hash != y->hash) {
+    return x->hash < y->hash ? -1 : 1;
+  }
+  int len = x->name_len < y->name_len ? x->name_len : y->name_len;
+  int c = memcmp(x->name, y->name, len);
+  return c ? c : x->name_len - y->name_len;
+}
+
+// split the full leaf at the end of path in two at the median hash of its
+// names, by the room they take
+static int dx_split(inode_t *dd, dx_path_t *path, int leaf) {
+  int rv = dx_make_room(dd, path);
+  if (rv < 0) {
+    return rv;
+  }
+
+  int lbnum = directory_bnum(dd, leaf);
+  void *block = blocks_get_block(lbnum);
+  char *copy = malloc(BLOCK_SIZE);
+  memcpy(copy, block, BLOCK_SIZE);
+  dirent_t **all = malloc(BLOCK_SIZE / DIRENT_SIZE(1) * sizeof(dirent_t *));
+  int count = 0, total = 0;
+  for (int off = 0; off < BLOCK_SIZE;) {
+    dirent_t *de = dirent_at(copy, off);
+    if (de->inum) {
+      all[count++] = de;
+      total += DIRENT_SIZE(de->name_len);
+    }
+    off += dirent_len(de, off, BLOCK_SIZE);
+  }
+  qsort(all, count, sizeof(dirent_t *), by_hash);
+
+  int median = 0;
+  for (int bytes = 0; median < count && bytes < total / 2; median++) {
+    bytes += DIRENT_SIZE(all[median]->name_len);
+  }
+  // names with the same hash stay together
+  int mid = median;
+  while (mid < count && all[mid]->hash == all[mid - 1]->hash) {
+    mid++;
+  }
+  if (mid == count) {
+    mid = median < count ? median : count - 1;
+    while (mid > 0 && all[mid]->hash == all[mid - 1]->hash) {
+      mid--;
+    }
+  }
+
+  int bnum;
+  int lblock = mid == 0 ? -ENOSPC : dx_grow(dd, &bnum);
+  if (lblock < 0) {
+    blocks_put_block(lbnum);
+    free(all);
+    free(copy);
+    return lblock;
+  }
+  printf("splitting directory block %d at %08x\n", leaf, all[mid]->hash);
+  void *upper = blocks_get_block(bnum);
+  blocks_dirty(lbnum);
+  blocks_dirty(bnum);
+  memset(block, 0, BLOCK_SIZE);
+  for (int i = 0; i < count; i++) {
+    dirent_t *de = all[i];
+    rv = dirent_add(i < mid ? block : upper, BLOCK_SIZE, de->name,
+                    de->name_len, de->hash, de->inum, de->type);
+    assert(rv >= 0);
+  }
+  blocks_put_block(bnum);
+  blocks_put_block(lbnum);
+
+  int level = path->depth - 1;
+  int pbnum = directory_bnum(dd, path->lblock[level]);
+  dx_header_t *parent = blocks_get_block(pbnum);
+  blocks_dirty(pbnum);
+  dx_insert(parent, path->pos[level] + 1, all[mid]->hash, lblock);
+  blocks_put_block(pbnum);
+  free(all);
+  free(copy);
+  return 0;
+}
+
 // Find the inode of the file in the passed in directory
 int directory_lookup(inode_t* dd, const char* name) {
-  dirent_t* dir_contents = blocks_get_block(dd->block);
+  int dir = dcache_dir(dd);
+  int inum;
+  unsigned ticket;
+  if (dir >= 0 && dcache_lookup(dir, name, &inum, &ticket)) {
+    return inum;
+  }
+
+  dx_path_t path;
+  uint32_t hash = directory_hash(name);
+  int bnum = directory_bnum(dd, leaf_of(dd, hash, &path));
+  void *block = blocks_get_block(bnum);
   printf("directory lookup: %s\n", name);
 
-  for (int i = 0; i < TOTAL_DIRENTS; i++) {
-    if (strcmp(dir_contents[i].name, name) == 0) {
-      printf("returning directory inum: %d\n", dir_contents[i].inum);
-      return dir_contents[i].inum;
-    }
+  int rv = -ENOENT;
+  int off = leaf_find(block, name, strlen(name), hash, NULL);
+  if (off >= 0) {
+    rv = dirent_at(block, off)->inum;
+    printf("returning directory inum: %d\n", rv);
+  }
+  blocks_put_block(bnum);
+  if (rv < 0) {
+    printf("directory lookup failed\n");
   }
-  printf("directory lookup failed\n");
-  return -ENOENT;
+  if (dir >= 0) {
+    dcache_insert(dir, name, rv, ticket);
+  }
+  return rv;
 }
 
 // Looks for the inode at the end of the path passed in
 int tree_lookup(const char* path) {
-  slist_t* file_path = s_explode(path, '/');
-  slist_t* curr_file = file_path;
-  int inode_num = ROOT_INODE;
-  inode_t* root_inode = get_inode(inode_num);
+  int inode_num;
+  unsigned ticket;
+  int cached = !snapshot_viewing();
+  if (cached && dcache_path_lookup(path, &inode_num, &ticket)) {
+    return inode_num < 0 ? -1 : inode_num;
+  }
 
   printf("tree_lookup path: %s\n", path);
 
-  while (curr_file) {
-    if (strcmp(curr_file->data, "") != 0) {
-      inode_t* node = get_inode(inode_num);
-      inode_num = directory_lookup(node, curr_file->data);
-      if (inode_num < 0) {
-        return -1;
-      }
+  path_iter_t it;
+  path_begin(&it, path);
+  char name[DIR_NAME_LENGTH];
+  int dir = -1;
+  inode_num = ROOT_INODE;
+  while (inode_num >= 0 && path_next(&it)) {
+    if (it.len >= DIR_NAME_LENGTH) {
+      return -1;
     }
-    curr_file = curr_file->next;
+    memcpy(name, it.name, it.len);
+    name[it.len] = 0;
+    dir = inode_num;
+    inode_num = directory_lookup(get_inode(dir), name);
+  }
+
+  // a path whose last name is not there is cached too, but not one that
+  // goes through a missing directory
+  if (cached && dir >= 0 && path_last(&it)) {
+    dcache_path_insert(path, dir, name, ticket);
+  }
+  if (inode_num < 0) {
+    return -1;
   }
 
   printf("returning tree lookup num: %d\n", inode_num);
@@ -70,31 +496,95 @@ int tree_lookup(const char* path) {
 // Puts the file and it's inode within the directory
 int directory_put(inode_t* dd, const char* name, int inum) {
   printf("putting dirs: %s\n", name);
-  dirent_t* dir_contents = blocks_get_block(dd->block);
+  int len = strlen(name);
+  if (len >= DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+
+  int dir = dcache_dir(dd);
+  uint32_t hash = directory_hash(name);
+  inode_t *node = get_inode(inum);
+  int type = node ? (node->mode & S_IFMT) >> 12 : 0;
 
-  for (int i = 0; i < TOTAL_DIRENTS; i++) {
-    if (dir_contents[i].filled != 1) {
-      dir_contents[i].inum = inum;
-      strcpy(dir_contents[i].name, name);
-      dir_contents[i].filled = 1;
+  // a full block is split (or the directory indexed) and the put tried
+  // again, which finds room in one of the halves
+  for (;;) {
+    dx_path_t path;
+    int leaf = leaf_of(dd, hash, &path);
+    int bnum = directory_bnum(dd, leaf);
+    void *block = blocks_get_block(bnum);
+    blocks_dirty(bnum);
+    int off = dirent_add(block, BLOCK_SIZE, name, len, hash, inum, type);
+    blocks_put_block(bnum);
+    if (off >= 0) {
+      if (dir >= 0) {
+        dcache_update(dir, name, inum, 0);
+      }
       return 0;
     }
+
+    int rv = (dd->flags & INODE_INDEX) ? dx_split(dd, &path, leaf)
+                                       : dx_create(dd);
+    if (rv < 0) {
+      return rv;
+    }
   }
-  return -1;
 }
 
 // deletes the file name within the passed in directory
 int directory_delete(inode_t* dd, const char* name) {
   printf("deleting dirs\n");
-  dirent_t* dir_contents = blocks_get_block(dd->block);
-  for (int i = 0; i < TOTAL_DIRENTS; i++) {
-    if (strcmp(dir_contents[i].name, name) == 0) {
-      dir_contents[i].filled = 0;
-      return 0;
-    }
+  int dir = dcache_dir(dd);
+  dx_path_t path;
+  uint32_t hash = directory_hash(name);
+  int bnum = directory_bnum(dd, leaf_of(dd, hash, &path));
+  void *block = blocks_get_block(bnum);
+  int rv = -ENOENT;
+  int prev;
+  int off = leaf_find(block, name, strlen(name), hash, &prev);
+  int is_dir = 0;
+  if (off >= 0) {
+    is_dir = dirent_at(block, off)->type == S_IFDIR >> 12;
+    blocks_dirty(bnum);
+    leaf_remove(block, off, prev);
+    rv = 0;
   }
 
-  return -1;
+  blocks_put_block(bnum);
+  if (rv == 0 && dir >= 0) {
+    dcache_update(dir, name, -ENOENT, is_dir);
+  }
+  return rv;
+}
+
+// get the logical blocks of the leaves of the directory in hash order into
+// a malloced array, returns how many there are
+static int directory_leaves(inode_t *dd, int **leaves) {
+  if (!(dd->flags & INODE_INDEX)) {
+    *leaves = malloc(sizeof(int));
+    (*leaves)[0] = 0;
+    return 1;
+  }
+
+  int rbnum = directory_bnum(dd, 0);
+  dx_header_t *root = blocks_get_block(rbnum);
+  *leaves = malloc(root->blocks * sizeof(int));
+  int count = 0;
+  for (int i = 0; i < root->count; i++) {
+    int lblock = dx_entries(root)[i].block;
+    if (root->levels == 0) {
+      (*leaves)[count++] = lblock;
+      continue;
+    }
+    int bnum = directory_bnum(dd, lblock);
+    dx_header_t *node = blocks_get_block(bnum);
+    for (int j = 0; j < node->count; j++) {
+      (*leaves)[count++] = dx_entries(node)[j].block;
+    }
+    blocks_put_block(bnum);
+  }
+  blocks_put_block(rbnum);
+  return count;
 }
 
 // gets an dirent_node struct of each file name at the end of the passed in path
@@ -102,29 +592,112 @@ dirent_node_t *directory_list(const char* path, int inum) {
   printf("listing dirs\n");
   if (path) inum = tree_lookup(path);
   inode_t* dd = get_inode(inum);
-  dirent_t* dir_contents = blocks_get_block(dd->block);
+  int *leaves;
+  int count = directory_leaves(dd, &leaves);
   dirent_node_t* dirents = NULL;
-  for (int i = 0; i < TOTAL_DIRENTS; i++) {
-    if (dir_contents[i].filled == 1) {
-      dirent_node_t* tmp = malloc(sizeof(dirent_node_t));
-      tmp->entry = dir_contents[i];
-      if (!dirents) {
-        dirents = tmp;
-        list_init(&dirents->dirent_list);
+  for (int l = 0; l < count; l++) {
+    int bnum = directory_bnum(dd, leaves[l]);
+    void *block = blocks_get_block(bnum);
+    for (int off = 0; off < BLOCK_SIZE;) {
+      dirent_t *de = dirent_at(block, off);
+      if (de->inum) {
+        dirent_node_t* tmp = malloc(sizeof(dirent_node_t));
+        memcpy(tmp->entry.name, de->name, de->name_len);
+        tmp->entry.name[de->name_len] = 0;
+        tmp->entry.inum = de->inum;
+        tmp->entry.type = de->type;
+        if (!dirents) {
+          dirents = tmp;
+          list_init(&dirents->dirent_list);
+        }
+        else list_add_before(&dirents->dirent_list, &tmp->dirent_list);
       }
-      else list_add_after(&dirents->dirent_list, &tmp->dirent_list);
+      off += dirent_len(de, off, BLOCK_SIZE);
     }
+    blocks_put_block(bnum);
   }
+  free(leaves);
   return dirents;
 }
 
+// the first hash past the leaf at the end of path, or 2^32 past the last
+static uint64_t leaf_end(inode_t *dd, dx_path_t *path) {
+  for (int level = path->depth - 1; level >= 0; level--) {
+    int bnum = directory_bnum(dd, path->lblock[level]);
+    dx_header_t *hdr = blocks_get_block(bnum);
+    int pos = path->pos[level] + 1;
+    // the block may be gone once put back
+    int more = pos < hdr->count;
+    uint64_t end = more ? dx_entries(hdr)[pos].hash : 0;
+    blocks_put_block(bnum);
+    if (more) {
+      return end;
+    }
+  }
+  return (uint64_t)UINT32_MAX + 1;
+}
+
+int directory_readdir(inode_t *dd, off_t cookie, dir_fill_t fill,
+                      void *arg) {
+  uint64_t hash = (uint64_t)cookie >> 31;
+  int rank = cookie & 0x7fffffff;
+  while (hash <= UINT32_MAX) {
+    dx_path_t path;
+    int bnum = directory_bnum(dd, leaf_of(dd, hash, &path));
+    void *block = blocks_get_block(bnum);
+
+    // the records of the leaf from the cookie on, in cookie order
+    dirent_t *order[BLOCK_SIZE / DIRENT_SIZE(1)];
+    int count = 0;
+    for (int off = 0; off < BLOCK_SIZE;) {
+      dirent_t *de = dirent_at(block, off);
+      if (de->inum && de->hash >= hash) {
+        order[count++] = de;
+      }
+      off += dirent_len(de, off, BLOCK_SIZE);
+    }
+    qsort(order, count, sizeof(dirent_t *), by_hash);
+
+    // names with the same hash share the leaf, so their ranks are right
+    int full = 0;
+    for (int i = 0, r = 0; i < count && !full; i++) {
+      dirent_t *de = order[i];
+      r = i > 0 && de->hash == order[i - 1]->hash ? r + 1 : 0;
+      if (de->hash == hash && r < rank) {
+        continue;
+      }
+      char name[DIR_NAME_LENGTH];
+      memcpy(name, de->name, de->name_len);
+      name[de->name_len] = 0;
+      off_t next = (off_t)de->hash << 31 | (r + 1);
+      full = fill(arg, name, de->inum, de->type, next);
+    }
+    blocks_put_block(bnum);
+    if (full || !(dd->flags & INODE_INDEX)) {
+      return 0;
+    }
+    hash = leaf_end(dd, &path);
+    rank = 0;
+  }
+  return 0;
+}
+
 // prints everything inside the passed in directory
 void print_directory(inode_t* dd) {
-  dirent_t* dir_contents = blocks_get_block(dd->block);
+  int *leaves;
+  int count = directory_leaves(dd, &leaves);
   printf("printing directory\n");
-  for (int i = 0; i < TOTAL_DIRENTS; i++) {
-    if (dir_contents[i].filled == 1) {
-      printf("-%s\n", dir_contents[i].name);
+  for (int l = 0; l < count; l++) {
+    int bnum = directory_bnum(dd, leaves[l]);
+    void *block = blocks_get_block(bnum);
+    for (int off = 0; off < BLOCK_SIZE;) {
+      dirent_t *de = dirent_at(block, off);
+      if (de->inum) {
+        printf("-%.*s\n", de->name_len, de->name);
+      }
+      off += dirent_len(de, off, BLOCK_SIZE);
     }
+    blocks_put_block(bnum);
   }
+  free(leaves);
 }
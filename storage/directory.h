@@ -1,54 +1,133 @@
 // Directory manipulation functions.
 //
 // Feel free to use as inspiration.
+//
+// A directory starts out as a single block of entries. When that fills up
+// it gets a hash index (INODE_INDEX): its first block becomes the root of
+// the index, whose entries split the hashes of the names (see
+// directory_hash) into ranges, each served by a leaf block of entries. A
+// full leaf is split in two at the median hash of its names. A full root
+// moves down into an index block of its own and splits from then on, which
+// gives the index a second level, so a lookup reads at most three blocks
+// however big the directory is. Names with the same hash always share a
+// leaf.
+//
+// A block of entries is a chain of variable-length records, each a
+// dirent_t followed by its name and padded to 4 bytes, so short names take
+// little room. rec_len covers the record and the free space after it, up
+// to the next record.
 
 // based on cs3650 starter code
 
 #ifndef DIRECTORY_H
 #define DIRECTORY_H
 
-#define DIR_NAME_LENGTH 48
+#define DIR_NAME_LENGTH 256 // names are up to 255 bytes
 
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 #include "blocks.h"
 #include "inode.h"
 #include "slist.h"
 #include "list.h"
 
+// A record in a block of entries. The last one in the block has rec_len 0
+// and runs to its end, so a block of zeros is one free record.
 typedef struct dirent {
+  uint32_t inum;    // 0 for a free record
+  uint32_t hash;    // directory_hash of the name
+  uint16_t rec_len; // bytes to the next record
+  uint8_t name_len;
+  uint8_t type;     // the S_IFMT bits of the inode's mode >> 12, as DT_*
+  char name[];      // name_len bytes, not terminated
+} dirent_t;
+
+// bytes a record for a name of len bytes takes
+#define DIRENT_SIZE(len) (((int)sizeof(dirent_t) + (len) + 3) & ~3)
+
+#define DX_MAGIC 0x58444e49 // "INDX"
+
+// Starts the root of the index and its index blocks. The entries follow it,
+// sorted by hash.
+typedef struct dx_header {
+  uint32_t magic;
+  uint16_t count;  // entries in use
+  uint16_t limit;  // entries that fit in the block
+  uint16_t levels; // in the root: levels of index blocks below it, 0 or 1
+  uint16_t _reserved;
+  uint32_t blocks; // in the root: logical blocks of the directory
+} dx_header_t;
+
+// Names whose hash is at least hash (and below the hash of the next entry)
+// are found through the given logical block of the directory. The first
+// entry of the root is at hash 0.
+typedef struct dx_entry {
+  uint32_t hash;
+  uint32_t block;
+} dx_entry_t;
+
+// An entry of a directory, as directory_list returns it
+typedef struct dir_entry {
   char name[DIR_NAME_LENGTH];
   int inum;
-  char _reserved[12];
-  int filled;
-} dirent_t;
+  int type; // DT_*
+} dir_entry_t;
 
 typedef struct dirent_node {
-  dirent_t entry;
+  dir_entry_t entry;
   list_entry_t dirent_list;
 } dirent_node_t;
 
 // Initializes the root node directory
 void directory_init();
 
+// Hash of a name in the directory index.
+uint32_t directory_hash(const char *name);
+
+// Bytes the record at offset off of a block of entries of size bytes takes
+// up, with the free space after it.
+int dirent_len(const dirent_t *de, int off, int size);
+
+// Add a record for the name to the block of entries of size bytes. Returns
+// its offset, or -ENOSPC if the block has no room for it.
+int dirent_add(void *block, int size, const char *name, int len,
+               uint32_t hash, int inum, int type);
+
 // Find the inode of the file in the passed in directory
 int directory_lookup(inode_t *dd, const char *name);
 
 // Looks for the inode at the end of the path passed in
 int tree_lookup(const char *path);
 
-// Puts the file and it's inode within the directory
+// Puts the file and it's inode within the directory. Returns 0,
+// -ENAMETOOLONG or -ENOSPC (no free block, or the index is full).
 int directory_put(inode_t *dd, const char *name, int inum);
 
-// deletes the file name within the passed in directory
+// deletes the file name within the passed in directory, returns 0 or
+// -ENOENT
 int directory_delete(inode_t *dd, const char *name);
 
 // gets an dirent_node struct of each file dirent at the end of the passed in path
 dirent_node_t *directory_list(const char *path, int inum);
 
+// Called by directory_readdir for each entry, with the cookie that
+// resumes the listing after it. Returns nonzero to stop there.
+typedef int (*dir_fill_t)(void *arg, const char *name, int inum, int type,
+                          off_t next);
+
+// Lists the entries of the directory from the cookie on (0 for the start)
+// without copying the directory, one leaf at a time. Entries come in the
+// order of their hash and, for names with the same hash, their name. The
+// cookie after an entry is its hash << 31 | (its rank among those names +
+// 1), so it stays valid while other entries come and go.
+int directory_readdir(inode_t *dd, off_t cookie, dir_fill_t fill,
+                      void *arg);
+
 // prints everything inside the passed in directory
 void print_directory(inode_t *dd);
 
@@ -0,0 +1,276 @@
+// Returning freed space to the host.
+
+#include "discard.h"
+#include "bitmap.h"
+#include "journal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// attempts at finding the journal with nothing uncommitted before giving up
+#define TRIM_TRIES 16
+
+typedef struct runs {
+  block_run_t *items;
+  int count;
+  int cap;
+} runs_t;
+
+static int mode = DISCARD_OFF;
+
+// blocks waiting to be punched out, by how far the transaction freeing them
+// has got, and blocks punched out whose bits the next commit clears
+static runs_t queued;  // freed in the running transaction
+static runs_t frozen;  // freed in the transaction being committed
+static runs_t ready;   // committed, for the thread
+static runs_t punched;
+static pthread_mutex_t discard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t worker;
+static int working = 0;
+static int stopping = 0; // under discard_lock
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+static int64_t discarded = 0; // blocks punched out since the mount
+
+static void runs_push(runs_t *r, int bnum, int count) {
+  // blocks are often freed in order
+  if (r->count > 0 &&
+      r->items[r->count - 1].bnum + r->items[r->count - 1].count == bnum) {
+    r->items[r->count - 1].count += count;
+    return;
+  }
+  if (r->count == r->cap) {
+    r->cap = r->cap ? 2 * r->cap : 64;
+    r->items = realloc(r->items, r->cap * sizeof(block_run_t));
+    assert(r->items);
+  }
+  r->items[r->count].bnum = bnum;
+  r->items[r->count].count = count;
+  r->count++;
+}
+
+// append the runs of from to to, leaving from empty
+static void runs_move(runs_t *to, runs_t *from) {
+  for (int i = 0; i < from->count; i++) {
+    runs_push(to, from->items[i].bnum, from->items[i].count);
+  }
+  from->count = 0;
+}
+
+// take the runs of from, leaving it empty
+static runs_t runs_take(runs_t *from) {
+  runs_t r = *from;
+  memset(from, 0, sizeof(runs_t));
+  return r;
+}
+
+static int by_bnum(const void *a, const void *b) {
+  return ((const block_run_t *)a)->bnum - ((const block_run_t *)b)->bnum;
+}
+
+// punch the runs out of the image, neighbours in one go, and hand them over
+// to the next commit
+static void punch(runs_t *r) {
+  if (r->count == 0) {
+    return;
+  }
+  qsort(r->items, r->count, sizeof(block_run_t), by_bnum);
+  int n = 0;
+  for (int i = 0; i < r->count; i++) {
+    block_run_t *last = n > 0 ? &r->items[n - 1] : NULL;
+    if (last && last->bnum + last->count == r->items[i].bnum) {
+      last->count += r->items[i].count;
+    } else {
+      r->items[n++] = r->items[i];
+    }
+  }
+  r->count = n;
+
+  int64_t total = 0;
+  for (int i = 0; i < r->count; i++) {
+    // failing only leaves the space allocated in the image file
+    blocks_punch(r->items[i].bnum, r->items[i].count);
+    total += r->items[i].count;
+  }
+  printf("+ discard: punched out %ld blocks in %d runs\n", (long)total,
+         r->count);
+
+  pthread_mutex_lock(&discard_lock);
+  discarded += total;
+  runs_move(&punched, r);
+  pthread_mutex_unlock(&discard_lock);
+}
+
+static void *discard_thread(void *arg) {
+  pthread_mutex_lock(&discard_lock);
+  while (!stopping) {
+    if (ready.count == 0) {
+      pthread_cond_wait(&wake, &discard_lock);
+      continue;
+    }
+    runs_t r = runs_take(&ready);
+    pthread_mutex_unlock(&discard_lock);
+    punch(&r);
+    free(r.items);
+    pthread_mutex_lock(&discard_lock);
+  }
+  pthread_mutex_unlock(&discard_lock);
+  return NULL;
+}
+
+// Start discarding if the image was mounted with it.
+void discard_init(const blocks_config_t *conf) {
+  mode = conf ? conf->discard : DISCARD_OFF;
+  discarded = 0;
+  stopping = 0;
+  working = 0;
+  if (mode == DISCARD_ASYNC && journal_active()) {
+    working = pthread_create(&worker, NULL, discard_thread, NULL) == 0;
+  }
+  if (mode != DISCARD_OFF) {
+    printf("+ discard_init: %s\n", working ? "async" : "sync");
+  }
+}
+
+// Punch out everything still waiting and stop.
+void discard_free() {
+  if (mode == DISCARD_OFF) {
+    return;
+  }
+  if (working) {
+    pthread_mutex_lock(&discard_lock);
+    stopping = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&discard_lock);
+    pthread_join(worker, NULL);
+    working = 0;
+  }
+  runs_t r = runs_take(&ready);
+  punch(&r);
+  free(r.items);
+
+  // every commit punches out what the one before it freed, and clears the
+  // bits of what was punched out
+  for (int i = 0; i < TRIM_TRIES && journal_active(); i++) {
+    pthread_mutex_lock(&discard_lock);
+    int left = queued.count + frozen.count + punched.count;
+    pthread_mutex_unlock(&discard_lock);
+    if (left == 0) {
+      break;
+    }
+    journal_commit();
+  }
+  printf("+ discard_free: %ld blocks punched out\n", (long)discarded);
+
+  // whatever is left (after failed commits) is only lost space
+  mode = DISCARD_OFF;
+  free(queued.items);
+  free(frozen.items);
+  free(punched.items);
+  memset(&queued, 0, sizeof(runs_t));
+  memset(&frozen, 0, sizeof(runs_t));
+  memset(&punched, 0, sizeof(runs_t));
+}
+
+// The count blocks starting at bnum were freed.
+int discard_queue(int bnum, int count) {
+  if (mode == DISCARD_OFF) {
+    return 0;
+  }
+  if (!journal_active()) {
+    blocks_punch(bnum, count);
+    discarded += count;
+    return 0;
+  }
+  pthread_mutex_lock(&discard_lock);
+  runs_push(&queued, bnum, count);
+  pthread_mutex_unlock(&discard_lock);
+  return 1;
+}
+
+// The journal freezes the running transaction.
+void discard_commit_begin() {
+  if (mode == DISCARD_OFF) {
+    return;
+  }
+  pthread_mutex_lock(&discard_lock);
+  runs_t done = runs_take(&punched);
+  runs_move(&frozen, &queued);
+  pthread_mutex_unlock(&discard_lock);
+
+  // the bits are cleared in the transaction being frozen
+  for (int i = 0; i < done.count; i++) {
+    blocks_release_now(done.items[i].bnum, done.items[i].count);
+  }
+  free(done.items);
+}
+
+// The journal has tried to commit the frozen transaction.
+void discard_commit_end(int rv) {
+  if (mode == DISCARD_OFF) {
+    return;
+  }
+  pthread_mutex_lock(&discard_lock);
+  if (rv < 0) {
+    // the blocks wait for the next commit
+    runs_move(&queued, &frozen);
+    pthread_mutex_unlock(&discard_lock);
+    return;
+  }
+  if (working) {
+    runs_move(&ready, &frozen);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&discard_lock);
+    return;
+  }
+  runs_t r = runs_take(&frozen);
+  pthread_mutex_unlock(&discard_lock);
+  punch(&r);
+  free(r.items);
+}
+
+// Punch out the runs of free blocks among [start, end).
+int64_t discard_range(int start, int end, int min) {
+  int64_t total = 0;
+  int group = BLOCK_SIZE * 8; // the bits of one bitmap block
+  for (int64_t g = start; g < end; g += group) {
+    int group_end = end - g < group ? end : g + group;
+
+    // a block that is free in a transaction that has not committed yet is
+    // still in use after a crash, so only punch with nothing uncommitted
+    int tries = 0;
+    journal_begin();
+    while (!journal_idle()) {
+      journal_end();
+      if (++tries == TRIM_TRIES) {
+        return -EBUSY;
+      }
+      journal_commit();
+      journal_begin();
+    }
+
+    void *bbm = get_blocks_bitmap();
+    int b = g;
+    while (b < group_end) {
+      int first = bitmap_find_zero(bbm, b, group_end);
+      if (first < 0) {
+        break;
+      }
+      b = bitmap_find_one(bbm, first, group_end);
+      if (b - first >= min) {
+        blocks_punch(first, b - first);
+        total += b - first;
+      }
+    }
+    journal_end();
+  }
+
+  printf("+ discard_range(%d, %d, %d): %ld blocks\n", start, end, min,
+         (long)total);
+  return total;
+}
@@ -0,0 +1,50 @@
+// Returning freed space to the host.
+//
+// Mounted with -o discard (blocks_config_t.discard), blocks that are freed
+// are punched out of the image file with fallocate, so a thinly provisioned
+// host gets their space back and copies of the image stay small. With the
+// journal the punching waits until the transaction freeing the blocks has
+// committed: before that a crash brings back the files that used them. The
+// blocks stay allocated in the block bitmap until they are punched, so
+// nothing is written to them meanwhile, and the next commit clears their
+// bits.
+//
+// DISCARD_SYNC punches the blocks as part of the commit. DISCARD_ASYNC
+// leaves that to a background thread, which sorts and merges what each
+// commit freed first. Without the journal blocks are punched as they are
+// freed.
+//
+// Free space can also be discarded on demand, like FITRIM (see
+// discard_range), whether the image was mounted with discard or not.
+
+#ifndef DISCARD_H
+#define DISCARD_H
+
+#include <stdint.h>
+
+#include "blocks.h"
+
+// Start discarding if the image was mounted with it. Called by blocks_init
+// once the journal is running.
+void discard_init(const blocks_config_t *conf);
+
+// Punch out everything still waiting and stop. Called by blocks_free
+// before the journal stops.
+void discard_free();
+
+// The count blocks starting at bnum were freed. Returns 1 if they were
+// queued to be punched out, in which case blocks_release_now is called for
+// them later, or 0 if the caller should clear their bits now.
+int discard_queue(int bnum, int count);
+
+// Called by the journal as it freezes the running transaction (with the
+// journal lock held), and once it has tried to commit it (rv is 0 or
+// -EIO).
+void discard_commit_begin();
+void discard_commit_end(int rv);
+
+// Punch out the runs of at least min free blocks among the blocks
+// [start, end). Returns the number of blocks punched, or a negative errno.
+int64_t discard_range(int start, int end, int min);
+
+#endif
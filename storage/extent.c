@@ -0,0 +1,500 @@
+#include "extent.h"
+#include "blocks.h"
+#include "inode.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// entries of a node start right after its header
+#define leaf_entries(h) ((extent_t *)((h) + 1))
+#define index_entries(h) ((extent_index_t *)((h) + 1))
+
+static extent_header_t *root_of(inode_t *node) { return &node->eh; }
+
+// pin the tree node stored in the given block
+static extent_header_t *node_block(int bnum) {
+  extent_header_t *hdr = blocks_get_block(bnum);
+  assert(hdr->magic == EXTENT_MAGIC);
+  return hdr;
+}
+
+// release a node from node_block; bnum 0 stands for the root in the inode
+static void put_node(int bnum) {
+  if (bnum != 0) {
+    blocks_put_block(bnum);
+  }
+}
+
+// number of entries that fit in a node stored in its own block
+static int block_capacity() {
+  return (BLOCK_SIZE - sizeof(extent_header_t)) / sizeof(extent_t);
+}
+
+// Index of the last entry whose lblock is <= the given block, or -1 if the
+// block comes before every entry. Index and leaf entries share a layout, so
+// this works for both.
+static int find_entry(extent_header_t *hdr, uint32_t lblock) {
+  extent_t *ex = leaf_entries(hdr);
+  int lo = 0, hi = hdr->entries - 1, found = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (ex[mid].lblock <= lblock) {
+      found = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return found;
+}
+
+// Reset the inode to an empty extent tree.
+void extent_init(inode_t *node) {
+  extent_header_t *root = root_of(node);
+  inode_dirty(node);
+  node->blocks = 0;
+  root->magic = EXTENT_MAGIC;
+  root->entries = 0;
+  root->max = EXTENT_ROOT_ENTRIES;
+  root->depth = 0;
+}
+
+// Find the physical block backing the given logical block, or 0 for a hole.
+int extent_lookup(inode_t *node, int lblock, int *count, int *flags) {
+  extent_header_t *hdr = root_of(node);
+  int bnum = 0; // block holding hdr, 0 for the root
+  // first logical block known to be past the node we are searching
+  int64_t limit = INT_MAX;
+
+  while (hdr->depth > 0) {
+    extent_index_t *idx = index_entries(hdr);
+    int i = find_entry(hdr, lblock);
+    if (i < 0) {
+      i = 0;
+    }
+    if (i + 1 < hdr->entries && idx[i + 1].lblock < limit) {
+      limit = idx[i + 1].lblock;
+    }
+    int child = idx[i].child;
+    hdr = node_block(child);
+    put_node(bnum);
+    bnum = child;
+  }
+
+  extent_t *ex = leaf_entries(hdr);
+  int i = find_entry(hdr, lblock);
+  int pblock = 0;
+  int run_flags = 0;
+  if (i >= 0 && lblock < (int64_t)ex[i].lblock + ex[i].len) {
+    int off = lblock - ex[i].lblock;
+    limit = (int64_t)ex[i].lblock + ex[i].len;
+    pblock = ex[i].pblock + off;
+    run_flags = ex[i].flags;
+  } else if (i + 1 < hdr->entries && ex[i + 1].lblock < limit) {
+    // a hole, which lasts until the next extent
+    limit = ex[i + 1].lblock;
+  }
+  put_node(bnum);
+
+  if (count) {
+    *count = limit - lblock;
+  }
+  if (flags) {
+    *flags = run_flags;
+  }
+  return pblock;
+}
+
+// Insert entry at position pos of the node. If the node is full it is split
+// in half and the new right sibling is reported through split_key and
+// split_bnum, to be linked into the parent.
+static int node_add(extent_header_t *hdr, int pos, const extent_t *entry,
+                    uint32_t *split_key, int *split_bnum) {
+  extent_t *ex = leaf_entries(hdr);
+
+  if (hdr->entries < hdr->max) {
+    memmove(&ex[pos + 1], &ex[pos], (hdr->entries - pos) * sizeof(extent_t));
+    ex[pos] = *entry;
+    hdr->entries++;
+    return 0;
+  }
+
+  int bnum = alloc_block();
+  if (bnum < 0) {
+    return -ENOSPC;
+  }
+
+  // lay out all entries including the new one, then deal them out
+  int total = hdr->entries + 1;
+  extent_t *all = malloc(total * sizeof(extent_t));
+  memcpy(all, ex, pos * sizeof(extent_t));
+  all[pos] = *entry;
+  memcpy(&all[pos + 1], &ex[pos], (hdr->entries - pos) * sizeof(extent_t));
+
+  extent_header_t *right = blocks_get_block(bnum);
+  blocks_dirty(bnum);
+  right->magic = EXTENT_MAGIC;
+  right->max = block_capacity();
+  right->depth = hdr->depth;
+
+  int keep = total / 2;
+  hdr->entries = keep;
+  memcpy(ex, all, keep * sizeof(extent_t));
+  right->entries = total - keep;
+  memcpy(leaf_entries(right), &all[keep], right->entries * sizeof(extent_t));
+  free(all);
+
+  printf("+ extent split at depth %d -> block %d\n", hdr->depth, bnum);
+  *split_key = leaf_entries(right)[0].lblock;
+  *split_bnum = bnum;
+  blocks_put_block(bnum);
+  return 0;
+}
+
+// can b be appended to a, on disk and in the file?
+static int can_merge(const extent_t *a, const extent_t *b) {
+  return a->lblock + a->len == b->lblock && a->pblock + a->len == b->pblock &&
+         a->flags == b->flags && a->len + b->len <= EXTENT_MAX_LEN;
+}
+
+// Insert the extent into the subtree rooted at hdr.
+static int insert_rec(extent_header_t *hdr, const extent_t *new_ex,
+                      uint32_t *split_key, int *split_bnum) {
+  *split_bnum = 0;
+
+  if (hdr->depth > 0) {
+    extent_index_t *idx = index_entries(hdr);
+    int i = find_entry(hdr, new_ex->lblock);
+    if (i < 0) {
+      // the new extent becomes the smallest key of the first child
+      i = 0;
+      idx[0].lblock = new_ex->lblock;
+    }
+
+    // the path down to the leaf is assumed to change
+    uint32_t child_key;
+    int child_split;
+    int child = idx[i].child;
+    extent_header_t *child_hdr = node_block(child);
+    blocks_dirty(child);
+    int rv = insert_rec(child_hdr, new_ex, &child_key, &child_split);
+    blocks_put_block(child);
+    if (rv < 0 || child_split == 0) {
+      return rv;
+    }
+
+    extent_index_t link = {.lblock = child_key, .child = child_split};
+    return node_add(hdr, i + 1, (extent_t *)&link, split_key, split_bnum);
+  }
+
+  extent_t *ex = leaf_entries(hdr);
+  int i = find_entry(hdr, new_ex->lblock);
+
+  // extend the previous extent if the new one continues it on disk
+  if (i >= 0) {
+    extent_t *prev = &ex[i];
+    assert(prev->lblock + prev->len <= new_ex->lblock);
+    if (can_merge(prev, new_ex)) {
+      prev->len += new_ex->len;
+
+      // which may close the gap to the next one
+      if (i + 1 < hdr->entries) {
+        extent_t *next = &ex[i + 1];
+        if (can_merge(prev, next)) {
+          prev->len += next->len;
+          memmove(next, next + 1,
+                  (hdr->entries - i - 2) * sizeof(extent_t));
+          hdr->entries--;
+        }
+      }
+      return 0;
+    }
+  }
+
+  // or prepend it to the next extent
+  if (i + 1 < hdr->entries) {
+    extent_t *next = &ex[i + 1];
+    assert(new_ex->lblock + new_ex->len <= next->lblock);
+    if (can_merge(new_ex, next)) {
+      next->lblock = new_ex->lblock;
+      next->pblock = new_ex->pblock;
+      next->len += new_ex->len;
+      return 0;
+    }
+  }
+
+  return node_add(hdr, i + 1, new_ex, split_key, split_bnum);
+}
+
+// Move the contents of the full root into a new block and turn the root
+// into an index pointing at it, adding a level to the tree.
+static int push_down_root(inode_t *node) {
+  extent_header_t *root = root_of(node);
+
+  int bnum = alloc_block();
+  if (bnum < 0) {
+    return -ENOSPC;
+  }
+
+  extent_header_t *child = blocks_get_block(bnum);
+  blocks_dirty(bnum);
+  child->magic = EXTENT_MAGIC;
+  child->entries = root->entries;
+  child->max = block_capacity();
+  child->depth = root->depth;
+  memcpy(leaf_entries(child), leaf_entries(root),
+         root->entries * sizeof(extent_t));
+  uint32_t first = leaf_entries(child)[0].lblock;
+  blocks_put_block(bnum);
+
+  extent_index_t *idx = index_entries(root);
+  idx[0].lblock = first;
+  idx[0].child = bnum;
+  idx[0]._reserved = 0;
+  root->entries = 1;
+  root->depth++;
+
+  printf("+ extent tree depth -> %d\n", root->depth);
+  return 0;
+}
+
+// Map len logical blocks starting at lblock to the physical blocks starting
+// at pblock.
+int extent_insert(inode_t *node, int lblock, int pblock, int len,
+                  int flags) {
+  assert(lblock >= 0 && pblock > 0 && len > 0);
+  inode_dirty(node);
+
+  while (len > 0) {
+    int n = len > EXTENT_MAX_LEN ? EXTENT_MAX_LEN : len;
+    extent_t new_ex = {
+        .lblock = lblock, .len = n, .flags = flags, .pblock = pblock};
+
+    // the root has no sibling to split into, so keep a free slot in it for
+    // a split coming up from below
+    extent_header_t *root = root_of(node);
+    if (root->entries == root->max) {
+      int rv = push_down_root(node);
+      if (rv < 0) {
+        return rv;
+      }
+    }
+
+    uint32_t split_key;
+    int split_bnum;
+    int rv = insert_rec(root, &new_ex, &split_key, &split_bnum);
+    if (rv < 0) {
+      return rv;
+    }
+    assert(split_bnum == 0);
+
+    node->blocks += n;
+    lblock += n;
+    pblock += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void release_run(uint32_t pblock, uint32_t count, int release) {
+  if (release) {
+    free_blocks(pblock, count);
+  }
+}
+
+// Unmap [start, end) from the subtree rooted at hdr, adding the number of
+// data blocks unmapped to freed. The data blocks themselves are only freed
+// if release is set. If the range punches a hole in the middle of an
+// extent, the part after the hole is left in tail for the caller to insert
+// again.
+static void remove_rec(extent_header_t *hdr, int64_t start, int64_t end,
+                       extent_t *tail, uint32_t *freed, int release) {
+  if (hdr->depth > 0) {
+    extent_index_t *idx = index_entries(hdr);
+    int i = 0;
+    while (i < hdr->entries) {
+      int64_t child_end = i + 1 < hdr->entries ? idx[i + 1].lblock : INT64_MAX;
+      if (child_end <= start || (i > 0 && idx[i].lblock >= end)) {
+        i++;
+        continue;
+      }
+
+      int bnum = idx[i].child;
+      extent_header_t *child = node_block(bnum);
+      blocks_dirty(bnum);
+      remove_rec(child, start, end, tail, freed, release);
+      int empty = child->entries == 0;
+      blocks_put_block(bnum);
+      if (empty) {
+        free_block(bnum);
+        memmove(&idx[i], &idx[i + 1],
+                (hdr->entries - i - 1) * sizeof(extent_index_t));
+        hdr->entries--;
+      } else {
+        i++;
+      }
+    }
+    return;
+  }
+
+  extent_t *ex = leaf_entries(hdr);
+  int i = 0;
+  while (i < hdr->entries) {
+    int64_t es = ex[i].lblock;
+    int64_t ee = es + ex[i].len;
+    if (ee <= start || es >= end) {
+      i++;
+      continue;
+    }
+
+    if (start <= es && ee <= end) {
+      // the whole extent goes away
+      release_run(ex[i].pblock, ex[i].len, release);
+      *freed += ex[i].len;
+      memmove(&ex[i], &ex[i + 1], (hdr->entries - i - 1) * sizeof(extent_t));
+      hdr->entries--;
+      continue;
+    }
+
+    if (es < start && ee > end) {
+      // punched out of the middle
+      tail->lblock = end;
+      tail->len = ee - end;
+      tail->pblock = ex[i].pblock + (end - es);
+      tail->flags = ex[i].flags;
+      release_run(ex[i].pblock + (start - es), end - start, release);
+      *freed += end - start;
+      ex[i].len = start - es;
+    } else if (es < start) {
+      // lose the end of the extent
+      release_run(ex[i].pblock + (start - es), ee - start, release);
+      *freed += ee - start;
+      ex[i].len = start - es;
+    } else {
+      // lose the start of the extent
+      release_run(ex[i].pblock, end - es, release);
+      *freed += end - es;
+      ex[i].pblock += end - es;
+      ex[i].len = ee - end;
+      ex[i].lblock = end;
+    }
+    i++;
+  }
+}
+
+// Pull the only child of the root back into the inode while it fits.
+static void collapse_root(inode_t *node) {
+  extent_header_t *root = root_of(node);
+
+  if (root->depth > 0 && root->entries == 0) {
+    // the caller still has the blocks just unmapped to take off the count
+    uint32_t blocks = node->blocks;
+    extent_init(node);
+    node->blocks = blocks;
+    return;
+  }
+
+  while (root->depth > 0 && root->entries == 1) {
+    int bnum = index_entries(root)[0].child;
+    extent_header_t *child = node_block(bnum);
+    if (child->entries > root->max) {
+      blocks_put_block(bnum);
+      return;
+    }
+    root->entries = child->entries;
+    root->depth = child->depth;
+    memcpy(leaf_entries(root), leaf_entries(child),
+           child->entries * sizeof(extent_t));
+    blocks_put_block(bnum);
+    free_block(bnum);
+    printf("+ extent tree depth -> %d\n", root->depth);
+  }
+}
+
+// unmap [lblock, lblock + count), freeing the data blocks if release is set
+static int unmap(inode_t *node, int lblock, int count, int release) {
+  assert(lblock >= 0 && count >= 0);
+  if (count == 0) {
+    return 0;
+  }
+  inode_dirty(node);
+
+  extent_t tail = {0};
+  uint32_t freed = 0;
+  remove_rec(root_of(node), lblock, (int64_t)lblock + count, &tail, &freed,
+             release);
+  collapse_root(node);
+  node->blocks -= freed;
+
+  if (tail.len > 0) {
+    // the tail is still mapped, it just moves to an extent of its own
+    node->blocks -= tail.len;
+    return extent_insert(node, tail.lblock, tail.pblock, tail.len,
+                         tail.flags);
+  }
+  return 0;
+}
+
+// Unmap count logical blocks starting at lblock and free the physical
+// blocks backing them.
+int extent_remove(inode_t *node, int lblock, int count) {
+  return unmap(node, lblock, count, 1);
+}
+
+// Change the flags of the mapped blocks among the count logical blocks
+// starting at lblock.
+int extent_set_flags(inode_t *node, int lblock, int count, int flags) {
+  int64_t end = (int64_t)lblock + count;
+
+  while (lblock < end) {
+    int run, run_flags;
+    int pblock = extent_lookup(node, lblock, &run, &run_flags);
+    if (run > end - lblock) {
+      run = end - lblock;
+    }
+
+    // remap the run with the new flags, keeping its blocks
+    if (pblock != 0 && run_flags != flags) {
+      int rv = unmap(node, lblock, run, 0);
+      if (rv == 0) {
+        rv = extent_insert(node, lblock, pblock, run, flags);
+      }
+      if (rv < 0) {
+        return rv;
+      }
+    }
+    lblock += run;
+  }
+  return 0;
+}
+
+static void print_rec(extent_header_t *hdr, int indent) {
+  if (hdr->depth > 0) {
+    extent_index_t *idx = index_entries(hdr);
+    for (int i = 0; i < hdr->entries; ++i) {
+      printf("%*s[%u..] -> node %u\n", indent, "", idx[i].lblock,
+             idx[i].child);
+      print_rec(node_block(idx[i].child), indent + 2);
+      blocks_put_block(idx[i].child);
+    }
+    return;
+  }
+
+  extent_t *ex = leaf_entries(hdr);
+  for (int i = 0; i < hdr->entries; ++i) {
+    printf("%*s[%u, %u) -> %u%s%s\n", indent, "", ex[i].lblock,
+           ex[i].lblock + ex[i].len, ex[i].pblock,
+           ex[i].flags & EXTENT_UNWRITTEN ? " (unwritten)" : "",
+           ex[i].flags & EXTENT_COMPRESSED ? " (compressed)" : "");
+  }
+}
+
+// Pretty-print the extent tree of the inode.
+void extent_print(inode_t *node) {
+  printf("extent tree (depth %d):\n", root_of(node)->depth);
+  print_rec(root_of(node), 2);
+}
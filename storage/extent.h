@@ -0,0 +1,70 @@
+// Extent tree mapping a file's logical blocks to runs of physical blocks.
+//
+// The root node lives inside the inode. When it fills up, its contents are
+// pushed down into a block of their own and the root becomes an index, so
+// lookups cost one binary search per level of the tree.
+
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stdint.h>
+
+#define EXTENT_MAGIC 0xf30a
+#define EXTENT_ROOT_ENTRIES 16 // entries that fit in the inode
+#define EXTENT_MAX_LEN 0xffff // blocks covered by a single extent
+
+// extent flags
+#define EXTENT_UNWRITTEN 0x1 // blocks are reserved but read as zeros
+#define EXTENT_COMPRESSED 0x2 // a compressed cluster, see compress.h
+
+struct inode;
+
+typedef struct extent_header {
+  uint16_t magic;
+  uint16_t entries; // number of valid entries following the header
+  uint16_t max;     // capacity of this node
+  uint16_t depth;   // 0 = entries are extents, otherwise indexes
+} extent_header_t;
+
+// leaf entry: maps [lblock, lblock + len) to [pblock, pblock + len)
+typedef struct extent {
+  uint32_t lblock;
+  uint16_t len;
+  uint16_t flags; // EXTENT_* flags
+  uint32_t pblock;
+} extent_t;
+
+// interior entry: child holds every extent at or above lblock (up to the
+// next index entry)
+typedef struct extent_index {
+  uint32_t lblock;
+  uint32_t child;
+  uint32_t _reserved;
+} extent_index_t;
+
+// Reset the inode to an empty extent tree.
+void extent_init(struct inode *node);
+
+// Find the physical block backing the given logical block, or 0 for a hole.
+// If count is not NULL, it receives the number of logical blocks starting
+// at lblock that are contiguous on disk with the same flags (or that stay a
+// hole). If flags is not NULL, it receives the flags of the extent.
+int extent_lookup(struct inode *node, int lblock, int *count, int *flags);
+
+// Map len logical blocks starting at lblock to the physical blocks starting
+// at pblock. The logical range must not be mapped yet. Returns 0 or -ENOSPC.
+int extent_insert(struct inode *node, int lblock, int pblock, int len,
+                  int flags);
+
+// Unmap count logical blocks starting at lblock and free the physical
+// blocks backing them. Returns 0 or -ENOSPC.
+int extent_remove(struct inode *node, int lblock, int count);
+
+// Change the flags of the mapped blocks among the count logical blocks
+// starting at lblock. Returns 0 or -ENOSPC.
+int extent_set_flags(struct inode *node, int lblock, int count, int flags);
+
+// Pretty-print the extent tree of the inode.
+void extent_print(struct inode *node);
+
+#endif
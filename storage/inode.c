@@ -1,71 +1,107 @@
 #include "inode.h"
+#include "compress.h"
+#include "dcache.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#define SIZE 64
+// next-fit cursor: allocation resumes where the previous one stopped
+static int next_inode_hint = ROOT_INODE + 1;
 
 // pretty print inode
 void print_inode(inode_t *node) {
-  printf("inode: refs: %d, mode: %d, size: %d, block: %d\n", node->refs,
-         node->mode, node->size, node->block);
+  if (node->flags & INODE_INLINE) {
+    printf("inode: refs: %d, mode: %d, size: %ld, inline\n", node->refs,
+           node->mode, (long)node->size);
+    return;
+  }
+  printf("inode: refs: %d, mode: %d, size: %ld, extents: %d (depth %d)\n",
+         node->refs, node->mode, (long)node->size, node->eh.entries,
+         node->eh.depth);
 }
 
 // get inode at given inum
 inode_t *get_inode(int inum) {
   // make sure inum is within range
-  assert(inum < SIZE);
+  assert(inum >= 0 && inum < INODE_COUNT);
   void *ibm = get_inode_bitmap();
   if (bitmap_get(ibm, inum) == 0) {
     return NULL;
   }
 
   printf("getting inode %d\n", inum);
-  inode_t *inode_ptr = (inode_t *)blocks_get_block(2);
+  inode_t *inode_ptr = (inode_t *)get_inode_table();
   return inode_ptr + inum;
 }
 
+// mark the inode as modified
+void inode_dirty(inode_t *node) { blocks_dirty_ptr(node, sizeof(inode_t)); }
+
 // allocates next free inode, return inum of allocated inode
-int alloc_inode() {
+int alloc_inode(int mode) {
   // get bitmap
   void *ibm = get_inode_bitmap();
 
   printf("trying to allocate\n");
 
-  // find next free space in the inode bitmap
-  for (int i = ROOT_INODE + 1; i < SIZE; i++) {
-    // if inode is free in the bitmap
-    if (bitmap_get(ibm, i) == 0) {
-      // get free inode
-      bitmap_put(ibm, i, 1);
-      inode_t *node = get_inode(i);
-
-      // allocate memory and fields
-      memset(node, 0, sizeof(inode_t));
-      node->refs = 0;
-      node->mode = 010644;
-      node->size = 0;
-      node->block = alloc_block();
-      node->next_inode = -1;
-      node->atime = time(NULL);
-      node->mtime = time(NULL);
-
-      // return inum i
-      printf("allocating inode at %d\n", i);
-      return i;
-    }
-    // else continue
-  }
-  // no free inode is found
-  return -1;
+  // find next free space in the inode bitmap, from the cursor to the end
+  // and then wrapping around
+  if (next_inode_hint >= INODE_COUNT) {
+    next_inode_hint = ROOT_INODE + 1;
+  }
+  int i = bitmap_find_zero(ibm, next_inode_hint, INODE_COUNT);
+  if (i < 0) {
+    i = bitmap_find_zero(ibm, ROOT_INODE + 1, next_inode_hint);
+  }
+  if (i < 0) {
+    // no free inode is found
+    return -1;
+  }
+
+  // everything but regular files starts out with one block
+  int bnum = 0;
+  if (!S_ISREG(mode)) {
+    bnum = alloc_block();
+    if (bnum < 0) {
+      return -1;
+    }
+    blocks_write(bnum, 0, NULL, BLOCK_SIZE);
+  }
+
+  // get free inode
+  blocks_dirty_ptr(ibm + i / 8, 1);
+  bitmap_put(ibm, i, 1);
+  next_inode_hint = i + 1 < INODE_COUNT ? i + 1 : ROOT_INODE + 1;
+  inode_t *node = get_inode(i);
+
+  // allocate memory and fields
+  inode_dirty(node);
+  memset(node, 0, sizeof(inode_t));
+  node->refs = 0;
+  node->mode = mode;
+  node->size = 0;
+  if (bnum) {
+    extent_init(node);
+    extent_insert(node, 0, bnum, 1, 0);
+  } else {
+    node->flags |= INODE_INLINE;
+  }
+  node->atime = time(NULL);
+  node->mtime = time(NULL);
+
+  // return inum i
+  printf("allocating inode at %d\n", i);
+  return i;
 }
 
 // free inode at inum
@@ -79,62 +115,326 @@ void free_inode(int inum) {
   assert(node->refs == 0);
   printf("freeing inode at %d\n", inum);
 
-  // shrink inode and free block, then set the memory at
+  // a new directory may get the number
+  if (S_ISDIR(node->mode)) {
+    dcache_forget(inum);
+  }
+
+  // free every block still mapped, then set the memory at
   // node to 0s
-  shrink_inode(node, node->size);
-  free_block(node->block);
+  if (!(node->flags & INODE_INLINE)) {
+    extent_remove(node, 0, INT_MAX);
+  }
 
+  inode_dirty(node);
   memset(node, 0, sizeof(inode_t));
+  blocks_dirty_ptr(ibm + inum / 8, 1);
   bitmap_put(ibm, inum, 0);
 }
 
-// grow inode by size
-int grow_inode(inode_t *node, int size) {
-  int target_size = node->size + size;
-  printf("growing inode from %d to %d\n", node->size, target_size);
+// move the data of an inline inode out into a block of its own
+static int promote_inode(inode_t *node) {
+  printf("moving inline data out of inode\n");
+
+  if (node->size == 0) {
+    node->flags &= ~INODE_INLINE;
+    extent_init(node);
+    return 0;
+  }
+
+  int bnum = alloc_block();
+  if (bnum < 0) {
+    return -ENOSPC;
+  }
+  blocks_write(bnum, 0, node->inline_data, node->size);
+  blocks_write(bnum, node->size, NULL, BLOCK_SIZE - node->size);
+
+  node->flags &= ~INODE_INLINE;
+  extent_init(node);
+  return extent_insert(node, 0, bnum, 1, 0);
+}
+
+// grow inode by size, leaving a hole that reads as zeros
+int grow_inode(inode_t *node, int64_t size) {
+  int64_t target_size = node->size + size;
+  printf("growing inode from %ld to %ld\n", (long)node->size,
+         (long)target_size);
+  inode_dirty(node);
+
+  if (node->flags & INODE_INLINE) {
+    if (target_size <= INODE_INLINE_SIZE) {
+      memset(node->inline_data + node->size, 0, target_size - node->size);
+      node->size = target_size;
+      return 0;
+    }
+    if (promote_inode(node) < 0) {
+      return -ENOSPC;
+    }
+  }
+
   node->size = target_size;
+  return 0;
+}
+
+// zero the parts of the run of count new blocks at lblock that fall outside
+// the bytes [offset, end) about to be written
+static void zero_edges(int bnum, int lblock, int count, int64_t offset,
+                       int64_t end) {
+  int64_t run_start = (int64_t)lblock * BLOCK_SIZE;
+  int64_t run_end = run_start + (int64_t)count * BLOCK_SIZE;
+  if (offset > run_start) {
+    blocks_write(bnum, 0, NULL, offset - run_start);
+  }
+  if (end < run_end) {
+    blocks_write(bnum, end - run_start, NULL, run_end - end);
+  }
+}
+
+// make sure blocks back the bytes [offset, offset + size) of the inode
+int map_inode(inode_t *node, int64_t offset, int64_t size) {
+  assert(!(node->flags & INODE_INLINE));
+  int64_t end = offset + size;
+  int lblock = offset / BLOCK_SIZE;
+  int last = bytes_to_blocks(end);
 
-  inode_t *pnode = node;
-  while (pnode->size > BLOCK_SIZE) {
-    if (pnode->next_inode == -1) {
-      pnode->next_inode = alloc_inode();
+  // blocks shared with other files are copied before they are written
+  if (unshare_inode(node, offset, size) < 0) {
+    return -ENOSPC;
+  }
+
+  while (lblock < last) {
+    int count, flags;
+    int pblock = extent_lookup(node, lblock, &count, &flags);
+    if (count > last - lblock) {
+      count = last - lblock;
+    }
+    if (pblock != 0) {
+      // preallocated blocks still hold whatever was there before, so clear
+      // what the write does not cover before they start being read
+      if (flags & EXTENT_UNWRITTEN) {
+        zero_edges(pblock, lblock, count, offset, end);
+        if (extent_set_flags(node, lblock, count, 0) < 0) {
+          return -ENOSPC;
+        }
+      }
+      lblock += count;
+      continue;
+    }
+
+    // fill the hole with as few runs as possible, continuing right after
+    // the block before it so the file stays sequential on disk
+    int goal = lblock > 0 ? extent_lookup(node, lblock - 1, NULL, NULL) : 0;
+    int got;
+    int bnum = alloc_blocks(goal ? goal + 1 : 0, count, &got);
+    if (bnum < 0) {
+      return -ENOSPC;
+    }
+    if (extent_insert(node, lblock, bnum, got, 0) < 0) {
+      free_blocks(bnum, got);
+      return -ENOSPC;
     }
-    int sz = pnode->size;
-    pnode = get_inode(pnode->next_inode);
-    pnode->size = sz - BLOCK_SIZE;
+
+    // only the edges of the range can leave part of a new block unwritten
+    zero_edges(bnum, lblock, got, offset, end);
+    lblock += got;
   }
 
   return 0;
 }
 
-// shrink inode by size
-int shrink_inode(inode_t *node, int size) {
-  void *ibm = get_inode_bitmap();
+// reserve blocks for the bytes [offset, offset + size) of the inode without
+// writing them; they read as zeros until written
+int prealloc_inode(inode_t *node, int64_t offset, int64_t size) {
+  if ((node->flags & INODE_INLINE) && promote_inode(node) < 0) {
+    return -ENOSPC;
+  }
 
-  inode_t *pnode = node;
-  while (size < pnode->size - BLOCK_SIZE) {
-    pnode = get_inode(pnode->next_inode);
+  int lblock = offset / BLOCK_SIZE;
+  int last = bytes_to_blocks(offset + size);
+
+  while (lblock < last) {
+    int count;
+    if (extent_lookup(node, lblock, &count, NULL) != 0) {
+      lblock += count;
+      continue;
+    }
+    // the unmapped end of a compressed cluster is not a hole
+    int cluster = lblock / CLUSTER_BLOCKS;
+    if (cluster_lookup(node, cluster, NULL) != 0) {
+      lblock = (cluster + 1) * CLUSTER_BLOCKS;
+      continue;
+    }
+    if (count > last - lblock) {
+      count = last - lblock;
+    }
+
+    int goal = lblock > 0 ? extent_lookup(node, lblock - 1, NULL, NULL) : 0;
+    int got;
+    int bnum = alloc_blocks(goal ? goal + 1 : 0, count, &got);
+    if (bnum < 0) {
+      return -ENOSPC;
+    }
+    if (extent_insert(node, lblock, bnum, got, EXTENT_UNWRITTEN) < 0) {
+      free_blocks(bnum, got);
+      return -ENOSPC;
+    }
+
+    // back the blocks in the image file too, so writing them later cannot
+    // fail for lack of space on the host
+    if (blocks_reserve(bnum, got) < 0) {
+      return -ENOSPC;
+    }
+    lblock += got;
   }
 
-  int inum_to_del = pnode->next_inode;
-  pnode->next_inode = -1;
+  return 0;
+}
+
+// shrink inode by size, freeing the blocks past the new end
+int shrink_inode(inode_t *node, int64_t size) {
+  int64_t target_size = node->size - size;
+  assert(target_size >= 0);
+  printf("shrinking inode from %ld to %ld\n", (long)node->size,
+         (long)target_size);
+  inode_dirty(node);
+
+  if (node->flags & INODE_INLINE) {
+    memset(node->inline_data + target_size, 0, node->size - target_size);
+    node->size = target_size;
+    return 0;
+  }
+
+  // an emptied regular file goes back to storing its data inline
+  if (target_size == 0 && S_ISREG(node->mode)) {
+    extent_remove(node, 0, INT_MAX);
+    memset(node->inline_data, 0, INODE_INLINE_SIZE);
+    node->flags |= INODE_INLINE;
+    node->size = 0;
+    return 0;
+  }
+
+  int keep = bytes_to_blocks(target_size);
+  extent_remove(node, keep, INT_MAX - keep);
+
+  // clear the tail of the last block so growing again reads zeros
+  int tail = target_size % BLOCK_SIZE;
+  if (tail != 0 && unshare_inode(node, target_size, 1) < 0) {
+    return -ENOSPC;
+  }
+  if (tail != 0) {
+    int flags;
+    int bnum = extent_lookup(node, keep - 1, NULL, &flags);
+    if (bnum != 0 && !(flags & EXTENT_UNWRITTEN)) {
+      blocks_write(bnum, tail, NULL, BLOCK_SIZE - tail);
+    }
+  }
+
+  node->size = target_size;
+  return 0;
+}
 
-  inode_t *to_del = get_inode(inum_to_del);
-  while (inum_to_del > 0) {
-    bitmap_put(ibm, inum_to_del, 0);
-    free_block(to_del->block);
-    inum_to_del = to_del->next_inode;
-    memset(to_del, 0, sizeof(inode_t));
+// give the inode its own copy of the shared blocks in [offset, offset + size)
+int unshare_inode(inode_t *node, int64_t offset, int64_t size) {
+  if ((node->flags & INODE_INLINE) || !blocks_can_share()) {
+    return 0;
   }
 
-  int target_size = node->size - size;
-  printf("shrinking inode from %d to %d\n", node->size, target_size);
+  int lblock = offset / BLOCK_SIZE;
+  int last = bytes_to_blocks(offset + size);
+  char *buf = NULL;
+
+  while (lblock < last) {
+    int count, flags, shared = 0;
+    int pblock = extent_lookup(node, lblock, &count, &flags);
+    if (count > last - lblock) {
+      count = last - lblock;
+    }
+    if (pblock != 0) {
+      count = blocks_shared_run(pblock, count, &shared);
+    }
+    if (!shared) {
+      lblock += count;
+      continue;
+    }
+
+    int goal = lblock > 0 ? extent_lookup(node, lblock - 1, NULL, NULL) : 0;
+    int got;
+    int bnum = alloc_blocks(goal ? goal + 1 : 0, count, &got);
+    if (bnum < 0) {
+      free(buf);
+      return -ENOSPC;
+    }
+
+    // unwritten blocks read as zeros whatever they hold, so only written
+    // ones need copying
+    if (!(flags & EXTENT_UNWRITTEN)) {
+      if (buf == NULL) {
+        buf = malloc(BLOCK_SIZE);
+        assert(buf);
+      }
+      for (int i = 0; i < got; i++) {
+        blocks_read(pblock + i, 0, buf, BLOCK_SIZE);
+        blocks_write(bnum + i, 0, buf, BLOCK_SIZE);
+      }
+    }
+
+    // dropping the shared blocks only takes this file off their owners
+    extent_remove(node, lblock, got);
+    if (extent_insert(node, lblock, bnum, got, flags) < 0) {
+      free_blocks(bnum, got);
+      free(buf);
+      return -ENOSPC;
+    }
+    printf("+ unshared %d blocks at %d: %d -> %d\n", got, lblock, pblock,
+           bnum);
+    lblock += got;
+  }
+
+  free(buf);
+  return 0;
+}
+
+// share the blocks behind len bytes of src with dst
+int clone_inode(inode_t *dst, int64_t dst_off, inode_t *src, int64_t src_off,
+                int64_t len) {
+  assert(!(src->flags & INODE_INLINE) && blocks_can_share());
+  assert(dst_off % BLOCK_SIZE == 0 && src_off % BLOCK_SIZE == 0);
+  printf("cloning %ld bytes from %ld to %ld\n", (long)len, (long)src_off,
+         (long)dst_off);
+  inode_dirty(dst);
+
+  if ((dst->flags & INODE_INLINE) && promote_inode(dst) < 0) {
+    return -ENOSPC;
+  }
+
+  // whatever the destination had there is replaced
+  int first = dst_off / BLOCK_SIZE;
+  int count = bytes_to_blocks(len);
+  extent_remove(dst, first, count);
+
+  int lblock = src_off / BLOCK_SIZE;
+  int end = lblock + count;
+  while (lblock < end) {
+    int run, flags;
+    int pblock = extent_lookup(src, lblock, &run, &flags);
+    if (run > end - lblock) {
+      run = end - lblock;
+    }
+    if (pblock != 0) {
+      if (blocks_share(pblock, run) < 0) {
+        return -EMLINK;
+      }
+      int at = first + (lblock - src_off / BLOCK_SIZE);
+      if (extent_insert(dst, at, pblock, run, flags) < 0) {
+        free_blocks(pblock, run); // just takes back the new owners
+        return -ENOSPC;
+      }
+    }
+    lblock += run;
+  }
 
-  pnode = node;
-  pnode->size = target_size;
-  while (pnode->next_inode != -1) {
-    pnode = get_inode(pnode->next_inode);
-    pnode->size -= size;
+  if (dst_off + len > dst->size) {
+    dst->size = dst_off + len;
   }
   return 0;
 }
@@ -7,21 +7,39 @@
 #ifndef INODE_H
 #define INODE_H
 
+#include <stdint.h>
 #include <time.h>
 
 #include "bitmap.h"
 #include "blocks.h"
+#include "extent.h"
 
 #define ROOT_INODE 1
 
+// inode flags
+#define INODE_INLINE 0x1 // file data is stored in inline_data, not in blocks
+#define INODE_COMPRESSED 0x2 // new file data is compressed, see compress.h
+#define INODE_INDEX 0x4 // a directory with a hash index, see directory.h
+
+// files up to this many bytes are kept inside the inode
+#define INODE_INLINE_SIZE 208
+
 typedef struct inode {
   int refs;   // reference count
   int mode;   // permission & type
-  int size;   // bytes
-  int block;  // single block pointer (if max file size <= 4K)
-  int next_inode;  // indirect blocks (inode list)
+  int64_t size;   // bytes
   time_t atime;
   time_t mtime;
+  int flags;  // INODE_* flags
+  uint32_t blocks;  // number of data blocks mapped (holes don't count)
+  char _reserved[8];
+  union {
+    struct {
+      extent_header_t eh;  // root of the extent tree mapping the file's blocks
+      extent_t extents[EXTENT_ROOT_ENTRIES];  // extent_index_t when eh.depth > 0
+    };
+    char inline_data[INODE_INLINE_SIZE];  // when flags has INODE_INLINE
+  };
 } inode_t;
 
 // pretty print inode
@@ -30,16 +48,43 @@ void print_inode(inode_t *node);
 // get inode at given inum
 inode_t *get_inode(int inum);
 
-// allocates next free inode, return inum of allocated inode
-int alloc_inode();
+// mark the inode as modified, see blocks_dirty_ptr
+void inode_dirty(inode_t *node);
+
+// allocates next free inode for an object of the given mode, return inum
+// of allocated inode. Regular files start out inline, other objects get
+// their first block right away.
+int alloc_inode(int mode);
 
 // free inode at inum
 void free_inode(int inum);
 
-// grow inode by size
-int grow_inode(inode_t *node, int size);
+// grow inode by size. The new bytes are a hole that reads as zeros until
+// they are written.
+int grow_inode(inode_t *node, int64_t size);
+
+// make sure blocks back the bytes [offset, offset + size) of the inode,
+// which the caller is about to overwrite. The rest of any new block is
+// zeroed.
+int map_inode(inode_t *node, int64_t offset, int64_t size);
+
+// reserve blocks for the bytes [offset, offset + size) of the inode, marked
+// unwritten so they read as zeros. Returns 0 or -ENOSPC.
+int prealloc_inode(inode_t *node, int64_t offset, int64_t size);
+
+// shrink inode by size, freeing the blocks past the new end
+int shrink_inode(inode_t *node, int64_t size);
+
+// give the inode its own copy of any block backing the bytes
+// [offset, offset + size) that it shares with other files, before they are
+// modified in place. Returns 0 or -ENOSPC.
+int unshare_inode(inode_t *node, int64_t offset, int64_t size);
 
-// shrink inode by size
-int shrink_inode(inode_t *node, int size);
+// map the len bytes at dst_off of dst to the blocks backing the bytes at
+// src_off of src, which must not be inline, sharing them instead of copying.
+// The offsets are block aligned, as is len unless it ends at the end of src.
+// Returns 0, -ENOSPC or -EMLINK.
+int clone_inode(inode_t *dst, int64_t dst_off, inode_t *src, int64_t src_off,
+                int64_t len);
 
 #endif
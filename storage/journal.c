@@ -0,0 +1,809 @@
+// Write-ahead metadata journal.
+
+#define _GNU_SOURCE
+#include "csum.h"
+#include "discard.h"
+#include "journal.h"
+#include "snapshot.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JBUF_BUCKETS 4096
+
+// a metadata block known to the journal
+typedef struct jbuf {
+  int bnum;
+  void *data;        // owned, unless the block is in the mapped metadata
+  int pins;          // users between journal_get_block and put
+  int in_txn;        // modified in the running transaction
+  int pending;       // committed copies waiting for a checkpoint
+  struct jbuf *next; // hash chain
+} jbuf_t;
+
+// a committed copy of a block, waiting to be written home
+typedef struct jcopy {
+  int bnum; // -1 once revoked
+  void *data;
+} jcopy_t;
+
+// growable array of block numbers
+typedef struct bvec {
+  int *items;
+  int count;
+  int cap;
+} bvec_t;
+
+static int journal_fd = -1;
+static superblock_t *meta = 0; // the privately mapped metadata region
+static int active = 0;
+
+static uint32_t log_start; // image block of the first log block
+static uint32_t log_size;  // number of log blocks
+static uint32_t head;      // next log block to write
+static uint32_t used;      // log blocks holding transactions
+static uint64_t sequence;  // of the running transaction
+static uint64_t logged;    // sequence of the next transaction in the log
+static uint32_t max_entries; // block numbers that fit in a descriptor
+
+// the running transaction
+static jbuf_t *buckets[JBUF_BUCKETS];
+static bvec_t txn_blocks;
+static bvec_t txn_revoked;
+static bvec_t txn_deferred; // freed blocks to release once committed
+
+// committed since the last checkpoint
+static jcopy_t *pending = 0;
+static int pending_count = 0, pending_cap = 0;
+
+// journal_lock protects the buffers, the running transaction and the
+// pending copies, and is held through operations. commit_lock serializes
+// commits and checkpoints (and protects the log position), which do their
+// I/O without holding journal_lock.
+static pthread_mutex_t journal_lock;
+static int depth = 0; // nesting of journal_begin, under journal_lock
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t committer;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static int stopping = 0;
+static int commit_interval = JOURNAL_DEFAULT_COMMIT;
+static int commit_error = 0; // result of the last commit, under commit_lock
+
+static void bvec_push(bvec_t *v, int item) {
+  if (v->count == v->cap) {
+    v->cap = v->cap ? 2 * v->cap : 64;
+    v->items = realloc(v->items, v->cap * sizeof(int));
+    assert(v->items);
+  }
+  v->items[v->count++] = item;
+}
+
+static void bvec_free(bvec_t *v) {
+  free(v->items);
+  memset(v, 0, sizeof(*v));
+}
+
+// FNV-1a, enough to tell a torn transaction from a complete one
+static uint32_t checksum(uint32_t sum, const void *data, size_t len) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < len; i++) {
+    sum = (sum ^ bytes[i]) * 16777619u;
+  }
+  return sum;
+}
+
+#define CHECKSUM_SEED 2166136261u
+
+// Write an empty journal header into the given block.
+void journal_format(void *block, uint64_t sequence) {
+  journal_header_t *jh = block;
+  memset(jh, 0, sizeof(*jh));
+  jh->hdr.magic = JOURNAL_MAGIC;
+  jh->hdr.type = JOURNAL_HEADER;
+  jh->hdr.sequence = sequence;
+  jh->start = 0;
+}
+
+static int read_block(int fd, uint32_t bnum, void *buf, int block_size) {
+  off_t off = (off_t)bnum * block_size;
+  return pread(fd, buf, block_size, off) == block_size ? 0 : -1;
+}
+
+static int write_block(int fd, uint32_t bnum, const void *buf,
+                       int block_size) {
+  off_t off = (off_t)bnum * block_size;
+  return pwrite(fd, buf, block_size, off) == block_size ? 0 : -1;
+}
+
+// does the log block hold a journal block of the given type and sequence?
+static int is_block(const void *buf, uint32_t type, uint64_t seq) {
+  const journal_block_t *jb = buf;
+  return jb->magic == JOURNAL_MAGIC && jb->type == type && jb->sequence == seq;
+}
+
+// Scan the log from its start, calling apply for every complete
+// transaction. Returns the number of transactions found and leaves the
+// position and sequence after the last one in pos and seq.
+static int scan_log(int fd, const superblock_t *sb, uint32_t *pos,
+                    uint64_t *seq,
+                    void (*apply)(int fd, const superblock_t *sb,
+                                  journal_descriptor_t *jd, uint32_t pos)) {
+  int bs = sb->block_size;
+  uint32_t first = sb->journal_start + 1;
+  uint32_t size = sb->journal_blocks - 1;
+  uint32_t entries = (bs - sizeof(journal_descriptor_t)) / sizeof(uint32_t);
+  char *desc = malloc(bs);
+  char *buf = malloc(bs);
+  int found = 0;
+  uint32_t scanned = 0;
+
+  while (scanned < size) {
+    if (read_block(fd, first + *pos, desc, bs) < 0 ||
+        !is_block(desc, JOURNAL_DESCRIPTOR, *seq)) {
+      break;
+    }
+    journal_descriptor_t *jd = (journal_descriptor_t *)desc;
+    if (jd->count + jd->revoked > entries || scanned + jd->count + 2 > size) {
+      break;
+    }
+
+    // the commit block vouches for everything before it
+    uint32_t sum = checksum(CHECKSUM_SEED, desc, bs);
+    for (uint32_t i = 0; i < jd->count; i++) {
+      read_block(fd, first + (*pos + 1 + i) % size, buf, bs);
+      sum = checksum(sum, buf, bs);
+    }
+    if (read_block(fd, first + (*pos + 1 + jd->count) % size, buf, bs) < 0 ||
+        !is_block(buf, JOURNAL_COMMIT, *seq) ||
+        ((journal_commit_t *)buf)->checksum != sum) {
+      break;
+    }
+
+    if (apply) {
+      apply(fd, sb, jd, *pos);
+    }
+    found++;
+    scanned += jd->count + 2;
+    *pos = (*pos + jd->count + 2) % size;
+    (*seq)++;
+  }
+
+  free(desc);
+  free(buf);
+  return found;
+}
+
+// a revocation seen while replaying: the block and the transaction it is in
+typedef struct revoke {
+  int bnum;
+  uint64_t seq;
+} revoke_t;
+
+static revoke_t *replay_revoked = 0;
+static int replay_revoked_count = 0, replay_revoked_cap = 0;
+
+static void collect_revoked(int fd, const superblock_t *sb,
+                            journal_descriptor_t *jd, uint32_t pos) {
+  for (uint32_t i = 0; i < jd->revoked; i++) {
+    if (replay_revoked_count == replay_revoked_cap) {
+      replay_revoked_cap = replay_revoked_cap ? 2 * replay_revoked_cap : 64;
+      replay_revoked =
+          realloc(replay_revoked, replay_revoked_cap * sizeof(revoke_t));
+      assert(replay_revoked);
+    }
+    revoke_t r = {jd->bnums[jd->count + i], jd->hdr.sequence};
+    replay_revoked[replay_revoked_count++] = r;
+  }
+}
+
+// was bnum revoked by this transaction or a later one?
+static int is_revoked(int bnum, uint64_t seq) {
+  for (int i = 0; i < replay_revoked_count; i++) {
+    if (replay_revoked[i].bnum == bnum && replay_revoked[i].seq >= seq) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void apply_txn(int fd, const superblock_t *sb,
+                      journal_descriptor_t *jd, uint32_t pos) {
+  int bs = sb->block_size;
+  uint32_t first = sb->journal_start + 1;
+  uint32_t size = sb->journal_blocks - 1;
+  char *buf = malloc(bs);
+
+  printf("+ journal: replaying transaction %lu (%u blocks)\n",
+         (unsigned long)jd->hdr.sequence, jd->count);
+  for (uint32_t i = 0; i < jd->count; i++) {
+    if (is_revoked(jd->bnums[i], jd->hdr.sequence)) {
+      continue;
+    }
+    read_block(fd, first + (pos + 1 + i) % size, buf, bs);
+    write_block(fd, jd->bnums[i], buf, bs);
+  }
+  free(buf);
+}
+
+// Count the committed transactions in the journal.
+int journal_pending(int fd, const superblock_t *sb) {
+  if (sb->journal_blocks == 0) {
+    return 0;
+  }
+
+  int bs = sb->block_size;
+  journal_header_t *jh = malloc(bs);
+  int found = -1;
+  if (read_block(fd, sb->journal_start, jh, bs) == 0 &&
+      is_block(jh, JOURNAL_HEADER, jh->hdr.sequence)) {
+    uint32_t pos = jh->start;
+    uint64_t seq = jh->hdr.sequence;
+    found = scan_log(fd, sb, &pos, &seq, NULL);
+  }
+  free(jh);
+  return found;
+}
+
+// Replay the committed transactions in the journal.
+int journal_replay(int fd, const superblock_t *sb) {
+  if (sb->journal_blocks == 0) {
+    return 0;
+  }
+
+  int bs = sb->block_size;
+  journal_header_t *jh = malloc(bs);
+  if (read_block(fd, sb->journal_start, jh, bs) < 0 ||
+      !is_block(jh, JOURNAL_HEADER, jh->hdr.sequence)) {
+    free(jh);
+    return -1;
+  }
+
+  // find the revocations first, they cancel earlier copies of a block
+  uint32_t pos = jh->start;
+  uint64_t seq = jh->hdr.sequence;
+  int found = scan_log(fd, sb, &pos, &seq, collect_revoked);
+
+  if (found > 0) {
+    pos = jh->start;
+    seq = jh->hdr.sequence;
+    scan_log(fd, sb, &pos, &seq, apply_txn);
+    if (fdatasync(fd) < 0) {
+      found = -1;
+    }
+
+    // the log is empty now
+    journal_format(jh, seq);
+    jh->start = pos;
+    if (write_block(fd, sb->journal_start, jh, bs) < 0 || fdatasync(fd) < 0) {
+      found = -1;
+    }
+  }
+
+  free(replay_revoked);
+  replay_revoked = 0;
+  replay_revoked_count = replay_revoked_cap = 0;
+  free(jh);
+  return found;
+}
+
+static jbuf_t *find(int bnum) {
+  for (jbuf_t *j = buckets[bnum % JBUF_BUCKETS]; j; j = j->next) {
+    if (j->bnum == bnum) {
+      return j;
+    }
+  }
+  return NULL;
+}
+
+static int is_meta(int bnum) { return blocks_is_meta(bnum); }
+
+static jbuf_t *add(int bnum) {
+  jbuf_t *j = calloc(1, sizeof(jbuf_t));
+  assert(j);
+  j->bnum = bnum;
+  if (is_meta(bnum)) {
+    j->data = (char *)meta + (size_t)bnum * BLOCK_SIZE;
+  } else {
+    j->data = malloc(BLOCK_SIZE);
+    assert(j->data);
+    int rv = blocks_read(bnum, 0, j->data, BLOCK_SIZE);
+    assert(rv == 0);
+    // a damaged block is reported, but there is nothing better to use
+    if (csum_mode() != CSUM_OFF) {
+      csum_verify(bnum, 1, j->data);
+    }
+  }
+  j->next = buckets[bnum % JBUF_BUCKETS];
+  buckets[bnum % JBUF_BUCKETS] = j;
+  return j;
+}
+
+static void drop(jbuf_t *j) {
+  jbuf_t **link = &buckets[j->bnum % JBUF_BUCKETS];
+  while (*link != j) {
+    link = &(*link)->next;
+  }
+  *link = j->next;
+  if (!is_meta(j->bnum)) {
+    free(j->data);
+  }
+  free(j);
+}
+
+// forget the buffer once nothing needs it any more
+static void maybe_drop(jbuf_t *j) {
+  if (j->pins == 0 && !j->in_txn && j->pending == 0) {
+    drop(j);
+  }
+}
+
+// Journal buffers for data blocks holding metadata.
+void *journal_get_block(int bnum) {
+  pthread_mutex_lock(&journal_lock);
+  jbuf_t *j = find(bnum);
+  if (!j) {
+    j = add(bnum);
+  }
+  j->pins++;
+  pthread_mutex_unlock(&journal_lock);
+  return j->data;
+}
+
+void journal_put_block(int bnum) {
+  pthread_mutex_lock(&journal_lock);
+  jbuf_t *j = find(bnum);
+  assert(j && j->pins > 0);
+  j->pins--;
+  maybe_drop(j);
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// Add the block to the running transaction.
+void journal_dirty(int bnum) {
+  pthread_mutex_lock(&journal_lock);
+  jbuf_t *j = find(bnum);
+  if (!j) {
+    // data blocks are only changed through journal_get_block
+    assert(is_meta(bnum));
+    j = add(bnum);
+  }
+  if (!j->in_txn) {
+    j->in_txn = 1;
+    bvec_push(&txn_blocks, bnum);
+    // its checksum joins the transaction when it commits, so its block of
+    // the checksum table counts from now on
+    int sums = csum_table_block(bnum);
+    if (sums >= 0) {
+      journal_dirty(sums);
+    }
+  }
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// The block is being freed.
+int journal_revoke(int bnum) {
+  pthread_mutex_lock(&journal_lock);
+  jbuf_t *j = find(bnum);
+  if (!j) {
+    pthread_mutex_unlock(&journal_lock);
+    return 0;
+  }
+  assert(j->pins == 0);
+
+  // committed copies must not be written over whatever the block holds next
+  for (int i = 0; i < pending_count; i++) {
+    if (pending[i].bnum == bnum) {
+      pending[i].bnum = -1;
+    }
+  }
+  drop(j);
+
+  // and must not be replayed either, so keep the block until the
+  // revocation is on disk
+  bvec_push(&txn_revoked, bnum);
+  bvec_push(&txn_deferred, bnum);
+  pthread_mutex_unlock(&journal_lock);
+  return 1;
+}
+
+// A metadata block is being freed.
+void journal_retire(int bnum) {
+  pthread_mutex_lock(&journal_lock);
+  if (!journal_revoke(bnum)) {
+    bvec_push(&txn_deferred, bnum);
+  }
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// Is the journal active?
+int journal_active() { return active; }
+
+// Open an operation.
+void journal_begin() {
+  if (active) {
+    pthread_mutex_lock(&journal_lock);
+    depth++;
+  }
+}
+
+// is the running transaction about to outgrow the log or a descriptor?
+// Operations that started before the commit add to it, so there must be
+// room left for one more of them.
+static int txn_full() {
+  uint32_t limit = max_entries < (log_size - 2) / 2 ? max_entries
+                                                    : (log_size - 2) / 2;
+  uint32_t slack = limit / 4 < JOURNAL_OP_BLOCKS ? limit / 4
+                                                 : JOURNAL_OP_BLOCKS;
+  return txn_blocks.count + txn_revoked.count + slack >= limit;
+}
+
+// Close an operation.
+void journal_end() {
+  if (!active) {
+    return;
+  }
+  // blocks snapshots need are copied before anything else can change
+  if (depth == 1) {
+    snapshot_flush();
+  }
+  int full = --depth == 0 && txn_full();
+  pthread_mutex_unlock(&journal_lock);
+
+  // don't wait for the commit thread when the log is filling up
+  if (full) {
+    journal_commit();
+  }
+}
+
+// write a logged block to its home location
+static int write_home(int bnum, const void *data) {
+  if (is_meta(bnum)) {
+    return write_block(journal_fd, bnum, data, BLOCK_SIZE);
+  }
+  return blocks_write_home(bnum, data);
+}
+
+// write the blocks home and mark the log empty; call with commit_lock held
+static int checkpoint() {
+  pthread_mutex_lock(&journal_lock);
+  jcopy_t *copies = pending;
+  int count = pending_count;
+  pending = 0;
+  pending_count = pending_cap = 0;
+  pthread_mutex_unlock(&journal_lock);
+
+  int rv = 0;
+  for (int i = 0; i < count; i++) {
+    int bnum = copies[i].bnum;
+    if (bnum < 0) {
+      continue;
+    }
+    rv |= write_home(bnum, copies[i].data);
+  }
+  rv |= blocks_flush();
+  rv |= fdatasync(journal_fd);
+
+  // the log can be reused once the header no longer points into it
+  char *block = calloc(1, BLOCK_SIZE);
+  journal_format(block, logged);
+  ((journal_header_t *)block)->start = head;
+  rv |= write_block(journal_fd, meta->journal_start, block, BLOCK_SIZE);
+  rv |= fdatasync(journal_fd);
+  free(block);
+  used = 0;
+
+  pthread_mutex_lock(&journal_lock);
+  for (int i = 0; i < count; i++) {
+    jbuf_t *j = copies[i].bnum >= 0 ? find(copies[i].bnum) : NULL;
+    if (j) {
+      j->pending--;
+      maybe_drop(j);
+    }
+    free(copies[i].data);
+  }
+  pthread_mutex_unlock(&journal_lock);
+  free(copies);
+
+  printf("+ journal: checkpointed %d blocks\n", count);
+  return rv ? -EIO : 0;
+}
+
+// write the frozen transaction to the log; call with commit_lock held
+static int write_txn(uint64_t seq, jcopy_t *copies, int count, bvec_t *revoked) {
+  uint32_t len = count + 2;
+  char *buf = calloc(len, BLOCK_SIZE);
+  assert(buf);
+
+  journal_descriptor_t *jd = (journal_descriptor_t *)buf;
+  jd->hdr.magic = JOURNAL_MAGIC;
+  jd->hdr.type = JOURNAL_DESCRIPTOR;
+  jd->hdr.sequence = seq;
+  jd->count = count;
+  jd->revoked = revoked->count;
+  for (int i = 0; i < count; i++) {
+    jd->bnums[i] = copies[i].bnum;
+    memcpy(buf + (size_t)(i + 1) * BLOCK_SIZE, copies[i].data, BLOCK_SIZE);
+  }
+  for (int i = 0; i < revoked->count; i++) {
+    jd->bnums[count + i] = revoked->items[i];
+  }
+
+  journal_commit_t *jc =
+      (journal_commit_t *)(buf + (size_t)(count + 1) * BLOCK_SIZE);
+  jc->hdr.magic = JOURNAL_MAGIC;
+  jc->hdr.type = JOURNAL_COMMIT;
+  jc->hdr.sequence = seq;
+  jc->checksum = checksum(CHECKSUM_SEED, buf, (size_t)(count + 1) * BLOCK_SIZE);
+
+  // one sequential write, or two when the log wraps around
+  int rv = 0;
+  uint32_t first = head < log_size - len ? len : log_size - head;
+  off_t off = (off_t)(log_start + head) * BLOCK_SIZE;
+  if (pwrite(journal_fd, buf, (size_t)first * BLOCK_SIZE, off) !=
+      (ssize_t)first * BLOCK_SIZE) {
+    rv = -EIO;
+  }
+  if (rv == 0 && first < len) {
+    size_t rest = (size_t)(len - first) * BLOCK_SIZE;
+    off = (off_t)log_start * BLOCK_SIZE;
+    if (pwrite(journal_fd, buf + (size_t)first * BLOCK_SIZE, rest, off) !=
+        (ssize_t)rest) {
+      rv = -EIO;
+    }
+  }
+  if (rv == 0 && fdatasync(journal_fd) < 0) {
+    rv = -EIO;
+  }
+  free(buf);
+
+  head = (head + len) % log_size;
+  used += len;
+  logged = seq + 1;
+  return rv;
+}
+
+// commit the running transaction; call with commit_lock held
+static int commit_locked() {
+  // freeze the running transaction; operations carry on in the next one
+  pthread_mutex_lock(&journal_lock);
+  discard_commit_begin();
+
+  // the checksums of the blocks join them, which may add blocks of the
+  // checksum table to the end of the transaction
+  for (int i = 0; i < txn_blocks.count; i++) {
+    jbuf_t *j = find(txn_blocks.items[i]);
+    if (j && j->in_txn) {
+      csum_meta(j->bnum, j->data);
+    }
+  }
+
+  int count = 0;
+  jcopy_t *copies = malloc((txn_blocks.count + 1) * sizeof(jcopy_t));
+  assert(copies);
+  for (int i = 0; i < txn_blocks.count; i++) {
+    jbuf_t *j = find(txn_blocks.items[i]);
+    if (!j || !j->in_txn) {
+      continue; // revoked since
+    }
+    copies[count].bnum = j->bnum;
+    copies[count].data = malloc(BLOCK_SIZE);
+    assert(copies[count].data);
+    memcpy(copies[count].data, j->data, BLOCK_SIZE);
+    count++;
+    j->in_txn = 0;
+    j->pending++;
+  }
+  bvec_t revoked = txn_revoked;
+  bvec_t deferred = txn_deferred;
+  memset(&txn_revoked, 0, sizeof(bvec_t));
+  memset(&txn_deferred, 0, sizeof(bvec_t));
+  txn_blocks.count = 0;
+  uint64_t seq = sequence;
+  if (count > 0 || revoked.count > 0) {
+    sequence++;
+  }
+  pthread_mutex_unlock(&journal_lock);
+
+  int rv = 0;
+  if (count > 0 || revoked.count > 0) {
+    uint32_t len = count + 2;
+    int fits = len <= log_size && count + revoked.count <= (int)max_entries;
+    if (!fits || used + len > log_size) {
+      rv = checkpoint();
+    }
+    if (fits) {
+      // data written before the commit reaches the image first, so the
+      // committed metadata never points at blocks that were not written;
+      // the flush in write_txn covers both
+      rv |= blocks_flush();
+      rv |= write_txn(seq, copies, count, &revoked);
+      printf("+ journal: committed transaction %lu (%d blocks, %d revoked)\n",
+             (unsigned long)seq, count, revoked.count);
+    } else {
+      // too big for the log: write it home directly, giving up atomicity,
+      // and move the header past its sequence
+      fprintf(stderr, "nufs: transaction of %d blocks bypasses the journal\n",
+              count);
+      for (int i = 0; i < count; i++) {
+        rv |= write_home(copies[i].bnum, copies[i].data);
+      }
+      logged = seq + 1;
+      rv |= checkpoint();
+    }
+  }
+
+  // blocks freed by the transaction may go back to the host now
+  discard_commit_end(rv ? -EIO : 0);
+
+  // the copies now wait for the checkpoint
+  pthread_mutex_lock(&journal_lock);
+  for (int i = 0; i < count; i++) {
+    if (pending_count == pending_cap) {
+      pending_cap = pending_cap ? 2 * pending_cap : 64;
+      pending = realloc(pending, pending_cap * sizeof(jcopy_t));
+      assert(pending);
+    }
+    pending[pending_count++] = copies[i];
+  }
+  pthread_mutex_unlock(&journal_lock);
+  free(copies);
+
+  // the revocations are durable, so the blocks may be reused
+  pthread_mutex_lock(&journal_lock);
+  for (int i = 0; i < deferred.count; i++) {
+    blocks_release(deferred.items[i], 1);
+  }
+  pthread_mutex_unlock(&journal_lock);
+  bvec_free(&revoked);
+  bvec_free(&deferred);
+
+  commit_error = rv ? -EIO : 0;
+  return commit_error;
+}
+
+// Commit the running transaction and wait until it is on disk.
+int journal_commit() {
+  if (!active) {
+    return 0;
+  }
+  pthread_mutex_lock(&commit_lock);
+  int rv = commit_locked();
+  pthread_mutex_unlock(&commit_lock);
+  return rv;
+}
+
+// Is the running transaction empty?
+int journal_idle() {
+  if (!active) {
+    return 1;
+  }
+  pthread_mutex_lock(&journal_lock);
+  int idle = txn_blocks.count == 0 && txn_revoked.count == 0;
+  pthread_mutex_unlock(&journal_lock);
+  return idle;
+}
+
+// Wait until the operations closed so far are committed.
+int journal_sync() {
+  if (!active) {
+    return 0;
+  }
+
+  // the caller's changes are in the running transaction, or else in the
+  // one before it, which may still be being committed
+  pthread_mutex_lock(&journal_lock);
+  int empty = txn_blocks.count == 0 && txn_revoked.count == 0;
+  uint64_t target = empty ? sequence - 1 : sequence;
+  pthread_mutex_unlock(&journal_lock);
+
+  // callers queue up on commit_lock while a commit is being written, and
+  // the first one through commits for all of them
+  pthread_mutex_lock(&commit_lock);
+  int rv;
+  if (logged <= target) {
+    rv = commit_locked();
+  } else {
+    rv = commit_error;
+  }
+  pthread_mutex_unlock(&commit_lock);
+
+  if (rv == 0 && !empty) {
+    printf("+ journal_sync: transaction %lu is on disk\n",
+           (unsigned long)target);
+  }
+  return rv < 0 ? rv : !empty;
+}
+
+static void *commit_thread(void *arg) {
+  pthread_mutex_lock(&wake_lock);
+  while (!stopping) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += commit_interval;
+    pthread_cond_timedwait(&wake, &wake_lock, &until);
+
+    pthread_mutex_unlock(&wake_lock);
+    journal_commit();
+    pthread_mutex_lock(&wake_lock);
+  }
+  pthread_mutex_unlock(&wake_lock);
+  return NULL;
+}
+
+// Start journaling the image.
+int journal_init(int fd, superblock_t *sb, const blocks_config_t *conf) {
+  journal_fd = fd;
+  meta = sb;
+
+  journal_header_t jh;
+  if (pread(fd, &jh, sizeof(jh), (off_t)sb->journal_start * BLOCK_SIZE) !=
+          sizeof(jh) ||
+      !is_block(&jh, JOURNAL_HEADER, jh.hdr.sequence)) {
+    return -EIO;
+  }
+
+  log_start = sb->journal_start + 1;
+  log_size = sb->journal_blocks - 1;
+  head = jh.start;
+  used = 0;
+  sequence = logged = jh.hdr.sequence;
+  max_entries = (BLOCK_SIZE - sizeof(journal_descriptor_t)) / sizeof(uint32_t);
+  commit_interval = conf && conf->commit_interval > 0 ? conf->commit_interval
+                                                      : JOURNAL_DEFAULT_COMMIT;
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&journal_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  active = 1;
+  stopping = 0;
+  if (pthread_create(&committer, NULL, commit_thread, NULL) != 0) {
+    active = 0;
+    return -EAGAIN;
+  }
+
+  printf("+ journal_init: %u log blocks, sequence %lu, commit every %ds\n",
+         log_size, (unsigned long)sequence, commit_interval);
+  return 0;
+}
+
+// Commit and checkpoint everything, then stop journaling.
+void journal_free() {
+  if (!active) {
+    return;
+  }
+
+  pthread_mutex_lock(&wake_lock);
+  stopping = 1;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&wake_lock);
+  pthread_join(committer, NULL);
+
+  // releasing the blocks the last transaction freed changes the bitmap
+  // again, which takes one more
+  journal_commit();
+  journal_commit();
+  pthread_mutex_lock(&commit_lock);
+  checkpoint();
+  pthread_mutex_unlock(&commit_lock);
+
+  // nothing is pinned or pending any more
+  for (int i = 0; i < JBUF_BUCKETS; i++) {
+    while (buckets[i]) {
+      drop(buckets[i]);
+    }
+  }
+  bvec_free(&txn_blocks);
+  active = 0;
+  pthread_mutex_destroy(&journal_lock);
+}
@@ -0,0 +1,131 @@
+// Write-ahead metadata journal.
+//
+// Every metadata block changed between journal_begin and journal_end joins
+// the running transaction. A commit thread periodically writes the running
+// transaction to a circular log in the image (a descriptor block, the
+// blocks themselves and a commit block) and flushes once for the whole
+// batch. The blocks only reach their home locations when the log is
+// checkpointed, so the image on disk always matches a committed state once
+// the log has been replayed, which blocks_init does on mount. File data is
+// not logged, but it is written out before the transaction that maps it
+// commits.
+//
+// While the journal is active the metadata region of the image is mapped
+// privately, and data blocks holding metadata (extent nodes, directory
+// blocks) are kept in journal buffers instead of going through the backend.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#include "blocks.h"
+
+#define JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+
+// journal block types
+#define JOURNAL_HEADER 1
+#define JOURNAL_DESCRIPTOR 2
+#define JOURNAL_COMMIT 3
+
+// journal size picked by blocks_format: one block in 64, within bounds
+#define JOURNAL_MIN_BLOCKS 16
+#define JOURNAL_MAX_BLOCKS 8192
+
+#define JOURNAL_DEFAULT_COMMIT 5 // seconds between commits
+
+// blocks a transaction keeps room for past the point where it is committed
+#define JOURNAL_OP_BLOCKS 64
+
+// Every journal block starts like this.
+typedef struct journal_block {
+  uint32_t magic;
+  uint32_t type;
+  uint64_t sequence;
+} journal_block_t;
+
+// First block of the journal. The log follows it.
+typedef struct journal_header {
+  journal_block_t hdr; // sequence of the first transaction to replay
+  uint32_t start;      // log block where that transaction starts
+  uint32_t _reserved;
+} journal_header_t;
+
+// Starts a transaction in the log: the home locations of the logged blocks
+// that follow it, then the blocks it revokes.
+typedef struct journal_descriptor {
+  journal_block_t hdr;
+  uint32_t count;   // logged blocks
+  uint32_t revoked; // revoked blocks, listed after the logged ones
+  uint32_t bnums[];
+} journal_descriptor_t;
+
+// Ends a transaction; without it the transaction is ignored.
+typedef struct journal_commit {
+  journal_block_t hdr;
+  uint32_t checksum; // of the descriptor and the logged blocks
+  uint32_t _reserved;
+} journal_commit_t;
+
+// Write an empty journal header into the given block.
+void journal_format(void *block, uint64_t sequence);
+
+// Replay the committed transactions in the journal of the unmapped image
+// open as fd. Returns the number of transactions replayed, or -1.
+int journal_replay(int fd, const superblock_t *sb);
+
+// Count the committed transactions in the journal of the unmapped image
+// open as fd without replaying them. Returns -1 if the journal header is
+// damaged.
+int journal_pending(int fd, const superblock_t *sb);
+
+// Start journaling the image open as fd, whose metadata is mapped
+// privately at meta. Returns 0 or a negative errno.
+int journal_init(int fd, superblock_t *meta, const blocks_config_t *conf);
+
+// Commit and checkpoint everything, then stop journaling.
+void journal_free();
+
+// Is the journal active?
+int journal_active();
+
+// Open and close an operation. Everything in between lands in the same
+// transaction. Operations nest, and other operations wait until the
+// outermost one is closed.
+void journal_begin();
+void journal_end();
+
+// Commit the running transaction and wait until it is on disk. Returns 0
+// or -EIO.
+int journal_commit();
+
+// Wait until the operations closed so far are committed, for fsync.
+// Callers that arrive while a commit is being written share the next one.
+// Returns 1 if a commit that started after the call covered them, which
+// also got all the data written before it onto the disk, or 0 if there was
+// nothing to commit (or no journal), leaving the data to the caller. Returns
+// -EIO if the commit failed.
+int journal_sync();
+
+// Is everything done so far committed? Inside an operation, it stays that
+// way until the operation changes something.
+int journal_idle();
+
+// Journal buffers for data blocks holding metadata, see blocks_get_block.
+void *journal_get_block(int bnum);
+void journal_put_block(int bnum);
+
+// Add the block to the running transaction.
+void journal_dirty(int bnum);
+
+// The block is being freed. Returns 1 if the journal knows about it, in
+// which case the block is revoked and journal calls blocks_release for it
+// once the transaction freeing it has committed.
+int journal_revoke(int bnum);
+
+// A metadata block is being freed. Like journal_revoke, but the journal
+// takes the block whether it knows about it or not, so that nothing is
+// written over it before the transaction freeing it has committed.
+void journal_retire(int bnum);
+
+#endif
@@ -3,8 +3,7 @@
 
 #ifndef __ASSEMBLER__
 
-#define offsetof(type, member)                                      \
-    ((size_t)(&((type *)0)->member))
+#include <stddef.h>
 
 /* *
  * to_struct - get the struct from a ptr
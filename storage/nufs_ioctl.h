@@ -0,0 +1,59 @@
+// ioctls understood by a mounted nufs, shared with the tools that send them
+
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// Grow the filesystem to the given size in bytes. Issued on the root
+// directory of the mount.
+#define NUFS_IOC_RESIZE _IOW('N', 1, uint64_t)
+
+// Share the blocks of a range of another file with the file the ioctl is
+// issued on, like FICLONERANGE (which Linux never passes on to FUSE
+// filesystems). The source is named by its path from the root of the
+// mount rather than by a file descriptor.
+#define NUFS_CLONE_PATH_MAX 1024
+
+struct nufs_clone_range {
+  uint64_t src_offset;
+  uint64_t src_length; // 0 for everything up to the end of the source
+  uint64_t dest_offset;
+  char src_path[NUFS_CLONE_PATH_MAX];
+};
+
+#define NUFS_IOC_CLONE_RANGE _IOW('N', 2, struct nufs_clone_range)
+
+// Take or delete a named snapshot of the volume. Issued on the root
+// directory of the mount.
+#define NUFS_SNAPSHOT_NAME_MAX 32
+
+struct nufs_snapshot {
+  char name[NUFS_SNAPSHOT_NAME_MAX];
+};
+
+#define NUFS_IOC_SNAPSHOT_CREATE _IOW('N', 3, struct nufs_snapshot)
+#define NUFS_IOC_SNAPSHOT_DELETE _IOW('N', 4, struct nufs_snapshot)
+
+// Discard the free space of the volume, as FITRIM in <linux/fs.h> does (so
+// fstrim works on a mount too). Only the bytes [start, start + len) of the
+// volume are looked at, and free runs shorter than minlen bytes are left
+// alone. len comes back as the number of bytes discarded. Issued on the
+// root directory of the mount.
+struct nufs_trim_range {
+  uint64_t start;
+  uint64_t len;
+  uint64_t minlen;
+};
+
+#define NUFS_IOC_TRIM _IOWR('X', 121, struct nufs_trim_range)
+
+// The inode flags of chattr and lsattr, as FS_IOC_GETFLAGS, FS_IOC_SETFLAGS
+// and FS_COMPR_FL in <linux/fs.h> (which defines a BLOCK_SIZE of its own).
+// Compression is the only flag nufs has.
+#define NUFS_IOC_GETFLAGS _IOR('f', 1, long)
+#define NUFS_IOC_SETFLAGS _IOW('f', 2, long)
+#define NUFS_COMPR_FL 0x00000004
+
+#endif
@@ -50,3 +50,31 @@ slist_t *s_explode(const char *text, char delim) {
 
   return s_cons(part, rest);
 }
+
+void path_begin(path_iter_t *it, const char *path) {
+  it->name = path;
+  it->len = 0;
+  it->next = path;
+}
+
+int path_next(path_iter_t *it) {
+  const char *p = it->next;
+  while (*p == '/') {
+    p++;
+  }
+  it->name = p;
+  while (*p != 0 && *p != '/') {
+    p++;
+  }
+  it->len = p - it->name;
+  it->next = p;
+  return it->len > 0;
+}
+
+int path_last(const path_iter_t *it) {
+  const char *p = it->next;
+  while (*p == '/') {
+    p++;
+  }
+  return *p == 0;
+}
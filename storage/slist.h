@@ -22,4 +22,21 @@ void s_free(slist_t *xs);
 // Split the given on the given delimiter into a list of strings.
 slist_t *s_explode(const char *text, char delim);
 
+// The names in a path, one at a time, without copying them out of it.
+// Empty names (from "//" or a trailing "/") are skipped.
+typedef struct path_iter {
+  const char *name; // the current name, not terminated
+  int len;          // its length
+  const char *next; // the rest of the path
+} path_iter_t;
+
+// Start iterating over the names in the path.
+void path_begin(path_iter_t *it, const char *path);
+
+// Move to the next name. Returns 0 past the last one.
+int path_next(path_iter_t *it);
+
+// Is there no name after the current one?
+int path_last(const path_iter_t *it);
+
 #endif
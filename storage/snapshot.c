@@ -0,0 +1,639 @@
+#include "snapshot.h"
+#include "bitmap.h"
+#include "csum.h"
+#include "journal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NO_COPY 0          // the snapshot does not care about the block
+#define PENDING UINT32_MAX // the copy is made by snapshot_flush
+#define EMPTY UINT32_MAX   // free slot of an exception map
+
+// a block the snapshot does not read from the live volume
+typedef struct exception {
+  uint32_t bnum;
+  uint32_t copy;
+  void *data; // what it held, kept for the metadata before meta_end
+} exception_t;
+
+typedef struct snapshot {
+  snapshot_slot_t *slot;
+  exception_t *map; // open addressing on bnum
+  int map_size;     // a power of two
+  int map_used;
+  uint32_t tail;    // last block of the exception table
+  void *meta;       // the metadata as the snapshot sees it, once read
+  uint32_t tables_end; // end of the per-block tables when it was taken
+} snapshot_t;
+
+// a block to copy, or to keep, once the operation changing it is done
+typedef struct preserve {
+  uint32_t bnum;
+  uint32_t mask; // snapshots that need it
+  void *data;    // what it held, NULL if the volume freed it
+} preserve_t;
+
+static snapshot_t *snaps[SNAPSHOT_MAX]; // by slot
+static int snap_count = 0;
+static uint8_t *owned = NULL; // blocks belonging to snapshots
+
+static preserve_t *queue = NULL;
+static int queue_count = 0;
+static int queue_cap = 0;
+static int flushing = 0;
+static int releasing = 0; // deleting a snapshot, don't adopt what it frees
+
+static __thread snapshot_t *viewing = NULL;
+static snapshot_t *mounted = NULL;
+
+static snapshot_slot_t *get_slots() {
+  return blocks_get_block(get_superblock()->snapshot_start);
+}
+
+// blocks before this (the bitmaps and the inode table) are copied into
+// memory as well
+static uint32_t meta_end() {
+  superblock_t *sb = get_superblock();
+  return sb->inode_table_start + sb->inode_table_blocks;
+}
+
+// the rest of the metadata region (the snapshot list and journal) and the
+// per-block tables are never preserved
+static int is_excluded(int bnum) {
+  superblock_t *sb = get_superblock();
+  return (bnum >= (int)meta_end() && bnum < (int)sb->data_start) ||
+         (bnum >= (int)sb->refcount_start &&
+          bnum < (int)blocks_tables_end(sb));
+}
+
+// find where the per-block tables were when the snapshot was taken
+static void find_tables(snapshot_t *s) {
+  superblock_t then = *get_superblock();
+  blocks_place_tables(&then, s->slot->tables, s->slot->block_count);
+  s->tables_end = blocks_tables_end(&then);
+}
+
+static uint32_t hash(uint32_t bnum) { return bnum * 2654435761u; }
+
+static exception_t *find(snapshot_t *s, uint32_t bnum) {
+  int mask = s->map_size - 1;
+  for (int i = hash(bnum) & mask;; i = (i + 1) & mask) {
+    if (s->map[i].bnum == bnum) {
+      return &s->map[i];
+    }
+    if (s->map[i].bnum == EMPTY) {
+      return NULL;
+    }
+  }
+}
+
+static void map_init(snapshot_t *s, int size) {
+  s->map = malloc(size * sizeof(exception_t));
+  assert(s->map);
+  for (int i = 0; i < size; i++) {
+    s->map[i].bnum = EMPTY;
+  }
+  s->map_size = size;
+  s->map_used = 0;
+}
+
+static exception_t *insert(snapshot_t *s, uint32_t bnum, uint32_t copy,
+                           void *data) {
+  if (2 * (s->map_used + 1) > s->map_size) {
+    exception_t *old = s->map;
+    int old_size = s->map_size;
+    map_init(s, old_size * 2);
+    for (int i = 0; i < old_size; i++) {
+      if (old[i].bnum != EMPTY) {
+        *insert(s, old[i].bnum, old[i].copy, old[i].data) = old[i];
+      }
+    }
+    free(old);
+  }
+
+  int mask = s->map_size - 1;
+  int i = hash(bnum) & mask;
+  while (s->map[i].bnum != EMPTY) {
+    i = (i + 1) & mask;
+  }
+  s->map[i] = (exception_t){bnum, copy, data};
+  s->map_used++;
+  return &s->map[i];
+}
+
+// was the block in use when the snapshot was taken? The tables are not
+// part of what it sees, wherever they were.
+static int used_then(snapshot_t *s, int bnum) {
+  if (bnum >= (int)s->slot->block_count ||
+      (bnum >= (int)s->slot->tables && bnum < (int)s->tables_end)) {
+    return 0;
+  }
+  superblock_t *sb = get_superblock();
+  int per_block = BLOCK_SIZE * 8;
+  int bb = sb->block_bitmap_start + bnum / per_block;
+  exception_t *e = find(s, bb);
+  void *bits = e ? e->data
+                 : (char *)get_blocks_bitmap() +
+                       (size_t)(bb - sb->block_bitmap_start) * BLOCK_SIZE;
+  return bitmap_get(bits, bnum % per_block);
+}
+
+// does the snapshot still read the block from the live volume?
+static int needs(snapshot_t *s, int bnum) {
+  return !(s->slot->flags & SNAPSHOT_BROKEN) && find(s, bnum) == NULL &&
+         used_then(s, bnum);
+}
+
+// the snapshots that need the block, as a mask of slots
+static uint32_t needed_by(int bnum) {
+  if (snap_count == 0 || is_excluded(bnum) || bitmap_get(owned, bnum)) {
+    return 0;
+  }
+  uint32_t mask = 0;
+  for (int i = 0; i < SNAPSHOT_MAX; i++) {
+    if (snaps[i] && needs(snaps[i], bnum)) {
+      mask |= 1u << i;
+    }
+  }
+  return mask;
+}
+
+static void queue_add(int bnum, uint32_t mask, void *data) {
+  if (queue_count == queue_cap) {
+    queue_cap = queue_cap ? queue_cap * 2 : 16;
+    queue = realloc(queue, queue_cap * sizeof(preserve_t));
+    assert(queue);
+  }
+  queue[queue_count++] = (preserve_t){bnum, mask, data};
+  for (int i = 0; i < SNAPSHOT_MAX; i++) {
+    if (mask & (1u << i)) {
+      insert(snaps[i], bnum, PENDING, data);
+    }
+  }
+}
+
+// add an entry to the exception table on disk
+static int append(snapshot_t *s, uint32_t bnum, uint32_t copy) {
+  int per_block =
+      (BLOCK_SIZE - sizeof(snapshot_table_t)) / sizeof(snapshot_entry_t);
+  if (s->tail != 0) {
+    snapshot_table_t *t = blocks_get_block(s->tail);
+    int room = t->count < per_block;
+    if (room) {
+      blocks_dirty(s->tail);
+      t->entries[t->count++] = (snapshot_entry_t){bnum, copy};
+    }
+    blocks_put_block(s->tail);
+    if (room) {
+      return 0;
+    }
+  }
+
+  int next = alloc_block();
+  if (next < 0) {
+    return -ENOSPC;
+  }
+  bitmap_put(owned, next, 1);
+  snapshot_table_t *t = blocks_get_block(next);
+  blocks_dirty(next);
+  memset(t, 0, BLOCK_SIZE);
+  t->count = 1;
+  t->entries[0] = (snapshot_entry_t){bnum, copy};
+  blocks_put_block(next);
+
+  if (s->tail != 0) {
+    snapshot_table_t *prev = blocks_get_block(s->tail);
+    blocks_dirty(s->tail);
+    prev->next = next;
+    blocks_put_block(s->tail);
+  } else {
+    blocks_dirty_ptr(&s->slot->table, sizeof(s->slot->table));
+    s->slot->table = next;
+  }
+  s->tail = next;
+  return 0;
+}
+
+// stop preserving a snapshot the volume has no room for
+static void set_broken(snapshot_t *s) {
+  if (!(s->slot->flags & SNAPSHOT_BROKEN)) {
+    fprintf(stderr, "nufs: out of space, snapshot %s is no longer kept\n",
+            s->slot->name);
+    blocks_dirty_ptr(&s->slot->flags, sizeof(s->slot->flags));
+    s->slot->flags |= SNAPSHOT_BROKEN;
+  }
+}
+
+// Load the snapshots of the mounted image.
+void snapshot_init() {
+  if (!snapshot_supported()) {
+    return;
+  }
+  owned = calloc((get_superblock()->max_block_count + 7) / 8, 1);
+  assert(owned);
+
+  snapshot_slot_t *slots = get_slots();
+  for (int i = 0; i < SNAPSHOT_MAX; i++) {
+    if (slots[i].name[0] == '\0') {
+      continue;
+    }
+    snapshot_t *s = calloc(1, sizeof(snapshot_t));
+    assert(s);
+    s->slot = &slots[i];
+    find_tables(s);
+    map_init(s, 64);
+
+    for (uint32_t tb = s->slot->table; tb != 0;) {
+      bitmap_put(owned, tb, 1);
+      snapshot_table_t *t = blocks_get_block(tb);
+      for (uint32_t j = 0; j < t->count; j++) {
+        snapshot_entry_t e = t->entries[j];
+        void *data = NULL;
+        if (e.copy != NO_COPY) {
+          bitmap_put(owned, e.copy, 1);
+        }
+        if (e.copy != NO_COPY && e.bnum < meta_end()) {
+          data = malloc(BLOCK_SIZE);
+          assert(data);
+          int rv = blocks_read(e.copy, 0, data, BLOCK_SIZE);
+          assert(rv == 0);
+        }
+        insert(s, e.bnum, e.copy, data);
+      }
+      s->tail = tb;
+      tb = t->next;
+      blocks_put_block(s->tail);
+    }
+
+    snaps[i] = s;
+    snap_count++;
+    printf("+ snapshot_init: %s, %d blocks preserved\n", s->slot->name,
+           s->map_used);
+  }
+}
+
+static void drop(snapshot_t *s) {
+  for (int i = 0; i < s->map_size; i++) {
+    if (s->map[i].bnum != EMPTY) {
+      free(s->map[i].data);
+    }
+  }
+  free(s->map);
+  free(s->meta);
+  free(s);
+}
+
+// Forget the snapshots before the image is closed.
+void snapshot_free() {
+  if (owned == NULL) {
+    return;
+  }
+  // preserve whatever the last operations left behind
+  journal_begin();
+  snapshot_flush();
+  journal_end();
+
+  mounted = NULL;
+  for (int i = 0; i < SNAPSHOT_MAX; i++) {
+    if (snaps[i]) {
+      drop(snaps[i]);
+      snaps[i] = NULL;
+    }
+  }
+  snap_count = 0;
+  free(owned);
+  owned = NULL;
+  free(queue);
+  queue = NULL;
+  queue_count = queue_cap = 0;
+}
+
+// Can the image take snapshots?
+int snapshot_supported() {
+  superblock_t *sb = get_superblock();
+  return sb->snapshot_start > 0 && blocks_can_share() && journal_active();
+}
+
+static int find_slot(const char *name) {
+  snapshot_slot_t *slots = get_slots();
+  for (int i = 0; i < SNAPSHOT_MAX; i++) {
+    if (slots[i].name[0] != '\0' &&
+        strncmp(slots[i].name, name, NUFS_SNAPSHOT_NAME_MAX) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Take a snapshot of the volume as it is now.
+int snapshot_create(const char *name) {
+  printf("+ snapshot_create(%s)\n", name);
+  if (!snapshot_supported()) {
+    return -EOPNOTSUPP;
+  }
+  size_t len = strlen(name);
+  if (len == 0 || len >= NUFS_SNAPSHOT_NAME_MAX || strchr(name, '/') ||
+      strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    return -EINVAL;
+  }
+  if (find_slot(name) >= 0) {
+    return -EEXIST;
+  }
+
+  snapshot_slot_t *slots = get_slots();
+  int i = 0;
+  while (i < SNAPSHOT_MAX && slots[i].name[0] != '\0') {
+    i++;
+  }
+  if (i == SNAPSHOT_MAX) {
+    return -ENOSPC;
+  }
+
+  // that is all: the volume is copied on write from here on
+  snapshot_slot_t *slot = &slots[i];
+  blocks_dirty_ptr(slot, sizeof(snapshot_slot_t));
+  memset(slot, 0, sizeof(snapshot_slot_t));
+  strcpy(slot->name, name);
+  slot->created = time(NULL);
+  slot->block_count = BLOCK_COUNT;
+  slot->tables = get_superblock()->refcount_start;
+
+  snapshot_t *s = calloc(1, sizeof(snapshot_t));
+  assert(s);
+  s->slot = slot;
+  find_tables(s);
+  map_init(s, 64);
+  snaps[i] = s;
+  snap_count++;
+  return 0;
+}
+
+// give back a block the snapshot being deleted owned
+static void give_back(uint32_t bnum) {
+  if (blocks_refcount(bnum) == 0) {
+    bitmap_put(owned, bnum, 0);
+    // snapshots taken since it was ours never used it
+    for (int i = 0; i < SNAPSHOT_MAX; i++) {
+      if (snaps[i] && needs(snaps[i], bnum)) {
+        insert(snaps[i], bnum, NO_COPY, NULL);
+        if (append(snaps[i], bnum, NO_COPY) < 0) {
+          set_broken(snaps[i]);
+        }
+      }
+    }
+  }
+  free_block(bnum);
+}
+
+// Delete a snapshot.
+int snapshot_delete(const char *name) {
+  printf("+ snapshot_delete(%s)\n", name);
+  if (!snapshot_supported()) {
+    return -EOPNOTSUPP;
+  }
+  int i = find_slot(name);
+  if (i < 0) {
+    return -ENOENT;
+  }
+  snapshot_t *s = snaps[i];
+  if (s == mounted || s == viewing) {
+    return -EBUSY;
+  }
+
+  snapshot_flush();
+  snaps[i] = NULL;
+  snap_count--;
+
+  releasing = 1;
+  for (int j = 0; j < s->map_size; j++) {
+    uint32_t copy = s->map[j].copy;
+    if (s->map[j].bnum != EMPTY && copy != NO_COPY && copy != PENDING) {
+      give_back(copy);
+    }
+  }
+  for (uint32_t tb = s->slot->table; tb != 0;) {
+    snapshot_table_t *t = blocks_get_block(tb);
+    uint32_t next = t->next;
+    blocks_put_block(tb);
+    give_back(tb);
+    tb = next;
+  }
+  releasing = 0;
+
+  blocks_dirty_ptr(s->slot, sizeof(snapshot_slot_t));
+  memset(s->slot, 0, sizeof(snapshot_slot_t));
+  drop(s);
+  return 0;
+}
+
+// Return the name of the snapshot in the given slot.
+const char *snapshot_name(int slot) {
+  if (!snapshot_supported() || snaps[slot] == NULL) {
+    return NULL;
+  }
+  return snaps[slot]->slot->name;
+}
+
+// the metadata as the snapshot sees it: what is still the same in the live
+// volume, and the copies of the rest
+static void build_meta(snapshot_t *s) {
+  if (s->meta) {
+    return;
+  }
+  size_t len = (size_t)meta_end() * BLOCK_SIZE;
+  s->meta = malloc(len);
+  assert(s->meta);
+  memcpy(s->meta, get_superblock(), len);
+  for (int i = 0; i < s->map_size; i++) {
+    exception_t *e = &s->map[i];
+    if (e->bnum != EMPTY && e->bnum < meta_end() && e->data) {
+      memcpy((char *)s->meta + (size_t)e->bnum * BLOCK_SIZE, e->data,
+             BLOCK_SIZE);
+    }
+  }
+}
+
+static snapshot_t *lookup(const char *name, int *rv) {
+  int i = snapshot_supported() ? find_slot(name) : -1;
+  if (i < 0) {
+    *rv = -ENOENT;
+    return NULL;
+  }
+  if (snaps[i]->slot->flags & SNAPSHOT_BROKEN) {
+    *rv = -EIO;
+    return NULL;
+  }
+  *rv = 0;
+  return snaps[i];
+}
+
+// Read the named snapshot instead of the volume until snapshot_leave.
+int snapshot_enter(const char *name) {
+  journal_begin();
+  int rv;
+  snapshot_t *s = lookup(name, &rv);
+  if (s == NULL) {
+    journal_end();
+    return rv;
+  }
+  build_meta(s);
+  viewing = s;
+  return 0;
+}
+
+void snapshot_leave() {
+  assert(viewing);
+  viewing = NULL;
+  journal_end();
+}
+
+// Read the named snapshot instead of the volume from now on.
+int snapshot_mount(const char *name) {
+  journal_begin();
+  int rv;
+  snapshot_t *s = lookup(name, &rv);
+  if (s) {
+    build_meta(s);
+    mounted = s;
+    printf("+ snapshot_mount(%s)\n", name);
+  }
+  journal_end();
+  return rv;
+}
+
+// Is a snapshot being read?
+int snapshot_viewing() { return viewing != NULL || mounted != NULL; }
+
+// Translate a block of the volume to the snapshot's version of it.
+int snapshot_view_map(int bnum, void **data) {
+  snapshot_t *s = viewing ? viewing : mounted;
+  if (bnum < (int)meta_end()) {
+    *data = (char *)s->meta + (size_t)bnum * BLOCK_SIZE;
+    return -1;
+  }
+  exception_t *e = find(s, bnum);
+  if (e == NULL || e->copy == NO_COPY) {
+    return bnum;
+  }
+  if (e->copy == PENDING) {
+    if (e->data == NULL) {
+      return bnum;
+    }
+    *data = e->data;
+    return -1;
+  }
+  return e->copy;
+}
+
+// The block is about to change; copy it first if a snapshot needs it.
+void snapshot_preserve(int bnum) {
+  if (snap_count == 0 || snapshot_viewing()) {
+    return;
+  }
+  uint32_t mask = needed_by(bnum);
+  if (mask == 0) {
+    return;
+  }
+  void *data = malloc(BLOCK_SIZE);
+  assert(data);
+  memcpy(data, blocks_get_block(bnum), BLOCK_SIZE);
+  blocks_put_block(bnum);
+  queue_add(bnum, mask, data);
+}
+
+// The volume is freeing the block.
+int snapshot_adopt(int bnum) {
+  if (snap_count == 0 || releasing || snapshot_viewing()) {
+    return 0;
+  }
+  uint32_t mask = needed_by(bnum);
+  if (mask == 0) {
+    return 0;
+  }
+  bitmap_put(owned, bnum, 1);
+  queue_add(bnum, mask, NULL);
+  printf("+ snapshot_adopt(%d)\n", bnum);
+  return 1;
+}
+
+// Does a snapshot need the block to stay as it is?
+int snapshot_holds(int bnum) {
+  if (snap_count == 0 || snapshot_viewing()) {
+    return 0;
+  }
+  return bitmap_get(owned, bnum) || needed_by(bnum) != 0;
+}
+
+// Finish preserving the blocks changed by the operation that is ending.
+void snapshot_flush() {
+  if (flushing || queue_count == 0) {
+    return;
+  }
+  flushing = 1;
+
+  // copying a block changes the bitmap, which may need preserving in turn,
+  // so the queue can grow while it is worked through
+  for (int i = 0; i < queue_count; i++) {
+    preserve_t p = queue[i];
+    uint32_t copy = p.bnum;
+    int keep = p.data && p.bnum < meta_end();
+
+    if (p.data) {
+      int bnum = alloc_block();
+      if (bnum < 0) {
+        for (int j = 0; j < SNAPSHOT_MAX; j++) {
+          if (p.mask & (1u << j)) {
+            exception_t *e = find(snaps[j], p.bnum);
+            e->copy = NO_COPY;
+            e->data = NULL;
+            set_broken(snaps[j]);
+          }
+        }
+        free(p.data);
+        continue;
+      }
+      copy = bnum;
+      bitmap_put(owned, copy, 1);
+      blocks_write(copy, 0, p.data, BLOCK_SIZE);
+      csum_meta(copy, p.data);
+    }
+
+    // one owner per snapshot
+    int owners = __builtin_popcount(p.mask);
+    for (int j = 1; j < owners; j++) {
+      int rv = blocks_share(copy, 1);
+      assert(rv == 0);
+    }
+
+    for (int j = 0; j < SNAPSHOT_MAX; j++) {
+      if (!(p.mask & (1u << j))) {
+        continue;
+      }
+      exception_t *e = find(snaps[j], p.bnum);
+      e->copy = copy;
+      e->data = NULL;
+      if (keep) {
+        e->data = p.data;
+        p.data = NULL;
+        if (--owners > 0) {
+          p.data = malloc(BLOCK_SIZE);
+          assert(p.data);
+          memcpy(p.data, e->data, BLOCK_SIZE);
+        }
+      }
+      if (append(snaps[j], p.bnum, copy) < 0) {
+        set_broken(snaps[j]);
+      }
+    }
+    free(p.data);
+    printf("+ snapshot_flush: %u -> %u\n", p.bnum, copy);
+  }
+
+  queue_count = 0;
+  flushing = 0;
+}
@@ -0,0 +1,111 @@
+// Read-only point-in-time snapshots of the whole volume.
+//
+// Taking a snapshot only fills in a slot in the snapshot list, so it costs
+// the same however big the volume is. From then on the volume is copied on
+// write, one block at a time, the first time a block the snapshot still
+// sees is changed:
+//
+//  - metadata (the superblock, bitmaps and inode table, and the directory
+//    and extent blocks in the data region) is copied to a new block before
+//    the change, together with the change in the same transaction;
+//  - file data is never written over in place. Writes move the file to new
+//    blocks the way they do for blocks shared between files (see
+//    unshare_inode), and blocks the volume frees are kept for the snapshot
+//    instead.
+//
+// Each snapshot records the blocks it took over in an exception table, a
+// chain of blocks of (block, copy) pairs. Everything else it reads from the
+// live volume, which has not changed there. Deleting a snapshot gives its
+// blocks back, or to other snapshots still sharing them.
+//
+// A snapshot is read by entering it: blocks_get_block and blocks_read then
+// return the snapshot's version of each block, so the usual lookups work
+// on it unchanged.
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "blocks.h"
+#include "nufs_ioctl.h"
+
+#define SNAPSHOT_MAX 16 // slots in the snapshot list
+
+#define SNAPSHOT_BROKEN 0x1 // the volume ran out of room to preserve it
+
+// A slot in the snapshot list, the block at superblock->snapshot_start.
+typedef struct snapshot_slot {
+  char name[NUFS_SNAPSHOT_NAME_MAX]; // empty for a free slot
+  int64_t created;                   // when it was taken
+  uint32_t block_count;              // size of the volume then
+  uint32_t table;                    // first exception table block, or 0
+  uint32_t flags;                    // SNAPSHOT_* flags
+  uint32_t tables;                   // where the per-block tables were then
+} snapshot_slot_t;
+
+// A block of the exception table. A copy of 0 means the snapshot does not
+// care about the block (it belonged to other snapshots when it was taken).
+typedef struct snapshot_entry {
+  uint32_t bnum;
+  uint32_t copy;
+} snapshot_entry_t;
+
+typedef struct snapshot_table {
+  uint32_t next;  // next block of the table, 0 for the last
+  uint32_t count; // entries in use
+  snapshot_entry_t entries[];
+} snapshot_table_t;
+
+// Load the snapshots of the mounted image. Called by blocks_init.
+void snapshot_init();
+
+// Forget the snapshots before the image is closed.
+void snapshot_free();
+
+// Can the image take snapshots?
+int snapshot_supported();
+
+// Take a snapshot of the volume as it is now, or delete one. Call inside a
+// journal operation. Return 0 or a negative errno.
+int snapshot_create(const char *name);
+int snapshot_delete(const char *name);
+
+// Return the name of the snapshot in the given slot (0 to SNAPSHOT_MAX - 1),
+// or NULL if the slot is free.
+const char *snapshot_name(int slot);
+
+// Read the named snapshot instead of the volume until snapshot_leave. This
+// opens a journal operation, so the volume does not change meanwhile.
+// Returns 0 or a negative errno.
+int snapshot_enter(const char *name);
+void snapshot_leave();
+
+// Read the named snapshot instead of the volume from now on, for read-only
+// mounts of it. Returns 0 or a negative errno.
+int snapshot_mount(const char *name);
+
+// Hooks for the block layer.
+
+// Is a snapshot being read?
+int snapshot_viewing();
+
+// Translate a block of the volume to the block holding the snapshot's
+// version of it. Returns that block, or -1 with *data pointing at a copy
+// kept in memory.
+int snapshot_view_map(int bnum, void **data);
+
+// The block is about to change; copy it first if a snapshot needs it.
+void snapshot_preserve(int bnum);
+
+// The volume is freeing the block. Returns 1 if snapshots keep it instead.
+int snapshot_adopt(int bnum);
+
+// Does a snapshot need the block to stay as it is?
+int snapshot_holds(int bnum);
+
+// Finish preserving the blocks changed by the operation that is ending.
+// Called by journal_end.
+void snapshot_flush();
+
+#endif
@@ -1,11 +1,34 @@
+#define _GNU_SOURCE
+#include "compress.h"
+#include "dcache.h"
+#include "dedup.h"
+#include "discard.h"
+#include "journal.h"
+#include "nufs_ioctl.h"
+#include "snapshot.h"
 #include "storage.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/falloc.h>
+
 // initialize storage
-void storage_init(const char *path) {
+void storage_init(const char *path, const blocks_config_t *conf) {
   // initialize blocks and directory
   printf("initalizing storage\n");
-  blocks_init(path);
+  blocks_init(path, conf);
+  dcache_init();
+  journal_begin();
   directory_init();
+  journal_end();
+}
+
+// write everything back and close the image
+void storage_free() {
+  printf("closing storage\n");
+  dcache_free();
+  blocks_free();
 }
 
 // get objects stats, returns something other than zero if it doesn't work
@@ -31,66 +54,225 @@ int storage_stat(const char *path, int inum, struct stat *st) {
   if (S_ISREG(node->mode)) {
     st->st_size = node->size;
   }
+  st->st_blksize = BLOCK_SIZE;
+  st->st_blocks = (blkcnt_t)node->blocks * (BLOCK_SIZE / 512);
 
   return 0;
 }
 
+// read from the inode; call inside a journal operation
+static int read_inode(inode_t *node, char *buf, size_t size, off_t offset) {
+  // make sure offset and size are >= 0
+  assert(offset >= 0);
+  assert(size >= 0);
+
+  // copy size bytes to buf from path + offset
+  if (size == 0 || offset >= node->size) {
+    return 0;
+  }
+  if (offset + size > node->size) {
+    size = node->size - offset;
+  }
+
+  if (node->flags & INODE_INLINE) {
+    memcpy(buf, node->inline_data + offset, size);
+    return size;
+  }
+
+  // copy one run of physically contiguous blocks at a time
+  char *cbuf = NULL;
+  size_t done = 0;
+  int rv = size;
+  while (done < size) {
+    int count, flags;
+    int bnum = extent_lookup(node, offset / BLOCK_SIZE, &count, &flags);
+    int block_off = offset % BLOCK_SIZE;
+    size_t n = (size_t)count * BLOCK_SIZE - block_off;
+    if (n > size - done) {
+      n = size - done;
+    }
+
+    // compressed clusters are read whole, the rest of them looks like a hole
+    int cluster = offset / cluster_bytes();
+    if ((bnum == 0 || (flags & EXTENT_COMPRESSED)) &&
+        cluster_lookup(node, cluster, NULL) != 0) {
+      int64_t cluster_off = offset - cluster * cluster_bytes();
+      n = cluster_bytes() - cluster_off;
+      if (n > size - done) {
+        n = size - done;
+      }
+      if (cbuf == NULL) {
+        cbuf = malloc(cluster_bytes());
+        assert(cbuf);
+      }
+      if (cluster_read(node, cluster, cbuf) < 0) {
+        rv = -EIO;
+        break;
+      }
+      memcpy(buf + done, cbuf + cluster_off, n);
+    } else if (bnum == 0 || (flags & EXTENT_UNWRITTEN)) {
+      // holes and preallocated blocks both read as zeros
+      memset(buf + done, 0, n);
+    } else {
+      if (blocks_read_checked(bnum, block_off, buf + done, n) < 0) {
+        rv = -EIO;
+        break;
+      }
+    }
+    done += n;
+    offset += n;
+  }
+
+  free(cbuf);
+  return rv;
+}
+
 // read data from object into buf starting at an offset
 int storage_read(const char *path, int inum,  char *buf, size_t size, off_t offset) {
   if (path) inum = tree_lookup(path);
 
   printf("reading from inode at %d\n", inum);
 
-  inode_t *node = get_inode(inum);
+  // the dedup pass remaps blocks of files that may be read meanwhile
+  journal_begin();
+  int rv = read_inode(get_inode(inum), buf, size, offset);
+  journal_end();
+  return rv;
+}
 
-  // make sure offset and size are >= 0
-  assert(offset >= 0);
-  assert(size >= 0);
+// write the bytes into the blocks backing them, mapping blocks where needed
+static int map_and_write(inode_t *node, const char *buf, size_t size,
+                         off_t offset) {
+  // fill in any holes being written to
+  if (map_inode(node, offset, size) < 0) {
+    return -ENOSPC;
+  }
 
-  // copy size bytes to buf from path + offset
-  if (size == 0) {
-    return 0;
-  } else {
-    if (offset + size > node->size) {
-      size = node->size - offset;
+  // copy one run of physically contiguous blocks at a time
+  size_t done = 0;
+  while (done < size) {
+    int count;
+    int bnum = extent_lookup(node, offset / BLOCK_SIZE, &count, NULL);
+    assert(bnum != 0);
+    int block_off = offset % BLOCK_SIZE;
+    size_t n = (size_t)count * BLOCK_SIZE - block_off;
+    if (n > size - done) {
+      n = size - done;
     }
-    inode_t* pnode = node;
 
-    while (offset >= BLOCK_SIZE) {
-      pnode = get_inode(pnode->next_inode);
-      offset -= BLOCK_SIZE;
+    if (blocks_write(bnum, block_off, buf + done, n) < 0) {
+      return -EIO;
     }
-    void *block_temp = blocks_get_block(pnode->block);
-    block_temp += offset;
-
-    if (size + offset > BLOCK_SIZE) {
-      memcpy(buf, block_temp, BLOCK_SIZE - offset);
-      int temp_sz = size;
-      temp_sz -= BLOCK_SIZE - offset;
-      buf += BLOCK_SIZE - offset;
-      while (temp_sz > BLOCK_SIZE) {
-        pnode = get_inode(pnode->next_inode);
-        block_temp = blocks_get_block(pnode->block);
-        memcpy(buf, block_temp, BLOCK_SIZE);
-        buf += BLOCK_SIZE;
-        temp_sz -= BLOCK_SIZE;
+    done += n;
+    offset += n;
+  }
+  return 0;
+}
+
+// write the bytes like map_and_write, except that with dedup on the whole
+// blocks among them share a block that already holds the same data
+static int write_blocks(inode_t *node, const char *buf, size_t size,
+                        off_t offset) {
+  int64_t end = offset + size;
+  int64_t first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+  int64_t last = end / BLOCK_SIZE * BLOCK_SIZE;
+  if (!dedup_enabled() || first >= last) {
+    return map_and_write(node, buf, size, offset);
+  }
+
+  int rv = 0;
+  if (offset < first) {
+    rv = map_and_write(node, buf, first - offset, offset);
+  }
+  for (int64_t pos = first; pos < last && rv == 0; pos += BLOCK_SIZE) {
+    const char *data = buf + (pos - offset);
+    uint32_t fp;
+    rv = dedup_block(node, pos / BLOCK_SIZE, data, &fp);
+    if (rv == 0) {
+      rv = map_and_write(node, data, BLOCK_SIZE, pos);
+      if (rv == 0) {
+        dedup_add(extent_lookup(node, pos / BLOCK_SIZE, NULL, NULL), fp);
       }
-      pnode = get_inode(pnode->next_inode);
-      block_temp = blocks_get_block(pnode->block);
-      memcpy(buf, block_temp, temp_sz);
-    } else {
-      memcpy(buf, block_temp, size);
     }
+    rv = rv < 0 ? rv : 0;
+  }
+  if (rv == 0 && last < end) {
+    rv = map_and_write(node, buf + (last - offset), end - last, last);
+  }
+  return rv;
+}
+
+// Store the cluster whose new contents are at cbuf: compressed if the file
+// compresses and that pays, plain otherwise. When it stays plain only the
+// bytes [from, to) of it are written, the rest being on disk already (the
+// whole cluster must be given for one that was compressed).
+static int store_cluster(inode_t *node, int cluster, const char *cbuf,
+                         int64_t from, int64_t to) {
+  if (node->flags & INODE_COMPRESSED) {
+    int rv = cluster_pack(node, cluster, cbuf);
+    if (rv != 0) {
+      return rv < 0 ? rv : 0;
+    }
+  }
 
-    return size;
+  // compressed blocks cannot be written in place
+  if (cluster_lookup(node, cluster, NULL) != 0) {
+    extent_remove(node, cluster * CLUSTER_BLOCKS, CLUSTER_BLOCKS);
   }
+
+  int64_t start = cluster * cluster_bytes();
+  if (to > node->size - start) {
+    to = node->size - start;
+  }
+  if (from >= to) {
+    return 0;
+  }
+  return write_blocks(node, cbuf + from, to - from, start + from);
 }
 
-// write from path to buff starting at an offset
-int storage_write(const char *path, int inum, const char *buf, size_t size,
-                  off_t offset) {
-  if (path) inum = tree_lookup(path);
-  assert(inum >= 0);
+// write to a file that compresses or has compressed clusters, one cluster
+// at a time
+static int write_clusters(inode_t *node, const char *buf, size_t size,
+                          off_t offset) {
+  char *cbuf = NULL;
+  size_t done = 0;
+  int rv = 0;
+  while (done < size && rv == 0) {
+    int cluster = offset / cluster_bytes();
+    int64_t cluster_off = offset - cluster * cluster_bytes();
+    size_t n = cluster_bytes() - cluster_off;
+    if (n > size - done) {
+      n = size - done;
+    }
+
+    int packed = cluster_lookup(node, cluster, NULL) != 0;
+    if (!packed && !(node->flags & INODE_COMPRESSED)) {
+      rv = write_blocks(node, buf + done, n, offset);
+    } else {
+      if (cbuf == NULL) {
+        cbuf = malloc(cluster_bytes());
+        assert(cbuf);
+      }
+      // the bytes the write leaves alone come from what is there
+      if (n < cluster_bytes()) {
+        rv = cluster_read(node, cluster, cbuf);
+      }
+      if (rv == 0) {
+        memcpy(cbuf + cluster_off, buf + done, n);
+        rv = packed ? store_cluster(node, cluster, cbuf, 0, cluster_bytes())
+                    : store_cluster(node, cluster, cbuf, cluster_off,
+                                    cluster_off + n);
+      }
+    }
+    done += n;
+    offset += n;
+  }
+  free(cbuf);
+  return rv;
+}
+
+// write to the inode at inum; call inside a journal operation
+static int write_inode(int inum, const char *buf, size_t size, off_t offset) {
   inode_t *node = get_inode(inum);
 
   printf("writing from inode at %d\n", inum);
@@ -101,38 +283,66 @@ int storage_write(const char *path, int inum, const char *buf, size_t size,
   // copy size bytes from buf to path + offset
   if (size == 0) {
     return 0;
-  } else {
-    if (size + offset > node->size) {
-      if (grow_inode(node, size + offset - node->size) < 0) {
-        return -1;
-      }
-    }
-    inode_t* pnode = node;
-    while (offset >= BLOCK_SIZE) {
-      pnode = get_inode(pnode->next_inode);
-      offset -= BLOCK_SIZE;
-    }
-    void *block_temp = blocks_get_block(pnode->block);
-    block_temp += offset;
-
-    if (size + offset > BLOCK_SIZE) {
-      memcpy(block_temp, buf, BLOCK_SIZE - offset);
-      int temp_sz = size;
-      temp_sz -= BLOCK_SIZE - offset;
-      buf += BLOCK_SIZE - offset;
-      while (temp_sz > 0) {
-        pnode = get_inode(pnode->next_inode);
-        block_temp = blocks_get_block(pnode->block);
-        memcpy(block_temp, buf, temp_sz > BLOCK_SIZE ? BLOCK_SIZE : temp_sz);
-        temp_sz -= BLOCK_SIZE;
-        buf += BLOCK_SIZE;
-      }
-    } else {
-      memcpy(block_temp, buf, size);
+  }
+  if (size + offset > node->size) {
+    if (grow_inode(node, size + offset - node->size) < 0) {
+      return -ENOSPC;
     }
+  }
 
+  if (node->flags & INODE_INLINE) {
+    inode_dirty(node);
+    memcpy(node->inline_data + offset, buf, size);
     return size;
   }
+
+  int rv;
+  int last = (offset + size - 1) / cluster_bytes() + 1;
+  if ((node->flags & INODE_COMPRESSED) ||
+      cluster_next(node, offset / cluster_bytes(), last) < last) {
+    rv = write_clusters(node, buf, size, offset);
+  } else {
+    rv = write_blocks(node, buf, size, offset);
+  }
+  return rv < 0 ? rv : (int)size;
+}
+
+// write from path to buff starting at an offset
+int storage_write(const char *path, int inum, const char *buf, size_t size,
+                  off_t offset) {
+  if (path) inum = tree_lookup(path);
+  assert(inum >= 0);
+
+  journal_begin();
+  int rv = write_inode(inum, buf, size, offset);
+  journal_end();
+  return rv;
+}
+
+// shrink the file to size bytes
+static int shrink_file(inode_t *node, int64_t size) {
+  int cluster = size / cluster_bytes();
+  int64_t cluster_off = size % cluster_bytes();
+  if ((node->flags & INODE_INLINE) || size == 0 || cluster_off == 0 ||
+      cluster_lookup(node, cluster, NULL) == 0) {
+    return shrink_inode(node, node->size - size);
+  }
+
+  // a compressed cluster cut by the new end is stored again without the
+  // bytes past it, which would come back if the file grew again
+  char *cbuf = malloc(cluster_bytes());
+  assert(cbuf);
+  int rv = cluster_read(node, cluster, cbuf);
+  if (rv == 0) {
+    memset(cbuf + cluster_off, 0, cluster_bytes() - cluster_off);
+    extent_remove(node, cluster * CLUSTER_BLOCKS, CLUSTER_BLOCKS);
+    rv = shrink_inode(node, node->size - size);
+  }
+  if (rv == 0) {
+    rv = store_cluster(node, cluster, cbuf, 0, cluster_off);
+  }
+  free(cbuf);
+  return rv;
 }
 
 // truncate file to size
@@ -141,50 +351,571 @@ int storage_truncate(const char *path, off_t size) {
   int inum = tree_lookup(path);
   assert(inum >= 0);
 
+  journal_begin();
+
   // get inode at inum and its size
   inode_t *node = get_inode(inum);
-  int node_size = node->size;
+  int64_t node_size = node->size;
 
   printf("truncating inode at %d\n", inum);
 
   // grow inode if the size is greater than the inode's current size
+  int rv;
   if (size >= node->size) {
-    int rv = grow_inode(node, size - node_size);
-    return rv;
+    rv = grow_inode(node, size - node_size);
   }
   // shrink inode if the size is less than the inode's curent size
   else {
-    int rv = shrink_inode(node, node_size - size);
-    return rv;
+    rv = shrink_file(node, size);
   }
+
+  journal_end();
+  return rv;
 }
 
-// make object at path
-int storage_mknod(const char *path, const char *name, int pinum, int mode) {
-  // make sure it doesn't already exist
-  if (path) {
-    pinum = tree_lookup(path);
+// find the next data or hole in the inode; call inside a journal operation
+static off_t seek_inode(int inum, off_t offset, int whence) {
+  inode_t *node = get_inode(inum);
+  if (node == NULL) {
+    return -ENOENT;
   }
-  
-  assert(pinum >= 0);
+
+  printf("seeking %s from %ld in inode %d\n",
+         whence == SEEK_DATA ? "data" : "hole", (long)offset, inum);
+
+  if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+    return -EINVAL;
+  }
+  if (offset < 0 || offset >= node->size) {
+    return -ENXIO;
+  }
+  if (node->flags & INODE_INLINE) {
+    return whence == SEEK_DATA ? offset : node->size;
+  }
+
+  // walk the extents one run (mapped or hole) at a time
+  int64_t lblock = offset / BLOCK_SIZE;
+  while (lblock * BLOCK_SIZE < node->size) {
+    int count, flags;
+    int mapped = extent_lookup(node, lblock, &count, &flags) != 0 &&
+                 !(flags & EXTENT_UNWRITTEN);
+
+    // the unmapped end of a compressed cluster is data too
+    int cluster = lblock / CLUSTER_BLOCKS;
+    if ((flags & EXTENT_COMPRESSED) ||
+        (!mapped && cluster_lookup(node, cluster, NULL) != 0)) {
+      mapped = 1;
+      count = (cluster + 1) * CLUSTER_BLOCKS - lblock;
+    }
+    if (mapped == (whence == SEEK_DATA)) {
+      int64_t found = lblock * BLOCK_SIZE;
+      return found > offset ? found : offset;
+    }
+    lblock += count;
+  }
+
+  // only holes left: there is no more data, but EOF counts as a hole
+  return whence == SEEK_DATA ? -ENXIO : node->size;
+}
+
+// find the next data or hole at or after offset (SEEK_DATA / SEEK_HOLE)
+off_t storage_lseek(const char *path, int inum, off_t offset, int whence) {
+  if (path) inum = tree_lookup(path);
+  journal_begin();
+  off_t rv = seek_inode(inum, offset, whence);
+  journal_end();
+  return rv;
+}
+
+// list the runs of blocks backing the inode into a malloced array, joining
+// runs that meet on disk; call inside a journal operation. Returns the
+// number of runs.
+static int inode_runs(inode_t *node, block_run_t **runs) {
+  *runs = NULL;
+  if (node->flags & INODE_INLINE) {
+    return 0;
+  }
+
+  int count = 0, cap = 0;
+  int64_t lblock = 0;
+  while (lblock < INT_MAX) {
+    int n;
+    int bnum = extent_lookup(node, lblock, &n, NULL);
+    lblock += n;
+    if (bnum == 0) {
+      continue;
+    }
+    block_run_t *last = count > 0 ? &(*runs)[count - 1] : NULL;
+    if (last && last->bnum + last->count == bnum) {
+      last->count += n;
+      continue;
+    }
+    if (count == cap) {
+      cap = cap ? 2 * cap : 16;
+      *runs = realloc(*runs, cap * sizeof(block_run_t));
+      assert(*runs);
+    }
+    (*runs)[count].bnum = bnum;
+    (*runs)[count].count = n;
+    count++;
+  }
+  return count;
+}
+
+// write back the blocks of the file, waiting for them if asked to
+static int sync_inode(int inum, int wait) {
+  journal_begin();
+  inode_t *node = get_inode(inum);
+  block_run_t *runs;
+  int count = node ? inode_runs(node, &runs) : -1;
+  journal_end();
+  if (count < 0) {
+    return -ENOENT;
+  }
+  int rv = blocks_sync(runs, count, wait);
+  free(runs);
+  return rv;
+}
+
+// get the data and metadata of the file onto the disk
+int storage_fsync(const char *path, int inum) {
+  if (path) inum = tree_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+
+  printf("syncing inode %d\n", inum);
+
+  if (!journal_active()) {
+    // nothing orders the metadata, so it all goes at once
+    return blocks_sync_all();
+  }
+  // a commit takes all the data written before it along, so the file's own
+  // blocks only need writing when there was nothing to commit
+  int rv = journal_sync();
+  if (rv == 0) {
+    rv = sync_inode(inum, 1);
+  }
+  return rv < 0 ? rv : 0;
+}
+
+// start writing back the data of the file, as it is closed
+int storage_flush(const char *path, int inum) {
+  if (path) inum = tree_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  return sync_inode(inum, 0);
+}
+
+// zero the bytes [offset, end) of the inode that are backed by written blocks
+static void zero_range(inode_t *node, int64_t offset, int64_t end) {
+  while (offset < end) {
+    int count, flags;
+    int bnum = extent_lookup(node, offset / BLOCK_SIZE, &count, &flags);
+    int block_off = offset % BLOCK_SIZE;
+    int64_t n = (int64_t)count * BLOCK_SIZE - block_off;
+    if (n > end - offset) {
+      n = end - offset;
+    }
+
+    if (bnum != 0 && !(flags & EXTENT_UNWRITTEN)) {
+      blocks_write(bnum, block_off, NULL, n);
+    }
+    offset += n;
+  }
+}
+
+// free the blocks behind [offset, end) of the plain part of a file,
+// zeroing partial blocks
+static int punch_blocks(inode_t *node, int64_t offset, int64_t end) {
+  // only whole blocks can be unmapped, the partial ones at the edges are
+  // zeroed in place (in copies of their own, if they are shared)
+  int first = bytes_to_blocks(offset);
+  int last = end / BLOCK_SIZE;
+  if (unshare_inode(node, offset, (int64_t)first * BLOCK_SIZE - offset) < 0 ||
+      unshare_inode(node, (int64_t)last * BLOCK_SIZE,
+                    end - (int64_t)last * BLOCK_SIZE) < 0) {
+    return -ENOSPC;
+  }
+  if (first >= last) {
+    zero_range(node, offset, end);
+    return 0;
+  }
+  zero_range(node, offset, (int64_t)first * BLOCK_SIZE);
+  zero_range(node, (int64_t)last * BLOCK_SIZE, end);
+
+  // hand the space back to the host before forgetting where it was
+  int lblock = first;
+  while (lblock < last) {
+    int count;
+    int bnum = extent_lookup(node, lblock, &count, NULL);
+    if (count > last - lblock) {
+      count = last - lblock;
+    }
+    if (bnum != 0) {
+      blocks_discard(bnum, count);
+    }
+    lblock += count;
+  }
+  return extent_remove(node, first, last - first);
+}
+
+// zero [offset, end) of the compressed cluster, dropping it if that is all
+// of it
+static int punch_cluster(inode_t *node, int cluster, int64_t offset,
+                         int64_t end) {
+  int64_t start = cluster * cluster_bytes();
+  if (offset == start &&
+      (end == start + cluster_bytes() || end >= node->size)) {
+    int count;
+    int bnum = cluster_lookup(node, cluster, &count);
+    blocks_discard(bnum, count);
+    return extent_remove(node, cluster * CLUSTER_BLOCKS, CLUSTER_BLOCKS);
+  }
+
+  char *cbuf = malloc(cluster_bytes());
+  assert(cbuf);
+  int rv = cluster_read(node, cluster, cbuf);
+  if (rv == 0) {
+    memset(cbuf + offset - start, 0, end - offset);
+    rv = store_cluster(node, cluster, cbuf, 0, cluster_bytes());
+  }
+  free(cbuf);
+  return rv;
+}
+
+// free the blocks behind [offset, offset + length), zeroing partial blocks
+static int punch_hole(inode_t *node, int64_t offset, int64_t length) {
+  int64_t end = offset + length;
+  if (end > node->size) {
+    end = node->size;
+  }
+  if (offset >= end) {
+    return 0;
+  }
+
+  if (node->flags & INODE_INLINE) {
+    inode_dirty(node);
+    memset(node->inline_data + offset, 0, end - offset);
+    return 0;
+  }
+
+  // compressed clusters one at a time, the plain runs between them in one go
+  int last = (end - 1) / cluster_bytes() + 1;
+  while (offset < end) {
+    int cluster = offset / cluster_bytes();
+    int next = cluster_next(node, cluster, last);
+    int64_t stop = next * cluster_bytes();
+    if (next == cluster) {
+      stop += cluster_bytes();
+    }
+    if (stop > end) {
+      stop = end;
+    }
+    int rv = next == cluster ? punch_cluster(node, cluster, offset, stop)
+                             : punch_blocks(node, offset, stop);
+    if (rv < 0) {
+      return rv;
+    }
+    offset = stop;
+  }
+  return 0;
+}
+
+// fallocate on the inode at inum; call inside a journal operation
+static int fallocate_inode(int inum, int mode, off_t offset, off_t length) {
+  inode_t *node = get_inode(inum);
+
+  printf("fallocate(%d, mode %d, %ld, %ld)\n", inum, mode, (long)offset,
+         (long)length);
+
+  if (offset < 0 || length <= 0) {
+    return -EINVAL;
+  }
+  if (!S_ISREG(node->mode)) {
+    return -ENODEV;
+  }
+
+  if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+    return punch_hole(node, offset, length) < 0 ? -ENOSPC : 0;
+  }
+  if (mode != 0 && mode != FALLOC_FL_KEEP_SIZE) {
+    return -EOPNOTSUPP;
+  }
+
+  int64_t end = offset + length;
+
+  // a range that still fits in the inode needs no blocks at all
+  if (!((node->flags & INODE_INLINE) && end <= INODE_INLINE_SIZE)) {
+    if (prealloc_inode(node, offset, length) < 0) {
+      return -ENOSPC;
+    }
+  }
+
+  if (!(mode & FALLOC_FL_KEEP_SIZE) && end > node->size) {
+    return grow_inode(node, end - node->size);
+  }
+  return 0;
+}
+
+// preallocate or deallocate space for [offset, offset + length)
+int storage_fallocate(const char *path, int inum, int mode, off_t offset,
+                      off_t length) {
+  if (path) inum = tree_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+
+  journal_begin();
+  int rv = fallocate_inode(inum, mode, offset, length);
+  journal_end();
+  return rv;
+}
+
+// does the file have compressed clusters among the bytes at offset?
+static int has_clusters(inode_t *node, int64_t offset, int64_t len) {
+  if ((node->flags & INODE_INLINE) || len <= 0) {
+    return 0;
+  }
+  int last = (offset + len - 1) / cluster_bytes() + 1;
+  return cluster_next(node, offset / cluster_bytes(), last) < last;
+}
+
+// share len bytes at src_off of one file with another file at dst_off
+int storage_clone(const char *src_path, int src_inum, off_t src_off,
+                  off_t len, const char *dst_path, int dst_inum,
+                  off_t dst_off) {
+  if (src_path) src_inum = tree_lookup(src_path);
+  if (dst_path) dst_inum = tree_lookup(dst_path);
+  if (src_inum < 0 || dst_inum < 0) {
+    return -ENOENT;
+  }
+  inode_t *src = get_inode(src_inum);
+  inode_t *dst = get_inode(dst_inum);
+  if (src == NULL || dst == NULL) {
+    return -ENOENT;
+  }
+
+  printf("clone(%d @+%ld, %ld bytes -> %d @+%ld)\n", src_inum, (long)src_off,
+         (long)len, dst_inum, (long)dst_off);
+
+  if (!S_ISREG(src->mode) || !S_ISREG(dst->mode)) {
+    return -EINVAL;
+  }
+  if (snapshot_viewing()) {
+    return -EROFS;
+  }
+  if (!blocks_can_share()) {
+    return -EOPNOTSUPP;
+  }
+  if (src_off < 0 || dst_off < 0 || len < 0 || src_off > src->size) {
+    return -EINVAL;
+  }
+  if (len == 0) {
+    len = src->size - src_off;
+  }
+  if (src_off + len > src->size) {
+    return -EINVAL;
+  }
+
+  // only whole blocks can be shared, except for the last block of the
+  // source when it lands at the end of the destination too
+  int to_eof = src_off + len == src->size;
+  if (src_off % BLOCK_SIZE != 0 || dst_off % BLOCK_SIZE != 0 ||
+      (!to_eof && len % BLOCK_SIZE != 0) ||
+      (len % BLOCK_SIZE != 0 && dst_off + len < dst->size)) {
+    return -EINVAL;
+  }
+  if (src_inum == dst_inum && src_off < dst_off + len &&
+      dst_off < src_off + len) {
+    return -EINVAL;
+  }
+  if (len == 0) {
+    return 0;
+  }
+
+  // and compressed clusters only whole, to the start of a cluster
+  int packed =
+      has_clusters(src, src_off, len) || has_clusters(dst, dst_off, len);
+  if (packed && (src_off % cluster_bytes() != 0 ||
+                 dst_off % cluster_bytes() != 0 ||
+                 (!to_eof && len % cluster_bytes() != 0) ||
+                 (len % cluster_bytes() != 0 && dst_off + len < dst->size))) {
+    return -EINVAL;
+  }
+
+  journal_begin();
+  int rv;
+  if (src->flags & INODE_INLINE) {
+    // there are no blocks to share, and copying is just as cheap
+    rv = write_inode(dst_inum, src->inline_data + src_off, len, dst_off);
+    rv = rv < 0 ? rv : 0;
+  } else {
+    // a compressed cluster the range ends in goes whole, what is left of it
+    // is past the end of the file
+    if (packed && !(dst->flags & INODE_INLINE)) {
+      int first = dst_off / cluster_bytes();
+      int last = (dst_off + len - 1) / cluster_bytes() + 1;
+      extent_remove(dst, first * CLUSTER_BLOCKS,
+                    (last - first) * CLUSTER_BLOCKS);
+    }
+    rv = clone_inode(dst, dst_off, src, src_off, len);
+  }
+  journal_end();
+  return rv;
+}
+
+// grow the filesystem while it is mounted
+int storage_resize(int64_t size) {
+  printf("resizing to %ld bytes\n", (long)size);
+  if (snapshot_viewing()) {
+    return -EROFS;
+  }
+  journal_begin();
+  int rv = blocks_grow(size);
+  journal_end();
+  return rv;
+}
+
+// discard the free space among the bytes [start, start + len) of the volume
+int64_t storage_trim(uint64_t start, uint64_t len, uint64_t minlen) {
+  printf("trimming %lu bytes from %lu (runs of %lu bytes or more)\n",
+         (unsigned long)len, (unsigned long)start, (unsigned long)minlen);
+  if (start >= (uint64_t)NUFS_SIZE) {
+    return -EINVAL;
+  }
+  uint64_t end = len < (uint64_t)NUFS_SIZE - start ? start + len : NUFS_SIZE;
+  int64_t first = start / BLOCK_SIZE;
+  int64_t last = end / BLOCK_SIZE;
+  if (first < get_superblock()->data_start) {
+    first = get_superblock()->data_start;
+  }
+  if (first >= last) {
+    return 0;
+  }
+  int64_t min = (minlen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (min > last - first) {
+    return 0;
+  }
+  int64_t rv = discard_range(first, last, min > 0 ? min : 1);
+  return rv < 0 ? rv : rv * BLOCK_SIZE;
+}
+
+// get the chattr flags of a file or directory
+int storage_get_flags(const char *path, int inum) {
+  if (path) inum = tree_lookup(path);
+  inode_t *node = inum < 0 ? NULL : get_inode(inum);
+  if (node == NULL) {
+    return -ENOENT;
+  }
+  return node->flags & INODE_COMPRESSED ? NUFS_COMPR_FL : 0;
+}
+
+// set the chattr flags of a file or directory
+int storage_set_flags(const char *path, int inum, int flags) {
+  if (path) inum = tree_lookup(path);
+  inode_t *node = inum < 0 ? NULL : get_inode(inum);
+  if (node == NULL) {
+    return -ENOENT;
+  }
+
+  printf("setting flags of inode %d to %x\n", inum, flags);
+
+  if (flags & ~NUFS_COMPR_FL) {
+    return -EOPNOTSUPP;
+  }
+  if (!S_ISREG(node->mode) && !S_ISDIR(node->mode)) {
+    return -ENOTTY;
+  }
+  if (snapshot_viewing()) {
+    return -EROFS;
+  }
+
+  journal_begin();
+  inode_dirty(node);
+  if (flags & NUFS_COMPR_FL) {
+    node->flags |= INODE_COMPRESSED;
+  } else {
+    node->flags &= ~INODE_COMPRESSED;
+  }
+  journal_end();
+  return 0;
+}
+
+// take a read-only snapshot of the whole volume
+int storage_snapshot(const char *name) {
+  printf("taking snapshot %s\n", name);
+  if (snapshot_viewing()) {
+    return -EROFS;
+  }
+  journal_begin();
+  int rv = snapshot_create(name);
+  journal_end();
+  return rv;
+}
+
+// delete a snapshot
+int storage_delete_snapshot(const char *name) {
+  printf("deleting snapshot %s\n", name);
+  if (snapshot_viewing()) {
+    return -EROFS;
+  }
+  journal_begin();
+  int rv = snapshot_delete(name);
+  journal_end();
+  return rv;
+}
+
+// make object in the directory at pinum; call inside a journal operation
+static int mknod_inode(int pinum, const char *path, const char *name,
+                       int mode) {
   inode_t *directory_node = get_inode(pinum);
   int inum = directory_lookup(directory_node, name);
   if (inum >= 0) {
     return -EEXIST;
   }
 
-  inum = alloc_inode();
+  inum = alloc_inode(mode);
+  if (inum < 0) {
+    return -ENOSPC;
+  }
   inode_t *node = get_inode(inum);
+  inode_dirty(node);
   node->refs = 1;
   node->mode = mode;
   node->size = 0;
 
+  // files and directories in a compressed directory compress too
+  if ((directory_node->flags & INODE_COMPRESSED) &&
+      (S_ISREG(mode) || S_ISDIR(mode))) {
+    node->flags |= INODE_COMPRESSED;
+  }
+
   printf("creating object for inode %d\n", inum);
 
-  directory_put(directory_node, name, inum);
-  printf("mknod(%s %s, %04o) -> %d\n", path, name, mode, 0);
+  int rv = directory_put(directory_node, name, inum);
+  if (rv < 0) {
+    node->refs = 0;
+    free_inode(inum);
+  }
+  printf("mknod(%s %s, %04o) -> %d\n", path, name, mode, rv);
 
-  return 0;
+  return rv;
+}
+
+// make object at path
+int storage_mknod(const char *path, const char *name, int pinum, int mode) {
+  // make sure it doesn't already exist
+  if (path) {
+    pinum = tree_lookup(path);
+  }
+  
+  assert(pinum >= 0);
+  journal_begin();
+  int rv = mknod_inode(pinum, path, name, mode);
+  journal_end();
+  return rv;
 }
 
 // unlink object at path
@@ -193,11 +924,17 @@ int storage_unlink(const char *path, int pinum, const char *name) {
 
   // get directory inode
   if (path) pinum = tree_lookup(path);
+  journal_begin();
   inode_t *directory_node = get_inode(pinum);
 
   // unlink the child from the directory
   int inum = directory_lookup(directory_node, name);
+  if (inum < 0) {
+    journal_end();
+    return inum;
+  }
   inode_t *node = get_inode(inum);
+  inode_dirty(node);
   node->refs--;
   int rv = directory_delete(directory_node, name);
 
@@ -207,6 +944,7 @@ int storage_unlink(const char *path, int pinum, const char *name) {
     free_inode(inum);
   }
 
+  journal_end();
   return rv;
 }
 
@@ -218,8 +956,7 @@ int storage_link(const char *from, int from_inum, const char *to_parent, int to_
 
   printf("linking");
 
-  inode_t *node = get_inode(from_inum);
-  node->refs++;
+  journal_begin();
 
   // get parent inode
   if (to_parent) to_pinum = tree_lookup(to_parent);
@@ -227,6 +964,12 @@ int storage_link(const char *from, int from_inum, const char *to_parent, int to_
 
   // create link
   int rv = directory_put(to_parent_node, to_child, from_inum);
+  if (rv >= 0) {
+    inode_t *node = get_inode(from_inum);
+    inode_dirty(node);
+    node->refs++;
+  }
+  journal_end();
 
   // return status
   return rv;
@@ -236,14 +979,19 @@ int storage_link(const char *from, int from_inum, const char *to_parent, int to_
 int storage_rename(const char *from_parent, int from_pinum, const char *from_child, const char *to_parent, int to_pinum, const char *to_child) {
   if (from_parent) from_pinum = tree_lookup(from_parent);
 
+  // both halves land in the same transaction
+  journal_begin();
   inode_t* from_pnode = get_inode(from_pinum);
   int from_inum = directory_lookup(from_pnode, from_child);
   
-  storage_link(NULL, from_inum, to_parent, to_pinum, to_child);
-  storage_unlink(from_parent, from_pinum, from_child);
+  int rv = storage_link(NULL, from_inum, to_parent, to_pinum, to_child);
+  if (rv >= 0) {
+    storage_unlink(from_parent, from_pinum, from_child);
+  }
+  journal_end();
 
   printf("renaming");
-  return 0;
+  return rv < 0 ? rv : 0;
 }
 
 // list objects at path
@@ -252,26 +1000,45 @@ dirent_node_t *storage_list(const char *path, int inum) {
   return directory_list(path, inum);
 }
 
+// list the directory from the cookie on, see directory_readdir
+int storage_readdir(const char *path, int inum, off_t cookie, dir_fill_t fill,
+                    void *arg) {
+  if (path) inum = tree_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  inode_t *node = get_inode(inum);
+  if (!S_ISDIR(node->mode)) {
+    return -ENOTDIR;
+  }
+  return directory_readdir(node, cookie, fill, arg);
+}
+
 // retrieve the parent dir of the path, mutates directory
 void split_path(const char *path, char *directory, char *name) {
-  strcpy(directory, path);
-
-  // start at end of path, iterate until /
-  int counter = 0;
-  int index = strlen(path) - 1;
-  while (path[index] != '/') {
-    counter++;
-    index--;
+  // find the last name
+  path_iter_t it;
+  path_begin(&it, path);
+  const char *last = path + strlen(path);
+  int len = 0;
+  while (path_next(&it)) {
+    last = it.name;
+    len = it.len;
   }
 
-  // add null terminator at end of parent
-  if (counter != strlen(path) - 1) {
-    directory[strlen(path) - counter - 1] = '\0';
-    if (name) strcpy(name, &directory[strlen(path) - counter]);
+  // the parent ends before the slashes in front of it, the root has none
+  size_t end = last - path;
+  while (end > 0 && path[end - 1] == '/') {
+    end--;
   }
-  // no parent directory, add null terminator
-  else {
-    directory[1] = '\0';
-    if (name) strcpy(name, &path[1]);
+  if (end == 0) {
+    strcpy(directory, "/");
+  } else {
+    memcpy(directory, path, end);
+    directory[end] = '\0';
+  }
+  if (name) {
+    memcpy(name, last, len);
+    name[len] = '\0';
   }
 }
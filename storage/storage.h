@@ -20,8 +20,11 @@
 #include "inode.h"
 #include "slist.h"
 
-// initialize storage
-void storage_init(const char *path);
+// initialize storage, conf may be NULL for the defaults
+void storage_init(const char *path, const blocks_config_t *conf);
+
+// write everything back and close the image
+void storage_free();
 
 // get objects stats, returns something other than zero if it doesn't work
 int storage_stat(const char *path, int inum, struct stat *st);
@@ -35,6 +38,58 @@ int storage_write(const char *path, int inum, const char *buf, size_t size, off_
 // truncate file to size
 int storage_truncate(const char *path, off_t size);
 
+// find the first data (SEEK_DATA) or hole (SEEK_HOLE) at or after offset,
+// returns the new offset or a negative errno
+off_t storage_lseek(const char *path, int inum, off_t offset, int whence);
+
+// get the data and metadata of the file or directory onto the disk, for
+// fsync. Concurrent calls share one journal commit, and when there is no
+// metadata to commit only the blocks of the file are written. Returns 0 or
+// a negative errno.
+int storage_fsync(const char *path, int inum);
+
+// start writing back the modified blocks of the file without waiting for
+// them, for close; returns 0 or a negative errno
+int storage_flush(const char *path, int inum);
+
+// preallocate (mode 0 or FALLOC_FL_KEEP_SIZE) or punch out
+// (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE) the bytes
+// [offset, offset + length), returns 0 or a negative errno
+int storage_fallocate(const char *path, int inum, int mode, off_t offset,
+                      off_t length);
+
+// make the len bytes at dst_off of one file share the blocks behind the
+// bytes at src_off of another (or the same) file, so they read the same
+// until either is written. len 0 means up to the end of the source. Offsets
+// must be block aligned, as must len unless the range ends at the end of
+// the source. Returns 0 or a negative errno.
+int storage_clone(const char *src_path, int src_inum, off_t src_off,
+                  off_t len, const char *dst_path, int dst_inum,
+                  off_t dst_off);
+
+// grow the filesystem to size bytes while it is mounted, returns 0 or a
+// negative errno
+int storage_resize(int64_t size);
+
+// punch the free space among the bytes [start, start + len) of the volume
+// out of the image, in runs of at least minlen bytes (like FITRIM); returns
+// the number of bytes discarded or a negative errno
+int64_t storage_trim(uint64_t start, uint64_t len, uint64_t minlen);
+
+// get the chattr flags of a file or directory (NUFS_COMPR_FL if the data
+// written to it is compressed, see compress.h), or a negative errno
+int storage_get_flags(const char *path, int inum);
+
+// set the chattr flags of a file or directory, returns 0 or a negative
+// errno (-EOPNOTSUPP for flags other than NUFS_COMPR_FL). Data already
+// written stays as it is.
+int storage_set_flags(const char *path, int inum, int flags);
+
+// take a read-only snapshot of the whole volume under the given name, or
+// delete one; returns 0 or a negative errno
+int storage_snapshot(const char *name);
+int storage_delete_snapshot(const char *name);
+
 // make object at path
 int storage_mknod(const char *path, const char *name, int pinum, int mode);
 
@@ -50,6 +105,11 @@ int storage_rename(const char *from_parent, int from_pinum, const char *from_chi
 // list objects at path
 dirent_node_t *storage_list(const char *path, int inum);
 
+// list the directory from the cookie on, calling fill for each entry until
+// it returns nonzero
+int storage_readdir(const char *path, int inum, off_t cookie, dir_fill_t fill,
+                    void *arg);
+
 // retrieve the parent dir of the path, mutates directory
 void split_path(const char *path, char *directory, char *name);
 
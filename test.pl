@@ -2,11 +2,13 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 74;
 use IO::Handle;
 
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    my ($opts) = @_;
+    $opts //= "";
+    system("(make mount NUFS_OPTS='$opts' 2>&1) >> test.log &");
     sleep 1;
 }
 
@@ -131,6 +133,39 @@ system("mv mnt/tmp/file.txt mnt/foo");
 ok(-e "mnt/foo/file.txt", "Move a file to another directory");
 my $msg6 = read_text("foo/file.txt");
 ok($msg4 eq $msg6, "Read data back correctly");
+system("mv mnt/foo mnt/moved");
+ok((-e "mnt/moved/file.txt" and !-e "mnt/foo/file.txt"),
+   "Paths follow a renamed directory");
+system("mv mnt/moved mnt/foo");
+
+say "# Big directories";
+
+mkdir("mnt/many");
+system("touch mnt/many/file-$_") for 1..1000;
+my @many = glob("mnt/many/file-*");
+ok(@many == 1000, "A directory holds 1000 files");
+unlink("mnt/many/file-$_") for grep { $_ % 2 } 1..1000;
+ok((-e "mnt/many/file-1000" and !-e "mnt/many/file-999"),
+   "Files are found and removed in a big directory");
+
+# listing it takes several readdir calls, each going on from the cookie the
+# last one stopped at
+opendir(my $dh, "mnt/many");
+my %seen;
+my $entries = 0;
+while (defined(my $name = readdir($dh))) {
+    next if $name eq "." or $name eq "..";
+    $seen{$name} = 1;
+    $entries++;
+}
+closedir($dh);
+ok(($entries == 500 and keys(%seen) == 500 and !$seen{"file-999"}),
+   "A big directory lists every file once");
+
+my $long = "n" x 255;
+write_text("many/$long", "long");
+ok((read_text("many/$long") eq "long\n" and !-e "mnt/many/${long}x"),
+   "Names can be 255 bytes long");
 
 unmount();
 
@@ -171,5 +206,243 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+say "# Sparse files";
+
+open my $sfh, ">", "mnt/sparse.bin";
+truncate $sfh, 8 * 1024 * 1024; # more than the whole 1MB image
+close $sfh;
+ok((-s "mnt/sparse.bin") == 8 * 1024 * 1024, "Sparse file larger than the disk");
+my $zeros = read_text_slice("sparse.bin", 16, 4 * 1024 * 1024);
+ok($zeros eq "\0" x 16, "Holes read back as zeros");
+
+say "# Preallocation";
+
+system("fallocate -l 64K mnt/prealloc.bin");
+ok((-s "mnt/prealloc.bin") == 64 * 1024, "Preallocating extends the file");
+$zeros = read_text_slice("prealloc.bin", 16, 32 * 1024);
+ok($zeros eq "\0" x 16, "Preallocated blocks read back as zeros");
+
+unmount();
+
+say "# Buffer cache";
+
+mount("-o backend=pread,cache_blocks=64");
+$back = read_text("larger.txt");
+ok($content eq $back, "Read back larger file through the buffer cache");
+write_text("cached.txt", $content);
+unmount();
+
+mount();
+$back = read_text("cached.txt");
+ok($content eq $back, "Data written through the buffer cache reaches the image");
+
+unmount();
+
+say "# Journal";
+
+mount("-o commit=1");
+write_text("journaled.txt", "survives a crash");
+sleep 2;
+system("pkill -9 -x nufs");
+unmount();
+
+mount();
+$back = read_text("journaled.txt");
+ok($back eq "survives a crash", "Committed metadata survives a crash");
+
+say "# Clones";
+
+ok(system("./nufsctl clone mnt/larger.txt mnt/clone.txt") == 0, "Clone a file");
+$back = read_text("clone.txt");
+ok($content eq $back, "Clone has the same content");
+write_text("clone.txt", "changed");
+$back = read_text("larger.txt");
+ok($content eq $back, "Writing the clone leaves the original alone");
+
+say "# Snapshots";
+
+write_text("snapped.txt", "before");
+ok(system("./nufsctl snapshot mnt first") == 0, "Take a snapshot");
+write_text("snapped.txt", "after");
+unlink("mnt/one.txt");
+ok(read_text(".snapshots/first/snapped.txt") eq "before",
+   "Snapshot keeps the old content");
+ok(-e "mnt/.snapshots/first/one.txt", "Snapshot keeps deleted files");
+ok(!open(my $snap, ">", "mnt/.snapshots/first/new.txt"), "Snapshots are read-only");
+ok(system("./nufsctl delete-snapshot mnt first") == 0 &&
+   `ls -a mnt/.snapshots` !~ /first/, "Delete a snapshot");
+
+unmount();
+
+say "# Checksums";
+
+mount("-o checksum=full");
+my $guarded = "checksummed data " x 1000;
+write_text("guarded.txt", $guarded);
+$back = read_text("guarded.txt");
+ok($guarded eq $back, "Read back data with checksums");
+unmount();
+
+# change a byte of the file behind the filesystem's back
+open my $img, "+<", "data.nufs";
+binmode $img;
+my $image = do { local $/ = undef; <$img> };
+seek $img, index($image, "checksummed data"), 0;
+print $img "C";
+close $img;
+
+mount("-o checksum=full");
+$back = read_text("guarded.txt");
+ok($guarded ne $back, "Damaged data is not read back");
+
+unmount();
+
+say "# Compression";
+
+mount();
+mkdir("mnt/logs");
+ok(system("./nufsctl compress mnt/logs") == 0, "Mark a directory compressed");
+my $log = "GET /index.html 200 ok\n" x 4000;
+write_text("logs/access.log", $log);
+unmount();
+
+mount();
+$back = read_text("logs/access.log");
+ok($back eq ($log =~ s/\s*$//r), "Read back compressed data");
+my $used = (stat "mnt/logs/access.log")[12] * 512;
+say "# $used bytes used for " . length($log);
+ok($used < length($log) / 2, "Compressed file takes less space");
+
+unmount();
+
+say "# Dedup";
+
+mount("-o dedup");
+my $artifact = join("", map { chr(65 + $_ % 26) x 4096 } 0 .. 15);
+write_text("artifact.bin", $artifact);
+write_text("artifact-copy.bin", $artifact);
+ok(read_text("artifact-copy.bin") eq $artifact, "Read back a deduplicated copy");
+write_text("artifact.bin", "rebuilt");
+ok(read_text("artifact-copy.bin") eq $artifact,
+   "Writing one copy leaves the other alone");
+unmount();
+
+mount("-o dedup");
+ok(read_text("artifact-copy.bin") eq $artifact, "Deduplicated data survives a remount");
+
+unmount();
+
+say "# fsck";
+
+# more extents than the inode holds, so the tree gets a level of its own
+mount();
+open my $efh, ">", "mnt/extents.bin";
+for my $i (0 .. 31) {
+    seek $efh, $i * 8192, 0;
+    print $efh "x";
+}
+close $efh;
+my $mapped = (stat "mnt/extents.bin")[12];
+truncate "mnt/extents.bin", 0;
+my $emptied = (stat "mnt/extents.bin")[12];
+unmount();
+ok(($mapped > 0 and $emptied == 0), "Truncating a file of many extents to 0");
+
+ok(system("./fsck.nufs -n data.nufs >> test.log") == 0, "A clean image checks clean");
+
+# mark the last free block before the tables at the end of the image in
+# use behind the filesystem's back
+open $img, "+<", "data.nufs";
+binmode $img;
+read $img, my $super, 96;
+my ($block_size, $bitmap_start, $tables) = (unpack "V24", $super)[2, 6, 17];
+my ($leak, $byte, $bits) = ($tables);
+do {
+    $leak--;
+    $byte = $bitmap_start * $block_size + int($leak / 8);
+    seek $img, $byte, 0;
+    read $img, $bits, 1;
+} while (ord($bits) & 1 << ($leak % 8));
+seek $img, $byte, 0;
+print $img chr(ord($bits) | 1 << ($leak % 8));
+close $img;
+
+ok(system("./fsck.nufs -n data.nufs >> test.log") >> 8 == 4, "fsck finds a leaked block");
+ok(system("./fsck.nufs -y data.nufs >> test.log") >> 8 == 1 &&
+   system("./fsck.nufs -n data.nufs >> test.log") == 0, "fsck repairs it");
+
+say "# Journal";
+
+# a journal big enough that transactions are only bounded by what fits in a
+# descriptor block, and no commits but the ones filling up forces
+system("rm -f data.nufs");
+system("./mkfs.nufs -J 4096 data.nufs 256M >> test.log");
+my $bypassed = () = `cat test.log` =~ /bypasses the journal/g;
+mount("-o commit=600");
+mkdir("mnt/many");
+for my $i (1 .. 15000) {
+    open my $fh, ">", "mnt/many/f$i";
+    close $fh;
+}
+unmount();
+sleep 1;
+ok((() = `cat test.log` =~ /bypasses the journal/g) == $bypassed,
+   "Full transactions leave room for their checksums");
+
+say "# mkfs";
 
+system("rm -f data.nufs");
+ok(system("./mkfs.nufs -b 8192 -N 1000 -J 64 data.nufs 16M >> test.log") == 0,
+   "Format an image with mkfs.nufs");
+ok(system("./mkfs.nufs data.nufs >> test.log 2>&1") != 0,
+   "mkfs.nufs leaves an existing image alone");
+
+mount();
+write_text("formatted.txt", "fresh");
+ok(read_text("formatted.txt") eq "fresh", "Use a formatted image");
+unmount();
+
+say "# fsync";
+
+mount("-o commit=60");
+open my $sfh2, ">", "mnt/synced.txt";
+$sfh2->print("on disk");
+ok($sfh2->sync, "Fsync a file");
+close $sfh2;
+system("pkill -9 -x nufs");
+unmount();
+
+mount();
+ok(read_text("synced.txt") eq "on disk", "Fsynced data survives a crash");
+unmount();
+
+say "# Discard";
+
+mount("-o discard,commit=1");
+write_text("discarded.bin", "x" x (1024 * 1024));
+sleep 2;
+my $before = (stat "data.nufs")[12];
+unlink("mnt/discarded.bin");
+sleep 3;
+my $after = (stat "data.nufs")[12];
+say "# image uses $before then $after blocks";
+ok($before - $after >= 2048, "Freed blocks are punched out of the image");
+unmount();
+
+mount();
+write_text("trimmed.bin", "y" x (1024 * 1024));
+unlink("mnt/trimmed.bin");
+ok(`./nufsctl trim mnt` =~ /trimmed/, "Trim the free space");
+unmount();
+
+say "# Dump";
+
+ok(system("./nufsdump data.nufs data.nfar 2>> test.log") == 0 &&
+   -s "data.nfar" < (-s "data.nufs") / 4, "Dump a volume into a small archive");
+system("rm -f data.nufs");
+ok(system("./nufsdump -r data.nfar data.nufs 2>> test.log") == 0, "Restore the archive");
+system("rm -f data.nfar");
+
+mount();
+ok(read_text("formatted.txt") eq "fresh", "Restored files read back");
+unmount();